@@ -0,0 +1,198 @@
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+
+#include <boost/program_options.hpp>
+
+#include "access_log.h"		/* access_log_record and access_log_file_header */
+
+namespace
+{
+	const char *method_name(access_method method) noexcept
+	{
+		switch (method)
+		{
+		case access_method::get:
+			return "GET";
+		case access_method::head:
+			return "HEAD";
+		case access_method::post:
+			return "POST";
+		default:
+			return "-";
+		}
+	}
+
+	std::string address_string(const access_log_record &record)
+	{
+		static const uint8_t ipv4_mapped_prefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+		char buffer[INET6_ADDRSTRLEN] = "-";
+
+		if (memcmp(record.address, ipv4_mapped_prefix, sizeof(ipv4_mapped_prefix)) == 0)
+		{
+			inet_ntop(AF_INET, record.address + 12, buffer, sizeof(buffer));
+		}
+		else
+		{
+			inet_ntop(AF_INET6, record.address, buffer, sizeof(buffer));
+		}
+
+		return buffer;
+	}
+
+	std::string timestamp_string(int64_t timestamp_ns)
+	{
+		time_t seconds = static_cast<time_t>(timestamp_ns / 1000000000);
+		struct tm broken_down;
+		char buffer[64] = "";
+
+		if (gmtime_r(&seconds, &broken_down))
+		{
+			size_t length = strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%S", &broken_down);
+			snprintf(buffer + length, sizeof(buffer) - length, ".%06ldZ",
+					static_cast<long>(timestamp_ns % 1000000000 / 1000));
+		}
+
+		return buffer;
+	}
+
+	std::string path_string(const access_log_record &record, bool csv)
+	{
+		std::string result(record.path, record.path_length);
+		if (record.path_truncated)
+		{
+			result += "...";
+		}
+
+		if (csv && result.find_first_of("\",\n") != std::string::npos)
+		{
+			std::string quoted = "\"";
+			for (char i: result)
+			{
+				quoted += i;
+				if (i == '"')
+				{
+					quoted += '"';
+				}
+			}
+			quoted += '"';
+			return quoted;
+		}
+
+		return result;
+	}
+
+	void print_record(const access_log_record &record, bool csv)
+	{
+		if (csv)
+		{
+			std::cout << timestamp_string(record.timestamp_ns) << ',' << address_string(record) << ',' << record.port
+				<< ',' << method_name(record.method) << ',' << path_string(record, true) << ','
+				<< (record.http09 ? "HTTP/0.9" : "HTTP/1.0") << ',' << record.status << ',' << record.bytes_sent
+				<< ',' << record.receive_us << ',' << record.parse_us << ',' << record.open_us << ',' << record.send_us
+				<< '\n';
+		}
+		else
+		{
+			std::cout << timestamp_string(record.timestamp_ns) << ' ' << address_string(record) << ':' << record.port
+				<< " \"" << method_name(record.method) << ' ' << path_string(record, false)
+				<< (record.http09 ? "\" " : " HTTP/1.0\" ") << record.status << ' ' << record.bytes_sent
+				<< " receive=" << record.receive_us << "us parse=" << record.parse_us << "us open=" << record.open_us
+				<< "us send=" << record.send_us << "us\n";
+		}
+	}
+
+	bool convert_file(const std::string &name, bool csv)
+	{
+		using FILE_pointer = std::unique_ptr<FILE, int (*)(FILE *)>;
+		FILE_pointer source(fopen(name.data(), "rb"), &fclose);
+
+		if (!source)
+		{
+			std::cerr << "Failed to open " << name << ": " << strerror(errno) << "\n";
+			return false;
+		}
+
+		access_log_file_header header;
+		if (fread(&header, sizeof(header), 1, source.get()) != 1 || !header.valid())
+		{
+			std::cerr << name << " is not an access log of a supported version\n";
+			return false;
+		}
+
+		constexpr size_t batch = 1024;
+		std::vector<access_log_record> records(batch);
+
+		size_t read;
+		while ((read = fread(records.data(), sizeof(access_log_record), batch, source.get())) != 0)
+		{
+			for (size_t i = 0; i != read; ++i)
+			{
+				// the file of a running server is zero-filled past the last record
+				if (records[i].timestamp_ns == 0)
+				{
+					return true;
+				}
+
+				print_record(records[i], csv);
+			}
+		}
+
+		return true;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<std::string> files;
+	std::string format;
+
+	try
+	{
+		boost::program_options::options_description options("Converts binary access logs of the server to text");
+		options.add_options()
+			("help", "Show this message")
+			("format,f", boost::program_options::value<std::string>(&format)->default_value("text"), "text or csv")
+			("file", boost::program_options::value<std::vector<std::string>>(&files), "Access log files in order");
+
+		boost::program_options::positional_options_description positional;
+		positional.add("file", -1);
+
+		boost::program_options::variables_map map;
+		boost::program_options::store(boost::program_options::command_line_parser(argc, argv)
+				.options(options).positional(positional).run(), map);
+		boost::program_options::notify(map);
+
+		if (map.count("help") || files.empty() || (format != "text" && format != "csv"))
+		{
+			std::cerr << "Usage: access_log_converter [--format text|csv] the_server_access.000001.bin ...\n"
+				<< options << "\n";
+			return map.count("help") ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	catch (std::exception &e)
+	{
+		std::cerr << "Command-line arguments error: " << e.what() << "\n";
+		return EXIT_FAILURE;
+	}
+
+	bool csv = (format == "csv");
+	if (csv)
+	{
+		std::cout << "timestamp,address,port,method,path,version,status,bytes,receive_us,parse_us,open_us,send_us\n";
+	}
+
+	bool success = true;
+	for (const auto &i: files)
+	{
+		success = convert_file(i, csv) && success;
+	}
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,531 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#ifdef BUNDLE_GZIP
+#include <zlib.h>
+#endif
+
+#include <boost/program_options.hpp>
+
+#include "static_bundle.h"		/* bundle_file_header, bundle_entry and bundle_path_hash() */
+
+namespace
+{
+	// smaller files gain nothing from compression, and a variant has to save a tenth to be worth a lookup
+	constexpr size_t min_compressed_size = 256;
+	constexpr double max_compression_ratio = 0.9;
+
+	struct source_file
+	{
+		std::string relative;
+		std::string full;
+		struct stat status;
+		std::string mime_type;
+		std::string compressed;
+		bundle_variant variants[bundle_encoding_count] = {};
+	};
+
+	struct index_entry
+	{
+		std::string path;
+		size_t file;
+		bool directory;
+	};
+
+	using FILE_pointer = std::unique_ptr<FILE, int (*)(FILE *)>;
+
+	bool inside(const std::string &path, const std::string &root)
+	{
+		char resolved[PATH_MAX];
+		if (!realpath(path.data(), resolved))
+		{
+			return false;
+		}
+
+		size_t length = strlen(resolved);
+		return length >= root.size() && memcmp(resolved, root.data(), root.size()) == 0 &&
+			(length == root.size() || resolved[root.size()] == '/' || root == "/");
+	}
+
+	// regular files of the tree with their relative paths, symlinks are followed only within the tree
+	bool collect(const std::string &root, std::vector<source_file> &files, std::vector<std::string> &directories)
+	{
+		char resolved_root[PATH_MAX];
+		if (!realpath(root.data(), resolved_root))
+		{
+			std::cerr << "Failed to resolve " << root << ": " << strerror(errno) << "\n";
+			return false;
+		}
+
+		std::vector<std::string> pending{ std::string() };
+		while (!pending.empty())
+		{
+			std::string current = std::move(pending.back());
+			pending.pop_back();
+			directories.push_back(current);
+
+			std::string path = current.empty() ? root : root + '/' + current;
+			std::unique_ptr<DIR, int (*)(DIR *)> directory{ opendir(path.data()), closedir };
+			if (!directory)
+			{
+				std::cerr << "Failed to list " << path << ": " << strerror(errno) << "\n";
+				return false;
+			}
+
+			while (struct dirent *entry = readdir(directory.get()))
+			{
+				std::string name{ entry->d_name };
+				if (name == "." || name == "..")
+				{
+					continue;
+				}
+				if (name.find('\n') != std::string::npos)
+				{
+					std::cerr << "Skipped a name with a line break in " << path << "\n";
+					continue;
+				}
+
+				source_file file;
+				file.relative = current.empty() ? name : current + '/' + name;
+				file.full = root + '/' + file.relative;
+
+				struct stat link_status;
+				if (lstat(file.full.data(), &link_status) == -1 || stat(file.full.data(), &file.status) == -1)
+				{
+					continue;
+				}
+				if (S_ISLNK(link_status.st_mode) && !inside(file.full, resolved_root))
+				{
+					std::cerr << "Skipped " << file.full << ", it leads outside of the tree\n";
+					continue;
+				}
+
+				if (S_ISDIR(file.status.st_mode))
+				{
+					// a link to a directory of the tree would be walked twice, or forever
+					if (!S_ISLNK(link_status.st_mode))
+					{
+						pending.push_back(file.relative);
+					}
+				}
+				else if (S_ISREG(file.status.st_mode))
+				{
+					files.push_back(std::move(file));
+				}
+			}
+		}
+
+		return true;
+	}
+
+	// one run of file(1) for the whole tree, names are passed in a file and never reach the shell
+	bool detect_mime_types(std::vector<source_file> &files)
+	{
+		if (files.empty())
+		{
+			return true;
+		}
+
+		char list_name[] = "/tmp/bundle_names.XXXXXX";
+		int list_fd = mkstemp(list_name);
+		if (list_fd == -1)
+		{
+			std::cerr << "Failed to create a temporary file: " << strerror(errno) << "\n";
+			return false;
+		}
+
+		FILE_pointer list(fdopen(list_fd, "w"), &fclose);
+		for (const source_file &file: files)
+		{
+			fprintf(list.get(), "%s\n", file.full.data());
+		}
+		list.reset();
+
+		std::string command = std::string("file -L --brief --mime -f ") + list_name;
+		FILE_pointer output(popen(command.data(), "r"), &pclose);
+
+		size_t i = 0;
+		char *line = nullptr;
+		size_t capacity = 0;
+		ssize_t length;
+		while (output && i != files.size() && (length = getline(&line, &capacity, output.get())) > 0)
+		{
+			files[i++].mime_type.assign(line, line[length - 1] == '\n' ? length - 1 : length);
+		}
+		free(line);
+		output.reset();
+		unlink(list_name);
+
+		if (i != files.size())
+		{
+			std::cerr << "file(1) told the types of " << i << " files out of " << files.size() << "\n";
+			return false;
+		}
+
+		return true;
+	}
+
+	bool read_whole(const source_file &file, std::string &content)
+	{
+		FILE_pointer source(fopen(file.full.data(), "rb"), &fclose);
+		if (!source)
+		{
+			return false;
+		}
+
+		content.resize(file.status.st_size);
+		return fread(content.data(), 1, content.size(), source.get()) == content.size();
+	}
+
+#ifdef BUNDLE_GZIP
+	bool gzip(const std::string &content, std::string &compressed)
+	{
+		z_stream stream{};
+		if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			return false;
+		}
+
+		compressed.resize(deflateBound(&stream, content.size()));
+		stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(content.data()));
+		stream.avail_in = content.size();
+		stream.next_out = reinterpret_cast<Bytef *>(compressed.data());
+		stream.avail_out = compressed.size();
+
+		bool done = (deflate(&stream, Z_FINISH) == Z_STREAM_END);
+		compressed.resize(stream.total_out);
+		deflateEnd(&stream);
+
+		return done;
+	}
+#endif
+
+	std::string http_date(time_t time)
+	{
+		struct tm broken_down;
+		char buffer[64] = "";
+		if (gmtime_r(&time, &broken_down))
+		{
+			strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &broken_down);
+		}
+		return buffer;
+	}
+
+	// the same headers the server makes for a file, but for Date, Expires and Connection added as it is sent
+	std::string precomputed_headers(const source_file &file, size_t length, bool compressed, bool has_variants)
+	{
+		char tag[64];
+		snprintf(tag, sizeof(tag), "\"%llx.%lx-%llx%s\"", static_cast<unsigned long long>(file.status.st_mtim.tv_sec),
+				static_cast<long>(file.status.st_mtim.tv_nsec), static_cast<unsigned long long>(file.status.st_size),
+				compressed ? "-gz" : "");
+
+		std::string headers = "Location: /" + file.relative + "\r\nServer: Bolbot-CPPserver/10.0\r\nAllow: GET\r\n";
+		headers += "Content-Length: " + std::to_string(length) + "\r\nContent-Type: " + file.mime_type + "\r\n";
+		if (compressed)
+		{
+			headers += "Content-Encoding: gzip\r\n";
+		}
+		if (has_variants)
+		{
+			headers += "Vary: Accept-Encoding\r\n";
+		}
+		headers += std::string("ETag: ") + tag + "\r\nLast-Modified: " + http_date(file.status.st_mtim.tv_sec) + "\r\n\r\n";
+
+		return headers;
+	}
+
+	bool write_all(int fd, const void *data, size_t length)
+	{
+		const char *position = static_cast<const char *>(data);
+		while (length)
+		{
+			ssize_t written = write(fd, position, length);
+			if (written == -1)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				return false;
+			}
+			position += written;
+			length -= written;
+		}
+		return true;
+	}
+
+	// the file has to be as long as it was when the index was made, the offsets of everything after it depend on it
+	bool copy_body(int destination, const source_file &file)
+	{
+		int source = open(file.full.data(), O_RDONLY | O_CLOEXEC);
+		if (source == -1)
+		{
+			return false;
+		}
+
+		off_t left = file.status.st_size;
+		while (left)
+		{
+			ssize_t copied = copy_file_range(source, nullptr, destination, nullptr, left, 0);
+			if (copied == -1 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL))
+			{
+				std::string content;
+				copied = read_whole(file, content) && write_all(destination, content.data(), content.size()) ?
+					static_cast<ssize_t>(content.size()) : -1;
+			}
+			if (copied <= 0)
+			{
+				break;
+			}
+			left -= copied;
+		}
+
+		close(source);
+		return left == 0;
+	}
+
+	bool build_bundle(const std::string &root, const std::string &output_name, const std::string &index_file, bool compress)
+	{
+		std::vector<source_file> files;
+		std::vector<std::string> directories;
+		if (!collect(root, files, directories) || !detect_mime_types(files))
+		{
+			return false;
+		}
+
+		for (source_file &file: files)
+		{
+			if (!compress || static_cast<size_t>(file.status.st_size) < min_compressed_size)
+			{
+				continue;
+			}
+
+#ifdef BUNDLE_GZIP
+			std::string content;
+			if (!read_whole(file, content))
+			{
+				std::cerr << "Failed to read " << file.full << "\n";
+				return false;
+			}
+			if (gzip(content, file.compressed) && file.compressed.size() > content.size() * max_compression_ratio)
+			{
+				file.compressed.clear();
+			}
+#endif
+		}
+
+		// every file by its path, a directory with the index file by its own path as well
+		std::vector<index_entry> index;
+		std::unordered_map<std::string, size_t> by_path;
+		for (size_t i = 0; i != files.size(); ++i)
+		{
+			index.push_back(index_entry{ files[i].relative, i, false });
+			by_path.emplace(files[i].relative, i);
+		}
+		for (const std::string &directory: directories)
+		{
+			auto found = by_path.find(directory.empty() ? index_file : directory + '/' + index_file);
+			if (!index_file.empty() && found != by_path.end())
+			{
+				index.push_back(index_entry{ directory, found->second, true });
+			}
+		}
+		std::sort(index.begin(), index.end(), [](const index_entry &left, const index_entry &right)
+				{
+					return left.path < right.path;
+				});
+
+		uint32_t slot_count = 16;
+		while (slot_count < index.size() * 2)
+		{
+			slot_count *= 2;
+		}
+
+		// strings: the paths, then the headers of every variant
+		std::string strings;
+		std::vector<uint64_t> path_offsets;
+		for (const index_entry &entry: index)
+		{
+			path_offsets.push_back(strings.size());
+			strings += entry.path;
+		}
+
+		for (source_file &file: files)
+		{
+			bool has_variants = !file.compressed.empty();
+
+			std::string headers = precomputed_headers(file, file.status.st_size, false, has_variants);
+			file.variants[bundle_identity].headers_offset = strings.size();
+			file.variants[bundle_identity].headers_length = headers.size();
+			file.variants[bundle_identity].body_length = file.status.st_size;
+			strings += headers;
+
+			if (has_variants)
+			{
+				headers = precomputed_headers(file, file.compressed.size(), true, true);
+				file.variants[bundle_gzip].headers_offset = strings.size();
+				file.variants[bundle_gzip].headers_length = headers.size();
+				file.variants[bundle_gzip].body_length = file.compressed.size();
+				strings += headers;
+			}
+		}
+
+		bundle_file_header header{};
+		memcpy(header.magic, bundle_file_header::magic_value, sizeof(header.magic));
+		header.version = bundle_file_header::current_version;
+		header.header_size = sizeof(header);
+		header.entry_size = sizeof(bundle_entry);
+		header.slot_count = slot_count;
+		header.entry_count = index.size();
+		header.entries_offset = sizeof(header);
+		header.slots_offset = header.entries_offset + index.size() * sizeof(bundle_entry);
+		header.strings_offset = header.slots_offset + uint64_t{ slot_count } * sizeof(uint32_t);
+		header.strings_size = strings.size();
+
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		header.created_ns = static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+
+		// bodies follow in the order of the files, the identity one first
+		uint64_t body_offset = header.strings_offset + header.strings_size;
+		for (source_file &file: files)
+		{
+			for (bundle_variant &variant: file.variants)
+			{
+				if (variant.headers_length)
+				{
+					variant.body_offset = body_offset;
+					body_offset += variant.body_length;
+				}
+			}
+		}
+		header.file_size = body_offset;
+
+		std::vector<bundle_entry> entries(index.size());
+		std::vector<uint32_t> slots(slot_count, 0);
+		for (size_t i = 0; i != index.size(); ++i)
+		{
+			bundle_entry &entry = entries[i];
+			entry.hash = bundle_path_hash(index[i].path);
+			entry.path_offset = path_offsets[i];
+			entry.path_length = index[i].path.size();
+			entry.flags = index[i].directory ? bundle_directory : 0;
+			memcpy(entry.variants, files[index[i].file].variants, sizeof(entry.variants));
+
+			uint32_t slot = entry.hash & (slot_count - 1);
+			while (slots[slot])
+			{
+				slot = (slot + 1) & (slot_count - 1);
+			}
+			slots[slot] = i + 1;
+		}
+
+		// written aside and renamed over, the server never maps a bundle cut short
+		std::string temporary = output_name + ".tmp";
+		int destination = open(temporary.data(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (destination == -1)
+		{
+			std::cerr << "Failed to create " << temporary << ": " << strerror(errno) << "\n";
+			return false;
+		}
+
+		bool written = write_all(destination, &header, sizeof(header)) &&
+			write_all(destination, entries.data(), entries.size() * sizeof(bundle_entry)) &&
+			write_all(destination, slots.data(), slots.size() * sizeof(uint32_t)) &&
+			write_all(destination, strings.data(), strings.size());
+
+		for (size_t i = 0; written && i != files.size(); ++i)
+		{
+			written = copy_body(destination, files[i]) &&
+				write_all(destination, files[i].compressed.data(), files[i].compressed.size());
+			if (!written)
+			{
+				std::cerr << "Failed to copy " << files[i].full << ", or it changed while the bundle was made\n";
+			}
+		}
+
+		written = written && fsync(destination) == 0 && lseek(destination, 0, SEEK_END) == static_cast<off_t>(header.file_size);
+		close(destination);
+
+		if (!written || rename(temporary.data(), output_name.data()) == -1)
+		{
+			std::cerr << "Failed to write " << output_name << "\n";
+			unlink(temporary.data());
+			return false;
+		}
+
+		size_t compressed = std::count_if(files.begin(), files.end(), [](const source_file &file)
+				{
+					return !file.compressed.empty();
+				});
+		std::cout << "Bundled " << files.size() << " files (" << compressed << " with a gzip variant, "
+			<< index.size() - files.size() << " directory indexes) into " << output_name << ", "
+			<< header.file_size << " bytes\n";
+
+		return true;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	std::string directory;
+	std::string output_name;
+	std::string index_file;
+	bool compress = false;
+
+	try
+	{
+		boost::program_options::options_description options("Packs a directory into a static bundle the server maps and serves");
+		options.add_options()
+			("help", "Show this message")
+			("directory,d", boost::program_options::value<std::string>(&directory), "Directory to pack")
+			("output,o", boost::program_options::value<std::string>(&output_name), "Bundle file to write")
+			("index", boost::program_options::value<std::string>(&index_file)->default_value("index.html"),
+				"File served for a directory that has it, empty for none")
+			("gzip", boost::program_options::bool_switch(&compress), "Add gzip variants of files that compress well");
+
+		boost::program_options::variables_map map;
+		boost::program_options::store(boost::program_options::parse_command_line(argc, argv, options), map);
+		boost::program_options::notify(map);
+
+		if (map.count("help") || directory.empty() || output_name.empty())
+		{
+			std::cerr << "Usage: bundle -d served_directory -o site.bundle [--gzip]\n" << options << "\n";
+			return map.count("help") ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	catch (std::exception &e)
+	{
+		std::cerr << "Command-line arguments error: " << e.what() << "\n";
+		return EXIT_FAILURE;
+	}
+
+#ifndef BUNDLE_GZIP
+	if (compress)
+	{
+		std::cerr << "Built without zlib, gzip variants are left out\n";
+	}
+#endif
+
+	while (directory.size() > 1 && directory.back() == '/')
+	{
+		directory.pop_back();
+	}
+
+	return build_bundle(directory, output_name, index_file, compress) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
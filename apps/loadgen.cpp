@@ -0,0 +1,793 @@
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "metrics.h"		/* latency_histogram */
+
+/*
+*	HTTP load generator for the server. Every thread drives its share of connections through epoll.
+*	In closed-loop mode a connection sends the next request as soon as it has room for it
+*	(pipeline depth, or a fresh connection without keep-alive) and latency is measured from the send.
+*	In constant-rate mode requests are scheduled at fixed intervals and latency is measured
+*	from the intended send time, so stalls of the server aren't hidden by coordinated omission.
+*/
+
+namespace
+{
+	struct settings
+	{
+		std::string host;
+		std::string port;
+		size_t connections;
+		size_t threads;
+		double duration;
+		bool keep_alive;
+		size_t pipeline;
+		double rate;
+		std::string requests_file;
+		std::string fixtures_directory;
+	};
+
+	int64_t now_ns() noexcept
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+	}
+
+	struct fixture
+	{
+		const char *name;
+		size_t size;
+		size_t copies;
+	};
+
+	// sizes typical for a static site: lots of small files, a few large ones
+	const fixture fixture_set[] =
+	{
+		{ "empty", 0, 1 },
+		{ "tiny_100b", 100, 16 },
+		{ "small_1k", 1024, 16 },
+		{ "small_4k", 4 * 1024, 16 },
+		{ "medium_16k", 16 * 1024, 8 },
+		{ "medium_64k", 64 * 1024, 8 },
+		{ "large_256k", 256 * 1024, 4 },
+		{ "large_1m", 1024 * 1024, 2 },
+		{ "huge_10m", 10 * 1024 * 1024, 1 }
+	};
+
+	bool make_fixtures(const std::string &directory)
+	{
+		if (mkdir(directory.data(), 0755) == -1 && errno != EEXIST)
+		{
+			std::cerr << "Failed to create " << directory << ": " << strerror(errno) << "\n";
+			return false;
+		}
+
+		std::mt19937 generator(20201019);		// fixed seed, the same files on every run
+		std::ofstream list(directory + "/requests.txt");
+
+		for (const auto &i: fixture_set)
+		{
+			for (size_t copy = 0; copy != i.copies; ++copy)
+			{
+				std::string name = std::string(i.name) + "_" + std::to_string(copy) + ".txt";
+				std::ofstream file(directory + "/" + name, std::ios::binary);
+
+				std::string line;
+				for (size_t written = 0; written < i.size; written += line.size())
+				{
+					line.clear();
+					for (size_t j = 0; j != 63; ++j)
+					{
+						line += static_cast<char>('a' + generator() % 26);
+					}
+					line += '\n';
+					if (line.size() > i.size - written)
+					{
+						line.resize(i.size - written);
+					}
+					file << line;
+				}
+
+				if (!file)
+				{
+					std::cerr << "Failed to write " << name << "\n";
+					return false;
+				}
+
+				list << '/' << name << '\n';
+			}
+		}
+
+		list << "/does_not_exist.txt\n";
+
+		std::cout << "Fixtures are in " << directory << ", request list is " << directory << "/requests.txt\n";
+		return static_cast<bool>(list);
+	}
+
+	class response_parser final
+	{
+		std::string head;
+		bool in_body = false;
+		long long content_length = -1;
+		long long body_left = 0;
+		int status = 0;
+		size_t bytes = 0;
+
+		void parse_head(size_t head_length)
+		{
+			// HTTP/1.0 200 OK
+			if (head.compare(0, 5, "HTTP/") == 0)
+			{
+				size_t space = head.find(' ');
+				if (space != std::string::npos)
+				{
+					status = atoi(head.data() + space + 1);
+				}
+			}
+
+			std::string lowered = head.substr(0, head_length);
+			std::transform(lowered.begin(), lowered.end(), lowered.begin(), ::tolower);
+			size_t length_position = lowered.find("\ncontent-length:");
+			if (length_position != std::string::npos)
+			{
+				content_length = atoll(lowered.data() + length_position + strlen("\ncontent-length:"));
+				body_left = content_length;
+			}
+		}
+
+	public:
+		// returns bytes taken from data, complete is set when the response is over
+		size_t feed(const char *data, size_t size, bool &complete)
+		{
+			complete = false;
+			size_t taken = 0;
+
+			if (!in_body)
+			{
+				size_t old_size = head.size();
+				head.append(data, size);
+
+				size_t end = head.find("\r\n\r\n");
+				if (end == std::string::npos)
+				{
+					bytes += size;
+					return size;
+				}
+
+				size_t head_length = end + 4;
+				taken = head_length - old_size;
+				bytes += taken;
+				parse_head(head_length);
+				head.resize(head_length);
+				in_body = true;
+
+				if (content_length == 0)
+				{
+					complete = true;
+					return taken;
+				}
+			}
+
+			size_t available = size - taken;
+			if (content_length >= 0)
+			{
+				size_t portion = std::min<size_t>(available, static_cast<size_t>(body_left));
+				body_left -= portion;
+				bytes += portion;
+				taken += portion;
+				complete = (body_left == 0);
+				return taken;
+			}
+
+			bytes += available;
+			return size;
+		}
+
+		// the server closed the connection, a response without length ends here
+		bool complete_at_eof() noexcept
+		{
+			if (head.empty())
+			{
+				return false;
+			}
+
+			if (!in_body && head.compare(0, 5, "HTTP/") == 0)
+			{
+				size_t space = head.find(' ');
+				if (space != std::string::npos)
+				{
+					status = atoi(head.data() + space + 1);
+				}
+			}
+
+			return !in_body || content_length < 0;
+		}
+
+		int get_status() const noexcept
+		{
+			return status;
+		}
+
+		size_t get_bytes() const noexcept
+		{
+			return bytes;
+		}
+
+		void reset()
+		{
+			head.clear();
+			in_body = false;
+			content_length = -1;
+			body_left = 0;
+			status = 0;
+			bytes = 0;
+		}
+	};
+
+	struct pending_request
+	{
+		int64_t intended_ns;
+		int64_t sent_ns;
+	};
+
+	struct connection
+	{
+		int fd = -1;
+		bool connected = false;
+		bool closing = false;		// without keep-alive only one request per connection
+		int64_t retry_ns = 0;		// when a refused connection may try again
+		size_t requests_sent = 0;
+		std::string output;
+		size_t output_sent = 0;
+		std::deque<pending_request> in_flight;
+		response_parser parser;
+	};
+
+	struct thread_report
+	{
+		latency_histogram latency;
+		uint64_t completed = 0;
+		uint64_t bytes = 0;
+		uint64_t connect_errors = 0;
+		uint64_t resets = 0;
+		uint64_t reconnects = 0;
+		std::map<int, uint64_t> statuses;
+	};
+
+	class worker final
+	{
+		const settings &config;
+		const struct addrinfo *target;
+		const std::vector<std::string> &requests;
+		size_t connection_count;
+		double rate;					// requests per second of this worker, 0 for closed loop
+		thread_report &report;
+
+		int epoll_fd = -1;
+		std::vector<connection> connections;
+		std::deque<int64_t> backlog;	// intended send times of scheduled requests not sent yet
+		uint64_t scheduled = 0;
+		size_t next_request;
+		int64_t start_ns = 0;
+
+		void open_connection(connection &c)
+		{
+			c = connection{};
+			c.fd = socket(target->ai_family, target->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, target->ai_protocol);
+			if (c.fd == -1)
+			{
+				++report.connect_errors;
+				return;
+			}
+
+			int yes = 1;
+			setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+			if (connect(c.fd, target->ai_addr, target->ai_addrlen) == -1)
+			{
+				if (errno != EINPROGRESS)
+				{
+					++report.connect_errors;
+					close(c.fd);
+					c.fd = -1;
+					return;
+				}
+			}
+			else
+			{
+				c.connected = true;
+			}
+
+			// the fd travels along with the index, so that events of a replaced socket are recognised
+			struct epoll_event event;
+			event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+			event.data.u64 = (static_cast<uint64_t>(c.fd) << 32) | static_cast<uint64_t>(&c - connections.data());
+			epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c.fd, &event);
+		}
+
+		void close_connection(connection &c)
+		{
+			if (c.fd != -1)
+			{
+				close(c.fd);
+			}
+
+			// requests the server never answered go back to be sent again
+			for (auto i = c.in_flight.rbegin(); i != c.in_flight.rend(); ++i)
+			{
+				++report.resets;
+				if (rate > 0)
+				{
+					backlog.push_front(i->intended_ns);
+				}
+			}
+
+			c.fd = -1;
+			c.in_flight.clear();
+		}
+
+		void reconnect(connection &c)
+		{
+			close_connection(c);
+			++report.reconnects;
+			open_connection(c);
+		}
+
+		bool has_room(const connection &c) const noexcept
+		{
+			if (c.fd == -1 || c.closing)
+			{
+				return false;
+			}
+
+			return c.in_flight.size() < (config.keep_alive ? config.pipeline : 1);
+		}
+
+		void enqueue_request(connection &c, int64_t intended_ns)
+		{
+			const std::string &path = requests[next_request];
+			next_request = (next_request + 1) % requests.size();
+
+			c.output += "GET ";
+			c.output += path;
+			c.output += " HTTP/1.0\r\nHost: ";
+			c.output += config.host;
+			c.output += config.keep_alive ? "\r\nConnection: keep-alive\r\n\r\n" : "\r\n\r\n";
+
+			c.in_flight.push_back(pending_request{ intended_ns, now_ns() });
+			++c.requests_sent;
+			if (!config.keep_alive)
+			{
+				c.closing = true;
+			}
+		}
+
+		void fill(connection &c)
+		{
+			while (has_room(c))
+			{
+				if (rate > 0)
+				{
+					if (backlog.empty())
+					{
+						return;
+					}
+					enqueue_request(c, backlog.front());
+					backlog.pop_front();
+				}
+				else
+				{
+					enqueue_request(c, 0);
+				}
+			}
+		}
+
+		bool flush(connection &c)
+		{
+			while (c.connected && c.output_sent < c.output.size())
+			{
+				ssize_t sent = send(c.fd, c.output.data() + c.output_sent, c.output.size() - c.output_sent, MSG_NOSIGNAL);
+				if (sent == -1)
+				{
+					if (errno == EAGAIN || errno == EWOULDBLOCK)
+					{
+						return true;
+					}
+					return false;
+				}
+				c.output_sent += sent;
+			}
+
+			if (c.output_sent == c.output.size())
+			{
+				c.output.clear();
+				c.output_sent = 0;
+			}
+
+			return true;
+		}
+
+		void complete_response(connection &c, int64_t now)
+		{
+			if (c.in_flight.empty())
+			{
+				c.parser.reset();
+				return;
+			}
+
+			const pending_request &request = c.in_flight.front();
+			int64_t from = (rate > 0) ? request.intended_ns : request.sent_ns;
+
+			report.latency.record(static_cast<uint64_t>(now - from));
+			++report.completed;
+			report.bytes += c.parser.get_bytes();
+			++report.statuses[c.parser.get_status()];
+
+			c.in_flight.pop_front();
+			c.parser.reset();
+		}
+
+		void on_readable(connection &c)
+		{
+			char buffer[64 * 1024];
+
+			while (true)
+			{
+				ssize_t received = recv(c.fd, buffer, sizeof(buffer), 0);
+				if (received == -1)
+				{
+					if (errno != EAGAIN && errno != EWOULDBLOCK)
+					{
+						reconnect(c);
+					}
+					return;
+				}
+
+				int64_t now = now_ns();
+
+				if (received == 0)
+				{
+					if (c.parser.complete_at_eof())
+					{
+						complete_response(c, now);
+					}
+					reconnect(c);
+					return;
+				}
+
+				size_t offset = 0;
+				while (offset < static_cast<size_t>(received))
+				{
+					bool complete;
+					offset += c.parser.feed(buffer + offset, received - offset, complete);
+					if (complete)
+					{
+						complete_response(c, now);
+					}
+				}
+			}
+		}
+
+		void on_event(connection &c, uint32_t events)
+		{
+			if (!c.connected && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+			{
+				int error = 0;
+				socklen_t length = sizeof(error);
+				getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+				if (error)
+				{
+					constexpr int64_t retry_delay_ns = 100 * 1000 * 1000;
+					++report.connect_errors;
+					close_connection(c);
+					c.retry_ns = now_ns() + retry_delay_ns;
+					return;
+				}
+				c.connected = true;
+			}
+
+			if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+			{
+				on_readable(c);
+				if (c.fd == -1 || !c.connected)
+				{
+					return;
+				}
+			}
+
+			if (!flush(c))
+			{
+				reconnect(c);
+			}
+		}
+
+		void schedule(int64_t now)
+		{
+			uint64_t due = static_cast<uint64_t>(static_cast<double>(now - start_ns) * rate / 1e9);
+			for (; scheduled < due; ++scheduled)
+			{
+				backlog.push_back(start_ns + static_cast<int64_t>(static_cast<double>(scheduled) * 1e9 / rate));
+			}
+		}
+
+	public:
+		worker(const settings &c, const struct addrinfo *t, const std::vector<std::string> &r,
+				size_t count, double worker_rate, size_t first_request, thread_report &result) :
+			config(c),
+			target{ t },
+			requests(r),
+			connection_count{ count },
+			rate{ worker_rate },
+			report(result),
+			connections(count),
+			next_request{ first_request }
+		{}
+
+		void run()
+		{
+			epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+			if (epoll_fd == -1)
+			{
+				std::cerr << "epoll_create1 failed: " << strerror(errno) << "\n";
+				return;
+			}
+
+			for (auto &i: connections)
+			{
+				open_connection(i);
+			}
+
+			start_ns = now_ns();
+			int64_t end_ns = start_ns + static_cast<int64_t>(config.duration * 1e9);
+			std::vector<struct epoll_event> events(connection_count + 1);
+
+			for (int64_t now = start_ns; now < end_ns; now = now_ns())
+			{
+				if (rate > 0)
+				{
+					schedule(now);
+				}
+
+				for (auto &i: connections)
+				{
+					if (i.fd == -1)
+					{
+						if (now >= i.retry_ns)
+						{
+							open_connection(i);
+						}
+						continue;
+					}
+
+					fill(i);
+					if (!flush(i))
+					{
+						reconnect(i);
+					}
+				}
+
+				int timeout = (rate > 0) ? 1 : 100;
+				int ready = epoll_wait(epoll_fd, events.data(), static_cast<int>(events.size()), timeout);
+				for (int i = 0; i < ready; ++i)
+				{
+					connection &c = connections[events[i].data.u64 & 0xffffffff];
+					if (c.fd == static_cast<int>(events[i].data.u64 >> 32))
+					{
+						on_event(c, events[i].events);
+					}
+				}
+			}
+
+			for (auto &i: connections)
+			{
+				// whatever is still in flight is not a reset
+				i.in_flight.clear();
+				close_connection(i);
+			}
+			close(epoll_fd);
+		}
+	};
+
+	std::vector<std::string> load_requests(const std::string &file_name)
+	{
+		std::vector<std::string> result;
+
+		if (file_name.empty())
+		{
+			result.push_back("/");
+			return result;
+		}
+
+		std::ifstream file(file_name);
+		std::string line;
+		while (std::getline(file, line))
+		{
+			if (!line.empty() && line.back() == '\r')
+			{
+				line.pop_back();
+			}
+			if (!line.empty() && line[0] != '#')
+			{
+				result.push_back(line[0] == '/' ? line : "/" + line);
+			}
+		}
+
+		return result;
+	}
+
+	void print_report(const settings &config, const std::vector<std::unique_ptr<thread_report>> &reports, double elapsed)
+	{
+		std::unique_ptr<latency_histogram::snapshot> latency{ new latency_histogram::snapshot };
+		thread_report total;
+
+		for (const auto &i: reports)
+		{
+			i->latency.add_to(*latency);
+			total.completed += i->completed;
+			total.bytes += i->bytes;
+			total.connect_errors += i->connect_errors;
+			total.resets += i->resets;
+			total.reconnects += i->reconnects;
+			for (const auto &j: i->statuses)
+			{
+				total.statuses[j.first] += j.second;
+			}
+		}
+
+		auto milliseconds = [&latency](double quantile)
+		{
+			return static_cast<double>(latency->value_at_quantile(quantile)) / 1e6;
+		};
+
+		printf("%s mode, %zu connections, %zu threads, keep-alive %s, pipeline %zu, %.1f s\n",
+				config.rate > 0 ? "constant-rate" : "closed-loop", config.connections, config.threads,
+				config.keep_alive ? "on" : "off", config.pipeline, elapsed);
+		if (config.rate > 0)
+		{
+			printf("target rate        %.0f req/s (latency from intended send time)\n", config.rate);
+		}
+		printf("requests           %llu\n", static_cast<unsigned long long>(total.completed));
+		printf("throughput         %.0f req/s, %.2f MiB/s\n", total.completed / elapsed,
+				total.bytes / elapsed / (1024 * 1024));
+		printf("latency p50        %.3f ms\n", milliseconds(0.5));
+		printf("latency p99        %.3f ms\n", milliseconds(0.99));
+		printf("latency p99.9      %.3f ms\n", milliseconds(0.999));
+		printf("latency max        %.3f ms\n", milliseconds(1.0));
+		printf("connect errors     %llu\n", static_cast<unsigned long long>(total.connect_errors));
+		printf("unanswered         %llu\n", static_cast<unsigned long long>(total.resets));
+		printf("reconnects         %llu\n", static_cast<unsigned long long>(total.reconnects));
+		for (const auto &i: total.statuses)
+		{
+			printf("status %-11d %llu\n", i.first, static_cast<unsigned long long>(i.second));
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	settings config;
+
+	try
+	{
+		boost::program_options::options_description options("Load generator for the C++ server");
+		options.add_options()
+			("help", "Show this message")
+			("host,h", boost::program_options::value<std::string>(&config.host)->default_value("127.0.0.1"), "Server IP")
+			("port,p", boost::program_options::value<std::string>(&config.port)->default_value("11111"), "Server port")
+			("connections,c", boost::program_options::value<size_t>(&config.connections)->default_value(16),
+				"Concurrent connections")
+			("threads,t", boost::program_options::value<size_t>(&config.threads)->default_value(1), "Threads")
+			("duration,d", boost::program_options::value<double>(&config.duration)->default_value(10), "Seconds to run")
+			("keep-alive,k", boost::program_options::bool_switch(&config.keep_alive), "Reuse connections")
+			("pipeline", boost::program_options::value<size_t>(&config.pipeline)->default_value(1),
+				"Requests in flight per connection with keep-alive")
+			("rate,r", boost::program_options::value<double>(&config.rate)->default_value(0),
+				"Requests per second in total, 0 for closed loop")
+			("requests", boost::program_options::value<std::string>(&config.requests_file),
+				"File with request paths, one per line, used round-robin")
+			("make-fixtures", boost::program_options::value<std::string>(&config.fixtures_directory),
+				"Create a directory of files of various sizes with requests.txt and exit");
+
+		boost::program_options::variables_map map;
+		boost::program_options::store(boost::program_options::parse_command_line(argc, argv, options), map);
+		boost::program_options::notify(map);
+
+		if (map.count("help"))
+		{
+			std::cout << options << "\n";
+			return EXIT_SUCCESS;
+		}
+	}
+	catch (std::exception &e)
+	{
+		std::cerr << "Command-line arguments error: " << e.what() << "\n";
+		return EXIT_FAILURE;
+	}
+
+	if (!config.fixtures_directory.empty())
+	{
+		return make_fixtures(config.fixtures_directory) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	config.threads = std::max<size_t>(1, std::min(config.threads, config.connections));
+	config.pipeline = std::max<size_t>(1, config.pipeline);
+
+	std::vector<std::string> requests = load_requests(config.requests_file);
+	if (requests.empty())
+	{
+		std::cerr << "No requests to send\n";
+		return EXIT_FAILURE;
+	}
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	struct addrinfo *target = nullptr;
+	int gai_res = getaddrinfo(config.host.data(), config.port.data(), &hints, &target);
+	if (gai_res != 0)
+	{
+		std::cerr << "Error of getaddrinfo: " << gai_strerror(gai_res) << "\n";
+		return EXIT_FAILURE;
+	}
+
+	std::vector<std::unique_ptr<thread_report>> reports;
+	std::vector<std::unique_ptr<worker>> workers;
+	std::vector<std::thread> threads;
+
+	for (size_t i = 0; i != config.threads; ++i)
+	{
+		size_t count = config.connections / config.threads + (i < config.connections % config.threads ? 1 : 0);
+		reports.emplace_back(new thread_report);
+		workers.emplace_back(new worker(config, target, requests, count, config.rate / config.threads,
+				i * requests.size() / config.threads, *reports.back()));
+	}
+
+	int64_t start = now_ns();
+	for (auto &i: workers)
+	{
+		threads.emplace_back(&worker::run, i.get());
+	}
+	for (auto &i: threads)
+	{
+		i.join();
+	}
+	double elapsed = static_cast<double>(now_ns() - start) / 1e9;
+
+	freeaddrinfo(target);
+
+	print_report(config, reports, elapsed);
+
+	return EXIT_SUCCESS;
+}
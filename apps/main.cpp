@@ -1,5 +1,6 @@
 #include "utils.h"		/* parse_program_options() and daemonize()*/
 #include "server.h"		/* get_listening_socket() and run_server_loop() */
+#include "upgrade.h"		/* remember_invocation() */
 
 int main(int argc, char **argv)
 {
@@ -7,6 +8,8 @@ int main(int argc, char **argv)
 
 	parse_program_options(argc, argv);
 
+	remember_invocation(argv);
+
 	daemonize();
 
 	int master_socket = get_listening_socket();
@@ -0,0 +1,162 @@
+#include <cstdio>
+#include <string>
+
+#include <benchmark/benchmark.h>
+
+#include "server.h"
+
+namespace
+{
+	const char *const sample_requests[] =
+	{
+		"GET /index.html\r\n",
+		"GET /index.html HTTP/1.0\r\n\r\n",
+		"GET /static/css/site.css?v=12 HTTP/1.0\r\nHost: 127.0.0.1:11111\r\nUser-Agent: loadgen\r\n"
+			"Accept: */*\r\nAccept-Encoding: gzip, deflate\r\nConnection: keep-alive\r\n\r\n",
+		"BREW /pot HTCPCP/1.0\r\n\r\n"
+	};
+
+	const char *const sample_names[] = { "http09", "minimal", "browser_like", "bad_request" };
+
+	// a small file that lives as long as the benchmarks do
+	class temporary_file final
+	{
+		std::string path;
+
+	public:
+		temporary_file()
+		{
+			char name[] = "/tmp/cpp_server_benchmark_XXXXXX";
+			int fd = mkstemp(name);
+			if (fd != -1)
+			{
+				const char content[] = "<p>benchmark</p>\n";
+				ssize_t written = write(fd, content, sizeof(content) - 1);
+				(void)written;
+				close(fd);
+				path = name;
+			}
+		}
+		~temporary_file()
+		{
+			if (!path.empty())
+			{
+				unlink(path.data());
+			}
+		}
+
+		const char *name() const noexcept
+		{
+			return path.data();
+		}
+	};
+
+	const temporary_file &sample_file()
+	{
+		static temporary_file file;
+		return file;
+	}
+}
+
+static void BM_http_request_construct_and_parse(benchmark::State &state)
+{
+	const char *source = sample_requests[state.range(0)];
+	state.SetLabel(sample_names[state.range(0)]);
+
+	for (auto _: state)
+	{
+		http_request request(source);
+		request.parse_request();
+		benchmark::DoNotOptimize(request.get_status());
+	}
+}
+BENCHMARK(BM_http_request_construct_and_parse)->DenseRange(0, 3);
+
+static void BM_http_request_parse(benchmark::State &state)
+{
+	http_request request(sample_requests[state.range(0)]);
+	state.SetLabel(sample_names[state.range(0)]);
+
+	for (auto _: state)
+	{
+		request.parse_request();
+		benchmark::DoNotOptimize(request.get_status());
+	}
+}
+BENCHMARK(BM_http_request_parse)->DenseRange(0, 3);
+
+static void BM_time_t_to_string(benchmark::State &state)
+{
+	time_t now = time_t_now();
+
+	for (auto _: state)
+	{
+		std::string result = time_t_to_string(now);
+		benchmark::DoNotOptimize(result.data());
+	}
+}
+BENCHMARK(BM_time_t_to_string);
+
+static void BM_http_response_phrase(benchmark::State &state)
+{
+	const short statuses[] = { 200, 404, 400, 505, 299 };
+	size_t i = 0;
+
+	for (auto _: state)
+	{
+		benchmark::DoNotOptimize(http_response_phrase(statuses[i]));
+		i = (i + 1) % (sizeof(statuses) / sizeof(statuses[0]));
+	}
+}
+BENCHMARK(BM_http_response_phrase);
+
+// header assembly alone, with the file properties already looked up
+static void BM_build_headers(benchmark::State &state)
+{
+	open_file file(sample_file().name());
+	file.size();
+
+	std::string headers;
+	for (auto _: state)
+	{
+		headers.clear();
+		append_headers(headers, file);
+		benchmark::DoNotOptimize(headers.data());
+	}
+}
+BENCHMARK(BM_build_headers);
+
+// what every served file pays: open, stat and MIME type
+static void BM_open_file_properties(benchmark::State &state)
+{
+	for (auto _: state)
+	{
+		open_file file(sample_file().name());
+		benchmark::DoNotOptimize(file.size());
+		benchmark::DoNotOptimize(file.mime_type().data());
+	}
+}
+BENCHMARK(BM_open_file_properties)->Unit(benchmark::kMicrosecond);
+
+// what the rate limits add to every request, each thread a client of its own, let through or turned away
+static void BM_rate_limiter_admit(benchmark::State &state)
+{
+	static const bool configured = rate_limiter::instance().configure(1e6, 1e6, { "/downloads=1:1" }, 65536);
+
+	struct sockaddr_storage peer = {};
+	struct sockaddr_in &ipv4 = reinterpret_cast<struct sockaddr_in &>(peer);
+	ipv4.sin_family = AF_INET;
+	ipv4.sin_addr.s_addr = htonl(0x0a000001 + state.thread_index());
+
+	std::string_view path = state.range(0) ? "/downloads/large.iso" : "/index.html";
+	state.SetLabel(state.range(0) ? "turned_away" : "let_through");
+
+	int64_t now = monotonic_now_ns();
+	for (auto _: state)
+	{
+		benchmark::DoNotOptimize(rate_limiter::instance().admit(peer, path, now));
+		now += 1000;
+	}
+	benchmark::DoNotOptimize(configured);
+}
+BENCHMARK(BM_rate_limiter_admit)->DenseRange(0, 1)->ThreadRange(1, 8)->UseRealTime();
@@ -0,0 +1,43 @@
+#include <cstring>
+
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+/*
+*	Same as BENCHMARK_MAIN() except that results are JSON unless asked otherwise,
+*	so runs on different hardware and releases can be stored and compared by tools.
+*/
+int main(int argc, char **argv)
+{
+	std::vector<char *> arguments(argv, argv + argc);
+
+	bool format_given = false;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strncmp(argv[i], "--benchmark_format", strlen("--benchmark_format")) == 0)
+		{
+			format_given = true;
+		}
+	}
+
+	static char json_format[] = "--benchmark_format=json";
+	if (!format_given)
+	{
+		arguments.push_back(json_format);
+	}
+
+	int count = static_cast<int>(arguments.size());
+	benchmark::Initialize(&count, arguments.data());
+	if (benchmark::ReportUnrecognizedArguments(count, arguments.data()))
+	{
+		return 1;
+	}
+
+	benchmark::AddCustomContext("server_version", SERVER_VERSION);
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+
+	return 0;
+}
@@ -0,0 +1,78 @@
+#include <atomic>
+
+#include <benchmark/benchmark.h>
+
+#include "multithreading.h"
+
+namespace
+{
+	constexpr int max_threads = 8;
+}
+
+// every thread pushes its own element and pops whatever is there
+static void BM_mt_safe_queue_push_pop(benchmark::State &state)
+{
+	static mt_safe_queue<int> queue;
+	int value = 0;
+
+	for (auto _: state)
+	{
+		queue.push(state.thread_index());
+		benchmark::DoNotOptimize(queue.try_pop(value));
+	}
+}
+BENCHMARK(BM_mt_safe_queue_push_pop)->ThreadRange(1, max_threads)->UseRealTime();
+
+// the owner pushes and pops at the front while the others steal from the back
+static void BM_stealing_queue_push_pop_steal(benchmark::State &state)
+{
+	static stealing_queue<int> queue;
+	int value = 0;
+
+	for (auto _: state)
+	{
+		if (state.thread_index() == 0)
+		{
+			queue.push(1);
+			queue.push(2);
+			benchmark::DoNotOptimize(queue.try_pop(value));
+		}
+		else
+		{
+			benchmark::DoNotOptimize(queue.try_steal(value));
+		}
+	}
+
+	if (state.thread_index() == 0)
+	{
+		while (queue.try_pop(value))
+		{}
+	}
+}
+BENCHMARK(BM_stealing_queue_push_pop_steal)->ThreadRange(1, max_threads)->UseRealTime();
+
+namespace
+{
+	std::atomic<unsigned> completed{ 0 };
+
+	void mark_completed(unsigned value)
+	{
+		completed.store(value, std::memory_order_release);
+	}
+}
+
+// from enqueue_task on an outside thread until a worker has run the task
+static void BM_thread_pool_round_trip(benchmark::State &state)
+{
+	thread_pool pool;
+	unsigned sequence = 0;
+
+	for (auto _: state)
+	{
+		++sequence;
+		pool.enqueue_task(mark_completed, sequence);
+		while (completed.load(std::memory_order_acquire) != sequence)
+		{}
+	}
+}
+BENCHMARK(BM_thread_pool_round_trip)->UseRealTime();
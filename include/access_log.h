@@ -0,0 +1,168 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "thread_slots.h"
+
+enum class access_method : uint8_t
+{
+	unknown,
+	get,
+	head,
+	post
+};
+
+/*
+*	One request in the binary access log, exactly 128 bytes on disk in host byte order.
+*	Address is IPv6 or IPv4-mapped IPv6, path is truncated to path_capacity bytes.
+*	Durations are in microseconds: receive is from accept to the whole request read,
+*	open is the lookup of the file and its properties, send covers status line, headers and body.
+*/
+struct access_log_record
+{
+	static constexpr size_t path_capacity = 72;
+
+	int64_t timestamp_ns;			// realtime at accept, 0 marks the unused tail of a file
+	uint8_t address[16];
+	uint16_t port;
+	access_method method;
+	uint8_t http09;
+	uint16_t status;
+	uint8_t path_length;
+	uint8_t path_truncated;
+	uint64_t bytes_sent;
+	uint32_t receive_us;
+	uint32_t parse_us;
+	uint32_t open_us;
+	uint32_t send_us;
+	char path[path_capacity];
+
+	void set_address(const struct sockaddr_storage &peer) noexcept;
+	void set_path(const char *data, size_t length) noexcept;
+};
+
+static_assert(sizeof(access_log_record) == 128, "access_log_record is a fixed on-disk format");
+
+/*
+*	Header at the start of every access log file, followed by records up to the end of file.
+*/
+struct access_log_file_header
+{
+	static constexpr char magic_value[8] = { 'C', 'P', 'P', 'S', 'A', 'L', 'O', 'G' };
+	static constexpr uint32_t current_version = 1;
+
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t record_size;
+	uint32_t sequence;
+	int64_t created_ns;
+	char reserved[32];
+
+	bool valid() const noexcept
+	{
+		return memcmp(magic, magic_value, sizeof(magic)) == 0 && version == current_version
+			&& header_size == sizeof(access_log_file_header) && record_size == sizeof(access_log_record);
+	}
+};
+
+static_assert(sizeof(access_log_file_header) == 64, "access_log_file_header is a fixed on-disk format");
+
+/*
+*	Records are appended to per-thread lock-free rings and never touch the disk on the request path.
+*	The background thread moves them by batches into a memory-mapped file segment
+*	and asks the kernel for asynchronous write-back of every batch; full segments are rotated
+*	into a new file <prefix>.<sequence>.bin truncated to the records actually written. Numbering goes on
+*	after the highest segment already there and a segment is never opened over an existing file.
+*	If no segment can be opened the log is disabled, and records it could not write are counted as dropped.
+*/
+class access_log final
+{
+public:
+	static constexpr size_t ring_capacity = 1024;		// records per thread, power of 2
+	static constexpr size_t max_threads = 256;
+
+private:
+	using ring = spsc_ring<access_log_record, ring_capacity>;
+
+	thread_slots<ring, max_threads> rings;
+	static thread_local thread_slot_handle<ring, max_threads> local_ring;
+
+	std::atomic<bool> enabled_flag{ false };
+	std::atomic<uint64_t> dropped_without_ring{ 0 };
+	std::atomic<uint64_t> dropped_unwritten{ 0 };
+	std::atomic<uint64_t> written{ 0 };
+
+	std::string prefix;
+	size_t segment_records = 0;
+	size_t kept_segments = 0;			// 0 keeps them all
+	uint32_t sequence = 0;
+
+	int segment_fd = -1;
+	char *segment = nullptr;
+	size_t segment_size = 0;
+	size_t segment_used = 0;			// records in the current segment
+	size_t segment_flushed = 0;			// records already handed to msync
+
+	std::thread writer;
+	std::mutex writer_mutex;
+	std::condition_variable writer_condv;
+	bool stop_requested = false;
+
+	access_log() = default;
+
+	// calls visit(name, sequence) for every segment of the prefix found on disk
+	template <typename Visitor>
+	void for_each_segment(Visitor visit) const noexcept;
+
+	bool open_segment() noexcept;
+	void close_segment() noexcept;
+	void flush_segment() noexcept;
+	void remove_old_segments() noexcept;
+	bool store(const access_log_record &record) noexcept;
+	size_t drain() noexcept;
+	void writing_loop() noexcept;
+
+public:
+	static access_log &instance();
+
+	access_log(const access_log &) = delete;
+	access_log &operator=(const access_log &) = delete;
+
+	~access_log();
+
+	// segment_mebibytes is the size of every file, beyond kept ones the oldest are removed; an empty prefix leaves the access log disabled
+	bool start(const std::string &file_prefix, size_t segment_mebibytes, size_t kept = 0) noexcept;
+
+	void stop() noexcept;
+
+	bool enabled() const noexcept
+	{
+		return enabled_flag.load(std::memory_order_relaxed);
+	}
+
+	void append(const access_log_record &record) noexcept;
+
+	uint64_t dropped() const noexcept;
+
+	uint64_t records_written() const noexcept
+	{
+		return written.load(std::memory_order_relaxed);
+	}
+};
+
+int64_t realtime_now_ns() noexcept;
+
+int64_t monotonic_now_ns() noexcept;
+
+#endif		// ACCESS_LOG_H
@@ -0,0 +1,109 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+#include <sys/socket.h>
+
+/*
+*	Connection budget of the server. The acceptor stops watching the listener while has_room() is false,
+*	so excess clients queue in the listen backlog rather than pushing the process into EMFILE, and watches
+*	resume_fd() to learn that a connection was released. If descriptors run out anyway, shed_pending() frees
+*	a reserved one to accept and close the head of the backlog instead of spinning on the error.
+*	Optionally caps concurrent connections per client address, counted in sharded hash maps.
+*/
+class admission_control final
+{
+public:
+	static constexpr size_t shard_count = 64;
+
+private:
+	struct client_key
+	{
+		uint64_t high;
+		uint64_t low;
+
+		bool operator==(const client_key &other) const noexcept
+		{
+			return high == other.high && low == other.low;
+		}
+	};
+
+	struct client_key_hash
+	{
+		size_t operator()(const client_key &key) const noexcept
+		{
+			return static_cast<size_t>((key.high ^ (key.low * 0x9e3779b97f4a7c15ULL)) >> 7);
+		}
+	};
+
+	struct alignas(64) shard
+	{
+		std::mutex mutex;
+		std::unordered_map<client_key, uint32_t, client_key_hash> counts;
+	};
+
+	std::atomic<size_t> in_use{ 0 };
+	size_t budget = SIZE_MAX;
+	size_t per_client_cap = 0;
+	int reserve_fd = -1;
+	int resume_event_fd = -1;
+
+	std::atomic<bool> paused{ false };
+
+	shard shards[shard_count];
+
+	admission_control() = default;
+
+	static client_key key_of(const struct sockaddr_storage &peer) noexcept;
+
+	shard &shard_of(const client_key &key) noexcept
+	{
+		return shards[client_key_hash{}(key) % shard_count];
+	}
+
+	void reserve() noexcept;
+
+public:
+	static admission_control &instance();
+
+	admission_control(const admission_control &) = delete;
+	admission_control &operator=(const admission_control &) = delete;
+
+	// 0 for no cap per client
+	void configure(size_t max_connections, size_t max_per_client) noexcept;
+
+	// false while the budget is used up, a release then makes resume_fd() readable
+	bool has_room() noexcept;
+
+	int resume_fd() const noexcept
+	{
+		return resume_event_fd;
+	}
+
+	void acknowledge_resume() noexcept;
+
+	// takes a slot for the accepted connection, false if it has to be closed right away
+	bool admit(const struct sockaddr_storage &peer) noexcept;
+
+	void release(const struct sockaddr_storage &peer) noexcept;
+
+	// called as accept fails with EMFILE or ENFILE, a release then makes resume_fd() readable
+	void shed_pending(int master_socket) noexcept;
+
+	size_t connections() const noexcept
+	{
+		return in_use.load(std::memory_order_relaxed);
+	}
+
+	size_t limit() const noexcept
+	{
+		return budget;
+	}
+};
+
+#endif		// ADMISSION_H
@@ -0,0 +1,21 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <string>
+#include <vector>
+
+/*
+*	Placement of threads on CPUs. Linux allocates a page on the node of the CPU that touches it first,
+*	so a thread pinned before it allocates its own structures gets them node-local with no NUMA library.
+*/
+
+// "0-3,8,10-11" into the listed CPUs in the given order, throws std::invalid_argument on a malformed list
+std::vector<unsigned> parse_cpu_list(const std::string &list);
+
+// node of the CPU as sysfs reports it, 0 on machines without NUMA
+unsigned numa_node_of(unsigned cpu) noexcept;
+
+// binds the calling thread to the set, false if it is empty or the kernel refused it
+bool pin_current_thread(const std::vector<unsigned> &cpus) noexcept;
+
+#endif		// AFFINITY_H
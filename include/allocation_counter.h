@@ -0,0 +1,15 @@
+#ifndef ALLOCATION_COUNTER_H
+#define ALLOCATION_COUNTER_H
+
+#include <cstdint>
+
+/*
+*	The program replaces the global operator new to count its calls, so steady-state request handling can be
+*	checked to allocate nothing. Every thread counts into one of a few cache-line aligned shards with a relaxed add.
+*	Memory taken by malloc() directly, inside libc for one, isn't counted.
+*/
+
+// calls of operator new since start, summed over the shards
+uint64_t heap_allocations() noexcept;
+
+#endif		// ALLOCATION_COUNTER_H
@@ -0,0 +1,50 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <memory_resource>
+
+/*
+*	Bump allocator of one connection for the memory of a single request: the parsed request and the resolved path.
+*	Allocations come from a buffer inside the owner and are never freed one by one; reset() as the next request
+*	starts makes the whole buffer available again. A request outgrowing the buffer continues on the heap,
+*	counted as an arena overflow in the metrics.
+*/
+class request_arena final
+{
+public:
+	static constexpr size_t capacity = 2048;
+
+private:
+	class overflow_resource final : public std::pmr::memory_resource
+	{
+		void *do_allocate(size_t bytes, size_t alignment) override;
+		void do_deallocate(void *pointer, size_t bytes, size_t alignment) override;
+		bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override;
+	};
+
+	alignas(std::max_align_t) std::byte buffer[capacity];
+	overflow_resource overflow;
+	std::pmr::monotonic_buffer_resource resource;
+
+public:
+	request_arena() noexcept :
+		resource{ buffer, capacity, &overflow }
+	{}
+
+	request_arena(const request_arena &) = delete;
+	request_arena &operator=(const request_arena &) = delete;
+
+	std::pmr::memory_resource *get() noexcept
+	{
+		return &resource;
+	}
+
+	// every object allocated from the arena must be gone or have dropped its memory by now
+	void reset() noexcept
+	{
+		resource.release();
+	}
+};
+
+#endif		// ARENA_H
@@ -0,0 +1,61 @@
+#ifndef BLOCKING_POOL_H
+#define BLOCKING_POOL_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+*	Threads for calls that may block on a cold or slow disk: open, stat and popen. Sized apart from the workers,
+*	which submit a job and get its continuation posted back to their own queue, so no event loop waits on the disk.
+*	Time spent in the queue is recorded in the metrics of the thread that runs the job.
+*/
+class blocking_pool final
+{
+	struct job
+	{
+		std::function<void()> function;
+		int64_t queued_ns;
+	};
+
+	mutable std::mutex mutex;
+	std::condition_variable condv;
+	std::deque<job> jobs;
+	bool stopping = false;
+
+	std::vector<std::thread> threads;
+
+	void working_loop() noexcept;
+
+public:
+	explicit blocking_pool(size_t count);
+	~blocking_pool();
+
+	blocking_pool(const blocking_pool &) = delete;
+	blocking_pool &operator=(const blocking_pool &) = delete;
+
+	// false if the job couldn't be queued, the caller is then to run it by itself
+	bool submit(std::function<void()> function) noexcept;
+
+	size_t size() const noexcept
+	{
+		return threads.size();
+	}
+
+	size_t queue_depth() const noexcept;
+};
+
+// null if blocking calls are made inline by the workers
+extern std::unique_ptr<blocking_pool> blocking_threads;
+
+// 0 threads for no pool
+void initialize_blocking_pool(size_t count);
+
+void terminate_blocking_pool();
+
+#endif		// BLOCKING_POOL_H
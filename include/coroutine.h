@@ -0,0 +1,773 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+#include <atomic>
+#include <cerrno>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+
+#include "event_loop.h"
+#include "blocking_pool.h"
+#include "tls.h"
+
+/*
+*	Per-thread cache of coroutine frames. Freed frames are kept in free lists by size class and handed out
+*	to the next coroutine of the thread, so a worker that has reached its peak of concurrent coroutines
+*	never asks the heap for a frame. A frame has to be freed by the thread that allocated it.
+*/
+class frame_pool final
+{
+public:
+	static constexpr size_t granularity = 64;
+	static constexpr size_t size_classes = 32;				// frames up to 2 KiB are pooled
+	static constexpr size_t max_cached_per_class = 4096;
+
+private:
+	struct free_frame
+	{
+		free_frame *next;
+	};
+
+	struct free_lists
+	{
+		free_frame *heads[size_classes] = {};
+		size_t cached[size_classes] = {};
+
+		~free_lists();
+	};
+
+	static free_lists &local() noexcept;
+
+	static size_t class_of(size_t size) noexcept
+	{
+		return (size + granularity - 1) / granularity - 1;
+	}
+
+public:
+	static void *allocate(size_t size);
+	static void deallocate(void *frame, size_t size) noexcept;
+
+	// creates the pool of the calling thread, so it outlives thread-local objects created later that own frames
+	static void prepare() noexcept;
+};
+
+/*
+*	Coroutine owned by a single object, which starts it and is told when it completes. The coroutine is created
+*	suspended; start() runs it up to its first suspension. On completion the finish callback is called
+*	while the coroutine sits at its final suspension point, and may destroy the task together with its owner.
+*/
+class task final
+{
+public:
+	using finish_callback = void (*)(void *context) noexcept;
+
+	struct promise_type
+	{
+		finish_callback finish = nullptr;
+		void *context = nullptr;
+
+		struct final_awaiter
+		{
+			bool await_ready() const noexcept
+			{
+				return false;
+			}
+
+			void await_suspend(std::coroutine_handle<promise_type> routine) noexcept
+			{
+				promise_type &promise = routine.promise();
+				if (promise.finish)
+				{
+					promise.finish(promise.context);
+				}
+			}
+
+			void await_resume() const noexcept
+			{}
+		};
+
+		task get_return_object() noexcept
+		{
+			return task{ std::coroutine_handle<promise_type>::from_promise(*this) };
+		}
+
+		std::suspend_always initial_suspend() const noexcept
+		{
+			return {};
+		}
+
+		final_awaiter final_suspend() const noexcept
+		{
+			return {};
+		}
+
+		void return_void() const noexcept
+		{}
+
+		void unhandled_exception() const noexcept;
+
+		static void *operator new(size_t size)
+		{
+			return frame_pool::allocate(size);
+		}
+
+		static void operator delete(void *frame, size_t size) noexcept
+		{
+			frame_pool::deallocate(frame, size);
+		}
+	};
+
+private:
+	std::coroutine_handle<promise_type> routine;
+
+	explicit task(std::coroutine_handle<promise_type> handle) noexcept :
+		routine{ handle }
+	{}
+
+public:
+	task() = default;
+	~task()
+	{
+		if (routine)
+		{
+			routine.destroy();
+		}
+	}
+
+	task(const task &) = delete;
+	task &operator=(const task &) = delete;
+
+	task(task &&other) noexcept :
+		routine{ other.routine }
+	{
+		other.routine = nullptr;
+	}
+	task &operator=(task &&other) noexcept
+	{
+		if (&other != this)
+		{
+			if (routine)
+			{
+				routine.destroy();
+			}
+			routine = other.routine;
+			other.routine = nullptr;
+		}
+
+		return *this;
+	}
+
+	void start(finish_callback finish, void *context) noexcept
+	{
+		routine.promise().finish = finish;
+		routine.promise().context = context;
+		routine.resume();
+	}
+};
+
+/*
+*	Coroutine awaited by another one, which owns it for the time of the co_await. It starts when awaited
+*	and hands control straight back to the awaiting coroutine once it returns its result.
+*/
+class subtask final
+{
+public:
+	struct promise_type
+	{
+		std::coroutine_handle<> continuation;
+		bool result = false;
+
+		struct final_awaiter
+		{
+			bool await_ready() const noexcept
+			{
+				return false;
+			}
+
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> routine) noexcept
+			{
+				return routine.promise().continuation;
+			}
+
+			void await_resume() const noexcept
+			{}
+		};
+
+		subtask get_return_object() noexcept
+		{
+			return subtask{ std::coroutine_handle<promise_type>::from_promise(*this) };
+		}
+
+		std::suspend_always initial_suspend() const noexcept
+		{
+			return {};
+		}
+
+		final_awaiter final_suspend() const noexcept
+		{
+			return {};
+		}
+
+		void return_value(bool value) noexcept
+		{
+			result = value;
+		}
+
+		// the awaiting coroutine gets false
+		void unhandled_exception() noexcept;
+
+		static void *operator new(size_t size)
+		{
+			return frame_pool::allocate(size);
+		}
+
+		static void operator delete(void *frame, size_t size) noexcept
+		{
+			frame_pool::deallocate(frame, size);
+		}
+	};
+
+private:
+	std::coroutine_handle<promise_type> routine;
+
+	explicit subtask(std::coroutine_handle<promise_type> handle) noexcept :
+		routine{ handle }
+	{}
+
+public:
+	~subtask()
+	{
+		if (routine)
+		{
+			routine.destroy();
+		}
+	}
+
+	subtask(const subtask &) = delete;
+	subtask &operator=(const subtask &) = delete;
+
+	subtask(subtask &&other) noexcept :
+		routine{ other.routine }
+	{
+		other.routine = nullptr;
+	}
+
+	bool await_ready() const noexcept
+	{
+		return false;
+	}
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+	{
+		routine.promise().continuation = awaiting;
+		return routine;
+	}
+
+	bool await_resume() const noexcept
+	{
+		return routine.promise().result;
+	}
+};
+
+// index of the calling worker of the pool
+size_t current_worker() noexcept;
+
+// resumes the coroutine on the given worker of the pool, false if it couldn't be queued there
+bool resume_on_worker(size_t index, std::coroutine_handle<> routine) noexcept;
+
+/*
+*	Non-blocking socket of one event loop with awaitable operations. An operation tries its call at once
+*	and suspends the coroutine only if the call would block, until the loop reports the socket ready.
+*	Results are those of the call, or a negated errno: -ETIMEDOUT once the deadline set by expect() passes,
+*	-ECANCELED after cancel(). The deadline spans operations, so a client can't extend it by trickling bytes.
+*	While no operation waits, readiness is switched to edge-triggered so it doesn't spin the loop.
+*	A socket secured with TLS reads and writes through its stream instead, and an operation may wait for
+*	the other direction than its own while a record is half done.
+*	The socket stays registered with the loop until it's destroyed; the descriptor is owned elsewhere.
+*/
+class async_socket final : public event_handler, public timer_handler
+{
+public:
+	class operation
+	{
+		friend class async_socket;
+
+		// false while the call would block
+		bool attempt() noexcept
+		{
+			while (true)
+			{
+				ssize_t done = call();
+				if (done >= 0)
+				{
+					result = done;
+					return true;
+				}
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				if (errno != EAGAIN && errno != EWOULDBLOCK)
+				{
+					result = -errno;
+					return true;
+				}
+				if (socket.cancelled || socket.expired)
+				{
+					result = socket.cancelled ? -ECANCELED : -ETIMEDOUT;
+					return true;
+				}
+				return false;
+			}
+		}
+
+	protected:
+		async_socket &socket;
+		uint32_t events;
+		ssize_t result = 0;
+
+		operation(async_socket &owner, uint32_t wanted) noexcept :
+			socket(owner),
+			events{ wanted }
+		{}
+
+		virtual ~operation() = default;
+
+		virtual ssize_t call() noexcept = 0;
+
+		// the result of a call of the TLS stream, which says what a call that would block waits for
+		ssize_t secured(ssize_t done) noexcept
+		{
+			if (done == -1 && errno == EAGAIN)
+			{
+				events = socket.tls->wanted();
+			}
+			return done;
+		}
+
+	public:
+		operation(const operation &) = delete;
+		operation &operator=(const operation &) = delete;
+
+		bool await_ready() noexcept
+		{
+			return attempt();
+		}
+
+		bool await_suspend(std::coroutine_handle<> routine) noexcept
+		{
+			return socket.wait(*this, routine);
+		}
+
+		ssize_t await_resume() const noexcept
+		{
+			return result;
+		}
+	};
+
+	class recv_operation final : public operation
+	{
+		char *buffer;
+		size_t length;
+
+		ssize_t call() noexcept override
+		{
+			if (socket.tls)
+			{
+				return secured(socket.tls->read(buffer, length));
+			}
+			return ::recv(socket.fd, buffer, length, 0);
+		}
+
+	public:
+		recv_operation(async_socket &owner, char *destination, size_t size) noexcept :
+			operation(owner, EPOLLIN),
+			buffer{ destination },
+			length{ size }
+		{}
+	};
+
+	class send_operation final : public operation
+	{
+		const char *data;
+		size_t length;
+		int flags;
+
+		ssize_t call() noexcept override
+		{
+			if (socket.tls && !socket.tls->kernel_sends())
+			{
+				return secured(socket.tls->write(data, length));
+			}
+			return ::send(socket.fd, data, length, flags);
+		}
+
+	public:
+		send_operation(async_socket &owner, const char *source, size_t size, int send_flags) noexcept :
+			operation(owner, EPOLLOUT),
+			data{ source },
+			length{ size },
+			flags{ send_flags }
+		{}
+	};
+
+	class sendfile_operation final : public operation
+	{
+		int file;
+		off_t &offset;
+		size_t length;
+
+		ssize_t call() noexcept override
+		{
+			if (socket.tls && !socket.tls->kernel_sends())
+			{
+				return secured(socket.tls->write_file(file, offset, length));
+			}
+			return ::sendfile(socket.fd, file, &offset, length);
+		}
+
+	public:
+		sendfile_operation(async_socket &owner, int file_fd, off_t &file_offset, size_t size) noexcept :
+			operation(owner, EPOLLOUT),
+			file{ file_fd },
+			offset(file_offset),
+			length{ size }
+		{}
+	};
+
+	// connect() is made by the first attempt, the later ones only ask how it went
+	class connect_operation final : public operation
+	{
+		const struct sockaddr *address;
+		socklen_t length;
+		bool started = false;
+
+		ssize_t call() noexcept override
+		{
+			if (!started)
+			{
+				started = true;
+				if (::connect(socket.fd, address, length) == 0)
+				{
+					return 0;
+				}
+				if (errno == EINPROGRESS)
+				{
+					errno = EAGAIN;
+				}
+				return -1;
+			}
+
+			int error = 0;
+			socklen_t size = sizeof(error);
+			if (getsockopt(socket.fd, SOL_SOCKET, SO_ERROR, &error, &size) == -1)
+			{
+				return -1;
+			}
+			if (error)
+			{
+				errno = error;
+				return -1;
+			}
+
+			// readiness may be stale, the connection is made once it has a peer
+			struct sockaddr_storage peer;
+			size = sizeof(peer);
+			if (getpeername(socket.fd, reinterpret_cast<struct sockaddr *>(&peer), &size) == -1)
+			{
+				errno = (errno == ENOTCONN) ? EAGAIN : errno;
+				return -1;
+			}
+			return 0;
+		}
+
+	public:
+		connect_operation(async_socket &owner, const struct sockaddr *peer, socklen_t size) noexcept :
+			operation(owner, EPOLLOUT),
+			address{ peer },
+			length{ size }
+		{}
+	};
+
+	// between the socket and a pipe, which never blocks as it's filled only while empty
+	class splice_operation final : public operation
+	{
+		int from;
+		int to;
+		size_t length;
+
+		ssize_t call() noexcept override
+		{
+			// records of a TLS socket can't be spliced in, and out only if the kernel encrypts them
+			if (socket.tls && (from == socket.fd || !socket.tls->kernel_sends()))
+			{
+				errno = EOPNOTSUPP;
+				return -1;
+			}
+			return ::splice(from, nullptr, to, nullptr, length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		}
+
+	public:
+		splice_operation(async_socket &owner, int source, int destination, size_t size, uint32_t wanted) noexcept :
+			operation(owner, wanted),
+			from{ source },
+			to{ destination },
+			length{ size }
+		{}
+	};
+
+	// the TLS handshake of a secured socket, 0 once it's complete
+	class handshake_operation final : public operation
+	{
+		ssize_t call() noexcept override
+		{
+			return secured(socket.tls->handshake());
+		}
+
+	public:
+		explicit handshake_operation(async_socket &owner) noexcept :
+			operation(owner, EPOLLIN)
+		{}
+	};
+
+private:
+	static constexpr uint32_t parked = EPOLLET;
+
+	event_loop &loop;
+	int fd = -1;
+	tls_stream *tls = nullptr;
+	uint32_t interest = 0;
+	bool expired = false;
+	bool cancelled = false;
+	timer deadline;
+	operation *waiting = nullptr;
+	std::coroutine_handle<> waiter;
+
+	bool wait(operation &pending, std::coroutine_handle<> routine) noexcept;
+
+	void resume() noexcept
+	{
+		std::coroutine_handle<> routine = waiter;
+		waiting = nullptr;
+		waiter = nullptr;
+		routine.resume();
+	}
+
+public:
+	explicit async_socket(event_loop &owner) noexcept :
+		loop(owner),
+		deadline{ this }
+	{}
+	~async_socket();
+
+	async_socket(const async_socket &) = delete;
+	async_socket &operator=(const async_socket &) = delete;
+
+	// registers the descriptor with the loop, watched for input
+	bool attach(int descriptor) noexcept;
+
+	// reads and writes go through the stream from now on, it outlives the socket
+	void secure(tls_stream &stream) noexcept
+	{
+		tls = &stream;
+	}
+
+	// (re)starts the deadline of the operations to come
+	void expect(int64_t timeout_ms) noexcept
+	{
+		expired = false;
+		loop.arm(deadline, timeout_ms);
+	}
+
+	// no deadline until the next expect()
+	void relax() noexcept
+	{
+		expired = false;
+		loop.cancel(deadline);
+	}
+
+	// the waiting operation and all the later ones complete with -ECANCELED
+	void cancel() noexcept
+	{
+		cancelled = true;
+		if (waiting)
+		{
+			waiting->result = -ECANCELED;
+			resume();
+		}
+	}
+
+	recv_operation recv(char *buffer, size_t length) noexcept
+	{
+		return recv_operation(*this, buffer, length);
+	}
+
+	// what has arrived already, without suspending: -EAGAIN if nothing has
+	ssize_t recv_now(char *buffer, size_t length) noexcept
+	{
+		ssize_t done = tls ? tls->read(buffer, length) : ::recv(fd, buffer, length, MSG_DONTWAIT);
+		return done == -1 ? -errno : done;
+	}
+
+	// with more, the data waits to go out in one segment with what is sent next
+	send_operation send(const char *data, size_t length, bool more = false) noexcept
+	{
+		return send_operation(*this, data, length, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+	}
+
+	sendfile_operation sendfile(int file, off_t &offset, size_t length) noexcept
+	{
+		return sendfile_operation(*this, file, offset, length);
+	}
+
+	handshake_operation handshake() noexcept
+	{
+		return handshake_operation(*this);
+	}
+
+	connect_operation connect(const struct sockaddr *address, socklen_t length) noexcept
+	{
+		return connect_operation(*this, address, length);
+	}
+
+	// from the socket into the write end of an empty pipe
+	splice_operation splice_in(int pipe, size_t length) noexcept
+	{
+		return splice_operation(*this, fd, pipe, length, EPOLLIN);
+	}
+
+	// from the read end of a pipe out to the socket
+	splice_operation splice_out(int pipe, size_t length) noexcept
+	{
+		return splice_operation(*this, pipe, fd, length, EPOLLOUT);
+	}
+
+	void on_event(uint32_t events) noexcept override;
+	void on_timer() noexcept override;
+};
+
+/*
+*	Awaitable running a function on the blocking pool; the coroutine is resumed on the worker that awaited it.
+*	Without a pool, or if the job can't be queued, the function is run inline by the worker.
+*/
+template <typename Function>
+class offloaded final
+{
+	Function function;
+	bool done = false;
+
+public:
+	explicit offloaded(Function f) :
+		function{ std::move(f) }
+	{}
+
+	bool await_ready() const noexcept
+	{
+		return !blocking_threads;
+	}
+
+	bool await_suspend(std::coroutine_handle<> routine) noexcept
+	{
+		size_t owner = current_worker();
+
+		return blocking_threads->submit([this, routine, owner]()
+				{
+					function();
+					done = true;
+
+					// a coroutine that can't be handed back to its worker stays suspended for good
+					resume_on_worker(owner, routine);
+				});
+	}
+
+	void await_resume()
+	{
+		if (!done)
+		{
+			function();
+		}
+	}
+};
+
+template <typename Function>
+offloaded<Function> offload(Function function)
+{
+	return offloaded<Function>(std::move(function));
+}
+
+/*
+*	Awaitable running a function for each of count indices as jobs of their own on the blocking pool, so they
+*	run side by side; the coroutine is resumed on the worker that awaited it once the last of them is done.
+*	Jobs that can't be queued are run inline by the worker, and all of them without a pool.
+*/
+template <typename Function>
+class offloaded_each final
+{
+	Function function;
+	size_t count;
+	std::atomic<size_t> left{ 0 };
+
+public:
+	offloaded_each(size_t n, Function f) :
+		function{ std::move(f) },
+		count{ n }
+	{}
+
+	bool await_ready() const noexcept
+	{
+		return !blocking_threads || !count;
+	}
+
+	bool await_suspend(std::coroutine_handle<> routine) noexcept
+	{
+		size_t owner = current_worker();
+
+		// the worker holds one more until all are queued, so no job can resume the coroutine before that
+		left.store(count + 1, std::memory_order_relaxed);
+
+		for (size_t i = 0; i != count; ++i)
+		{
+			bool queued = blocking_threads->submit([this, routine, owner, i]()
+					{
+						function(i);
+						if (left.fetch_sub(1, std::memory_order_acq_rel) == 1)
+						{
+							resume_on_worker(owner, routine);
+						}
+					});
+
+			if (!queued)
+			{
+				function(i);
+				left.fetch_sub(1, std::memory_order_relaxed);
+			}
+		}
+
+		return left.fetch_sub(1, std::memory_order_acq_rel) != 1;
+	}
+
+	void await_resume()
+	{
+		if (!blocking_threads)
+		{
+			for (size_t i = 0; i != count; ++i)
+			{
+				function(i);
+			}
+		}
+	}
+};
+
+template <typename Function>
+offloaded_each<Function> offload_each(size_t count, Function function)
+{
+	return offloaded_each<Function>(count, std::move(function));
+}
+
+#endif		// COROUTINE_H
@@ -0,0 +1,126 @@
+#ifndef DIRECTORY_LISTING_H
+#define DIRECTORY_LISTING_H
+
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+enum class listing_format : uint8_t
+{
+	none,
+	html,
+	json
+};
+
+/*
+*	Rendered listing of one version of a directory. Entries are written in the order readdir returns them
+*	through a small buffer into an anonymous memory file, so a directory of any size is rendered without
+*	holding the listing on the heap, and the listing is sent with sendfile like any other file.
+*	Immutable once rendered; the descriptor is shared by every connection sending the listing.
+*/
+class directory_listing final
+{
+	int fd = -1;
+	size_t length = 0;
+	listing_format format;
+	struct timespec modified;
+	struct timespec changed;
+	ino_t inode;
+	dev_t device;
+	std::string last_modified_text;
+
+	explicit directory_listing(listing_format kind) noexcept :
+		format{ kind }
+	{}
+
+	void write_out(std::string &buffer, bool flush);
+
+public:
+	~directory_listing();
+
+	directory_listing(const directory_listing &) = delete;
+	directory_listing &operator=(const directory_listing &) = delete;
+
+	// throws std::system_error if the directory can't be read or the listing can't be written
+	static std::shared_ptr<const directory_listing> render(int directory_fd, const struct stat &status,
+			std::string_view url_path, listing_format kind);
+
+	// true if the listing still shows the directory of this status
+	bool current(const struct stat &status) const noexcept;
+
+	int descriptor() const noexcept
+	{
+		return fd;
+	}
+
+	size_t size() const noexcept
+	{
+		return length;
+	}
+
+	const char *mime_type() const noexcept
+	{
+		return format == listing_format::json ? "application/json" : "text/html; charset=utf-8";
+	}
+
+	const std::string &last_modified() const noexcept
+	{
+		return last_modified_text;
+	}
+};
+
+/*
+*	Listings by directory path, rendered once per version of a directory and reused until its mtime, ctime
+*	or inode changes. Looked up from the blocking pool under a mutex; rendering happens outside of it,
+*	so concurrent misses on one directory may render it twice and the last one is kept.
+*	Holds up to capacity listings, the least recently used one is dropped to make room.
+*/
+class listing_cache final
+{
+public:
+	static constexpr size_t capacity = 1024;
+
+private:
+	struct entry
+	{
+		std::shared_ptr<const directory_listing> listing;
+		uint64_t last_used;
+	};
+
+	// looked up by a view of the path, no key is built for a hit
+	struct path_hash
+	{
+		using is_transparent = void;
+
+		size_t operator()(std::string_view path) const noexcept
+		{
+			return std::hash<std::string_view>{}(path);
+		}
+	};
+
+	std::mutex mutex;
+	std::unordered_map<std::string, entry, path_hash, std::equal_to<>> entries;
+	uint64_t uses = 0;
+
+	listing_cache() = default;
+
+public:
+	static listing_cache &instance();
+
+	listing_cache(const listing_cache &) = delete;
+	listing_cache &operator=(const listing_cache &) = delete;
+
+	// the listing of the open directory at path, rendered anew if the cached one is stale; may throw
+	std::shared_ptr<const directory_listing> get(int directory_fd, std::string_view path, std::string_view url_path,
+			listing_format kind);
+};
+
+#endif		// DIRECTORY_LISTING_H
@@ -0,0 +1,103 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include <sys/epoll.h>
+
+#include "timer_wheel.h"
+
+class event_handler
+{
+public:
+	virtual ~event_handler() = default;
+
+	virtual void on_event(uint32_t events) noexcept = 0;
+};
+
+/*
+*	Readiness loop of one thread: epoll for the descriptors, an eventfd to be woken up by other threads
+*	and a timer wheel for deadlines. Everything but wake() is called from the owner thread only.
+*	A handler may be destroyed by another one handled in the same batch of events while its own events
+*	are still in the batch, so handlers are retired rather than destroyed during a dispatch.
+*/
+class event_loop final
+{
+public:
+	static constexpr int64_t tick_ms = 100;
+	static constexpr int max_events = 256;
+
+private:
+	int epoll_fd;
+	int wake_fd;
+	std::atomic<bool> sleeping{ false };
+	timer_wheel wheel;
+
+	struct retired_object
+	{
+		void (*destroy)(void *);
+		void *object;
+	};
+
+	bool dispatching = false;
+	std::vector<retired_object> retired;
+
+	size_t dispatch(int timeout_ms) noexcept;
+	void destroy_retired() noexcept;
+	void close_descriptors() noexcept;
+
+public:
+	event_loop();
+	~event_loop();
+
+	event_loop(const event_loop &) = delete;
+	event_loop &operator=(const event_loop &) = delete;
+
+	static int64_t now_ms() noexcept;
+
+	bool add(int fd, uint32_t events, event_handler *handler) noexcept;
+	bool modify(int fd, uint32_t events, event_handler *handler) noexcept;
+	void remove(int fd) noexcept;
+
+	// destroys the object once the batch being dispatched is handled, at once outside a dispatch
+	void retire(void (*destroy)(void *), void *object) noexcept;
+
+	void arm(timer &t, int64_t delay_ms) noexcept
+	{
+		wheel.arm(t, now_ms(), delay_ms);
+	}
+
+	void cancel(timer &t) noexcept
+	{
+		wheel.cancel(t);
+	}
+
+	// handles whatever is ready without blocking
+	size_t poll() noexcept
+	{
+		return dispatch(0);
+	}
+
+	/*
+	*	Blocks until an event, a due timer or wake(). The predicate is checked after the loop is marked
+	*	as sleeping, so work published before a wake() that saw the mark is never missed.
+	*/
+	template <typename Predicate>
+	size_t sleep_unless(Predicate has_other_work) noexcept
+	{
+		sleeping.store(true, std::memory_order_seq_cst);
+
+		size_t handled = dispatch(has_other_work() ? 0 : wheel.next_timeout_ms(now_ms()));
+
+		sleeping.store(false, std::memory_order_relaxed);
+
+		return handled;
+	}
+
+	// callable from any thread, makes a sleeping loop return, false if it wasn't sleeping
+	bool wake() noexcept;
+};
+
+#endif		// EVENT_LOOP_H
@@ -0,0 +1,286 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <sys/types.h>
+
+// sent by a client ahead of its first frame, whether it knew the server speaks HTTP/2 or upgraded to it
+constexpr std::string_view http2_preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+enum class http2_error : uint32_t
+{
+	no_error = 0x0,
+	protocol_error = 0x1,
+	internal_error = 0x2,
+	flow_control_error = 0x3,
+	stream_closed = 0x5,
+	frame_size_error = 0x6,
+	refused_stream = 0x7,
+	cancel = 0x8,
+	compression_error = 0x9,
+	enhance_your_calm = 0xb
+};
+
+struct http2_header
+{
+	std::string name;
+	std::string value;
+};
+
+/*
+*	Decoder of the header blocks of one connection (HPACK, RFC 7541): indexes into the static table and
+*	the dynamic table the peer builds within the size we allow, literals plain or Huffman-coded.
+*	A block that fails to decode leaves the table out of step with the peer, so it's a connection error.
+*/
+class hpack_decoder final
+{
+public:
+	static constexpr size_t table_size = 4096;				// the default, never announced otherwise
+	static constexpr size_t max_list_size = 65536;			// decoded names and values with 32 bytes each
+
+private:
+	std::deque<http2_header> dynamic;		// the newest first
+	size_t dynamic_size = 0;
+	size_t size_limit = table_size;
+
+	void evict(size_t limit) noexcept;
+	void insert(const http2_header &field);
+
+public:
+	// false on a compression error
+	bool decode(const uint8_t *data, size_t size, std::vector<http2_header> &fields);
+};
+
+/*
+*	Encoder of response header blocks. Fields that repeat between responses (the server, content types and the like)
+*	go into the dynamic table once and are referred to by index afterwards; the ones changing with every response
+*	(dates, lengths, tags) are sent as literals without indexing, so they don't push the repeating ones out.
+*	The table never outgrows what the peer allows with SETTINGS_HEADER_TABLE_SIZE.
+*/
+class hpack_encoder final
+{
+	std::deque<http2_header> dynamic;		// the newest first
+	size_t dynamic_size = 0;
+	size_t size_limit = hpack_decoder::table_size;
+	size_t smallest_limit = hpack_decoder::table_size;		// since the last block
+	bool size_changed = false;
+
+	void evict(size_t limit) noexcept;
+
+public:
+	// applies from the next block on, which starts with the update of the size
+	void set_table_size(size_t size) noexcept;
+
+	void begin_block(std::string &block);
+
+	// the name is lowercase
+	void encode(std::string_view name, std::string_view value, std::string &block);
+};
+
+// a request of a stream, complete once the last frame of its header block has arrived
+struct http2_request
+{
+	uint32_t stream = 0;
+	std::string method;
+	std::string path;					// with the query, as it came
+	std::string accept_encoding;		// all the fields joined by commas
+	bool body = false;					// DATA frames follow, they are read through and discarded
+};
+
+// a stream that has ended, by its response sent or by a reset
+struct http2_finished
+{
+	uint32_t stream;
+	uint64_t bytes_sent;				// of the body
+	bool complete;
+};
+
+// the body of a DATA frame sent from a file after the first after bytes of the output
+struct http2_file_part
+{
+	size_t after;
+	int file;
+	off_t offset;
+	size_t length;
+	std::shared_ptr<const void> keeper;		// keeps the descriptor open until the part is sent
+};
+
+/*
+*	State of one HTTP/2 connection over cleartext (RFC 9113), without any IO. The bytes that arrive are given
+*	to receive(), which answers settings, pings and flow control on its own and collects complete requests;
+*	respond() queues the head of a response and the body to come, from a file or from memory, and schedule()
+*	interleaves DATA frames of all the streams with a response, a frame per stream in turn, within the windows
+*	of flow control. Frames to write pile up in the output, bodies from files as parts to send with sendfile
+*	in between; the caller writes it all and calls written(). After a connection error the output ends
+*	with GOAWAY and nothing more is read.
+*/
+class http2_session final
+{
+public:
+	static constexpr size_t frame_header_size = 9;
+	static constexpr uint32_t default_window = 65535;
+	static constexpr uint32_t max_window = 0x7fffffff;
+	static constexpr size_t max_frame_size = 16384;			// of the frames received, never announced otherwise
+	static constexpr size_t max_sent_frame = 65536;			// of DATA frames sent, if the peer allows that much
+	static constexpr size_t max_header_block = 65536;
+
+private:
+	struct stream
+	{
+		int64_t send_window = default_window;
+		int64_t receive_window = default_window;
+		uint32_t unacknowledged = 0;		// DATA received and not credited back yet
+		bool remote_closed = false;			// END_STREAM received
+		bool responded = false;
+		bool local_closed = false;			// END_STREAM queued
+
+		int file = -1;
+		off_t offset = 0;
+		uint64_t left = 0;
+		std::string body;					// in place of a file
+		size_t body_offset = 0;
+		std::shared_ptr<const void> keeper;
+		uint64_t sent = 0;
+	};
+
+	size_t stream_limit;
+	std::map<uint32_t, stream> streams;
+	uint32_t last_stream = 0;
+	uint32_t last_scheduled = 0;
+
+	hpack_decoder decoder;
+	hpack_encoder encoder;
+
+	std::string input;
+	size_t input_offset = 0;
+	size_t preface_left = http2_preface.size();
+
+	std::string header_block;
+	uint32_t header_stream = 0;			// the stream whose block continues, 0 for none
+	bool header_end_stream = false;
+
+	int64_t connection_send_window = default_window;
+	int64_t connection_receive_window = default_window;
+	uint32_t connection_unacknowledged = 0;
+	uint32_t peer_initial_window = default_window;
+	size_t peer_frame_size = max_frame_size;
+
+	bool goaway_sent = false;
+	bool goaway_received = false;
+	bool failed = false;
+
+	std::string output;
+	std::deque<http2_file_part> file_parts;
+	size_t scheduled_file_bytes = 0;
+
+	std::vector<http2_request> requests;
+	std::vector<http2_finished> finished;
+
+	void append_frame_header(size_t length, uint8_t type, uint8_t flags, uint32_t stream_id);
+	void append_settings();
+	void append_window_update(uint32_t stream_id, uint32_t increment);
+	void reset(uint32_t stream_id, http2_error error);
+	void fail(http2_error error);
+
+	void close(std::map<uint32_t, stream>::iterator position, bool complete);
+
+	// END_STREAM is queued, a stream the client hasn't closed yet is reset
+	void finish_local(std::map<uint32_t, stream>::iterator position);
+
+	// false on a connection error
+	bool handle_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t *payload, size_t length);
+	bool handle_data(uint8_t flags, uint32_t stream_id, const uint8_t *payload, size_t length);
+	bool handle_headers(uint8_t flags, uint32_t stream_id, const uint8_t *payload, size_t length);
+	bool handle_settings(uint8_t flags, uint32_t stream_id, const uint8_t *payload, size_t length);
+	bool apply_setting(uint16_t identifier, uint32_t value);
+	bool handle_window_update(uint32_t stream_id, const uint8_t *payload, size_t length);
+	bool end_header_block();
+
+	void encode_head(uint32_t stream_id, std::string_view http1_head, bool end_stream);
+
+public:
+	explicit http2_session(size_t max_streams);
+
+	http2_session(const http2_session &) = delete;
+	http2_session &operator=(const http2_session &) = delete;
+
+	/*
+	*	The connection came as an HTTP/1.1 request with Upgrade: h2c, which becomes stream 1 half-closed by the client;
+	*	settings are the value of its HTTP2-Settings. False if they don't decode.
+	*/
+	bool upgrade(std::string_view settings, http2_request request);
+
+	void receive(const char *data, size_t size);
+
+	// the requests complete since the last call
+	std::vector<http2_request> &new_requests() noexcept
+	{
+		return requests;
+	}
+
+	// the streams ended since the last call
+	std::vector<http2_finished> &finished_streams() noexcept
+	{
+		return finished;
+	}
+
+	/*
+	*	Queues the response of a stream: the status and the headers come from an HTTP/1 response head,
+	*	the body, if any, is length bytes of the file from the offset. False if the stream is gone meanwhile.
+	*/
+	bool respond(uint32_t stream_id, std::string_view http1_head, int file, off_t offset, size_t length,
+			std::shared_ptr<const void> keeper);
+
+	// the same with the body in memory
+	bool respond(uint32_t stream_id, std::string_view http1_head, std::string body);
+
+	// appends DATA frames of the streams with a response until the output holds about budget bytes or the windows are used up
+	void schedule(size_t budget);
+
+	// no more streams accepted, GOAWAY tells the peer the last one that will be answered
+	void shut_down();
+
+	const std::string &pending_output() const noexcept
+	{
+		return output;
+	}
+
+	std::deque<http2_file_part> &pending_file_parts() noexcept
+	{
+		return file_parts;
+	}
+
+	void written() noexcept
+	{
+		output.clear();
+		file_parts.clear();
+		scheduled_file_bytes = 0;
+	}
+
+	bool has_output() const noexcept
+	{
+		return !output.empty() || !file_parts.empty();
+	}
+
+	// no stream open
+	bool idle() const noexcept
+	{
+		return streams.empty();
+	}
+
+	// nothing more will be read or answered once the output is written
+	bool done() const noexcept
+	{
+		return failed || ((goaway_sent || goaway_received) && streams.empty());
+	}
+};
+
+#endif		// HTTP2_H
@@ -0,0 +1,140 @@
+#ifndef LOGGING_H
+#define LOGGING_H
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "thread_slots.h"
+
+#define LOG_CERROR(x) log_errno((__func__), (__FILE__), (__LINE__), (x))
+#define LOG_CERROR_VALUE(x, y) log_errno((__func__), (__FILE__), (__LINE__), (x), errno, (y))
+#define LOG_CERROR_TEXT(x, y) log_message(log_level::error, (__func__), (__FILE__), (__LINE__), (x), (y))
+#define LOG_CLOG(x) log_message(log_level::info, (__func__), (__FILE__), (__LINE__), (x))
+#define LOG_CLOG_TEXT(x, y) log_message(log_level::info, (__func__), (__FILE__), (__LINE__), (x), (y))
+#define LOG_CLOG_VALUE(x, y) log_value((__func__), (__FILE__), (__LINE__), (x), (y))
+
+enum class log_level : unsigned char
+{
+	info,		// goes to the_server_log.log, the former std::clog
+	error		// goes to the_server_err.log, the former std::cerr
+};
+
+/*
+*	Binary record as it is stored in the rings. Every pointer must refer to a string literal
+*	(__func__, __FILE__ and the message of the LOG_ macros), anything else is copied into detail.
+*/
+struct log_record
+{
+	static constexpr size_t detail_capacity = 72;
+
+	int64_t timestamp_ns;
+	const char *function;
+	const char *file;
+	const char *message;
+	long long value;
+	uint32_t line;
+	int error_number;
+	log_level level;
+	bool has_errno;
+	bool has_value;
+	unsigned char detail_length;
+	char detail[detail_capacity];
+};
+
+/*
+*	Lock-free asynchronous logging. Every thread appends records into its own SPSC ring,
+*	the background thread drains all the rings, formats records and writes them by batches.
+*	Full rings drop the records and count the drops, which are reported later in the error log.
+*	Before start() and after stop() records are formatted and written to stderr synchronously.
+*/
+class async_logger final
+{
+public:
+	static constexpr char log_file_err_name[] = "the_server_err.log";
+	static constexpr char log_file_log_name[] = "the_server_log.log";
+
+	static constexpr size_t ring_capacity = 256;		// records per thread, power of 2
+	static constexpr size_t max_threads = 256;		// rings at most, thus memory is bounded
+	static constexpr size_t batch_size = 64 * 1024;
+
+private:
+	using ring = spsc_ring<log_record, ring_capacity>;
+
+	// formatted records on their way to one of the files, touched by the consumer only
+	class batch final
+	{
+		char buffer[batch_size];
+		size_t used = 0;
+
+	public:
+		int fd = -1;
+
+		void add(const log_record &record) noexcept;
+		void flush() noexcept;
+	};
+
+	thread_slots<ring, max_threads> rings;
+	static thread_local thread_slot_handle<ring, max_threads> local_ring;
+
+	std::atomic<bool> running_flag{ false };
+	std::atomic<uint64_t> dropped_without_ring{ 0 };
+	uint64_t reported_dropped_without_ring = 0;
+
+	batch err_batch;
+	batch log_batch;
+
+	std::thread consumer;
+	std::mutex consumer_mutex;						// only guards sleeping and stop requests
+	std::condition_variable consumer_condv;
+	bool stop_requested = false;
+
+	async_logger() = default;
+
+	void consuming_loop() noexcept;
+	size_t drain() noexcept;
+	void close_files() noexcept;
+	void write_synchronously(const log_record &record) noexcept;
+
+public:
+	static async_logger &instance();
+
+	async_logger(const async_logger &) = delete;
+	async_logger &operator=(const async_logger &) = delete;
+
+	~async_logger();
+
+	// opens the log files relative to the current directory and launches the consumer
+	bool start(bool truncate = true) noexcept;
+
+	// drains everything appended so far, closes the files and writes the rest synchronously from now on
+	void stop() noexcept;
+
+	bool running() const noexcept
+	{
+		return running_flag.load(std::memory_order_acquire);
+	}
+
+	void append(const log_record &record) noexcept;
+
+	uint64_t dropped() const noexcept;
+};
+
+size_t format_log_record(const log_record &record, char *buffer, size_t buffer_size) noexcept;
+
+void log_errno(const char *function, const char *file, size_t line, const char *message,
+		int actual_errno = errno) noexcept;
+
+void log_errno(const char *function, const char *file, size_t line, const char *message,
+		int actual_errno, long long value) noexcept;
+
+void log_message(log_level level, const char *function, const char *file, size_t line, const char *message,
+		const char *detail = nullptr) noexcept;
+
+void log_value(const char *function, const char *file, size_t line, const char *message,
+		long long value) noexcept;
+
+#endif		// LOGGING_H
@@ -0,0 +1,84 @@
+#ifndef LRU_LIST_H
+#define LRU_LIST_H
+
+/*
+*	Links of an object in an lru_list, the object derives from it. A copy starts out of any list
+*	and an assignment keeps the links the object had, so objects can be copied and assigned as they were.
+*/
+struct lru_hook
+{
+	lru_hook *newer = nullptr;
+	lru_hook *older = nullptr;
+
+	lru_hook() = default;
+	lru_hook(const lru_hook &) noexcept
+	{}
+	lru_hook &operator=(const lru_hook &) noexcept
+	{
+		return *this;
+	}
+};
+
+/*
+*	Intrusive list of the objects of a cache from the most recently used to the least, so that a use is recorded
+*	and the object to evict is found in constant time, without allocating. The list owns nothing, an object is
+*	unlinked before it is destroyed. Not thread-safe, guarded by the lock of its cache.
+*/
+template <typename T>
+class lru_list final
+{
+	lru_hook *newest = nullptr;
+	lru_hook *oldest = nullptr;
+
+public:
+	// an object not in the list, linked as the most recently used
+	void push(T &object) noexcept
+	{
+		lru_hook &hook = object;
+		hook.newer = nullptr;
+		hook.older = newest;
+		if (newest)
+		{
+			newest->newer = &hook;
+		}
+		else
+		{
+			oldest = &hook;
+		}
+		newest = &hook;
+	}
+
+	void unlink(T &object) noexcept
+	{
+		lru_hook &hook = object;
+		(hook.newer ? hook.newer->older : newest) = hook.older;
+		(hook.older ? hook.older->newer : oldest) = hook.newer;
+		hook.newer = nullptr;
+		hook.older = nullptr;
+	}
+
+	// an object in the list, moved to the most recently used
+	void touch(T &object) noexcept
+	{
+		if (newest != &static_cast<lru_hook &>(object))
+		{
+			unlink(object);
+			push(object);
+		}
+	}
+
+	// nullptr if the list is empty
+	T *least_recent() const noexcept
+	{
+		return static_cast<T *>(oldest);
+	}
+
+	// forgets every object, for when all of them are destroyed at once
+	void clear() noexcept
+	{
+		newest = nullptr;
+		oldest = nullptr;
+	}
+};
+
+#endif		// LRU_LIST_H
@@ -0,0 +1,220 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "thread_slots.h"
+
+/*
+*	HDR-style log-linear histogram of durations in nanoseconds: every power of two is split
+*	into 8 linear sub-buckets, so any recorded value is off by 12.5% at most.
+*	Values above 2^40 ns (about 18 minutes) land into the last bucket.
+*/
+class latency_histogram final
+{
+public:
+	static constexpr unsigned sub_bucket_bits = 3;
+	static constexpr unsigned max_value_bits = 40;
+	static constexpr size_t bucket_count = (max_value_bits - sub_bucket_bits + 1) << sub_bucket_bits;
+
+	static size_t bucket_index(uint64_t value) noexcept
+	{
+		constexpr uint64_t max_value = (uint64_t{ 1 } << max_value_bits) - 1;
+		if (value > max_value)
+		{
+			value = max_value;
+		}
+		if (value < (uint64_t{ 1 } << sub_bucket_bits))
+		{
+			return static_cast<size_t>(value);
+		}
+
+		unsigned shift = 63 - __builtin_clzll(value) - sub_bucket_bits;
+		size_t sub_bucket = static_cast<size_t>(value >> shift) & ((size_t{ 1 } << sub_bucket_bits) - 1);
+
+		return ((shift + 1) << sub_bucket_bits) + sub_bucket;
+	}
+
+	// exclusive upper bound of values counted in the bucket
+	static uint64_t bucket_upper_bound(size_t index) noexcept
+	{
+		if (index < (size_t{ 1 } << sub_bucket_bits))
+		{
+			return index + 1;
+		}
+
+		unsigned shift = static_cast<unsigned>(index >> sub_bucket_bits) - 1;
+		uint64_t sub_bucket = index & ((size_t{ 1 } << sub_bucket_bits) - 1);
+
+		return ((uint64_t{ 1 } << sub_bucket_bits) + sub_bucket + 1) << shift;
+	}
+
+	void record(uint64_t value) noexcept
+	{
+		buckets[bucket_index(value)].fetch_add(1, std::memory_order_relaxed);
+		sum.fetch_add(value, std::memory_order_relaxed);
+	}
+
+	struct snapshot
+	{
+		uint64_t buckets[bucket_count] = {};
+		uint64_t count = 0;
+		uint64_t sum = 0;
+
+		// upper bound of the bucket holding the quantile, 0 for an empty histogram
+		uint64_t value_at_quantile(double quantile) const noexcept;
+
+		// number of values strictly below bound, exact when bound is a power of 2 above 8
+		uint64_t count_below(uint64_t bound) const noexcept;
+	};
+
+	void add_to(snapshot &destination) const noexcept
+	{
+		for (size_t i = 0; i != bucket_count; ++i)
+		{
+			uint64_t value = buckets[i].load(std::memory_order_relaxed);
+			destination.buckets[i] += value;
+			destination.count += value;
+		}
+		destination.sum += sum.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<uint64_t> buckets[bucket_count] = {};
+	std::atomic<uint64_t> sum{ 0 };
+};
+
+enum class connection_deadline : uint8_t
+{
+	read_header,
+	read_body,
+	write_stall,
+	keep_alive
+};
+
+constexpr size_t connection_deadline_count = 4;
+
+/*
+*	Counters of one thread. Only the owner thread writes them with relaxed atomics, which are uncontended
+*	as every object sits on its own cache lines; scrapes sum all of them up.
+*/
+struct alignas(64) thread_metrics
+{
+	static constexpr short min_status = 100;
+	static constexpr short max_status = 599;
+
+	std::atomic<uint64_t> requests_by_status[max_status - min_status + 1] = {};
+	std::atomic<uint64_t> bytes_sent{ 0 };
+	std::atomic<uint64_t> connections_accepted{ 0 };
+	std::atomic<uint64_t> accept_errors{ 0 };
+	std::atomic<uint64_t> accept_batches{ 0 };
+	std::atomic<uint64_t> accept_pauses{ 0 };
+	std::atomic<uint64_t> shed_fd_exhausted{ 0 };
+	std::atomic<uint64_t> shed_per_client{ 0 };
+	std::atomic<uint64_t> sendfile_short_writes{ 0 };
+	std::atomic<uint64_t> arena_overflows{ 0 };
+	std::atomic<uint64_t> listing_renders{ 0 };
+	std::atomic<uint64_t> listing_cache_hits{ 0 };
+	std::atomic<uint64_t> path_cache_hits{ 0 };
+	std::atomic<uint64_t> path_cache_misses{ 0 };
+	std::atomic<uint64_t> negative_cache_hits{ 0 };
+	std::atomic<uint64_t> negative_cache_flushes{ 0 };
+	std::atomic<uint64_t> bundle_hits{ 0 };
+	std::atomic<uint64_t> proxied_requests{ 0 };
+	std::atomic<uint64_t> upstream_connects{ 0 };
+	std::atomic<uint64_t> upstream_reuses{ 0 };
+	std::atomic<uint64_t> upstream_failures{ 0 };
+	std::atomic<uint64_t> rate_limited{ 0 };
+	std::atomic<uint64_t> http2_connections{ 0 };
+	std::atomic<uint64_t> http2_streams{ 0 };
+	std::atomic<uint64_t> tls_handshakes{ 0 };
+	std::atomic<uint64_t> tls_resumptions{ 0 };
+	std::atomic<uint64_t> tls_kernel_offloads{ 0 };
+	std::atomic<uint64_t> tls_failures{ 0 };
+	std::atomic<uint64_t> connection_timeouts[connection_deadline_count] = {};
+
+	// opened and closed on the same thread in most cases, only the sum over all threads is meaningful
+	std::atomic<int64_t> open_connections{ 0 };
+
+	latency_histogram request_duration;
+	latency_histogram open_duration;
+	latency_histogram handoff_duration;
+	latency_histogram blocking_wait_duration;
+
+	void count_request(short status, uint64_t bytes, uint64_t duration_ns) noexcept
+	{
+		if (status < min_status || status > max_status)
+		{
+			status = 500;
+		}
+		requests_by_status[status - min_status].fetch_add(1, std::memory_order_relaxed);
+		bytes_sent.fetch_add(bytes, std::memory_order_relaxed);
+		request_duration.record(duration_ns);
+	}
+
+	void count_timeout(connection_deadline deadline) noexcept
+	{
+		connection_timeouts[static_cast<size_t>(deadline)].fetch_add(1, std::memory_order_relaxed);
+	}
+};
+
+/*
+*	Registry of all per-thread counters, and of gauges and counters kept elsewhere, read by callbacks on every scrape.
+*	Threads over the capacity of the registry share one more object, still correct since counters are atomic.
+*/
+class server_metrics final
+{
+public:
+	static constexpr size_t max_threads = 1024;
+
+	// label set such as R"(queue="common")" (empty for none) and the value
+	using gauge_values = std::vector<std::pair<std::string, double>>;
+	using gauge_reader = std::function<gauge_values()>;
+
+private:
+	thread_slots<thread_metrics, max_threads> slots;
+	static thread_local thread_slot_handle<thread_metrics, max_threads> local_slot;
+	thread_metrics shared_overflow;
+
+	struct gauge
+	{
+		std::string name;
+		std::string help;
+		gauge_reader reader;
+		const char *type;
+	};
+
+	mutable std::mutex gauges_mutex;
+	std::vector<gauge> gauges;
+
+	server_metrics() = default;
+
+public:
+	static server_metrics &instance();
+
+	server_metrics(const server_metrics &) = delete;
+	server_metrics &operator=(const server_metrics &) = delete;
+
+	thread_metrics &local() noexcept
+	{
+		thread_metrics *own = local_slot.get();
+		return own ? *own : shared_overflow;
+	}
+
+	void register_gauge(std::string name, std::string help, gauge_reader reader);
+
+	// a value that only grows, read the same way; the name ends with _total
+	void register_counter(std::string name, std::string help, gauge_reader reader);
+
+	// the whole state in Prometheus text exposition format 0.0.4
+	std::string render_prometheus() const;
+};
+
+#endif		// METRICS_H
@@ -12,7 +12,9 @@
 #include <deque>
 #include <functional>
 
-#include <iostream>
+#include "logging.h"
+#include "event_loop.h"
+#include "affinity.h"
 
 template <typename T>
 class mt_safe_queue final
@@ -99,6 +101,13 @@ public:
 
 		return queue.empty();
 	}
+
+	size_t size() const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		return queue.size();
+	}
 };
 
 template <typename T>
@@ -218,7 +227,14 @@ public:
 		std::lock_guard<std::mutex> lock(mutex);
 
 		return deque.empty();
-	}	
+	}
+
+	size_t size() const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		return deque.size();
+	}
 };
 
 class thread_joiner final
@@ -233,7 +249,12 @@ public:
 	{
 		for (auto &i: threads)
 		{
-			if (i.joinable())
+			// a pool torn down from one of its own threads, as std::terminate may do, lets that one go on its own
+			if (i.get_id() == std::this_thread::get_id())
+			{
+				i.detach();
+			}
+			else if (i.joinable())
 			{
 				i.join();
 			}
@@ -304,8 +325,15 @@ class thread_pool final
 	std::atomic<bool> terminate_flag;
 	mt_safe_queue<moveable_task> common_tasks_queue;
 	std::vector<std::unique_ptr<stealing_queue<moveable_task>>> task_queues;
+	std::vector<std::unique_ptr<mt_safe_queue<moveable_task>>> pinned_queues;	// never stolen, see run_on()
+	std::vector<std::unique_ptr<event_loop>> loops;
+	std::atomic<size_t> next_to_wake{ 0 };
+	std::vector<unsigned> worker_cpus;				// empty if the workers aren't pinned
+	std::vector<std::vector<size_t>> steal_orders;	// per worker, the siblings on its node first
+	bool running = false;
 
 	static thread_local stealing_queue<moveable_task> *local_tasks_queue;
+	static thread_local event_loop *local_loop;
 	static thread_local size_t thread_index;
 
 	std::vector<std::thread> threads;
@@ -313,10 +341,8 @@ class thread_pool final
 
 	bool try_steal(moveable_task &dest)
 	{
-		for (size_t i = 0; i != task_queues.size(); ++i)
+		for (size_t index: steal_orders[thread_index])
 		{
-			size_t index = (thread_index + i + 1) % task_queues.size();
-
 			if (task_queues[index]->try_steal(dest))
 			{
 				return true;
@@ -326,16 +352,100 @@ class thread_pool final
 		return false;
 	}
 
-	void working_loop(size_t index)
+	// every worker starts from the next index, so thieves spread over the victims rather than all hit the first one
+	void plan_stealing()
+	{
+		std::vector<unsigned> nodes(threads.size(), 0);
+		for (size_t i = 0; !worker_cpus.empty() && i != nodes.size(); ++i)
+		{
+			nodes[i] = numa_node_of(worker_cpus[i % worker_cpus.size()]);
+		}
+
+		steal_orders.resize(threads.size());
+		for (size_t i = 0; i != threads.size(); ++i)
+		{
+			steal_orders[i].reserve(threads.size() - 1);
+
+			for (bool same_node: { true, false })
+			{
+				for (size_t j = 1; j != threads.size(); ++j)
+				{
+					size_t index = (i + j) % threads.size();
+					if ((nodes[index] == nodes[i]) == same_node)
+					{
+						steal_orders[i].push_back(index);
+					}
+				}
+			}
+		}
+	}
+
+	// the queues and the loop of a worker are allocated by the worker itself once pinned, so they are local to its node
+	bool set_up_worker(size_t index, std::promise<void> &ready, std::shared_future<bool> started)
+	{
+		try
+		{
+			if (!worker_cpus.empty())
+			{
+				pin_current_thread({ worker_cpus[index % worker_cpus.size()] });
+			}
+
+			task_queues[index].reset(new stealing_queue<moveable_task>);
+			pinned_queues[index].reset(new mt_safe_queue<moveable_task>);
+			loops[index].reset(new event_loop);
+
+			ready.set_value();
+		}
+		catch (...)
+		{
+			ready.set_exception(std::current_exception());
+			return false;
+		}
+
+		// no worker looks at the others before all of them are set up
+		return started.get();
+	}
+
+	bool has_pending_tasks() const
+	{
+		if (terminate_flag.load(std::memory_order_acquire) || !common_tasks_queue.empty() ||
+				!pinned_queues[thread_index]->empty())
+		{
+			return true;
+		}
+
+		for (const auto &i: task_queues)
+		{
+			if (!i->empty())
+			{
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	void working_loop(size_t index, std::promise<void> &ready, std::shared_future<bool> started)
 	{
 		thread_index = index;
+		if (!set_up_worker(index, ready, std::move(started)))
+		{
+			return;
+		}
+
 		local_tasks_queue = task_queues[thread_index].get();
+		local_loop = loops[thread_index].get();
+
+		// tasks run in batches between polls, so neither the queues nor the sockets of the loop starve
+		constexpr size_t tasks_between_polls = 32;
+		size_t tasks_since_poll = 0;
 
 		while (!terminate_flag.load(std::memory_order_acquire))
 		{
 			moveable_task task;
 
-			if ((local_tasks_queue && local_tasks_queue->try_pop(task)) || common_tasks_queue.try_pop(task) || try_steal(task))
+			if (pinned_queues[thread_index]->try_pop(task) || (local_tasks_queue && local_tasks_queue->try_pop(task)) ||
+					common_tasks_queue.try_pop(task) || try_steal(task))
 			{
 				try
 				{
@@ -343,48 +453,140 @@ class thread_pool final
 				}
 				catch (std::exception &e)
 				{
-					std::cerr << std::this_thread::get_id() << " got an exception: " << e.what() << std::endl;
+					LOG_CERROR_TEXT("Worker thread got an exception:", e.what());
 				}
 				catch (...)
 				{
-					std::cerr << std::this_thread::get_id() << " got unknown exception thrown" << std::endl;
+					LOG_CERROR_TEXT("Worker thread got unknown exception thrown", nullptr);
+				}
+
+				if (++tasks_since_poll == tasks_between_polls)
+				{
+					local_loop->poll();
+					tasks_since_poll = 0;
 				}
 			}
 			else
 			{
-				std::this_thread::yield();
+				tasks_since_poll = 0;
+				local_loop->sleep_unless([this]() { return has_pending_tasks(); });
+			}
+		}
+	}
+
+	void wake_one() noexcept
+	{
+		size_t first = next_to_wake.fetch_add(1, std::memory_order_relaxed);
+
+		for (size_t i = 0; i != loops.size(); ++i)
+		{
+			if (loops[(first + i) % loops.size()]->wake())
+			{
+				return;
 			}
 		}
 	}
 
 public:
-	thread_pool() :
+	// as many workers as CPUs in the list, or as the hardware has, if the count is 0
+	explicit thread_pool(size_t count = 0, std::vector<unsigned> cpus = {}) :
 		terminate_flag{ false },
-		task_queues(std::thread::hardware_concurrency()),
-		threads(std::thread::hardware_concurrency()),
+		task_queues(count ? count : (cpus.empty() ? std::thread::hardware_concurrency() : cpus.size())),
+		pinned_queues(task_queues.size()),
+		loops(task_queues.size()),
+		worker_cpus{ std::move(cpus) },
+		threads(task_queues.size()),
 		joiner_of_pool_threads{ threads }
 	{
+		plan_stealing();
+
+		std::vector<std::promise<void>> ready(threads.size());
+		std::vector<std::future<void>> set_up;
+		for (auto &i: ready)
+		{
+			set_up.push_back(i.get_future());
+		}
+
+		std::promise<bool> start;
+		std::shared_future<bool> started = start.get_future().share();
+
+		size_t spawned = 0;
 		try
 		{
-			for (auto &i: task_queues)
+			for (; spawned != threads.size(); ++spawned)
 			{
-				i.reset(new stealing_queue<moveable_task>);
+				threads[spawned] = std::thread(&thread_pool::working_loop, this, spawned, std::ref(ready[spawned]), started);
 			}
+			running = true;
+		}
+		catch (std::exception &e)
+		{
+			LOG_CERROR_TEXT("thread pool initialization failed:", e.what());
+		}
 
-			for (size_t i = 0; i != threads.size(); ++i)
+		for (size_t i = 0; i != spawned; ++i)
+		{
+			try
 			{
-				threads[i] = std::thread(&thread_pool::working_loop, this, i);
+				set_up[i].get();
+			}
+			catch (std::exception &e)
+			{
+				running = false;
+				LOG_CERROR_TEXT("worker thread failed to start:", e.what());
 			}
 		}
-		catch (...)
+
+		if (!running)
 		{
 			terminate_flag.store(true, std::memory_order_release);
-			std::cerr << "thread pool initialization failed" << std::endl;
 		}
+		start.set_value(running);
 	}
 	~thread_pool()
 	{
 		terminate_flag.store(true, std::memory_order_release);
+
+		for (auto &i: loops)
+		{
+			if (i)
+			{
+				i->wake();
+			}
+		}
+	}
+
+	// 0 if the pool failed to start
+	size_t size() const noexcept
+	{
+		return running ? threads.size() : 0;
+	}
+
+	// event loop of the calling worker thread, null outside of the pool
+	static event_loop *current_loop() noexcept
+	{
+		return local_loop;
+	}
+
+	// index of the calling worker thread, meaningless outside of the pool
+	static size_t current_index() noexcept
+	{
+		return thread_index;
+	}
+
+	// the common queue first, then the queue of every worker
+	std::vector<size_t> queue_sizes() const
+	{
+		std::vector<size_t> result;
+		result.reserve(task_queues.size() + 1);
+
+		result.push_back(common_tasks_queue.size());
+		for (const auto &i: task_queues)
+		{
+			result.push_back(i ? i->size() : 0);
+		}
+
+		return result;
 	}
 
 	template <typename Function, typename Argument>
@@ -399,13 +601,37 @@ public:
 		else
 		{
 			common_tasks_queue.push(std::move(task));
+			wake_one();
 		}
 	}
+
+	// the task runs on the given worker, unless another one steals it
+	template <typename Function, typename Argument>
+	void enqueue_task_to(size_t index, Function &&function, Argument &&argument)
+	{
+		moveable_task task{ std::bind(function, std::move(argument)) };
+
+		index %= task_queues.size();
+		task_queues[index]->push(std::move(task));
+		loops[index]->wake();
+	}
+
+	// the function is run by the given worker and by no other, for work on the state of its event loop
+	template <typename Function>
+	void run_on(size_t index, Function function)
+	{
+		moveable_task task{ std::move(function) };
+
+		index %= pinned_queues.size();
+		pinned_queues[index]->push(std::move(task));
+		loops[index]->wake();
+	}
 };
 
 extern std::unique_ptr<thread_pool> worker_threads;
 
-void initialize_thread_pool();
+// the workers are pinned one per CPU of the list in turn, none if it is empty
+void initialize_thread_pool(size_t count, std::vector<unsigned> cpus);
 
 void terminate_thread_pool();
 
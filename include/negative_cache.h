@@ -0,0 +1,124 @@
+#ifndef NEGATIVE_CACHE_H
+#define NEGATIVE_CACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+
+#include "lru_list.h"
+
+/*
+*	Normalized paths known to have nothing to serve beneath the root, so repeated requests for them (scanners
+*	probing /wp-admin, /.env and the like) are answered with 404 on the worker, without the blocking pool or a syscall.
+*	Bounded, sharded by path, the least recently used path of a full shard is dropped to make room.
+*	An optional Bloom filter in front answers most lookups of existing paths without taking a lock.
+*
+*	A thread watches the served tree with inotify and forgets every known path as soon as anything beneath the root
+*	is created, moved in or has its permissions changed. Paths are recorded with the generation of the tree they were
+*	looked up in, so a lookup that raced with a change is never recorded for the new one. If the tree can't be watched
+*	completely, e. g. as there aren't enough inotify watches, a path is known only for the validity given.
+*/
+class negative_cache final
+{
+public:
+	static constexpr size_t shard_count = 64;
+	static constexpr size_t bloom_bits_per_path = 16;
+
+private:
+	struct entry : lru_hook
+	{
+		uint64_t generation = 0;
+		int64_t recorded_ns = 0;
+		const std::string *path = nullptr;		// the key of the entry, for eviction
+	};
+
+	struct path_hash
+	{
+		using is_transparent = void;
+
+		size_t operator()(std::string_view path) const noexcept
+		{
+			return std::hash<std::string_view>{}(path);
+		}
+	};
+
+	struct alignas(64) shard
+	{
+		std::mutex mutex;
+		std::unordered_map<std::string, entry, path_hash, std::equal_to<>> entries;
+		lru_list<entry> recency;
+	};
+
+	size_t shard_capacity = 0;
+	int64_t validity_ns = 0;
+
+	alignas(64) std::atomic<uint64_t> tree_generation{ 0 };
+	std::atomic<bool> watched{ false };
+
+	std::unique_ptr<std::atomic<uint64_t>[]> bloom;
+	size_t bloom_words = 0;
+	std::atomic<size_t> bloom_insertions{ 0 };
+
+	int inotify_fd = -1;
+	int stop_fd = -1;
+	std::string root_path;
+	std::thread watcher;
+
+	shard shards[shard_count];
+
+	negative_cache() = default;
+
+	shard &shard_of(size_t hash) noexcept
+	{
+		return shards[(hash >> 7) % shard_count];
+	}
+
+	bool bloom_may_contain(size_t hash) const noexcept;
+	void bloom_insert(size_t hash) noexcept;
+	void bloom_clear() noexcept;
+
+	bool fresh(const entry &known, int64_t now) const noexcept;
+
+	// false if the tree can't be watched completely
+	bool watch_tree(std::unordered_map<int, std::string> &directories, const std::string &relative) noexcept;
+	void watching_loop(std::unordered_map<int, std::string> directories) noexcept;
+
+	void forget_all() noexcept;
+
+public:
+	static negative_cache &instance();
+
+	negative_cache(const negative_cache &) = delete;
+	negative_cache &operator=(const negative_cache &) = delete;
+
+	~negative_cache();
+
+	// paths are recorded only after a successful start with non-zero capacity
+	bool start(const std::string &directory, size_t capacity, bool use_bloom, double validity_seconds) noexcept;
+	void stop() noexcept;
+
+	bool enabled() const noexcept
+	{
+		return shard_capacity != 0;
+	}
+
+	// taken before the filesystem is consulted, passed to record() afterwards
+	uint64_t generation() const noexcept
+	{
+		return tree_generation.load(std::memory_order_acquire);
+	}
+
+	// true if there was nothing to serve at the normalized path and the tree hasn't changed since
+	bool contains(std::string_view relative) noexcept;
+
+	// a lookup of the normalized path found nothing in the tree of the given generation
+	void record(std::string_view relative, uint64_t looked_up_in) noexcept;
+};
+
+#endif		// NEGATIVE_CACHE_H
@@ -0,0 +1,178 @@
+#ifndef PATH_RESOLVER_H
+#define PATH_RESOLVER_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "lru_list.h"
+
+/*
+*	Regular file or directory found beneath the served root, opened once and shared by every request for it.
+*	Its properties are taken as it's opened: the size, the modification time, the entity tag made of them and,
+*	for a regular file, the MIME type told by file(1). Immutable, so requests send from the same descriptor with offsets of their own.
+*/
+class resolved_file final
+{
+	int fd;
+	struct stat status;
+	std::string location_text;
+	std::string mime;
+	std::string last_modified_text;
+	std::string etag_text;
+
+public:
+	// takes over the descriptor
+	resolved_file(int descriptor, const struct stat &properties, std::string location);
+	~resolved_file();
+
+	resolved_file(const resolved_file &) = delete;
+	resolved_file &operator=(const resolved_file &) = delete;
+
+	int descriptor() const noexcept
+	{
+		return fd;
+	}
+
+	bool directory() const noexcept
+	{
+		return S_ISDIR(status.st_mode);
+	}
+
+	size_t size() const noexcept
+	{
+		return static_cast<size_t>(status.st_size);
+	}
+
+	const std::string &location() const noexcept
+	{
+		return location_text;
+	}
+
+	const std::string &mime_type() const noexcept
+	{
+		return mime;
+	}
+
+	const std::string &last_modified() const noexcept
+	{
+		return last_modified_text;
+	}
+
+	// quoted, changes with the size or the modification time
+	const std::string &etag() const noexcept
+	{
+		return etag_text;
+	}
+
+	// true if the status is that of the same, unchanged file
+	bool same_as(const struct stat &other) const noexcept;
+};
+
+/*
+*	Resolution of request paths beneath the served root. The root is opened once as a directory descriptor
+*	and every path is opened relative to it with openat2(RESOLVE_BENEATH), so neither a dot-dot segment
+*	nor a symlink leads outside of it, and the kernel walks only the part below the root.
+*	Resolved files are kept in a sharded cache by normalized path and revalidated once the given validity
+*	has passed since their last check, with an O_PATH lookup and fstat instead of an open and file(1).
+*	Paths with nothing to serve go to the negative cache instead. Every cached file holds a descriptor,
+*	capacity counts against the budget of them.
+*/
+class path_resolver final
+{
+public:
+	static constexpr size_t shard_count = 64;
+
+private:
+	struct entry : lru_hook
+	{
+		std::shared_ptr<const resolved_file> file;
+		int64_t validated_ns = 0;
+		uint64_t requests = 0;
+		const std::string *path = nullptr;		// the key of the entry, for eviction
+	};
+
+	struct path_hash
+	{
+		using is_transparent = void;
+
+		size_t operator()(std::string_view path) const noexcept
+		{
+			return std::hash<std::string_view>{}(path);
+		}
+	};
+
+	struct alignas(64) shard
+	{
+		mutable std::mutex mutex;
+		std::unordered_map<std::string, entry, path_hash, std::equal_to<>> entries;
+		lru_list<entry> recency;
+	};
+
+	int root_fd = -1;
+	std::string root_path;
+	size_t shard_capacity = 0;
+	int64_t validity_ns = 0;
+	std::atomic<bool> beneath_supported{ true };
+
+	shard shards[shard_count];
+
+	path_resolver() = default;
+
+	shard &shard_of(std::string_view relative) noexcept
+	{
+		return shards[(path_hash{}(relative) >> 7) % shard_count];
+	}
+
+	// -1 with errno set on failure
+	int open_beneath(const char *relative, int flags) noexcept;
+
+	// nullptr if there is nothing to serve at the path, which is recorded in the negative cache if it is certain
+	std::shared_ptr<const resolved_file> load(const std::pmr::string &relative, uint64_t generation);
+
+	bool still_valid(const resolved_file &file, const std::pmr::string &relative) noexcept;
+
+	void store(shard &own, const std::pmr::string &relative, std::shared_ptr<const resolved_file> file, int64_t now);
+
+public:
+	static path_resolver &instance();
+
+	path_resolver(const path_resolver &) = delete;
+	path_resolver &operator=(const path_resolver &) = delete;
+
+	// false if the root can't be opened
+	bool open_root(const std::string &directory, size_t capacity, double validity_seconds) noexcept;
+
+	// files the cache may hold open at a time
+	size_t capacity() const noexcept
+	{
+		return shard_capacity * shard_count;
+	}
+
+	/*
+	*	URL path to a path relative to the root: percent-decoded, without empty and dot segments, dot-dot
+	*	segments applied. False for a path above the root or with an encoded slash or NUL, which isn't served.
+	*/
+	static bool normalize(std::string_view url_path, std::pmr::string &relative);
+
+	// a normalized path back into a URL path, percent-encoded where a segment can't carry a character as it is
+	static void append_encoded(std::string &destination, std::string_view relative);
+
+	// a normalized path, nullptr if there is no regular file or directory at it
+	std::shared_ptr<const resolved_file> resolve(const std::pmr::string &relative);
+
+	// up to count cached paths, the most requested first
+	std::vector<std::string> hottest(size_t count) const;
+};
+
+#endif		// PATH_RESOLVER_H
@@ -0,0 +1,252 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "coroutine.h"
+#include "event_loop.h"
+
+/*
+*	Connection to an upstream, registered with the event loop of the worker that opened it and used by that worker only.
+*	Between requests it waits, parked, in the pool of the worker for the next request to the same upstream.
+*/
+class upstream_connection final
+{
+	// closed after the socket has left the loop, a descriptor number can't be reused meanwhile
+	class descriptor final
+	{
+		int fd;
+
+	public:
+		explicit descriptor(int opened) noexcept :
+			fd{ opened }
+		{}
+		~descriptor()
+		{
+			close(fd);
+		}
+
+		descriptor(const descriptor &) = delete;
+		descriptor &operator=(const descriptor &) = delete;
+
+		operator int() const noexcept
+		{
+			return fd;
+		}
+	};
+
+public:
+	static constexpr size_t buffer_size = 8192;
+
+	descriptor fd;
+	async_socket socket;
+	size_t upstream;
+	bool connected = false;
+	bool reused = false;
+	int64_t idle_since_ns = 0;
+
+	// the response head and whatever of the body came with it
+	char buffer[buffer_size];
+
+	event_loop &loop;
+
+	upstream_connection(event_loop &owner, int opened, size_t index) noexcept :
+		fd{ opened },
+		socket(owner),
+		upstream{ index },
+		loop(owner)
+	{}
+
+	upstream_connection(const upstream_connection &) = delete;
+	upstream_connection &operator=(const upstream_connection &) = delete;
+};
+
+/*
+*	Deleter of upstream connections. A connection that can't be reused is dropped by the coroutine of a client,
+*	which runs inside a batch of events that may still hold one for the upstream socket (the upstream closing
+*	its side, most likely), so the connection is retired to its loop rather than deleted on the spot.
+*/
+struct upstream_retirement
+{
+	void operator()(upstream_connection *connection) const noexcept;
+};
+
+using upstream_pointer = std::unique_ptr<upstream_connection, upstream_retirement>;
+
+// a pipe bodies are spliced through, -1 in both ends if there is none
+struct pipe_pair
+{
+	int read_end = -1;
+	int write_end = -1;
+
+	explicit operator bool() const noexcept
+	{
+		return read_end != -1;
+	}
+};
+
+struct proxy_route
+{
+	size_t index;
+	std::string prefix;
+	std::vector<size_t> upstreams;
+};
+
+// what the head of an upstream response says about its body and the connection
+struct upstream_response
+{
+	short status = 0;
+	bool length_known = false;			// by Content-Length or as a response that has no body
+	uint64_t content_length = 0;
+	bool chunked = false;				// the body is chunked, its end known once the last chunk is read
+	bool reusable = false;				// keep-alive agreed on and the end of the body known
+};
+
+/*
+*	Reverse proxy of the configured prefixes: a request whose path starts with one is forwarded to the upstreams
+*	of the prefix in turn, skipping for a while those that failed to connect. Heads are rewritten on the way,
+*	bodies are spliced between the sockets through a pipe without being copied to the process or buffered whole.
+*	Every worker keeps idle keep-alive connections to every upstream for its next requests, so neither the pools
+*	nor the sockets in them are ever shared between threads.
+*/
+class reverse_proxy final
+{
+public:
+	static constexpr size_t pipe_capacity = 65536;		// the default size of a pipe, spliced at once
+	static constexpr int64_t down_for_ns = 5000000000;		// an upstream that refused a connection is skipped this long
+	static constexpr int64_t max_idle_ns = 30000000000;	// idle connections older than this are closed
+	static constexpr size_t max_cached_pipes = 64;
+
+private:
+	struct upstream
+	{
+		std::string name;
+		struct sockaddr_storage address;
+		socklen_t length;
+		std::atomic<int64_t> down_until_ns{ 0 };
+	};
+
+	struct worker_state
+	{
+		std::vector<std::vector<upstream_pointer>> idle;		// by upstream, the oldest first
+		std::vector<size_t> cursors;		// by route
+		std::vector<pipe_pair> pipes;
+		bool draining = false;
+
+		~worker_state();
+	};
+
+	std::vector<proxy_route> routes;		// the longest prefix first
+	std::vector<std::unique_ptr<upstream>> upstreams;
+	size_t idle_limit = 0;
+
+	reverse_proxy() = default;
+
+	static worker_state &local();
+
+	size_t add_upstream(const std::string &name);
+
+public:
+	static reverse_proxy &instance();
+
+	reverse_proxy(const reverse_proxy &) = delete;
+	reverse_proxy &operator=(const reverse_proxy &) = delete;
+
+	// every specification is a prefix, = and a comma-separated list of host:port; false if one isn't valid
+	bool configure(const std::vector<std::string> &specifications, size_t idle_per_upstream) noexcept;
+
+	bool enabled() const noexcept
+	{
+		return !routes.empty();
+	}
+
+	// the most descriptors idle connections of all the workers may hold
+	size_t idle_capacity(size_t workers) const noexcept
+	{
+		return workers * upstreams.size() * idle_limit;
+	}
+
+	/*
+	*	The route of the longest prefix that is the normalized path or a whole number of its segments, so that //api,
+	*	/./api or /%61pi are /api as well. Null for none and for a path that doesn't normalize; the path the request is
+	*	forwarded with is left in normalized, decoded, with its leading slash and a trailing one if it had one.
+	*/
+	const proxy_route *match(std::string_view path, std::pmr::string &normalized) const noexcept;
+
+	// the next upstream of the route that is up, idle connection to it if the worker has one or a new unconnected one
+	upstream_pointer acquire(const proxy_route &route, event_loop &loop) noexcept;
+
+	const struct sockaddr *address(size_t upstream, socklen_t &length) const noexcept
+	{
+		length = upstreams[upstream]->length;
+		return reinterpret_cast<const struct sockaddr *>(&upstreams[upstream]->address);
+	}
+
+	const std::string &name(size_t upstream) const noexcept
+	{
+		return upstreams[upstream]->name;
+	}
+
+	void mark_down(size_t upstream) noexcept;
+
+	// kept in the pool of the worker if there is room, closed otherwise
+	void release(upstream_pointer connection) noexcept;
+
+	pipe_pair take_pipe() noexcept;
+
+	// a pipe that may still hold data is closed rather than reused
+	void give_back(pipe_pair pipe, bool empty) noexcept;
+
+	// closes the idle connections of the calling worker and keeps no more
+	static void drain_local() noexcept;
+
+	/*
+	*	The request head for an upstream: an HTTP/1.0 request line for the normalized path, encoded again, and the query
+	*	of the original; hop-by-hop headers dropped, the client appended to X-Forwarded-For.
+	*/
+	static void forward_request_head(std::string_view head, std::string_view normalized, const struct sockaddr_storage &client,
+			std::string &destination);
+
+	// a Content-Length value of 1 to 18 digits and nothing else, false for anything else
+	static bool parse_content_length(std::string_view value, uint64_t &length) noexcept;
+
+	// 0 until the blank line has arrived
+	static size_t response_head_length(const char *data, size_t size) noexcept;
+
+	// false if the head isn't that of a response
+	static bool parse_response_head(std::string_view head, bool head_request, upstream_response &response) noexcept;
+
+	// the response head for a client: an HTTP/1.0 status line and hop-by-hop headers dropped
+	static void forward_response_head(std::string_view head, bool keep_alive, std::string &destination);
+};
+
+// writes all of the data, false if the socket fails or stalls for longer than the timeout
+subtask send_all(async_socket &to, const char *data, size_t size, int64_t timeout_ms);
+
+/*
+*	Moves length bytes, or all of them up to the end of input if to_end, from one socket to the other.
+*	Through the pipe if there is one, through the buffer otherwise. False if either side fails or times out,
+*	or the input ends before length; moved counts the bytes written out.
+*/
+subtask relay(async_socket &from, int64_t read_timeout_ms, async_socket &to, int64_t write_timeout_ms, pipe_pair pipe,
+		char *buffer, size_t buffer_size, uint64_t length, bool to_end, uint64_t &moved);
+
+/*
+*	Passes a chunked body on as the plain data of its chunks, for a client that knows no chunks and reads to the end.
+*	The buffer holds what has arrived of the body from start to end. False if either side fails or times out,
+*	or the chunks are malformed; clean is set if nothing came after the body.
+*/
+subtask relay_chunked(async_socket &from, int64_t read_timeout_ms, async_socket &to, int64_t write_timeout_ms, pipe_pair pipe,
+		char *buffer, size_t buffer_size, size_t start, size_t end, uint64_t &moved, bool &clean);
+
+#endif		// PROXY_H
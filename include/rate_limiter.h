@@ -0,0 +1,84 @@
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <sys/socket.h>
+
+/*
+*	Request rate limits per client address, and per client address and prefix, as token buckets.
+*	A bucket is a single atomic word, the time at which it will be full again (the theoretical arrival time
+*	of the generic cell rate algorithm): a request is let through if that time is within the burst from now,
+*	and moves it on by one interval with a compare-and-swap. Buckets live in a fixed table of sets of four,
+*	one cache line each, picked by a hash of the key; a bucket that has filled up again says nothing about
+*	its client, so it is taken over in place by the next key of its set and idle clients never need sweeping.
+*	With all four buckets of a set busy the one closest to full is evicted. Counting is approximate: keys are
+*	compared by a 64-bit hash and concurrent takeovers may lose a request or two, never a lock.
+*/
+class rate_limiter final
+{
+public:
+	static constexpr size_t set_size = 4;
+
+private:
+	struct bucket
+	{
+		std::atomic<uint64_t> key{ 0 };		// 0 for a bucket never used
+		std::atomic<int64_t> full_at_ns{ 0 };
+	};
+
+	struct alignas(64) bucket_set
+	{
+		bucket buckets[set_size];
+	};
+
+	struct limit
+	{
+		int64_t interval_ns = 0;			// 0 for no limit
+		int64_t tolerance_ns = 0;			// the burst beyond the first request
+	};
+
+	struct prefix_limit
+	{
+		std::string prefix;
+		limit rate;
+	};
+
+	std::unique_ptr<bucket_set[]> sets;
+	size_t set_mask = 0;
+	limit per_client;
+	std::vector<prefix_limit> prefixes;		// the longest first
+
+	rate_limiter() = default;
+
+	static limit make_limit(double rate, double burst);
+	static uint64_t key_of(const struct sockaddr_storage &peer, uint64_t salt) noexcept;
+
+	// 0 if the request is let through, the nanoseconds until it would be otherwise
+	int64_t take(uint64_t key, const limit &rate, int64_t now_ns) noexcept;
+
+public:
+	static rate_limiter &instance();
+
+	rate_limiter(const rate_limiter &) = delete;
+	rate_limiter &operator=(const rate_limiter &) = delete;
+
+	// a rate of 0 is no limit per client, every prefix limit is /path=rate[:burst]; false if one isn't valid
+	bool configure(double rate, double burst, const std::vector<std::string> &prefix_limits, size_t entries) noexcept;
+
+	bool enabled() const noexcept
+	{
+		return sets != nullptr;
+	}
+
+	// 0 if the request is let through, otherwise the seconds the client should wait, at least 1; the path as requested
+	uint32_t admit(const struct sockaddr_storage &peer, std::string_view path, int64_t now_ns) noexcept;
+};
+
+#endif		// RATE_LIMITER_H
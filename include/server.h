@@ -3,15 +3,40 @@
 
 #include <atomic>
 #include <thread>
-#include <regex>
-
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <poll.h>
+#include <strings.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/sendfile.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "utils.h"
 #include "multithreading.h"
+#include "access_log.h"
+#include "metrics.h"
+#include "event_loop.h"
+#include "admission.h"
+#include "upgrade.h"
+#include "arena.h"
+#include "allocation_counter.h"
+#include "slab.h"
+#include "coroutine.h"
+#include "path_resolver.h"
+#include "negative_cache.h"
+#include "warm_up.h"
+#include "static_bundle.h"
+#include "proxy.h"
+#include "rate_limiter.h"
+#include "http2.h"
+#include "tls.h"
 
 extern std::unique_ptr<thread_pool> worker_threads;
 
@@ -21,80 +46,116 @@ int get_binded_socket(struct addrinfo *address_info) noexcept;
 
 int get_listening_socket() noexcept;
 
+// options of the command line: TCP_DEFER_ACCEPT and TCP_FASTOPEN for listeners only, the rest for both
+void set_listener_options(int fd) noexcept;
+
+void set_connection_options(int fd) noexcept;
+
 void run_server_loop(int master_socket);
 
+/*
+*	Accepted socket with what is known about its client. Owns the descriptor and the admission slot,
+*	both given back on destruction; move-only and kept by value, so accepting doesn't allocate.
+*	The descriptor and the timestamps come first, the address of the peer is rarely needed after admission.
+*/
 class active_connection final
 {
-	class implementation final
+	int fd;
+	int error_number;
+	bool admitted = false;
+	int64_t accepted_monotonic_ns;
+	int64_t accepted_wall_ns;
+	socklen_t peer_length;
+	struct sockaddr_storage peer_storage;
+
+	void release() noexcept
 	{
-	public:
-		explicit implementation(int master_socket) noexcept :
-			fd{ accept(master_socket, nullptr, nullptr) }
+		if (fd == -1)
 		{
-			if (fd == -1)
-			{
-				std::lock_guard<std::mutex> lock(cerr_mutex);
-				LOG_CERROR("Error of accept, connection stays flawed");
-			}
+			return;
 		}
-		~implementation()
-		{
-			if (fd == -1)
-			{
-				return;
-			}
 
-			if (close(fd) == -1)
-			{
-				std::lock_guard<std::mutex> lock(cerr_mutex);
-				LOG_CERROR("Failed to close connection");
-				std::cerr << "fd " << fd << " not closed in proper way\n";
-			}
+		if (admitted)
+		{
+			admission_control::instance().release(peer_storage);
 		}
 
-		implementation(const implementation &) = default;
-		implementation &operator=(const implementation &) = default;
-		implementation(implementation &&) = default;
-		implementation &operator=(implementation &&) = default;
-
-		operator int() const noexcept
+		if (close(fd) == -1)
 		{
-			return fd;
+			LOG_CERROR_VALUE("Failed to close connection, not closed in proper way fd", fd);
 		}
+	}
 
-	private:
-		int fd;
-	};
+public:
+	explicit active_connection(int master_socket) noexcept :
+		fd{ -1 },
+		error_number{ 0 },
+		accepted_monotonic_ns{ monotonic_now_ns() },
+		accepted_wall_ns{ realtime_now_ns() },
+		peer_length{ sizeof(peer_storage) }
+	{
+		fd = accept4(master_socket, reinterpret_cast<struct sockaddr *>(&peer_storage), &peer_length,
+				SOCK_NONBLOCK | SOCK_CLOEXEC);
 
-	std::shared_ptr<implementation> fd;
+		if (fd == -1)
+		{
+			error_number = errno;
 
-public:
-	explicit active_connection(int master_socket) :
-		fd{ new implementation(master_socket) }
-	{}
-	~active_connection() = default;
+			// the backlog got empty under a non-blocking listener, nothing has failed
+			if (error_number == EAGAIN || error_number == EWOULDBLOCK)
+			{
+				return;
+			}
 
-	active_connection(const active_connection &other) :
-		fd{ other.fd }
-	{}
-	active_connection &operator=(const active_connection &other)
-	{
-		if (this != &other)
+			server_metrics::instance().local().accept_errors.fetch_add(1, std::memory_order_relaxed);
+
+			// running out of descriptors is handled by admission_control, not logged on every attempt
+			if (error_number != EMFILE && error_number != ENFILE)
+			{
+				LOG_CERROR("Error of accept, connection stays flawed");
+			}
+		}
+		else
 		{
-			fd = other.fd;
+			server_metrics::instance().local().connections_accepted.fetch_add(1, std::memory_order_relaxed);
 		}
-
-		return *this;
+	}
+	~active_connection()
+	{
+		release();
 	}
 
+	active_connection(const active_connection &) = delete;
+	active_connection &operator=(const active_connection &) = delete;
+
 	active_connection(active_connection &&other) noexcept :
-		fd{ std::move(other.fd) }
-	{}
+		fd{ other.fd },
+		error_number{ other.error_number },
+		admitted{ other.admitted },
+		accepted_monotonic_ns{ other.accepted_monotonic_ns },
+		accepted_wall_ns{ other.accepted_wall_ns },
+		peer_length{ other.peer_length },
+		peer_storage(other.peer_storage)
+	{
+		other.fd = -1;
+		other.admitted = false;
+	}
 	active_connection &operator=(active_connection &&other) noexcept
 	{
 		if (&other != this)
 		{
-			fd = std::move(other.fd);
+			release();
+
+			fd = other.fd;
+			error_number = other.error_number;
+			admitted = other.admitted;
+			accepted_monotonic_ns = other.accepted_monotonic_ns;
+			accepted_wall_ns = other.accepted_wall_ns;
+			peer_length = other.peer_length;
+			peer_storage = other.peer_storage;
+
+			other.fd = -1;
+			other.admitted = false;
 		}
 
 		return *this;
@@ -102,55 +163,199 @@ public:
 
 	explicit operator bool() const noexcept
 	{
-		return (*fd != -1);
+		return (fd != -1);
 	}
 
 	operator int() const noexcept
 	{
-		return *fd;
+		return fd;
 	}
-};
 
-void process_the_accepted_connection(active_connection client_fd);
+	const struct sockaddr_storage &peer() const noexcept
+	{
+		return peer_storage;
+	}
+
+	int64_t accepted_ns() const noexcept
+	{
+		return accepted_monotonic_ns;
+	}
+
+	int64_t accepted_realtime_ns() const noexcept
+	{
+		return accepted_wall_ns;
+	}
 
+	// errno of the failed accept
+	int accept_error() const noexcept
+	{
+		return error_number;
+	}
+
+	// counts the connection against the budget until it's closed, false if it's over the budget of its client
+	bool admit() noexcept
+	{
+		admitted = admission_control::instance().admit(peer_storage);
+		return admitted;
+	}
+};
+
+/*
+*	Parser of a request head. Lines are views into the source, which has to outlive the object; the address
+*	and the query are the only copies and come from the given memory resource, the arena of the connection as a rule.
+*/
 class http_request final
 {
-	std::string source;
-	std::string address;
+	std::string_view source;
+	std::pmr::string address;
+	std::pmr::string query;
 	short status = 520;
 	char delimiter;
-	bool http09;
+	bool http09 = false;
+	bool keep_alive_requested = false;
+	bool gzip_acceptable = false;
+	bool length_declared = false;
+	bool improper_header = false;
+	size_t declared_content_length = 0;
+	access_method method = access_method::unknown;
+
+	static bool is_space(char c) noexcept
+	{
+		return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+	}
 
-	const std::regex simple_request
+	static bool is_control(char c) noexcept
 	{
-		R"(^GET\s\S+$)"
-	};
-	const std::regex full_request
+		return static_cast<unsigned char>(c) < 0x20 || c == 0x7f;
+	}
+
+	static bool is_separator(char c) noexcept
 	{
-		R"(^((GET)|(POST)|(HEAD))(\s\S+\s)(HTTP/\d\.\d)$)"
-	};
-	const std::regex header
+		return strchr("()<>@,;:\"/[]?={} \t", c) != nullptr;
+	}
+
+	static bool is_digit(char c) noexcept
 	{
-		R"(^[^()<>@,;:\"/\[\]?={} 	[:cntrl:]]+:[^[:cntrl:]]*$)"
-	};
+		return c >= '0' && c <= '9';
+	}
+
+	static size_t token_end(std::string_view text, size_t position) noexcept
+	{
+		while (position != text.size() && !is_space(text[position]))
+		{
+			++position;
+		}
+		return position;
+	}
+
+	// GET, then a single space and a target: GET /index.html
+	static bool is_simple_request(std::string_view line) noexcept
+	{
+		return line.size() > 4 && line.compare(0, 3, "GET") == 0 && is_space(line[3]) && token_end(line, 4) == line.size();
+	}
 
-	std::string readline(std::istringstream &stream) const
+	// a method, a target and a version separated by single spaces: GET /index.html HTTP/1.0
+	static bool is_full_request(std::string_view line) noexcept
 	{
-		std::string result;
-		getline(stream, result, delimiter);
-		if (delimiter == '\r')
+		size_t target = 0;
+		if (line.size() > 3 && line.compare(0, 3, "GET") == 0 && is_space(line[3]))
+		{
+			target = 4;
+		}
+		else if (line.size() > 4 && (line.compare(0, 4, "POST") == 0 || line.compare(0, 4, "HEAD") == 0) && is_space(line[4]))
+		{
+			target = 5;
+		}
+		else
+		{
+			return false;
+		}
+
+		size_t version = token_end(line, target);
+		if (version == target || version == line.size())
 		{
-			if (stream.peek() == '\n')
+			return false;
+		}
+
+		std::string_view rest = line.substr(version + 1);
+		return rest.size() == 8 && rest.compare(0, 5, "HTTP/") == 0 && is_digit(rest[5]) && rest[6] == '.' &&
+				is_digit(rest[7]);
+	}
+
+	// a token, a colon and a value without control characters
+	static bool is_header(std::string_view line) noexcept
+	{
+		size_t colon = 0;
+		while (colon != line.size() && line[colon] != ':')
+		{
+			if (is_separator(line[colon]) || is_control(line[colon]))
+			{
+				return false;
+			}
+			++colon;
+		}
+
+		if (colon == 0 || colon == line.size())
+		{
+			return false;
+		}
+
+		for (size_t i = colon + 1; i != line.size(); ++i)
+		{
+			if (is_control(line[i]))
 			{
-				stream.get();
+				return false;
 			}
 		}
+
+		return true;
+	}
+
+	static bool equal_ignoring_case(std::string_view left, const char *right) noexcept
+	{
+		return left.size() == strlen(right) && strncasecmp(left.data(), right, left.size()) == 0;
+	}
+
+	static bool contains_ignoring_case(std::string_view text, const char *pattern) noexcept
+	{
+		size_t length = strlen(pattern);
+		for (size_t i = 0; i + length <= text.size(); ++i)
+		{
+			if (strncasecmp(text.data() + i, pattern, length) == 0)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// the next line without its delimiter, empty at the end of the source
+	std::string_view readline(size_t &position) const noexcept
+	{
+		if (position >= source.size())
+		{
+			return {};
+		}
+
+		size_t end = source.find(delimiter, position);
+		if (end == std::string_view::npos)
+		{
+			end = source.size();
+		}
+
+		std::string_view result = source.substr(position, end - position);
+		position = (end == source.size()) ? end : end + 1;
+		if (delimiter == '\r' && position != source.size() && source[position] == '\n')
+		{
+			++position;
+		}
+
 		return result;
 	}
 
 	void set_delimiter() noexcept
 	{
-		if (source.find('\r') != std::string::npos)
+		if (source.find('\r') != std::string_view::npos)
 		{
 			delimiter = '\r';
 		}
@@ -162,7 +367,7 @@ class http_request final
 
 	bool is_invalid_request() noexcept
 	{
-		if (source.find('\n') == std::string::npos && source.find('\r') == std::string::npos)
+		if (source.find('\n') == std::string_view::npos && source.find('\r') == std::string_view::npos)
 		{
 			if (source.size())
 			{
@@ -179,68 +384,66 @@ class http_request final
 		return false;
 	}
 
-	void set_address_from_first_line(std::string first_line)
+	// the second word of the line without the query, which is kept apart with its question mark
+	void set_address_from_first_line(std::string_view first_line)
 	{
-		std::stringstream temp;
-		temp.str(first_line);
-		temp >> address;
-		temp >> address;					// is this a deliberate repetition?
-
-		auto question_mark_pos = address.find("?");
-		if (question_mark_pos != std::string::npos)
+		size_t begin = token_end(first_line, 0);
+		while (begin != first_line.size() && is_space(first_line[begin]))
 		{
-			address.erase(question_mark_pos);
+			++begin;
 		}
-	}
 
-public:
-	explicit http_request(const char *s) :
-		source{ s }
-	{
-		set_delimiter();
+		std::string_view target = first_line.substr(begin, token_end(first_line, begin) - begin);
+		size_t mark = target.find('?');
+		address.assign(target.substr(0, mark));
+		query.assign(mark == std::string_view::npos ? std::string_view() : target.substr(mark));
 	}
 
-	http_request(const http_request &) = default;				// is this a problem? do some unit tests perhaps...
-	http_request &operator=(const http_request &) = default;
-
-	void parse_request()
+	void parse_first_line(std::string_view first_line)
 	{
-		if (is_invalid_request())
+		if (first_line.size() < 5 || first_line.find(' ') == std::string_view::npos)
 		{
+			status = 400;
 			return;
 		}
 
-		std::istringstream stream{ source };
-
-		std::string first_line = readline(stream);
-		if (first_line.size() < 5 || first_line.find(" ") == std::string::npos)
+		if (first_line.compare(0, 4, "GET ") == 0)
 		{
-			status = 400;
-			return;
+			method = access_method::get;
+		}
+		else if (first_line.compare(0, 5, "HEAD ") == 0)
+		{
+			method = access_method::head;
+		}
+		else if (first_line.compare(0, 5, "POST ") == 0)
+		{
+			method = access_method::post;
 		}
 
-		if (regex_match(first_line, full_request))
+		if (is_full_request(first_line))
 		{
 			http09 = false;
-			if (first_line.find(" HTTP/0.9") != std::string::npos)
+			if (first_line.find(" HTTP/0.9") != std::string_view::npos)
 			{
 				http09 = true;
 			}
 			else
 			{
-				if (first_line.find(" HTTP/1.0") == std::string::npos)
+				if (first_line.find(" HTTP/1.0") == std::string_view::npos)
 				{
 					status = 505;
 					return;
 				}
 				if (first_line.find("HEAD") == 0 || first_line.find("POST") == 0)		// why not implement HEAD sometime later?
 				{
+					// still looked up among the proxied prefixes, an upstream may allow the method
 					status = 405;
+					set_address_from_first_line(first_line);
 					return;
 				}
 			}
 		}
-		else if(regex_match(first_line, simple_request))
+		else if (is_simple_request(first_line))
 		{
 			http09 = true;
 		}
@@ -253,20 +456,178 @@ public:
 		status = 200;
 
 		set_address_from_first_line(first_line);
+	}
 
-		if (http09)
+	void parse_headers(size_t position)
+	{
+		std::string_view current;
+		while (!(current = readline(position)).empty())
 		{
-			return;
+			if (!is_header(current))
+			{
+				std::pmr::string text{ current, address.get_allocator() };
+				LOG_CLOG_TEXT("Found improper header in request:", text.data());
+				improper_header = true;
+				continue;
+			}
+
+			size_t colon = current.find(':');
+			std::string_view name = current.substr(0, colon);
+			size_t value_start = current.find_first_not_of(" \t", colon + 1);
+			std::string_view value = (value_start == std::string_view::npos) ? std::string_view{} :
+					current.substr(value_start);
+
+			if (equal_ignoring_case(name, "Connection"))
+			{
+				keep_alive_requested = contains_ignoring_case(value, "keep-alive");
+			}
+			else if (equal_ignoring_case(name, "Accept-Encoding"))
+			{
+				gzip_acceptable = accepts_coding(value, "gzip");
+			}
+			else if (equal_ignoring_case(name, "Content-Length"))
+			{
+				// a length read differently by an upstream would smuggle a request in the body, so only one plain number passes
+				uint64_t length = 0;
+				if (length_declared || !reverse_proxy::parse_content_length(value, length))
+				{
+					status = 400;
+					declared_content_length = 0;
+					return;
+				}
+				declared_content_length = length;
+				length_declared = true;
+			}
+			else if (equal_ignoring_case(name, "Transfer-Encoding"))
+			{
+				// bodies are delimited by their length only, a chunked one could be sent again with it
+				status = contains_ignoring_case(value, "chunked") ? 411 : 501;
+				declared_content_length = 0;
+				return;
+			}
+		}
+	}
+
+public:
+	// true if the list of an Accept-Encoding names the coding or * without q=0
+	static bool accepts_coding(std::string_view value, const char *coding) noexcept
+	{
+		bool accepted = false;
+
+		while (!value.empty())
+		{
+			size_t comma = value.find(',');
+			std::string_view item = value.substr(0, comma);
+			value = (comma == std::string_view::npos) ? std::string_view{} : value.substr(comma + 1);
+
+			size_t semicolon = item.find(';');
+			std::string_view name = item.substr(0, semicolon);
+			while (!name.empty() && is_space(name.front()))
+			{
+				name.remove_prefix(1);
+			}
+			while (!name.empty() && is_space(name.back()))
+			{
+				name.remove_suffix(1);
+			}
+
+			bool exact = equal_ignoring_case(name, coding);
+			if (!exact && name != "*")
+			{
+				continue;
+			}
+
+			// a zero weight refuses the coding, whatever the digits after the point
+			bool refused = false;
+			size_t weight = (semicolon == std::string_view::npos) ? std::string_view::npos : item.find("q=", semicolon);
+			if (weight != std::string_view::npos)
+			{
+				std::string_view number = item.substr(weight + 2);
+				number = number.substr(0, number.find(';'));
+				refused = !number.empty() && number.front() == '0' &&
+						number.find_first_of("123456789") == std::string_view::npos;
+			}
+
+			// the coding named explicitly overrides the wildcard
+			if (exact)
+			{
+				return !refused;
+			}
+			accepted = !refused;
+		}
+
+		return accepted;
+	}
+
+	explicit http_request(const char *s, std::pmr::memory_resource *memory = std::pmr::get_default_resource()) :
+		source{ s },
+		address{ memory },
+		query{ memory }
+	{
+		set_delimiter();
+	}
+
+	http_request(const char *s, size_t length, std::pmr::memory_resource *memory = std::pmr::get_default_resource()) :
+		source{ s, length },
+		address{ memory },
+		query{ memory }
+	{
+		set_delimiter();
+	}
+
+	http_request(const http_request &) = default;
+	http_request &operator=(const http_request &) = default;
+
+	/*
+	*	Length of the request head at the beginning of data including its terminating empty line,
+	*	the first line alone for HTTP/0.9, 0 while the head is incomplete.
+	*/
+	static size_t head_length(const char *data, size_t size) noexcept
+	{
+		const char *first_line_end = static_cast<const char *>(memchr(data, '\n', size));
+		if (!first_line_end)
+		{
+			return 0;
+		}
+
+		static const char version_marker[] = " HTTP/";
+		if (!memmem(data, first_line_end - data, version_marker, sizeof(version_marker) - 1))
+		{
+			return first_line_end - data + 1;
 		}
 
-		std::string current;
-		while (!(current = readline(stream)).empty())
+		// the head ends with an empty line, either CRLF CRLF or bare LF LF
+		for (const char *i = first_line_end; i; i = static_cast<const char *>(memchr(i + 1, '\n', data + size - i - 1)))
 		{
-			if (!regex_match(current, header))
+			const char *next = i + 1;
+			if (next != data + size && *next == '\r')
+			{
+				++next;
+			}
+			if (next != data + size && *next == '\n')
 			{
-				std::cout << "Found improper header in request: " << current << std::endl;
+				return next - data + 1;
 			}
 		}
+
+		return 0;
+	}
+
+	void parse_request()
+	{
+		if (is_invalid_request())
+		{
+			return;
+		}
+
+		size_t position = 0;
+
+		parse_first_line(readline(position));
+
+		if (!http09 && status != 400)
+		{
+			parse_headers(position);
+		}
 	}
 
 	explicit operator bool() const noexcept
@@ -279,26 +640,260 @@ public:
 		return status;
 	}
 
-	std::string get_address() const noexcept
+	const std::pmr::string &get_address() const noexcept
 	{
 		return address;
 	}
 
+	const std::pmr::string &get_query() const noexcept
+	{
+		return query;
+	}
+
 	bool status_required() const noexcept
 	{
 		return !http09;
 	}
+
+	access_method get_method() const noexcept
+	{
+		return method;
+	}
+
+	bool keep_alive() const noexcept
+	{
+		return keep_alive_requested;
+	}
+
+	size_t content_length() const noexcept
+	{
+		return declared_content_length;
+	}
+
+	// a line skipped as not a header, which another parser may take for one
+	bool has_improper_header() const noexcept
+	{
+		return improper_header;
+	}
+
+	// answers the request with the error instead, nothing of its body is read
+	void refuse(short error) noexcept
+	{
+		status = error;
+		declared_content_length = 0;
+	}
+
+	bool gzip_accepted() const noexcept
+	{
+		return gzip_acceptable;
+	}
+};
+
+/*
+*	Request of an HTTP/2 stream from the moment its headers are complete until its response is sent:
+*	what is logged of it and what the response is made of, the head as that of HTTP/1.
+*/
+struct http2_exchange
+{
+	access_log_record record;
+	int64_t start_ns = 0;
+	int64_t send_start_ns = 0;
+	bool gzip_accepted = false;
+	bool opening = false;
+	bool open_failed = false;
+	bool responded = false;
+
+	std::pmr::string target;
+	std::pmr::string relative;
+	std::pmr::string query;
+	std::string head;
+	std::string body;						// in memory, in place of a descriptor
+	int body_fd = -1;
+	off_t body_offset = 0;
+	size_t body_length = 0;
+	std::shared_ptr<const resolved_file> file;
+	std::shared_ptr<const directory_listing> listing;
 };
 
-void process_client_request(active_connection &client, http_request request);
+/*
+*	One client connection on the event loop of a worker thread, served by a coroutine that reads requests
+*	and writes responses in turn, suspending whenever the socket would block. The request head has to arrive
+*	within the read-header deadline counted from its first byte (a slowloris can't stretch it by trickling),
+*	a declared body is skipped within the read-body deadline, the response must make progress within
+*	the write-stall deadline and an idle keep-alive connection waits for the next request within
+*	the keep-alive deadline. Expired connections are closed and counted. The requested file is opened
+*	on the blocking pool, if there is one; meanwhile the connection neither reads nor has a deadline.
+*	A request for a proxied prefix is forwarded to an upstream instead, its body and the response streamed through.
+*	A client that opens with the preface of HTTP/2 or asks to upgrade to it is served over HTTP/2 from then on,
+*	the requests of all its streams resolved like those of HTTP/1 and their bodies interleaved on the socket.
+*	With TLS the handshake comes first, and the socket reads and writes through the TLS stream of the connection.
+*	The connection is released back to the slab of its worker once the coroutine completes.
+*/
+class http_connection final
+{
+public:
+	static constexpr size_t buffer_size = 8192;
+
+	// longer declared bodies aren't worth reading through, the connection is closed after the response instead
+	static constexpr size_t max_skipped_body = 1024 * 1024;
+
+	// the most an HTTP/2 connection writes before it looks at what the client has sent meanwhile
+	static constexpr size_t http2_write_budget = 256 * 1024;
+
+	enum class stage : uint8_t
+	{
+		reading_head,
+		skipping_body,
+		writing,
+		idle,
+		opening,
+		proxying
+	};
+
+private:
+	friend class slab<http_connection>;
+
+	// touched on every event: the state, the offsets and the socket with its deadline, within the first cache lines
+	slab_handle self;
+	stage current = stage::reading_head;
+	bool input_closed = false;
+	bool keep_alive = false;
+	bool open_failed = false;
+
+	size_t input_used = 0;
+	size_t body_left = 0;
+	size_t output_sent = 0;
+	off_t file_offset = 0;
+	size_t file_left = 0;
+	int body_fd = -1;				// the file, the listing or the bundle the body is sent from
+
+	active_connection client;		// the descriptor first, the address of the peer last
+	tls_stream tls;					// close_notify goes out before the descriptor is closed
+	async_socket socket;			// unregistered before the descriptor is closed
+
+	// touched once per request or less: the buffers, the file and what is logged
+	alignas(64) char input[buffer_size];
+
+	std::string output;
+	request_arena arena;
+	std::pmr::string target{ arena.get() };		// the requested path as it came
+	std::pmr::string relative{ arena.get() };		// the same path normalized, relative to the root
+	std::pmr::string query{ arena.get() };		// whatever followed the path, with its question mark
+	std::shared_ptr<const resolved_file> file;
+	std::shared_ptr<const directory_listing> listing;		// sent in place of a requested directory
+	const proxy_route *upstream_route = nullptr;			// null unless the request is forwarded
+
+	int64_t request_start_ns;
+	int64_t request_start_realtime_ns;
+	int64_t send_start_ns = 0;
+	int64_t open_start_ns = 0;
+	access_log_record record;
+
+	task routine;		// destroyed first, its frame may still refer to the members above
+
+	// the connections of the worker thread, recycled in place of allocating one per accept
+	static thread_local slab<http_connection> local_connections;
+	static thread_local bool local_draining;
+
+	http_connection(event_loop &owner, active_connection accepted) noexcept;
+	~http_connection();
+
+	bool start() noexcept;
+	void consume(size_t length) noexcept;
+	void count_timeout() noexcept;
+
+	// the coroutine serving the connection, it is closed as the coroutine completes
+	task run();
+
+	// the TLS handshake, false if the connection is to be closed; failures are counted
+	subtask secure();
+	static void finished(void *connection) noexcept;
+
+	// false once the connection is to be closed, the failure is logged and counted
+	bool received(ssize_t result) noexcept;
+	bool start_request(size_t head_length) noexcept;
+	bool finish_open() noexcept;
+	void finish_request() noexcept;
+
+	// sends the request head in the output, the body and the response after it; false if the connection is gone
+	subtask exchange_with_upstream();
+
+	// the rest of the connection over HTTP/2, after the upgrade request of upgrade_head bytes if it's not 0
+	subtask serve_http2(size_t upgrade_head);
+
+	// writes the output of the session, false if the connection is gone
+	subtask flush_http2(http2_session &session);
+
+	// answers what needs no blocking call right away, true if the path is to be opened
+	bool begin_stream(http2_exchange &exchange, const http2_request &request) noexcept;
+	void respond_stream(http2_session &session, uint32_t stream, http2_exchange &exchange) noexcept;
+	static void finish_stream(http2_exchange &exchange, uint64_t bytes_sent) noexcept;
+
+	// may block, runs on the blocking pool
+	void open_target() noexcept;
+	static void open_stream(http2_exchange &exchange) noexcept;
+
+	// the file of the normalized path, or for a directory its index file or its listing; may block.
+	// A directory requested without a trailing slash is left in file as it is, to be redirected
+	static void resolve(std::string_view target, std::pmr::string &relative, std::shared_ptr<const resolved_file> &file,
+			std::shared_ptr<const directory_listing> &listing);
+
+public:
+	http_connection(const http_connection &) = delete;
+	http_connection &operator=(const http_connection &) = delete;
+
+	// runs on a worker thread of the pool, the connection then stays with the event loop of that worker
+	static void serve(active_connection client) noexcept;
+
+	// the connections accepted at one readiness of the listener and given to the same worker
+	static void serve_batch(std::vector<active_connection> &clients) noexcept;
+
+	// closes idle connections of the calling worker and makes the rest close after their current response
+	static void drain_local() noexcept;
+
+	// allocates the slots for count connections of the calling worker ahead of its first accept
+	static void reserve_local(size_t count) noexcept;
+};
 
 const char *http_response_phrase(short status) noexcept;
 
-ssize_t send_status_line(active_connection &client, short status);
+// the whole 404 response, serialized once
+std::string_view not_found_response(bool keep_alive) noexcept;
+
+// a directory requested without a trailing slash, which relative links within it would resolve against its parent
+bool needs_trailing_slash(std::string_view target, std::string_view relative) noexcept;
+
+/*
+*	The whole 301 response to the normalized path with a slash appended and the query of the request after it.
+*	Built from the normalized path rather than the target, so a target like //host/dir can't redirect off the site.
+*/
+void append_redirect(std::string &destination, std::string_view relative, std::string_view query, bool keep_alive);
+
+// the longest Retry-After a 429 response has
+constexpr uint32_t max_retry_after = 120;
+
+// the whole 429 response, serialized once for every wait up to the longest
+std::string_view too_many_requests_response(uint32_t retry_after, bool keep_alive) noexcept;
+
+// the whole 502 or 504 response, always closing
+std::string_view upstream_error_response(short status) noexcept;
+
+void append_status_line(std::string &destination, short status);
+
+// appended to what is there, so a reused response buffer doesn't allocate
+void append_headers(std::string &destination, open_file &file, bool keep_alive = false);
+void append_headers(std::string &destination, const resolved_file &file, bool keep_alive = false);
+
+// an empty entity tag is left out
+void append_headers(std::string &destination, std::string_view location, size_t size, std::string_view mime_type,
+		std::string_view last_modified, bool keep_alive = false, std::string_view etag = {});
+
+// Date and Expires of now, then the rest of the headers serialized ahead of time
+void append_dated_headers(std::string &destination, std::string_view precomputed, bool keep_alive = false);
 
-ssize_t send_headers(active_connection &client, open_file &file);
+std::string build_metrics_response(bool status_required, bool keep_alive);
 
-void send_client_a_file(active_connection &client, open_file &file) noexcept;
+void register_server_gauges();
 
 time_t time_t_now() noexcept;
 
@@ -0,0 +1,194 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <utility>
+#include <vector>
+
+/*
+*	Reference to an object of a slab: the index of its slot and the generation the slot had when the object
+*	was placed there. Every release bumps the generation, so a handle kept past the object goes stale
+*	instead of reaching whatever was placed into the slot next.
+*/
+struct slab_handle
+{
+	uint32_t index = UINT32_MAX;
+	uint32_t generation = 0;
+
+	bool operator==(const slab_handle &other) const noexcept
+	{
+		return index == other.index && generation == other.generation;
+	}
+};
+
+/*
+*	Pool of objects of one type for one thread. Slots come in chunks of ChunkSlots, allocated as the pool
+*	grows and kept until the pool is destroyed, so a thread that has served its peak number of objects
+*	serves any later one without touching the heap. Released slots are reused last in, first out,
+*	the ones most likely to be still in the cache. Not thread-safe, the owner thread is the only user.
+*/
+template <typename T, size_t ChunkSlots = 64>
+class slab final
+{
+	struct slot
+	{
+		alignas(T) std::byte storage[sizeof(T)];
+		uint32_t generation = 0;
+		uint32_t next_free = UINT32_MAX;
+		bool used = false;
+
+		T *object() noexcept
+		{
+			return std::launder(reinterpret_cast<T *>(storage));
+		}
+	};
+
+	std::vector<slot *> chunks;
+	uint32_t first_free = UINT32_MAX;
+	size_t used_slots = 0;
+
+	slot &at(uint32_t index) noexcept
+	{
+		return chunks[index / ChunkSlots][index % ChunkSlots];
+	}
+
+	bool grow() noexcept
+	{
+		if ((chunks.size() + 1) * ChunkSlots >= UINT32_MAX)
+		{
+			return false;
+		}
+
+		slot *chunk = nullptr;
+		try
+		{
+			chunks.reserve(chunks.size() + 1);
+			chunk = new slot[ChunkSlots];
+		}
+		catch (...)
+		{
+			return false;
+		}
+
+		uint32_t base = static_cast<uint32_t>(chunks.size() * ChunkSlots);
+		chunks.push_back(chunk);
+
+		// linked so the lowest index is handed out first
+		for (size_t i = ChunkSlots; i--; )
+		{
+			chunk[i].next_free = first_free;
+			first_free = base + static_cast<uint32_t>(i);
+		}
+
+		return true;
+	}
+
+public:
+	slab() = default;
+
+	slab(const slab &) = delete;
+	slab &operator=(const slab &) = delete;
+
+	~slab()
+	{
+		for (auto chunk: chunks)
+		{
+			for (size_t i = 0; i != ChunkSlots; ++i)
+			{
+				if (chunk[i].used)
+				{
+					chunk[i].object()->~T();
+				}
+			}
+			delete[] chunk;
+		}
+	}
+
+	// allocates the chunks for at least count objects up front
+	void reserve(size_t count) noexcept
+	{
+		while (capacity() < count && grow())
+		{}
+	}
+
+	// the object is constructed in place, nullptr if no slot could be allocated
+	template <typename... Arguments>
+	T *acquire(slab_handle &handle, Arguments &&... arguments) noexcept
+	{
+		if (first_free == UINT32_MAX && !grow())
+		{
+			return nullptr;
+		}
+
+		uint32_t index = first_free;
+		slot &taken = at(index);
+		first_free = taken.next_free;
+
+		handle = { index, taken.generation };
+		T *object = new (taken.storage) T(std::forward<Arguments>(arguments)...);
+		taken.used = true;
+		++used_slots;
+
+		return object;
+	}
+
+	// destroys the object, handles to it go stale
+	void release(slab_handle handle) noexcept
+	{
+		if (!resolve(handle))
+		{
+			return;
+		}
+
+		slot &released = at(handle.index);
+		released.used = false;
+		++released.generation;
+		--used_slots;
+
+		released.object()->~T();
+
+		released.next_free = first_free;
+		first_free = handle.index;
+	}
+
+	// nullptr if the object of the handle has been released
+	T *resolve(slab_handle handle) noexcept
+	{
+		if (handle.index / ChunkSlots >= chunks.size())
+		{
+			return nullptr;
+		}
+
+		slot &found = at(handle.index);
+		return (found.used && found.generation == handle.generation) ? found.object() : nullptr;
+	}
+
+	// visits every live object; the visitor may release the one it is given
+	template <typename Visitor>
+	void for_each(Visitor visit) noexcept
+	{
+		for (size_t i = 0; i != chunks.size() * ChunkSlots; ++i)
+		{
+			slot &current = at(static_cast<uint32_t>(i));
+			if (current.used)
+			{
+				visit(*current.object());
+			}
+		}
+	}
+
+	size_t size() const noexcept
+	{
+		return used_slots;
+	}
+
+	size_t capacity() const noexcept
+	{
+		return chunks.size() * ChunkSlots;
+	}
+};
+
+#endif		// SLAB_H
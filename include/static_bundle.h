@@ -0,0 +1,149 @@
+#ifndef STATIC_BUNDLE_H
+#define STATIC_BUNDLE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+/*
+*	Static site bundle, the whole served tree packed into one immutable file by the bundle tool:
+*	the header, entries sorted by path, a table of hash slots, strings (paths and precomputed response headers)
+*	and the bodies last. Offsets are counted from the start of the file, integers are in the byte order
+*	of the machine that wrote it.
+*/
+enum bundle_encoding : uint32_t
+{
+	bundle_identity,
+	bundle_gzip,
+	bundle_encoding_count
+};
+
+// one representation of a file, the body as it is sent and the headers that go with it
+struct bundle_variant
+{
+	uint64_t body_offset;
+	uint64_t body_length;
+	uint64_t headers_offset;		// within the strings, from Location up to the blank line
+	uint32_t headers_length;		// 0 if the file has no such variant
+	uint32_t reserved;
+};
+
+static_assert(sizeof(bundle_variant) == 32, "bundle_variant is a fixed on-disk format");
+
+struct bundle_entry
+{
+	uint64_t hash;
+	uint64_t path_offset;			// within the strings, normalized and relative to the root of the tree
+	uint32_t path_length;
+	uint32_t flags;					// bundle_directory for a directory served by its index file
+	bundle_variant variants[bundle_encoding_count];
+};
+
+constexpr uint32_t bundle_directory = 1;
+
+static_assert(sizeof(bundle_entry) == 88, "bundle_entry is a fixed on-disk format");
+
+struct bundle_file_header
+{
+	static constexpr char magic_value[8] = { 'C', 'P', 'P', 'S', 'B', 'N', 'D', 'L' };
+	static constexpr uint32_t current_version = 1;
+
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t entry_size;
+	uint32_t slot_count;			// a power of two; 0 marks an empty slot, others hold an entry index plus one
+	uint64_t entry_count;
+	uint64_t entries_offset;
+	uint64_t slots_offset;
+	uint64_t strings_offset;
+	uint64_t strings_size;
+	uint64_t file_size;
+	int64_t created_ns;
+	char reserved[32];
+
+	// the layout only, offsets are checked against the size of the file by the reader
+	bool valid() const noexcept
+	{
+		return memcmp(magic, magic_value, sizeof(magic)) == 0 && version == current_version &&
+			header_size == sizeof(bundle_file_header) && entry_size == sizeof(bundle_entry) &&
+			slot_count && !(slot_count & (slot_count - 1)) && entry_count < slot_count;
+	}
+};
+
+static_assert(sizeof(bundle_file_header) == 112, "bundle_file_header is a fixed on-disk format");
+
+// FNV-1a, stable across builds as the tool and the server have to agree on it
+inline uint64_t bundle_path_hash(std::string_view path) noexcept
+{
+	uint64_t hash = 14695981039346656037ull;
+	for (char c: path)
+	{
+		hash ^= static_cast<unsigned char>(c);
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+/*
+*	Bundle the server serves from. Opening it maps the header, the index and the strings and checks the header only,
+*	so it takes the same time whatever the number of files. Lookups read the mapping, bodies are sent
+*	with sendfile from the descriptor of the bundle at their offsets: no path walk, stat or open per request.
+*/
+class static_bundle final
+{
+	int fd = -1;
+	const char *mapping = nullptr;
+	size_t mapped = 0;
+
+	const bundle_file_header *header = nullptr;
+	const bundle_entry *entries = nullptr;
+	const uint32_t *slots = nullptr;
+	const char *strings = nullptr;
+
+	static_bundle() = default;
+
+	bool in_strings(uint64_t offset, uint64_t length) const noexcept
+	{
+		return offset <= header->strings_size && length <= header->strings_size - offset;
+	}
+
+public:
+	static static_bundle &instance();
+
+	static_bundle(const static_bundle &) = delete;
+	static_bundle &operator=(const static_bundle &) = delete;
+
+	~static_bundle();
+
+	// false if the file isn't a bundle this server can read
+	bool open(const std::string &path) noexcept;
+
+	bool enabled() const noexcept
+	{
+		return header != nullptr;
+	}
+
+	int descriptor() const noexcept
+	{
+		return fd;
+	}
+
+	size_t size() const noexcept
+	{
+		return header ? header->entry_count : 0;
+	}
+
+	// the representation of the file at the normalized path to send, null if the bundle has none there;
+	// directory tells whether the path is that of a directory, answered with its index file
+	const bundle_variant *find(std::string_view relative, bool gzip_accepted, bool *directory = nullptr) const noexcept;
+
+	std::string_view headers(const bundle_variant &variant) const noexcept
+	{
+		return std::string_view(strings + variant.headers_offset, variant.headers_length);
+	}
+};
+
+#endif		// STATIC_BUNDLE_H
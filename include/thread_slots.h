@@ -0,0 +1,251 @@
+#ifndef THREAD_SLOTS_H
+#define THREAD_SLOTS_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <utility>
+
+/*
+*	Fixed registry of per-thread objects. A thread claims a free slot once and keeps using it without any locking;
+*	when the thread exits its slot is returned and inherited by the next thread that asks for one, objects included.
+*	Objects are allocated lazily on the first claim of a slot and live as long as the registry does,
+*	so a reader may visit every slot ever used at any moment. Memory is bounded by Capacity * sizeof(T).
+*/
+template <typename T, size_t Capacity>
+class thread_slots final
+{
+	struct slot
+	{
+		std::atomic<bool> owned{ false };
+		std::atomic<T *> value{ nullptr };
+	};
+
+	slot slots[Capacity];
+	std::atomic<size_t> high_water_mark{ 0 };
+
+	static T *allocate()
+	{
+		void *memory = nullptr;
+		if (posix_memalign(&memory, alignof(T) > 64 ? alignof(T) : 64, sizeof(T)) != 0)
+		{
+			throw std::bad_alloc();
+		}
+
+		try
+		{
+			return new (memory) T;
+		}
+		catch (...)
+		{
+			free(memory);
+			throw;
+		}
+	}
+
+	static void deallocate(T *value) noexcept
+	{
+		value->~T();
+		free(value);
+	}
+
+public:
+	thread_slots() = default;
+
+	thread_slots(const thread_slots &) = delete;
+	thread_slots &operator=(const thread_slots &) = delete;
+
+	~thread_slots()
+	{
+		for (auto &i: slots)
+		{
+			if (T *value = i.value.load(std::memory_order_acquire))
+			{
+				deallocate(value);
+			}
+		}
+	}
+
+	// returns nullptr when every slot is taken or the object can't be allocated
+	T *acquire() noexcept
+	{
+		for (size_t i = 0; i != Capacity; ++i)
+		{
+			bool expected = false;
+			if (slots[i].owned.load(std::memory_order_relaxed)
+					|| !slots[i].owned.compare_exchange_strong(expected, true, std::memory_order_acquire))
+			{
+				continue;
+			}
+
+			T *value = slots[i].value.load(std::memory_order_acquire);
+			if (!value)
+			{
+				try
+				{
+					value = allocate();
+				}
+				catch (...)
+				{
+					slots[i].owned.store(false, std::memory_order_release);
+					return nullptr;
+				}
+
+				slots[i].value.store(value, std::memory_order_release);
+			}
+
+			size_t mark = high_water_mark.load(std::memory_order_relaxed);
+			while (mark < i + 1 && !high_water_mark.compare_exchange_weak(mark, i + 1, std::memory_order_release))
+			{}
+
+			return value;
+		}
+
+		return nullptr;
+	}
+
+	void release(T *value) noexcept
+	{
+		for (size_t i = 0; i != high_water_mark.load(std::memory_order_acquire); ++i)
+		{
+			if (slots[i].value.load(std::memory_order_relaxed) == value)
+			{
+				slots[i].owned.store(false, std::memory_order_release);
+				return;
+			}
+		}
+	}
+
+	// visits every object that was ever claimed, owned or not; concurrent owners keep writing meanwhile
+	template <typename Function>
+	void for_each(Function &&function) const
+	{
+		size_t used = high_water_mark.load(std::memory_order_acquire);
+
+		for (size_t i = 0; i != used; ++i)
+		{
+			if (T *value = slots[i].value.load(std::memory_order_acquire))
+			{
+				function(*value);
+			}
+		}
+	}
+};
+
+/*
+*	Meant to be a thread_local: claims a slot on first use and returns it on thread exit.
+*/
+template <typename T, size_t Capacity>
+class thread_slot_handle final
+{
+	thread_slots<T, Capacity> &registry;
+	T *value = nullptr;
+
+public:
+	explicit thread_slot_handle(thread_slots<T, Capacity> &r) noexcept :
+		registry(r)
+	{}
+
+	thread_slot_handle(const thread_slot_handle &) = delete;
+	thread_slot_handle &operator=(const thread_slot_handle &) = delete;
+
+	~thread_slot_handle()
+	{
+		if (value)
+		{
+			registry.release(value);
+			value = nullptr;
+		}
+	}
+
+	T *get() noexcept
+	{
+		if (!value)
+		{
+			value = registry.acquire();
+		}
+
+		return value;
+	}
+};
+
+/*
+*	Bounded single-producer single-consumer ring, the usual tenant of thread_slots.
+*	The producer never waits: when the ring is full the element is dropped and counted.
+*	Producer changes (a slot inherited by another thread) are ordered by the slot ownership flag.
+*/
+template <typename T, size_t Capacity>
+class spsc_ring final
+{
+	static_assert((Capacity & (Capacity - 1)) == 0, "Capacity of spsc_ring must be a power of 2");
+
+	alignas(64) std::atomic<size_t> head{ 0 };			// consumer position
+	alignas(64) std::atomic<size_t> tail{ 0 };			// producer position
+	size_t cached_head = 0;								// producer's copy of head
+	std::atomic<uint64_t> dropped_count{ 0 };
+	alignas(64) uint64_t reported_dropped = 0;			// consumer side
+	T elements[Capacity];
+
+public:
+	spsc_ring() = default;
+
+	spsc_ring(const spsc_ring &) = delete;
+	spsc_ring &operator=(const spsc_ring &) = delete;
+
+	bool push(const T &element) noexcept
+	{
+		size_t position = tail.load(std::memory_order_relaxed);
+		if (position - cached_head == Capacity)
+		{
+			cached_head = head.load(std::memory_order_acquire);
+			if (position - cached_head == Capacity)
+			{
+				dropped_count.store(dropped_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+				return false;
+			}
+		}
+
+		elements[position & (Capacity - 1)] = element;
+		tail.store(position + 1, std::memory_order_release);
+
+		return true;
+	}
+
+	// consumer only; hands every available element to function and returns their number
+	template <typename Function>
+	size_t consume(Function &&function)
+	{
+		size_t from = head.load(std::memory_order_relaxed);
+		size_t to = tail.load(std::memory_order_acquire);
+
+		for (size_t i = from; i != to; ++i)
+		{
+			function(elements[i & (Capacity - 1)]);
+		}
+		head.store(to, std::memory_order_release);
+
+		return to - from;
+	}
+
+	size_t size() const noexcept
+	{
+		return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+	}
+
+	uint64_t dropped() const noexcept
+	{
+		return dropped_count.load(std::memory_order_relaxed);
+	}
+
+	// consumer only; drops since the previous call
+	uint64_t take_new_drops() noexcept
+	{
+		uint64_t total = dropped();
+		uint64_t result = total - reported_dropped;
+		reported_dropped = total;
+		return result;
+	}
+};
+
+#endif		// THREAD_SLOTS_H
@@ -0,0 +1,141 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <cstddef>
+#include <cstdint>
+
+class timer_handler
+{
+public:
+	virtual ~timer_handler() = default;
+
+	virtual void on_timer() noexcept = 0;
+};
+
+/*
+*	Intrusive node of the timer wheel, embedded into its owner so arming and cancelling never allocate.
+*	A timer is either linked into exactly one slot of one wheel or unlinked (prev and next are null).
+*/
+struct timer final
+{
+	timer *prev = nullptr;
+	timer *next = nullptr;
+	uint64_t expiry_tick = 0;
+	timer_handler *handler = nullptr;
+
+	timer() = default;
+	explicit timer(timer_handler *owner) noexcept :
+		handler{ owner }
+	{}
+
+	timer(const timer &) = delete;
+	timer &operator=(const timer &) = delete;
+
+	~timer()
+	{
+		unlink();
+	}
+
+	bool armed() const noexcept
+	{
+		return next != nullptr;
+	}
+
+	void unlink() noexcept
+	{
+		if (next)
+		{
+			prev->next = next;
+			next->prev = prev;
+			prev = nullptr;
+			next = nullptr;
+		}
+	}
+};
+
+/*
+*	Hierarchical hashed timing wheel (Varghese and Lauck, the scheme of the classic Linux timers):
+*	4 levels of 64 slots, level 0 holds the next 64 ticks and every next level 64 times coarser ranges,
+*	which are cascaded down as the lower level wraps. Arming and cancelling are O(1) list operations,
+*	advancing touches one slot per elapsed tick. Single-threaded, every event loop owns its wheel.
+*/
+class timer_wheel final
+{
+public:
+	static constexpr unsigned slot_bits = 6;
+	static constexpr size_t slots_per_level = size_t{ 1 } << slot_bits;
+	static constexpr unsigned levels = 4;
+
+private:
+	struct slot
+	{
+		timer head;
+
+		slot() noexcept
+		{
+			head.prev = &head;
+			head.next = &head;
+		}
+		slot(const slot &) = delete;
+		slot &operator=(const slot &) = delete;
+		~slot()
+		{
+			// timers outliving the wheel are detached rather than left dangling
+			while (head.next != &head)
+			{
+				head.next->unlink();
+			}
+			head.prev = nullptr;
+			head.next = nullptr;
+		}
+
+		bool empty() const noexcept
+		{
+			return head.next == &head;
+		}
+
+		void push_back(timer &t) noexcept
+		{
+			t.prev = head.prev;
+			t.next = &head;
+			head.prev->next = &t;
+			head.prev = &t;
+		}
+	};
+
+	slot slots[levels][slots_per_level];
+
+	int64_t origin_ms;
+	int64_t tick_ms;
+	uint64_t current_tick = 0;			// the next tick to be processed
+
+	void place(timer &t) noexcept;
+	void cascade(unsigned level, size_t index) noexcept;
+	size_t process_tick() noexcept;
+
+	uint64_t tick_of(int64_t time_ms) const noexcept
+	{
+		return time_ms <= origin_ms ? 0 : static_cast<uint64_t>((time_ms - origin_ms) / tick_ms);
+	}
+
+public:
+	timer_wheel(int64_t now_ms, int64_t tick_length_ms) noexcept;
+
+	timer_wheel(const timer_wheel &) = delete;
+	timer_wheel &operator=(const timer_wheel &) = delete;
+
+	// (re)arms the timer to fire no earlier than delay_ms from now, rounded up to whole ticks
+	void arm(timer &t, int64_t now_ms, int64_t delay_ms) noexcept;
+
+	void cancel(timer &t) noexcept;
+
+	// fires every timer due by now, returns how many fired
+	size_t advance(int64_t now_ms) noexcept;
+
+	// milliseconds until advance() has something to do, -1 while no timer is armed
+	int next_timeout_ms(int64_t now_ms) const noexcept;
+
+	bool empty() const noexcept;
+};
+
+#endif		// TIMER_WHEEL_H
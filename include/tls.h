@@ -0,0 +1,114 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <sys/types.h>
+
+struct ssl_st;
+struct ssl_ctx_st;
+
+/*
+*	TLS of the listening socket: the certificate chain and the key, protocols from TLS 1.2 on with AEAD ciphers only,
+*	which the kernel can take over, and session resumption by tickets and by a cache of sessions, both shared by
+*	all the workers. ALPN offers h2 when HTTP/2 is spoken. Kernel TLS is asked for on every connection; OpenSSL turns
+*	it on after the handshake where the kernel and the cipher allow, otherwise the connection stays encrypted in userspace.
+*/
+class tls_context final
+{
+	// never freed: OpenSSL cleans itself up at exit, ahead of the static objects made before it
+	struct ssl_ctx_st *context = nullptr;
+
+	tls_context() = default;
+
+public:
+	static tls_context &instance();
+
+	tls_context(const tls_context &) = delete;
+	tls_context &operator=(const tls_context &) = delete;
+
+	// an empty key is looked for in the certificate file, a session cache of 0 leaves resumption to tickets alone
+	bool configure(const std::string &certificate, const std::string &key, size_t session_cache, bool http2) noexcept;
+
+	bool enabled() const noexcept
+	{
+		return context != nullptr;
+	}
+
+	struct ssl_ctx_st *get() const noexcept
+	{
+		return context;
+	}
+};
+
+/*
+*	TLS of one connection on a non-blocking socket. The calls stand for those of the socket they replace:
+*	a count, or -1 with errno set, EAGAIN if the connection would block, with the readiness to wait for in wanted().
+*	Once the kernel encrypts what is sent, plain send, sendfile and splice on the socket are as good as write()
+*	and go out zero-copy; until then a file is read a record at a time and encrypted in userspace.
+*	What is received always goes through OpenSSL, which reads records from the kernel as they are if it decrypts them.
+*/
+class tls_stream final
+{
+public:
+	static constexpr size_t record_size = 16384;
+
+private:
+	struct ssl_st *ssl = nullptr;
+	uint32_t want = 0;
+	bool kernel_send = false;
+	bool broken = false;				// after a fatal error nothing more is written, close_notify neither
+
+	// a part of a file read for write_file() and not written yet, which is retried as it is
+	std::unique_ptr<char[]> chunk;
+	size_t chunk_length = 0;
+
+	// -1 with errno for a call that returned result
+	ssize_t fail(int result) noexcept;
+
+public:
+	tls_stream() = default;
+	~tls_stream();
+
+	tls_stream(const tls_stream &) = delete;
+	tls_stream &operator=(const tls_stream &) = delete;
+
+	// false if the connection can't be made
+	bool start(int fd) noexcept;
+
+	bool active() const noexcept
+	{
+		return ssl != nullptr;
+	}
+
+	// 0 once the handshake is complete
+	ssize_t handshake() noexcept;
+
+	ssize_t read(char *buffer, size_t length) noexcept;
+	ssize_t write(const char *data, size_t length) noexcept;
+
+	// up to a record of the file from the offset, which is moved on by what is written
+	ssize_t write_file(int file, off_t &offset, size_t length) noexcept;
+
+	// EPOLLIN or EPOLLOUT, for a call that would block
+	uint32_t wanted() const noexcept
+	{
+		return want;
+	}
+
+	// the kernel encrypts what is sent, the socket is written to as it is
+	bool kernel_sends() const noexcept
+	{
+		return kernel_send;
+	}
+
+	bool resumed() const noexcept;
+
+	// the protocol agreed with ALPN is HTTP/2
+	bool http2() const noexcept;
+};
+
+#endif		// TLS_H
@@ -0,0 +1,26 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+/*
+*	Binary upgrade without refusing a single connection. On SIGUSR2 the running server starts its executable
+*	anew with the same arguments and working directory, handing over the listening socket as an inherited
+*	descriptor. The new process skips the fork of daemonize(), adopts the socket instead of binding,
+*	and reports through a pipe once it accepts; only then the old process stops accepting and drains.
+*	If the new process fails to start or to report in time, the old one keeps serving.
+*/
+
+// to be called before daemonize(), which changes the working directory
+void remember_invocation(char **argv) noexcept;
+
+bool started_by_upgrade() noexcept;
+
+// the socket handed over by the previous process, -1 if there was none
+int inherited_listening_socket() noexcept;
+
+// tells the previous process that this one accepts connections, no-op without one
+void report_upgrade_ready() noexcept;
+
+// true once the new process accepts connections on the socket, the caller is then to drain and exit
+bool start_upgrade(int master_socket) noexcept;
+
+#endif		// UPGRADE_H
@@ -11,6 +11,7 @@
 #include <string>
 #include <memory>
 #include <mutex>
+#include <vector>
 
 #include <boost/program_options.hpp>
 
@@ -20,17 +21,65 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/signalfd.h>
 
+#include "logging.h"
+#include "access_log.h"
 #include "multithreading.h"
-
-#define LOG_CERROR(x) log_errno((__func__), (__FILE__), (__LINE__), (x))
-//#define LOG_CERROR(x, y) log_errno((__func__), (__FILE__), (__LINE__), (x), (y))	// was commented out initially
-
-extern std::mutex cerr_mutex;
+#include "blocking_pool.h"
+#include "affinity.h"
+#include "upgrade.h"
+#include "directory_listing.h"
 
 extern std::string server_ip;
 extern std::string server_port;
 extern std::string server_directory;
+extern std::string access_log_prefix;
+extern size_t access_log_segment_mebibytes;
+extern size_t access_log_kept_segments;
+extern std::string metrics_path;
+extern double read_header_timeout;
+extern double read_body_timeout;
+extern double write_stall_timeout;
+extern double keep_alive_timeout;
+extern size_t max_connections;
+extern size_t max_connections_per_client;
+extern size_t reserved_descriptors;
+extern double drain_timeout;
+extern bool tcp_nodelay;
+extern int tcp_defer_accept;
+extern int tcp_fastopen;
+extern int send_buffer;
+extern int receive_buffer;
+extern int listen_backlog;
+extern int tcp_notsent_lowat;
+extern int busy_poll;
+extern size_t worker_count;
+extern size_t blocking_thread_count;
+extern size_t connection_slots;
+extern std::string index_file;				// empty if directories aren't resolved to an index
+extern listing_format directory_listings;
+extern size_t path_cache_entries;
+extern double path_cache_validity;
+extern size_t negative_cache_entries;
+extern bool negative_cache_bloom;
+extern bool warm_up_tree;
+extern std::string hot_list;
+extern size_t hot_list_size;
+extern std::string bundle_path;
+extern std::vector<std::string> proxy_routes;		// prefix=host:port,...
+extern size_t proxy_keepalive;
+extern double proxy_timeout;
+extern double rate_limit;				// 0 if clients aren't limited as a whole
+extern double rate_burst;
+extern std::vector<std::string> rate_limit_prefixes;		// prefix=rate[:burst]
+extern size_t rate_limit_entries;
+extern size_t http2_max_streams;		// 0 if HTTP/2 isn't spoken
+extern std::string tls_certificate;		// empty if connections aren't encrypted
+extern std::string tls_key;
+extern size_t tls_session_cache;
+extern std::vector<unsigned> worker_cpu_list;		// empty if the workers aren't pinned
+extern std::vector<unsigned> acceptor_cpu_list;
 
 void parse_program_options(int argc, char **argv) noexcept;
 
@@ -40,8 +89,6 @@ class log_redirector final
 {
 private:
 	static constexpr char log_file_out_name[] = "the_server_out.log";
-	static constexpr char log_file_err_name[] = "the_server_err.log";
-	static constexpr char log_file_log_name[] = "the_server_log.log";
 
 	class redirected_stream final
 	{
@@ -50,11 +97,11 @@ private:
 		std::streambuf *old_buffer;
 		std::ofstream own_ofstream;
 	public:
-		redirected_stream(std::ostream &where_from, const char *dest_file) :
+		redirected_stream(std::ostream &where_from, const char *dest_file, std::ios_base::openmode mode) :
 			log_stream{ &where_from },
 			old_buffer{ log_stream->rdbuf() }
 		{
-			own_ofstream.open(dest_file);
+			own_ofstream.open(dest_file, mode);
 
 			if (!own_ofstream.is_open())
 			{
@@ -70,15 +117,13 @@ private:
 		}
 	};
 
+	// std::cerr and std::clog are replaced by async_logger and aren't redirected anymore
 	redirected_stream *redirected_cout = nullptr;
-	redirected_stream *redirected_cerr = nullptr;
-	redirected_stream *redirected_clog = nullptr;
 
 protected:
 	log_redirector() :
-		redirected_cout{ new redirected_stream(std::cout, log_file_out_name) },
-		redirected_cerr{ new redirected_stream(std::cerr, log_file_err_name) },
-		redirected_clog{ new redirected_stream(std::clog, log_file_log_name) }
+		redirected_cout{ new redirected_stream(std::cout, log_file_out_name,
+				started_by_upgrade() ? std::ios_base::app : std::ios_base::out | std::ios_base::trunc) }
 	{}
 public:
 	static log_redirector &instance()
@@ -93,19 +138,14 @@ public:
 	~log_redirector()
 	{
 		delete redirected_cout;
-		delete redirected_cerr;
-		delete redirected_clog;
 	}
 };
 
-void signal_handler(int signal_number) noexcept;
-
-void set_signal(int signal_number) noexcept;
+sigset_t handled_signals() noexcept;
 
 void set_signals() noexcept;
 
-// worth refactoring - much too unclear
-void log_errno(const char *function, const char *file, size_t line, const char *message, int actual_errno = errno) noexcept;
+int open_signal_fd() noexcept;
 
 size_t set_maximal_avaliable_limit_of_fd() noexcept;
 
@@ -115,6 +155,9 @@ std::string popen_reader(const char *command);
 
 std::string time_t_to_string(time_t seconds_since_epoch);
 
+// the same text as time_t_to_string() without a temporary string
+void append_time_t(std::string &destination, time_t seconds_since_epoch);
+
 class open_file final
 {
 /*
@@ -135,7 +178,6 @@ class open_file final
 			struct stat statbuf;
 			if (stat(path, &statbuf) == -1)
 			{
-				std::lock_guard<std::mutex> lock(cerr_mutex);
 				LOG_CERROR("error of stat, file_properties will remain empty values");
 
 				return;
@@ -162,12 +204,12 @@ class open_file final
 			return size;
 		}
 
-		std::string get_mime_type() const
+		const std::string &get_mime_type() const noexcept
 		{
 			return mime_type;
 		}
 
-		std::string get_last_modified() const
+		const std::string &get_last_modified() const noexcept
 		{
 			return last_modified;
 		}
@@ -175,6 +217,13 @@ class open_file final
 
 	std::unique_ptr<file_properties> properties{ nullptr };
 
+	// what the accessors return when there is nothing to tell
+	static const std::string &nothing() noexcept
+	{
+		static const std::string empty;
+		return empty;
+	}
+
 	bool get_file_properties() noexcept
 	{
 		try
@@ -183,16 +232,13 @@ class open_file final
 		}
 		catch (std::exception &e)
 		{
-			std::lock_guard<std::mutex> lock(cerr_mutex);
-			std::cerr << "Failed to get properties of the file "
-				<< address << ": " << e.what() << "\n";
+			LOG_CERROR_TEXT("Failed to get properties of the file", e.what());
 
 			return false;
 		}
 		catch (...)
 		{
-			std::lock_guard<std::mutex> lock(cerr_mutex);
-			std::cerr << "Unknown error while getting properties of file " << address << "\n";
+			LOG_CERROR_TEXT("Unknown error while getting properties of file", address.data());
 
 			return false;
 		}
@@ -216,9 +262,7 @@ public:
 		}
 		if (close(fd) == -1)
 		{
-			std::lock_guard<std::mutex> lock(cerr_mutex);
-			LOG_CERROR("failed to close the opened file");
-			std::cerr << "File with descriptor " << fd << " wasn't properly closed.\n";
+			LOG_CERROR_VALUE("failed to close the opened file with descriptor", fd);
 		}
 	}
 
@@ -250,43 +294,43 @@ public:
 		return properties->get_size();
 	}
 
-	std::string mime_type()
+	const std::string &mime_type()
 	{
 		if (fd == -1)
 		{
-			return "";
+			return nothing();
 		}
 
 		if (!properties)
 		{
 			if (!get_file_properties())
 			{
-				return "";
+				return nothing();
 			}
 		}
 
 		return properties->get_mime_type();
 	}
 
-	std::string last_modified()
+	const std::string &last_modified()
 	{
 		if (fd == -1)
 		{
-			return "";
+			return nothing();
 		}
 
 		if (!properties)
 		{
 			if (!get_file_properties())
 			{
-				return "";
+				return nothing();
 			}
 		}
 
 		return properties->get_last_modified();
 	}
 
-	std::string location() const
+	const std::string &location() const noexcept
 	{
 		return address;
 	}
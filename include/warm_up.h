@@ -0,0 +1,84 @@
+#ifndef WARM_UP_H
+#define WARM_UP_H
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+
+/*
+*	Warm-up of the caches after a start, made in the background while the server already accepts.
+*	Paths of the hot list come first: they are resolved into the path cache and their contents are read ahead
+*	into the page cache. Then the served tree is walked breadth first and whatever is found is resolved with its size,
+*	modification time, MIME type and entity tag until the path cache is full.
+*	Runs as jobs of the blocking pool, on at most half of its threads and a few paths per job, so requests coming
+*	meanwhile keep their share of it. On shutdown the hot list can be rewritten with the paths requested most.
+*/
+class warm_up final
+{
+public:
+	static constexpr size_t paths_per_job = 16;
+
+private:
+	struct item
+	{
+		std::string relative;
+		bool directory;
+		bool hot;
+	};
+
+	std::mutex mutex;
+	std::deque<item> pending;
+	size_t runners = 0;
+	size_t max_runners = 1;
+	size_t limit = 0;
+
+	std::atomic<size_t> indexed{ 0 };
+	std::atomic<size_t> prefetched{ 0 };
+	int64_t started_ns = 0;
+	std::atomic<int64_t> duration_ns{ 0 };
+
+	warm_up() = default;
+
+	// queues a job of a runner, which keeps requeueing itself while there is work
+	void launch() noexcept;
+	void run_job() noexcept;
+
+	// false when the runner is to stop
+	bool take(item &next) noexcept;
+	void process(const item &next) noexcept;
+	void list_directory(int directory_fd, const std::string &relative);
+
+	void finish() noexcept;
+
+public:
+	static warm_up &instance();
+
+	warm_up(const warm_up &) = delete;
+	warm_up &operator=(const warm_up &) = delete;
+
+	// false if there is nothing to warm up or no blocking pool to do it
+	bool start(const std::string &hot_list, bool walk) noexcept;
+
+	// 0 until it finishes
+	double seconds() const noexcept
+	{
+		return duration_ns.load(std::memory_order_acquire) / 1e9;
+	}
+
+	size_t indexed_paths() const noexcept
+	{
+		return indexed.load(std::memory_order_relaxed);
+	}
+
+	size_t prefetched_files() const noexcept
+	{
+		return prefetched.load(std::memory_order_relaxed);
+	}
+
+	// the paths of the path cache requested most, one URL path per line
+	static bool save_hot_list(const std::string &hot_list, size_t count) noexcept;
+};
+
+#endif		// WARM_UP_H
@@ -0,0 +1,421 @@
+#include "access_log.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+
+#include "logging.h"
+
+constexpr char access_log_file_header::magic_value[8];
+constexpr uint32_t access_log_file_header::current_version;
+
+thread_local thread_slot_handle<access_log::ring, access_log::max_threads>
+	access_log::local_ring{ access_log::instance().rings };
+
+namespace
+{
+	constexpr auto writing_period = std::chrono::milliseconds(10);
+}
+
+void access_log_record::set_address(const struct sockaddr_storage &peer) noexcept
+{
+	memset(address, 0, sizeof(address));
+	port = 0;
+
+	if (peer.ss_family == AF_INET)
+	{
+		const struct sockaddr_in &ipv4 = reinterpret_cast<const struct sockaddr_in &>(peer);
+		address[10] = 0xff;
+		address[11] = 0xff;
+		memcpy(address + 12, &ipv4.sin_addr, 4);
+		port = ntohs(ipv4.sin_port);
+	}
+	else if (peer.ss_family == AF_INET6)
+	{
+		const struct sockaddr_in6 &ipv6 = reinterpret_cast<const struct sockaddr_in6 &>(peer);
+		memcpy(address, &ipv6.sin6_addr, sizeof(address));
+		port = ntohs(ipv6.sin6_port);
+	}
+}
+
+void access_log_record::set_path(const char *data, size_t length) noexcept
+{
+	path_truncated = (length > path_capacity);
+	path_length = static_cast<uint8_t>(path_truncated ? path_capacity : length);
+	memcpy(path, data, path_length);
+}
+
+access_log &access_log::instance()
+{
+	static access_log object;
+	return object;
+}
+
+access_log::~access_log()
+{
+	stop();
+}
+
+template <typename Visitor>
+void access_log::for_each_segment(Visitor visit) const noexcept
+{
+	size_t slash = prefix.rfind('/');
+	std::string directory;
+	std::string base;
+
+	try
+	{
+		directory = (slash == std::string::npos) ? "." : (slash ? prefix.substr(0, slash) : "/");
+		base = (slash == std::string::npos) ? prefix : prefix.substr(slash + 1);
+	}
+	catch (...)
+	{
+		return;
+	}
+
+	DIR *listing = opendir(directory.data());
+	if (!listing)
+	{
+		LOG_CERROR("failed to list the directory of the access log");
+		return;
+	}
+
+	// <base>.<digits>.bin and nothing else
+	while (struct dirent *entry = readdir(listing))
+	{
+		const char *name = entry->d_name;
+		if (strncmp(name, base.data(), base.size()) != 0 || name[base.size()] != '.')
+		{
+			continue;
+		}
+
+		const char *digits = name + base.size() + 1;
+		char *end = nullptr;
+		unsigned long found = strtoul(digits, &end, 10);
+		if (end == digits || *digits < '0' || *digits > '9' || strcmp(end, ".bin") != 0 || found > UINT32_MAX)
+		{
+			continue;
+		}
+
+		char path[4096];
+		snprintf(path, sizeof(path), "%s/%s", directory.data(), name);
+		visit(path, static_cast<uint32_t>(found));
+	}
+
+	closedir(listing);
+}
+
+bool access_log::start(const std::string &file_prefix, size_t segment_mebibytes, size_t kept) noexcept
+{
+	if (enabled() || file_prefix.empty() || !segment_mebibytes)
+	{
+		return enabled();
+	}
+
+	try
+	{
+		prefix = file_prefix;
+	}
+	catch (...)
+	{
+		return false;
+	}
+
+	segment_records = (segment_mebibytes * 1024 * 1024 - sizeof(access_log_file_header)) / sizeof(access_log_record);
+	kept_segments = kept;
+
+	// the logs of earlier runs are left as they are, numbering goes on after the highest of them
+	sequence = 0;
+	for_each_segment([this](const char *, uint32_t found)
+	{
+		sequence = std::max(sequence, found);
+	});
+
+	if (!open_segment())
+	{
+		return false;
+	}
+
+	stop_requested = false;
+	enabled_flag.store(true, std::memory_order_release);
+
+	try
+	{
+		writer = std::thread(&access_log::writing_loop, this);
+	}
+	catch (std::exception &e)
+	{
+		enabled_flag.store(false, std::memory_order_release);
+		close_segment();
+		LOG_CERROR_TEXT("failed to launch the access log thread, access log is disabled:", e.what());
+		return false;
+	}
+
+	LOG_CLOG_TEXT("Access log is written to", prefix.data());
+
+	return true;
+}
+
+void access_log::stop() noexcept
+{
+	if (!writer.joinable() || writer.get_id() == std::this_thread::get_id())
+	{
+		return;
+	}
+
+	enabled_flag.store(false, std::memory_order_release);
+
+	{
+		std::lock_guard<std::mutex> lock(writer_mutex);
+		stop_requested = true;
+	}
+	writer_condv.notify_one();
+	writer.join();
+
+	drain();
+	close_segment();
+}
+
+void access_log::append(const access_log_record &record) noexcept
+{
+	if (!enabled())
+	{
+		return;
+	}
+
+	ring *own = local_ring.get();
+	if (!own)
+	{
+		dropped_without_ring.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	own->push(record);
+}
+
+uint64_t access_log::dropped() const noexcept
+{
+	uint64_t result = dropped_without_ring.load(std::memory_order_relaxed) + dropped_unwritten.load(std::memory_order_relaxed);
+	rings.for_each([&result](const ring &r)
+	{
+		result += r.dropped();
+	});
+	return result;
+}
+
+bool access_log::open_segment() noexcept
+{
+	// a file in the way, made by anyone else since, is skipped rather than overwritten
+	do
+	{
+		if (sequence == UINT32_MAX)
+		{
+			errno = EEXIST;
+			break;
+		}
+
+		char name[4096];
+		snprintf(name, sizeof(name), "%s.%06u.bin", prefix.data(), ++sequence);
+		segment_fd = open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	}
+	while (segment_fd == -1 && errno == EEXIST);
+
+	if (segment_fd == -1)
+	{
+		LOG_CERROR("failed to create the access log file, access log is disabled");
+		return false;
+	}
+
+	segment_size = sizeof(access_log_file_header) + segment_records * sizeof(access_log_record);
+	if (ftruncate(segment_fd, segment_size) == -1)
+	{
+		LOG_CERROR("failed to size the access log file, access log is disabled");
+		close(segment_fd);
+		segment_fd = -1;
+		return false;
+	}
+
+	void *mapping = mmap(nullptr, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, segment_fd, 0);
+	if (mapping == MAP_FAILED)
+	{
+		LOG_CERROR("failed to map the access log file, access log is disabled");
+		close(segment_fd);
+		segment_fd = -1;
+		return false;
+	}
+	segment = static_cast<char *>(mapping);
+
+	access_log_file_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, access_log_file_header::magic_value, sizeof(header.magic));
+	header.version = access_log_file_header::current_version;
+	header.header_size = sizeof(access_log_file_header);
+	header.record_size = sizeof(access_log_record);
+	header.sequence = sequence;
+	header.created_ns = realtime_now_ns();
+	memcpy(segment, &header, sizeof(header));
+
+	segment_used = 0;
+	segment_flushed = 0;
+
+	remove_old_segments();
+
+	return true;
+}
+
+void access_log::remove_old_segments() noexcept
+{
+	if (!kept_segments || sequence <= kept_segments)
+	{
+		return;
+	}
+
+	uint32_t oldest_kept = static_cast<uint32_t>(sequence - kept_segments + 1);
+	for_each_segment([oldest_kept](const char *name, uint32_t found)
+	{
+		if (found < oldest_kept && unlink(name) == -1)
+		{
+			LOG_CERROR_TEXT("failed to remove an old access log file", name);
+		}
+	});
+}
+
+void access_log::close_segment() noexcept
+{
+	if (!segment)
+	{
+		return;
+	}
+
+	flush_segment();
+
+	if (munmap(segment, segment_size) == -1)
+	{
+		LOG_CERROR("failed to unmap the access log file");
+	}
+	segment = nullptr;
+
+	if (ftruncate(segment_fd, sizeof(access_log_file_header) + segment_used * sizeof(access_log_record)) == -1)
+	{
+		LOG_CERROR("failed to truncate the rotated access log file");
+	}
+	if (close(segment_fd) == -1)
+	{
+		LOG_CERROR("failed to close the rotated access log file");
+	}
+	segment_fd = -1;
+}
+
+void access_log::flush_segment() noexcept
+{
+	if (segment_flushed == segment_used)
+	{
+		return;
+	}
+
+	const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	size_t from = sizeof(access_log_file_header) + segment_flushed * sizeof(access_log_record);
+	size_t to = sizeof(access_log_file_header) + segment_used * sizeof(access_log_record);
+	from -= from % page_size;
+
+	if (msync(segment + from, to - from, MS_ASYNC) == -1)
+	{
+		LOG_CERROR("msync of the access log failed");
+	}
+
+	segment_flushed = segment_used;
+}
+
+bool access_log::store(const access_log_record &record) noexcept
+{
+	if (!segment)
+	{
+		return false;
+	}
+
+	if (segment_used == segment_records)
+	{
+		close_segment();
+		if (!open_segment())
+		{
+			// nothing is taken in any more, what's left in the rings is counted as dropped
+			enabled_flag.store(false, std::memory_order_release);
+			return false;
+		}
+	}
+
+	memcpy(segment + sizeof(access_log_file_header) + segment_used * sizeof(access_log_record), &record, sizeof(record));
+	++segment_used;
+
+	return true;
+}
+
+size_t access_log::drain() noexcept
+{
+	size_t drained = 0;
+	size_t stored = 0;
+	uint64_t lost = 0;
+
+	rings.for_each([&](ring &r)
+	{
+		drained += r.consume([this, &stored](const access_log_record &record)
+		{
+			stored += store(record);
+		});
+		lost += r.take_new_drops();
+	});
+
+	if (drained != stored)
+	{
+		dropped_unwritten.fetch_add(drained - stored, std::memory_order_relaxed);
+	}
+
+	if (lost)
+	{
+		LOG_CLOG_VALUE("Access log records dropped because the rings were full:", lost);
+	}
+
+	flush_segment();
+	written.fetch_add(stored, std::memory_order_relaxed);
+
+	return drained;
+}
+
+void access_log::writing_loop() noexcept
+{
+	std::unique_lock<std::mutex> lock(writer_mutex);
+
+	while (!stop_requested)
+	{
+		lock.unlock();
+		size_t drained = drain();
+		lock.lock();
+
+		// a busy pass most likely means the rings are filling up faster than the period allows
+		if (drained < ring_capacity / 2 && !stop_requested)
+		{
+			writer_condv.wait_for(lock, writing_period);
+		}
+	}
+}
+
+int64_t realtime_now_ns() noexcept
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+int64_t monotonic_now_ns() noexcept
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
@@ -0,0 +1,173 @@
+#include "admission.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+
+#include "logging.h"
+#include "metrics.h"
+
+constexpr size_t admission_control::shard_count;
+
+admission_control &admission_control::instance()
+{
+	static admission_control object;
+	return object;
+}
+
+admission_control::client_key admission_control::key_of(const struct sockaddr_storage &peer) noexcept
+{
+	client_key key{ 0, 0 };
+
+	if (peer.ss_family == AF_INET)
+	{
+		const struct sockaddr_in &ipv4 = reinterpret_cast<const struct sockaddr_in &>(peer);
+		key.low = uint64_t{ 0xffff } << 32 | ntohl(ipv4.sin_addr.s_addr);
+	}
+	else if (peer.ss_family == AF_INET6)
+	{
+		const struct sockaddr_in6 &ipv6 = reinterpret_cast<const struct sockaddr_in6 &>(peer);
+		memcpy(&key.high, ipv6.sin6_addr.s6_addr, sizeof(key.high));
+		memcpy(&key.low, ipv6.sin6_addr.s6_addr + sizeof(key.high), sizeof(key.low));
+	}
+
+	return key;
+}
+
+void admission_control::reserve() noexcept
+{
+	if (reserve_fd == -1)
+	{
+		reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	}
+}
+
+void admission_control::configure(size_t max_connections, size_t max_per_client) noexcept
+{
+	budget = max_connections ? max_connections : 1;
+	per_client_cap = max_per_client;
+	reserve();
+
+	if (resume_event_fd == -1)
+	{
+		resume_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (resume_event_fd == -1)
+		{
+			LOG_CERROR("failed to create the eventfd of admission control, paused accepting resumes by timeout only");
+		}
+	}
+
+	LOG_CLOG_VALUE("Connections admitted at a time:", budget);
+	if (per_client_cap)
+	{
+		LOG_CLOG_VALUE("Connections admitted per client address:", per_client_cap);
+	}
+}
+
+bool admission_control::has_room() noexcept
+{
+	if (in_use.load(std::memory_order_acquire) < budget)
+	{
+		return true;
+	}
+
+	// marked before the second look, so a release in between either is seen here or sees the mark
+	if (!paused.exchange(true, std::memory_order_seq_cst))
+	{
+		server_metrics::instance().local().accept_pauses.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	if (in_use.load(std::memory_order_seq_cst) < budget)
+	{
+		paused.store(false, std::memory_order_relaxed);
+		return true;
+	}
+
+	return false;
+}
+
+void admission_control::acknowledge_resume() noexcept
+{
+	uint64_t counter;
+	while (resume_event_fd != -1 && read(resume_event_fd, &counter, sizeof(counter)) > 0)
+	{}
+}
+
+bool admission_control::admit(const struct sockaddr_storage &peer) noexcept
+{
+	if (per_client_cap)
+	{
+		client_key key = key_of(peer);
+		shard &own = shard_of(key);
+
+		std::lock_guard<std::mutex> lock(own.mutex);
+		try
+		{
+			uint32_t &count = own.counts[key];
+			if (count >= per_client_cap)
+			{
+				server_metrics::instance().local().shed_per_client.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+			++count;
+		}
+		catch (...)
+		{
+			return false;
+		}
+	}
+
+	in_use.fetch_add(1, std::memory_order_acq_rel);
+
+	return true;
+}
+
+void admission_control::release(const struct sockaddr_storage &peer) noexcept
+{
+	if (per_client_cap)
+	{
+		client_key key = key_of(peer);
+		shard &own = shard_of(key);
+
+		std::lock_guard<std::mutex> lock(own.mutex);
+		auto found = own.counts.find(key);
+		if (found != own.counts.end() && --found->second == 0)
+		{
+			own.counts.erase(found);
+		}
+	}
+
+	in_use.fetch_sub(1, std::memory_order_seq_cst);
+
+	if (paused.load(std::memory_order_seq_cst) && paused.exchange(false, std::memory_order_seq_cst))
+	{
+		uint64_t one = 1;
+		if (resume_event_fd != -1 && write(resume_event_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+		{
+			LOG_CERROR("failed to resume accepting");
+		}
+	}
+}
+
+void admission_control::shed_pending(int master_socket) noexcept
+{
+	server_metrics::instance().local().shed_fd_exhausted.fetch_add(1, std::memory_order_relaxed);
+
+	if (reserve_fd != -1)
+	{
+		close(reserve_fd);
+		reserve_fd = -1;
+
+		int shed = accept(master_socket, nullptr, nullptr);
+		if (shed != -1)
+		{
+			close(shed);
+		}
+
+		reserve();
+	}
+
+	// the descriptors are likely still exhausted, the next accept waits for a connection to go away
+	paused.store(true, std::memory_order_seq_cst);
+}
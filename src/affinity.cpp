@@ -0,0 +1,116 @@
+#include "affinity.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+
+#include "logging.h"
+
+namespace
+{
+	unsigned parse_cpu(const std::string &list, size_t &position)
+	{
+		const char *begin = list.data() + position;
+		char *end = nullptr;
+
+		errno = 0;
+		unsigned long cpu = strtoul(begin, &end, 10);
+		if (end == begin || *begin == '-' || *begin == '+' || errno || cpu >= CPU_SETSIZE)
+		{
+			throw std::invalid_argument("malformed CPU list: " + list);
+		}
+
+		position += end - begin;
+		return static_cast<unsigned>(cpu);
+	}
+}
+
+std::vector<unsigned> parse_cpu_list(const std::string &list)
+{
+	std::vector<unsigned> result;
+
+	size_t position = 0;
+	while (position != list.size())
+	{
+		unsigned first = parse_cpu(list, position);
+		unsigned last = first;
+
+		if (position != list.size() && list[position] == '-')
+		{
+			last = parse_cpu(list, ++position);
+			if (last < first)
+			{
+				throw std::invalid_argument("malformed CPU list: " + list);
+			}
+		}
+
+		for (unsigned i = first; i <= last; ++i)
+		{
+			result.push_back(i);
+		}
+
+		if (position != list.size() && (list[position] != ',' || ++position == list.size()))
+		{
+			throw std::invalid_argument("malformed CPU list: " + list);
+		}
+	}
+
+	return result;
+}
+
+unsigned numa_node_of(unsigned cpu) noexcept
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u", cpu);
+
+	DIR *directory = opendir(path);
+	if (!directory)
+	{
+		return 0;
+	}
+
+	// the directory of a CPU holds a link named after its node
+	unsigned node = 0;
+	while (struct dirent *entry = readdir(directory))
+	{
+		if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9')
+		{
+			node = static_cast<unsigned>(strtoul(entry->d_name + 4, nullptr, 10));
+			break;
+		}
+	}
+	closedir(directory);
+
+	return node;
+}
+
+bool pin_current_thread(const std::vector<unsigned> &cpus) noexcept
+{
+	if (cpus.empty())
+	{
+		return false;
+	}
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (unsigned i: cpus)
+	{
+		CPU_SET(i, &set);
+	}
+
+	int result = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (result != 0)
+	{
+		errno = result;
+		LOG_CERROR_VALUE("failed to pin a thread, it runs on any CPU. The first CPU of its set is", cpus.front());
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,68 @@
+#include "allocation_counter.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+	struct alignas(64) shard
+	{
+		std::atomic<uint64_t> count{ 0 };
+	};
+
+	constexpr size_t shard_count = 64;
+
+	// constant-initialized, so counting works during the dynamic initialization of other translation units too
+	shard shards[shard_count];
+	std::atomic<size_t> next_shard{ 0 };
+	thread_local size_t own_shard = shard_count;
+
+	void count_allocation() noexcept
+	{
+		if (own_shard == shard_count)
+		{
+			own_shard = next_shard.fetch_add(1, std::memory_order_relaxed) % shard_count;
+		}
+
+		shards[own_shard].count.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void *allocate(size_t size)
+	{
+		count_allocation();
+
+		while (true)
+		{
+			void *pointer = malloc(size ? size : 1);
+			if (pointer)
+			{
+				return pointer;
+			}
+
+			std::new_handler handler = std::get_new_handler();
+			if (!handler)
+			{
+				throw std::bad_alloc();
+			}
+			handler();
+		}
+	}
+}
+
+uint64_t heap_allocations() noexcept
+{
+	uint64_t result = 0;
+	for (const auto &i: shards)
+	{
+		result += i.count.load(std::memory_order_relaxed);
+	}
+
+	return result;
+}
+
+// the array and nothrow forms of libstdc++ call this one, the default operator delete frees what malloc() gave
+void *operator new(size_t size)
+{
+	return allocate(size);
+}
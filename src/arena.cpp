@@ -0,0 +1,22 @@
+#include "arena.h"
+
+#include "metrics.h"
+
+constexpr size_t request_arena::capacity;
+
+void *request_arena::overflow_resource::do_allocate(size_t bytes, size_t alignment)
+{
+	server_metrics::instance().local().arena_overflows.fetch_add(1, std::memory_order_relaxed);
+
+	return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+}
+
+void request_arena::overflow_resource::do_deallocate(void *pointer, size_t bytes, size_t alignment)
+{
+	std::pmr::new_delete_resource()->deallocate(pointer, bytes, alignment);
+}
+
+bool request_arena::overflow_resource::do_is_equal(const std::pmr::memory_resource &other) const noexcept
+{
+	return this == &other;
+}
@@ -0,0 +1,124 @@
+#include "blocking_pool.h"
+
+#include <exception>
+
+#include "logging.h"
+#include "metrics.h"
+#include "access_log.h"
+
+std::unique_ptr<blocking_pool> blocking_threads;
+
+blocking_pool::blocking_pool(size_t count)
+{
+	try
+	{
+		threads.reserve(count);
+		for (size_t i = 0; i != count; ++i)
+		{
+			threads.emplace_back(&blocking_pool::working_loop, this);
+		}
+	}
+	catch (std::exception &e)
+	{
+		LOG_CERROR_TEXT("blocking pool got fewer threads than requested:", e.what());
+	}
+}
+
+blocking_pool::~blocking_pool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	condv.notify_all();
+
+	// never joins the thread it's called from, which is the case when a job calls std::terminate
+	for (auto &i: threads)
+	{
+		if (i.get_id() == std::this_thread::get_id())
+		{
+			i.detach();
+		}
+		else
+		{
+			i.join();
+		}
+	}
+}
+
+bool blocking_pool::submit(std::function<void()> function) noexcept
+{
+	if (threads.empty())
+	{
+		return false;
+	}
+
+	try
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		jobs.push_back(job{ std::move(function), monotonic_now_ns() });
+	}
+	catch (...)
+	{
+		return false;
+	}
+	condv.notify_one();
+
+	return true;
+}
+
+size_t blocking_pool::queue_depth() const noexcept
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	return jobs.size();
+}
+
+void blocking_pool::working_loop() noexcept
+{
+	while (true)
+	{
+		job current;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			condv.wait(lock, [this]() { return stopping || !jobs.empty(); });
+
+			// jobs left in the queue are dropped, the process is exiting
+			if (stopping)
+			{
+				return;
+			}
+
+			current = std::move(jobs.front());
+			jobs.pop_front();
+		}
+
+		server_metrics::instance().local().blocking_wait_duration.record(monotonic_now_ns() - current.queued_ns);
+
+		try
+		{
+			current.function();
+		}
+		catch (std::exception &e)
+		{
+			LOG_CERROR_TEXT("Blocking job got an exception:", e.what());
+		}
+		catch (...)
+		{
+			LOG_CERROR_TEXT("Blocking job got unknown exception thrown", nullptr);
+		}
+	}
+}
+
+void initialize_blocking_pool(size_t count)
+{
+	if (count)
+	{
+		blocking_threads.reset(new blocking_pool(count));
+	}
+}
+
+void terminate_blocking_pool()
+{
+	blocking_threads.reset(nullptr);
+}
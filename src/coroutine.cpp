@@ -0,0 +1,193 @@
+#include "coroutine.h"
+
+#include <new>
+
+#include "logging.h"
+#include "multithreading.h"
+
+constexpr size_t frame_pool::granularity;
+constexpr size_t frame_pool::size_classes;
+constexpr size_t frame_pool::max_cached_per_class;
+
+frame_pool::free_lists::~free_lists()
+{
+	for (size_t i = 0; i != size_classes; ++i)
+	{
+		while (free_frame *frame = heads[i])
+		{
+			heads[i] = frame->next;
+			::operator delete(frame);
+		}
+	}
+}
+
+frame_pool::free_lists &frame_pool::local() noexcept
+{
+	static thread_local free_lists lists;
+	return lists;
+}
+
+void *frame_pool::allocate(size_t size)
+{
+	size_t index = class_of(size);
+	if (index >= size_classes)
+	{
+		return ::operator new(size);
+	}
+
+	free_lists &lists = local();
+	if (free_frame *frame = lists.heads[index])
+	{
+		lists.heads[index] = frame->next;
+		--lists.cached[index];
+		return frame;
+	}
+
+	return ::operator new((index + 1) * granularity);
+}
+
+void frame_pool::deallocate(void *frame, size_t size) noexcept
+{
+	size_t index = class_of(size);
+	if (index >= size_classes)
+	{
+		::operator delete(frame);
+		return;
+	}
+
+	free_lists &lists = local();
+	if (lists.cached[index] == max_cached_per_class)
+	{
+		::operator delete(frame);
+		return;
+	}
+
+	free_frame *freed = static_cast<free_frame *>(frame);
+	freed->next = lists.heads[index];
+	lists.heads[index] = freed;
+	++lists.cached[index];
+}
+
+void frame_pool::prepare() noexcept
+{
+	local();
+}
+
+void task::promise_type::unhandled_exception() const noexcept
+{
+	LOG_CERROR_TEXT("A coroutine ended with an exception", nullptr);
+}
+
+void subtask::promise_type::unhandled_exception() noexcept
+{
+	LOG_CERROR_TEXT("An awaited coroutine ended with an exception", nullptr);
+	result = false;
+}
+
+size_t current_worker() noexcept
+{
+	return thread_pool::current_index();
+}
+
+bool resume_on_worker(size_t index, std::coroutine_handle<> routine) noexcept
+{
+	try
+	{
+		worker_threads->run_on(index, [routine]()
+				{
+					routine.resume();
+				});
+	}
+	catch (std::exception &e)
+	{
+		LOG_CERROR_TEXT("Failed to hand a coroutine back to its worker, it stays suspended:", e.what());
+		return false;
+	}
+
+	return true;
+}
+
+async_socket::~async_socket()
+{
+	loop.cancel(deadline);
+
+	// closing the descriptor isn't enough, a child of popen forked by another thread may hold a copy of it until exec
+	if (fd != -1)
+	{
+		loop.remove(fd);
+	}
+}
+
+bool async_socket::attach(int descriptor) noexcept
+{
+	if (!loop.add(descriptor, EPOLLIN, this))
+	{
+		return false;
+	}
+
+	fd = descriptor;
+	interest = EPOLLIN;
+
+	return true;
+}
+
+bool async_socket::wait(operation &pending, std::coroutine_handle<> routine) noexcept
+{
+	if (interest != pending.events)
+	{
+		if (!loop.modify(fd, pending.events, this))
+		{
+			pending.result = -EIO;
+			return false;
+		}
+		interest = pending.events;
+	}
+
+	waiting = &pending;
+	waiter = routine;
+
+	return true;
+}
+
+void async_socket::on_event(uint32_t) noexcept
+{
+	if (!waiting)
+	{
+		// level-triggered input or hang-up would spin the loop until an operation waits, edge-triggered comes once
+		if (interest != parked && loop.modify(fd, parked, this))
+		{
+			interest = parked;
+		}
+		return;
+	}
+
+	// readiness may be stale, the operation is tried first and keeps waiting if it still would block
+	if (waiting->attempt())
+	{
+		resume();
+		return;
+	}
+
+	// a TLS record may have turned the operation around, a read waiting to write or the other way
+	if (interest != waiting->events)
+	{
+		if (!loop.modify(fd, waiting->events, this))
+		{
+			waiting->result = -EIO;
+			resume();
+			return;
+		}
+		interest = waiting->events;
+	}
+}
+
+void async_socket::on_timer() noexcept
+{
+	expired = true;
+
+	if (waiting)
+	{
+		waiting->result = -ETIMEDOUT;
+		resume();
+	}
+}
@@ -0,0 +1,360 @@
+#include "directory_listing.h"
+
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <system_error>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+
+#include "logging.h"
+#include "metrics.h"
+#include "utils.h"
+
+constexpr size_t listing_cache::capacity;
+
+namespace
+{
+	constexpr size_t flush_threshold = 64 * 1024;
+
+	void append_html_escaped(std::string &destination, std::string_view text)
+	{
+		for (char c: text)
+		{
+			switch (c)
+			{
+			case '&':
+				destination += "&amp;";
+				break;
+			case '<':
+				destination += "&lt;";
+				break;
+			case '>':
+				destination += "&gt;";
+				break;
+			case '"':
+				destination += "&quot;";
+				break;
+			default:
+				destination += c;
+			}
+		}
+	}
+
+	// everything but unreserved characters and slashes, so a name is a single segment of the link
+	void append_url_encoded(std::string &destination, std::string_view text)
+	{
+		static const char hex[] = "0123456789ABCDEF";
+
+		for (char c: text)
+		{
+			unsigned char u = static_cast<unsigned char>(c);
+			if (isalnum(u) || c == '-' || c == '_' || c == '.' || c == '~' || c == '/')
+			{
+				destination += c;
+			}
+			else
+			{
+				destination += '%';
+				destination += hex[u >> 4];
+				destination += hex[u & 0xf];
+			}
+		}
+	}
+
+	void append_json_escaped(std::string &destination, std::string_view text)
+	{
+		static const char hex[] = "0123456789abcdef";
+
+		for (char c: text)
+		{
+			unsigned char u = static_cast<unsigned char>(c);
+			if (c == '"' || c == '\\')
+			{
+				destination += '\\';
+				destination += c;
+			}
+			else if (u < 0x20)
+			{
+				destination += "\\u00";
+				destination += hex[u >> 4];
+				destination += hex[u & 0xf];
+			}
+			else
+			{
+				destination += c;
+			}
+		}
+	}
+
+	void append_number(std::string &destination, unsigned long long value)
+	{
+		char digits[24];
+		snprintf(digits, sizeof(digits), "%llu", value);
+		destination += digits;
+	}
+
+	class directory_stream final
+	{
+		DIR *directory;
+
+	public:
+		explicit directory_stream(int directory_fd)
+		{
+			// a descriptor of its own, the position of the one given stays untouched
+			int own = openat(directory_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (own == -1)
+			{
+				throw std::system_error(errno, std::generic_category(), "openat of the listed directory");
+			}
+
+			directory = fdopendir(own);
+			if (!directory)
+			{
+				int error = errno;
+				close(own);
+				throw std::system_error(error, std::generic_category(), "fdopendir");
+			}
+		}
+
+		~directory_stream()
+		{
+			closedir(directory);
+		}
+
+		directory_stream(const directory_stream &) = delete;
+		directory_stream &operator=(const directory_stream &) = delete;
+
+		int descriptor() const noexcept
+		{
+			return dirfd(directory);
+		}
+
+		// null at the end of the directory
+		struct dirent *next()
+		{
+			errno = 0;
+			struct dirent *result = readdir(directory);
+			if (!result && errno)
+			{
+				throw std::system_error(errno, std::generic_category(), "readdir");
+			}
+			return result;
+		}
+	};
+}
+
+directory_listing::~directory_listing()
+{
+	if (fd != -1 && close(fd) == -1)
+	{
+		LOG_CERROR_VALUE("failed to close the memory file of a directory listing, descriptor", fd);
+	}
+}
+
+void directory_listing::write_out(std::string &buffer, bool flush)
+{
+	if (!flush && buffer.size() < flush_threshold)
+	{
+		return;
+	}
+
+	size_t written = 0;
+	while (written != buffer.size())
+	{
+		ssize_t result = write(fd, buffer.data() + written, buffer.size() - written);
+		if (result == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			throw std::system_error(errno, std::generic_category(), "write of a directory listing");
+		}
+		written += result;
+	}
+
+	length += buffer.size();
+	buffer.clear();
+}
+
+std::shared_ptr<const directory_listing> directory_listing::render(int directory_fd, const struct stat &status,
+		std::string_view url_path, listing_format kind)
+{
+	std::shared_ptr<directory_listing> result{ new directory_listing(kind) };
+
+	result->fd = memfd_create("directory_listing", MFD_CLOEXEC);
+	if (result->fd == -1)
+	{
+		throw std::system_error(errno, std::generic_category(), "memfd_create");
+	}
+
+	result->modified = status.st_mtim;
+	result->changed = status.st_ctim;
+	result->inode = status.st_ino;
+	result->device = status.st_dev;
+	result->last_modified_text = time_t_to_string(status.st_mtim.tv_sec);
+
+	std::string base{ url_path };
+	if (base.empty() || base.back() != '/')
+	{
+		base += '/';
+	}
+
+	std::string buffer;
+	buffer.reserve(flush_threshold + 1024);
+
+	bool json = (kind == listing_format::json);
+	if (json)
+	{
+		buffer += "{\"path\":\"";
+		append_json_escaped(buffer, base);
+		buffer += "\",\"entries\":[";
+	}
+	else
+	{
+		buffer += "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><title>Index of ";
+		append_html_escaped(buffer, base);
+		buffer += "</title></head>\n<body><h1>Index of ";
+		append_html_escaped(buffer, base);
+		buffer += "</h1>\n<table>\n<tr><th>Name</th><th>Size</th><th>Last modified</th></tr>\n";
+		if (base != "/")
+		{
+			buffer += "<tr><td><a href=\"../\">../</a></td><td></td><td></td></tr>\n";
+		}
+	}
+
+	directory_stream directory(directory_fd);
+	bool first = true;
+
+	while (struct dirent *entry = directory.next())
+	{
+		std::string_view name{ entry->d_name };
+		if (name == "." || name == "..")
+		{
+			continue;
+		}
+
+		struct stat entry_status;
+		bool known = (fstatat(directory.descriptor(), entry->d_name, &entry_status, AT_SYMLINK_NOFOLLOW) == 0);
+		bool subdirectory = known ? S_ISDIR(entry_status.st_mode) : (entry->d_type == DT_DIR);
+		unsigned long long size = (known && !subdirectory) ? entry_status.st_size : 0;
+
+		if (json)
+		{
+			buffer += first ? "\n{\"name\":\"" : ",\n{\"name\":\"";
+			append_json_escaped(buffer, name);
+			buffer += subdirectory ? "\",\"type\":\"directory\",\"size\":" : "\",\"type\":\"file\",\"size\":";
+			append_number(buffer, size);
+			buffer += ",\"mtime\":";
+			append_number(buffer, known ? entry_status.st_mtim.tv_sec : 0);
+			buffer += '}';
+		}
+		else
+		{
+			buffer += "<tr><td><a href=\"";
+			append_url_encoded(buffer, base);
+			append_url_encoded(buffer, name);
+			if (subdirectory)
+			{
+				buffer += '/';
+			}
+			buffer += "\">";
+			append_html_escaped(buffer, name);
+			if (subdirectory)
+			{
+				buffer += '/';
+			}
+			buffer += "</a></td><td>";
+			if (!subdirectory)
+			{
+				append_number(buffer, size);
+			}
+			buffer += "</td><td>";
+			if (known)
+			{
+				append_time_t(buffer, entry_status.st_mtim.tv_sec);
+			}
+			buffer += "</td></tr>\n";
+		}
+
+		first = false;
+		result->write_out(buffer, false);
+	}
+
+	buffer += json ? "\n]}\n" : "</table>\n</body></html>\n";
+	result->write_out(buffer, true);
+
+	return result;
+}
+
+bool directory_listing::current(const struct stat &status) const noexcept
+{
+	return status.st_ino == inode && status.st_dev == device &&
+			status.st_mtim.tv_sec == modified.tv_sec && status.st_mtim.tv_nsec == modified.tv_nsec &&
+			status.st_ctim.tv_sec == changed.tv_sec && status.st_ctim.tv_nsec == changed.tv_nsec;
+}
+
+listing_cache &listing_cache::instance()
+{
+	static listing_cache object;
+	return object;
+}
+
+std::shared_ptr<const directory_listing> listing_cache::get(int directory_fd, std::string_view path,
+		std::string_view url_path, listing_format kind)
+{
+	struct stat status;
+	if (fstat(directory_fd, &status) == -1)
+	{
+		throw std::system_error(errno, std::generic_category(), "fstat of the listed directory");
+	}
+
+	// one entry for a directory requested with and without the trailing slash
+	while (path.size() > 1 && path.back() == '/')
+	{
+		path.remove_suffix(1);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto found = entries.find(path);
+		if (found != entries.end() && found->second.listing->current(status))
+		{
+			found->second.last_used = ++uses;
+			server_metrics::instance().local().listing_cache_hits.fetch_add(1, std::memory_order_relaxed);
+			return found->second.listing;
+		}
+	}
+
+	std::shared_ptr<const directory_listing> rendered = directory_listing::render(directory_fd, status, url_path, kind);
+	server_metrics::instance().local().listing_renders.fetch_add(1, std::memory_order_relaxed);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	auto found = entries.find(path);
+	if (found == entries.end() && entries.size() >= capacity)
+	{
+		auto oldest = entries.begin();
+		for (auto i = entries.begin(); i != entries.end(); ++i)
+		{
+			if (i->second.last_used < oldest->second.last_used)
+			{
+				oldest = i;
+			}
+		}
+		entries.erase(oldest);
+	}
+	if (found != entries.end())
+	{
+		found->second = entry{ rendered, ++uses };
+	}
+	else
+	{
+		entries.emplace(std::string(path), entry{ rendered, ++uses });
+	}
+
+	return rendered;
+}
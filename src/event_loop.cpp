@@ -0,0 +1,188 @@
+#include "event_loop.h"
+
+#include <ctime>
+#include <new>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "logging.h"
+
+constexpr int64_t event_loop::tick_ms;
+constexpr int event_loop::max_events;
+
+event_loop::event_loop() :
+	epoll_fd{ epoll_create1(EPOLL_CLOEXEC) },
+	wake_fd{ eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) },
+	wheel{ now_ms(), tick_ms }
+{
+	if (epoll_fd == -1 || wake_fd == -1)
+	{
+		LOG_CERROR("failed to create the descriptors of an event loop");
+		close_descriptors();
+		throw std::runtime_error("Failed to create an event loop");
+	}
+
+	// the wake-up descriptor is told apart by a null handler
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = nullptr;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event) == -1)
+	{
+		LOG_CERROR("failed to watch the wake-up descriptor of an event loop");
+		close_descriptors();
+		throw std::runtime_error("Failed to create an event loop");
+	}
+
+	retired.reserve(max_events);
+}
+
+event_loop::~event_loop()
+{
+	close_descriptors();
+}
+
+void event_loop::close_descriptors() noexcept
+{
+	if (wake_fd != -1)
+	{
+		close(wake_fd);
+		wake_fd = -1;
+	}
+	if (epoll_fd != -1)
+	{
+		close(epoll_fd);
+		epoll_fd = -1;
+	}
+}
+
+int64_t event_loop::now_ms() noexcept
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	return static_cast<int64_t>(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+}
+
+bool event_loop::add(int fd, uint32_t events, event_handler *handler) noexcept
+{
+	struct epoll_event event;
+	event.events = events;
+	event.data.ptr = handler;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+	{
+		LOG_CERROR_VALUE("epoll_ctl failed to add descriptor", fd);
+		return false;
+	}
+
+	return true;
+}
+
+bool event_loop::modify(int fd, uint32_t events, event_handler *handler) noexcept
+{
+	struct epoll_event event;
+	event.events = events;
+	event.data.ptr = handler;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1)
+	{
+		LOG_CERROR_VALUE("epoll_ctl failed to modify descriptor", fd);
+		return false;
+	}
+
+	return true;
+}
+
+void event_loop::remove(int fd) noexcept
+{
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr) == -1)
+	{
+		LOG_CERROR_VALUE("epoll_ctl failed to remove descriptor", fd);
+	}
+}
+
+void event_loop::retire(void (*destroy)(void *), void *object) noexcept
+{
+	if (dispatching)
+	{
+		try
+		{
+			retired.push_back({ destroy, object });
+			return;
+		}
+		catch (std::bad_alloc &)
+		{
+			LOG_CERROR_TEXT("No memory to retire a handler, it's destroyed in the middle of a batch", nullptr);
+		}
+	}
+
+	destroy(object);
+}
+
+void event_loop::destroy_retired() noexcept
+{
+	// destroying one may retire others, which are destroyed at once as the batch is over
+	for (size_t i = 0; i != retired.size(); ++i)
+	{
+		retired[i].destroy(retired[i].object);
+	}
+	retired.clear();
+}
+
+bool event_loop::wake() noexcept
+{
+	// only the first waker of a sleep pays for the syscall
+	if (!sleeping.exchange(false, std::memory_order_seq_cst))
+	{
+		return false;
+	}
+
+	uint64_t one = 1;
+	if (write(wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+	{
+		LOG_CERROR("failed to wake up an event loop");
+	}
+
+	return true;
+}
+
+size_t event_loop::dispatch(int timeout_ms) noexcept
+{
+	struct epoll_event events[max_events];
+
+	int ready = epoll_wait(epoll_fd, events, max_events, timeout_ms);
+	if (ready == -1)
+	{
+		if (errno != EINTR)
+		{
+			LOG_CERROR("epoll_wait failed");
+		}
+		ready = 0;
+	}
+
+	dispatching = true;
+
+	for (int i = 0; i != ready; ++i)
+	{
+		event_handler *handler = static_cast<event_handler *>(events[i].data.ptr);
+
+		if (handler)
+		{
+			handler->on_event(events[i].events);
+		}
+		else
+		{
+			uint64_t counter;
+			while (read(wake_fd, &counter, sizeof(counter)) > 0)
+			{}
+		}
+	}
+
+	size_t fired = wheel.advance(now_ms());
+
+	dispatching = false;
+	destroy_retired();
+
+	return static_cast<size_t>(ready) + fired;
+}
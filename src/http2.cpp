@@ -0,0 +1,1447 @@
+#include "http2.h"
+
+#include <algorithm>
+#include <cstring>
+
+constexpr size_t hpack_decoder::table_size;
+constexpr size_t hpack_decoder::max_list_size;
+constexpr size_t http2_session::frame_header_size;
+constexpr uint32_t http2_session::default_window;
+constexpr uint32_t http2_session::max_window;
+constexpr size_t http2_session::max_frame_size;
+constexpr size_t http2_session::max_sent_frame;
+constexpr size_t http2_session::max_header_block;
+
+namespace
+{
+	enum frame_type : uint8_t
+	{
+		data_frame = 0x0,
+		headers_frame = 0x1,
+		priority_frame = 0x2,
+		rst_stream_frame = 0x3,
+		settings_frame = 0x4,
+		push_promise_frame = 0x5,
+		ping_frame = 0x6,
+		goaway_frame = 0x7,
+		window_update_frame = 0x8,
+		continuation_frame = 0x9
+	};
+
+	enum frame_flag : uint8_t
+	{
+		end_stream_flag = 0x1,
+		ack_flag = 0x1,
+		end_headers_flag = 0x4,
+		padded_flag = 0x8,
+		priority_flag = 0x20
+	};
+
+	// lengths of the canonical Huffman code of HPACK by symbol, the last one is EOS (RFC 7541, appendix B)
+	constexpr uint8_t huffman_lengths[257] =
+	{
+		13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+		28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+		6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+		5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+		13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+		7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+		15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+		6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+		20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+		24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+		22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+		21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+		26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+		19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+		20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+		26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+		30
+	};
+
+	constexpr size_t eos_symbol = 256;
+	constexpr unsigned longest_code = 30;
+	constexpr unsigned shortest_code = 5;
+
+	/*
+	*	The code is canonical, so the lengths are all it takes: codes of one length are consecutive numbers
+	*	in the order of their symbols, and a code is recognized by the range of its length it falls into.
+	*/
+	struct huffman_code
+	{
+		uint32_t codes[eos_symbol + 1];
+		uint32_t first_code[longest_code + 1] = {};
+		uint16_t first_index[longest_code + 1] = {};
+		uint16_t count[longest_code + 1] = {};
+		uint16_t symbols[eos_symbol + 1];			// by length, then by value
+
+		huffman_code() noexcept
+		{
+			for (size_t i = 0; i <= eos_symbol; ++i)
+			{
+				++count[huffman_lengths[i]];
+			}
+
+			uint16_t index = 0;
+			uint32_t code = 0;
+			for (unsigned length = 1; length <= longest_code; ++length)
+			{
+				first_index[length] = index;
+				first_code[length] = code;
+				index += count[length];
+				code = (code + count[length]) << 1;
+			}
+
+			uint16_t filled[longest_code + 1] = {};
+			for (size_t i = 0; i <= eos_symbol; ++i)
+			{
+				unsigned length = huffman_lengths[i];
+				symbols[first_index[length] + filled[length]] = static_cast<uint16_t>(i);
+				codes[i] = first_code[length] + filled[length]++;
+			}
+		}
+	};
+
+	const huffman_code &huffman() noexcept
+	{
+		static const huffman_code table;
+		return table;
+	}
+
+	struct static_field
+	{
+		std::string_view name;
+		std::string_view value;
+	};
+
+	// indexed from 1 (RFC 7541, appendix A)
+	constexpr static_field static_table[] =
+	{
+		{ ":authority", "" },
+		{ ":method", "GET" },
+		{ ":method", "POST" },
+		{ ":path", "/" },
+		{ ":path", "/index.html" },
+		{ ":scheme", "http" },
+		{ ":scheme", "https" },
+		{ ":status", "200" },
+		{ ":status", "204" },
+		{ ":status", "206" },
+		{ ":status", "304" },
+		{ ":status", "400" },
+		{ ":status", "404" },
+		{ ":status", "500" },
+		{ "accept-charset", "" },
+		{ "accept-encoding", "gzip, deflate" },
+		{ "accept-language", "" },
+		{ "accept-ranges", "" },
+		{ "accept", "" },
+		{ "access-control-allow-origin", "" },
+		{ "age", "" },
+		{ "allow", "" },
+		{ "authorization", "" },
+		{ "cache-control", "" },
+		{ "content-disposition", "" },
+		{ "content-encoding", "" },
+		{ "content-language", "" },
+		{ "content-length", "" },
+		{ "content-location", "" },
+		{ "content-range", "" },
+		{ "content-type", "" },
+		{ "cookie", "" },
+		{ "date", "" },
+		{ "etag", "" },
+		{ "expect", "" },
+		{ "expires", "" },
+		{ "from", "" },
+		{ "host", "" },
+		{ "if-match", "" },
+		{ "if-modified-since", "" },
+		{ "if-none-match", "" },
+		{ "if-range", "" },
+		{ "if-unmodified-since", "" },
+		{ "last-modified", "" },
+		{ "link", "" },
+		{ "location", "" },
+		{ "max-forwards", "" },
+		{ "proxy-authenticate", "" },
+		{ "proxy-authorization", "" },
+		{ "range", "" },
+		{ "referer", "" },
+		{ "refresh", "" },
+		{ "retry-after", "" },
+		{ "server", "" },
+		{ "set-cookie", "" },
+		{ "strict-transport-security", "" },
+		{ "transfer-encoding", "" },
+		{ "user-agent", "" },
+		{ "vary", "" },
+		{ "via", "" },
+		{ "www-authenticate", "" }
+	};
+
+	constexpr size_t static_table_size = sizeof(static_table) / sizeof(static_table[0]);
+
+	// what an entry of the dynamic table counts against its size
+	size_t entry_size(const http2_header &field) noexcept
+	{
+		return field.name.size() + field.value.size() + 32;
+	}
+
+	// fields that change with every response aren't worth a place in the dynamic table
+	bool is_volatile(std::string_view name) noexcept
+	{
+		return name == "date" || name == "expires" || name == "last-modified" || name == "etag" ||
+				name == "content-length" || name == "location" || name == "retry-after" || name == "content-range";
+	}
+
+	// fields of HTTP/1 that mean nothing in HTTP/2 and make a request malformed
+	bool is_connection_specific(std::string_view name) noexcept
+	{
+		return name == "connection" || name == "keep-alive" || name == "proxy-connection" ||
+				name == "transfer-encoding" || name == "upgrade";
+	}
+
+	void append_integer(std::string &block, uint8_t first, unsigned prefix_bits, uint64_t value)
+	{
+		uint64_t limit = (uint64_t{ 1 } << prefix_bits) - 1;
+		if (value < limit)
+		{
+			block += static_cast<char>(first | value);
+			return;
+		}
+
+		block += static_cast<char>(first | limit);
+		value -= limit;
+		while (value >= 128)
+		{
+			block += static_cast<char>(value % 128 + 128);
+			value /= 128;
+		}
+		block += static_cast<char>(value);
+	}
+
+	bool read_integer(const uint8_t *&position, const uint8_t *end, unsigned prefix_bits, uint64_t &value) noexcept
+	{
+		if (position == end)
+		{
+			return false;
+		}
+
+		uint64_t limit = (uint64_t{ 1 } << prefix_bits) - 1;
+		value = *position++ & limit;
+		if (value < limit)
+		{
+			return true;
+		}
+
+		// nothing in a block of the allowed size needs more than four bytes of continuation
+		for (unsigned shift = 0; position != end && shift <= 21; shift += 7)
+		{
+			uint8_t byte = *position++;
+			value += uint64_t{ byte & 0x7fu } << shift;
+			if (!(byte & 0x80))
+			{
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	size_t huffman_size(std::string_view text) noexcept
+	{
+		size_t bits = 0;
+		for (unsigned char c: text)
+		{
+			bits += huffman_lengths[c];
+		}
+
+		return (bits + 7) / 8;
+	}
+
+	void huffman_encode(std::string_view text, std::string &block)
+	{
+		const huffman_code &code = huffman();
+
+		uint64_t bits = 0;
+		unsigned pending = 0;
+		for (unsigned char c: text)
+		{
+			bits = (bits << huffman_lengths[c]) | code.codes[c];
+			pending += huffman_lengths[c];
+			while (pending >= 8)
+			{
+				pending -= 8;
+				block += static_cast<char>(bits >> pending);
+			}
+			bits &= (uint64_t{ 1 } << pending) - 1;
+		}
+
+		// padded with the most significant bits of EOS, all ones
+		if (pending)
+		{
+			block += static_cast<char>((bits << (8 - pending)) | (0xffu >> pending));
+		}
+	}
+
+	bool huffman_decode(const uint8_t *data, size_t size, std::string &text)
+	{
+		const huffman_code &code = huffman();
+
+		text.clear();
+		text.reserve(size + size / 2);
+
+		uint64_t bits = 0;
+		unsigned available = 0;
+		for (size_t i = 0; i != size; ++i)
+		{
+			bits = (bits << 8) | data[i];
+			available += 8;
+
+			while (available >= shortest_code)
+			{
+				unsigned length = shortest_code;
+				uint32_t candidate = 0;
+				for (; length <= std::min(available, longest_code); ++length)
+				{
+					candidate = static_cast<uint32_t>(bits >> (available - length)) & ((uint32_t{ 1 } << length) - 1);
+					if (candidate - code.first_code[length] < code.count[length])
+					{
+						break;
+					}
+				}
+
+				// the rest of a longer code is still to come
+				if (length > std::min(available, longest_code))
+				{
+					break;
+				}
+
+				uint16_t symbol = code.symbols[code.first_index[length] + candidate - code.first_code[length]];
+				if (symbol == eos_symbol)
+				{
+					return false;
+				}
+				text += static_cast<char>(symbol);
+				available -= length;
+			}
+
+			bits &= (uint64_t{ 1 } << available) - 1;
+		}
+
+		// at most seven bits of padding, the most significant ones of EOS
+		return available <= 7 && bits == (uint64_t{ 1 } << available) - 1;
+	}
+
+	void append_string(std::string_view text, std::string &block)
+	{
+		size_t coded = huffman_size(text);
+		if (coded < text.size())
+		{
+			append_integer(block, 0x80, 7, coded);
+			huffman_encode(text, block);
+		}
+		else
+		{
+			append_integer(block, 0x00, 7, text.size());
+			block += text;
+		}
+	}
+
+	bool read_string(const uint8_t *&position, const uint8_t *end, std::string &text)
+	{
+		if (position == end)
+		{
+			return false;
+		}
+
+		bool coded = *position & 0x80;
+		uint64_t length;
+		if (!read_integer(position, end, 7, length) || length > static_cast<uint64_t>(end - position))
+		{
+			return false;
+		}
+
+		if (coded)
+		{
+			if (!huffman_decode(position, length, text))
+			{
+				return false;
+			}
+		}
+		else
+		{
+			text.assign(reinterpret_cast<const char *>(position), length);
+		}
+		position += length;
+
+		return true;
+	}
+
+	uint32_t read_uint32(const uint8_t *data) noexcept
+	{
+		return uint32_t{ data[0] } << 24 | uint32_t{ data[1] } << 16 | uint32_t{ data[2] } << 8 | data[3];
+	}
+
+	void append_uint32(std::string &destination, uint32_t value)
+	{
+		destination += static_cast<char>(value >> 24);
+		destination += static_cast<char>(value >> 16);
+		destination += static_cast<char>(value >> 8);
+		destination += static_cast<char>(value);
+	}
+
+	// the unpadded URL-safe alphabet of HTTP2-Settings, false on anything else
+	bool decode_base64url(std::string_view text, std::string &decoded)
+	{
+		uint32_t bits = 0;
+		unsigned available = 0;
+
+		for (char c: text)
+		{
+			uint32_t value;
+			if (c >= 'A' && c <= 'Z')
+			{
+				value = c - 'A';
+			}
+			else if (c >= 'a' && c <= 'z')
+			{
+				value = c - 'a' + 26;
+			}
+			else if (c >= '0' && c <= '9')
+			{
+				value = c - '0' + 52;
+			}
+			else if (c == '-' || c == '+')
+			{
+				value = 62;
+			}
+			else if (c == '_' || c == '/')
+			{
+				value = 63;
+			}
+			else if (c == '=')
+			{
+				break;
+			}
+			else
+			{
+				return false;
+			}
+
+			bits = (bits << 6) | value;
+			available += 6;
+			if (available >= 8)
+			{
+				available -= 8;
+				decoded += static_cast<char>(bits >> available);
+				bits &= (uint32_t{ 1 } << available) - 1;
+			}
+		}
+
+		return true;
+	}
+}
+
+void hpack_decoder::evict(size_t limit) noexcept
+{
+	while (dynamic_size > limit)
+	{
+		dynamic_size -= entry_size(dynamic.back());
+		dynamic.pop_back();
+	}
+}
+
+void hpack_decoder::insert(const http2_header &field)
+{
+	// an entry larger than the table empties it and isn't added
+	size_t size = entry_size(field);
+	if (size > size_limit)
+	{
+		evict(0);
+		return;
+	}
+
+	evict(size_limit - size);
+	dynamic.push_front(field);
+	dynamic_size += size;
+}
+
+bool hpack_decoder::decode(const uint8_t *data, size_t size, std::vector<http2_header> &fields)
+{
+	const uint8_t *position = data;
+	const uint8_t *end = data + size;
+	size_t list_size = 0;
+
+	auto lookup = [this](uint64_t index, http2_header &field)
+	{
+		if (index == 0)
+		{
+			return false;
+		}
+		if (index <= static_table_size)
+		{
+			field.name = static_table[index - 1].name;
+			field.value = static_table[index - 1].value;
+			return true;
+		}
+		if (index - static_table_size > dynamic.size())
+		{
+			return false;
+		}
+		field = dynamic[index - static_table_size - 1];
+		return true;
+	};
+
+	while (position != end)
+	{
+		uint8_t first = *position;
+		http2_header field;
+
+		if (first & 0x80)
+		{
+			uint64_t index;
+			if (!read_integer(position, end, 7, index) || !lookup(index, field))
+			{
+				return false;
+			}
+		}
+		else if ((first & 0xe0) == 0x20)
+		{
+			// an update of the size may only open a block, and never above what we allow
+			uint64_t limit;
+			if (!fields.empty() || !read_integer(position, end, 5, limit) || limit > table_size)
+			{
+				return false;
+			}
+			size_limit = limit;
+			evict(size_limit);
+			continue;
+		}
+		else
+		{
+			bool indexing = first & 0x40;
+			uint64_t index;
+			if (!read_integer(position, end, indexing ? 6 : 4, index))
+			{
+				return false;
+			}
+
+			if (index)
+			{
+				if (!lookup(index, field))
+				{
+					return false;
+				}
+			}
+			else if (!read_string(position, end, field.name))
+			{
+				return false;
+			}
+
+			if (!read_string(position, end, field.value))
+			{
+				return false;
+			}
+
+			if (indexing)
+			{
+				insert(field);
+			}
+		}
+
+		list_size += entry_size(field);
+		if (list_size > max_list_size)
+		{
+			return false;
+		}
+		fields.push_back(std::move(field));
+	}
+
+	return true;
+}
+
+void hpack_encoder::evict(size_t limit) noexcept
+{
+	while (dynamic_size > limit)
+	{
+		dynamic_size -= entry_size(dynamic.back());
+		dynamic.pop_back();
+	}
+}
+
+void hpack_encoder::set_table_size(size_t size) noexcept
+{
+	size = std::min(size, hpack_decoder::table_size);
+	if (size == size_limit)
+	{
+		return;
+	}
+
+	// a table shrunk and grown back between two blocks still has to be shrunk at the peer
+	smallest_limit = std::min(smallest_limit, size);
+	size_limit = size;
+	size_changed = true;
+	evict(size_limit);
+}
+
+void hpack_encoder::begin_block(std::string &block)
+{
+	if (!size_changed)
+	{
+		return;
+	}
+
+	if (smallest_limit < size_limit)
+	{
+		append_integer(block, 0x20, 5, smallest_limit);
+	}
+	append_integer(block, 0x20, 5, size_limit);
+
+	smallest_limit = size_limit;
+	size_changed = false;
+}
+
+void hpack_encoder::encode(std::string_view name, std::string_view value, std::string &block)
+{
+	size_t name_index = 0;
+
+	for (size_t i = 0; i != static_table_size; ++i)
+	{
+		if (static_table[i].name == name)
+		{
+			if (static_table[i].value == value)
+			{
+				append_integer(block, 0x80, 7, i + 1);
+				return;
+			}
+			if (!name_index)
+			{
+				name_index = i + 1;
+			}
+		}
+	}
+
+	for (size_t i = 0; i != dynamic.size(); ++i)
+	{
+		if (dynamic[i].name == name && dynamic[i].value == value)
+		{
+			append_integer(block, 0x80, 7, static_table_size + i + 1);
+			return;
+		}
+	}
+
+	bool indexing = !is_volatile(name) && entry_size(http2_header{ std::string(name), std::string(value) }) <= size_limit;
+	if (indexing)
+	{
+		append_integer(block, 0x40, 6, name_index);
+	}
+	else
+	{
+		append_integer(block, 0x00, 4, name_index);
+	}
+
+	if (!name_index)
+	{
+		append_string(name, block);
+	}
+	append_string(value, block);
+
+	if (indexing)
+	{
+		http2_header field{ std::string(name), std::string(value) };
+		size_t size = entry_size(field);
+		evict(size_limit - size);
+		dynamic.push_front(std::move(field));
+		dynamic_size += size;
+	}
+}
+
+http2_session::http2_session(size_t max_streams) :
+	stream_limit{ max_streams }
+{
+	// the server's preface, sent without waiting for the client's
+	append_settings();
+}
+
+void http2_session::append_frame_header(size_t length, uint8_t type, uint8_t flags, uint32_t stream_id)
+{
+	output += static_cast<char>(length >> 16);
+	output += static_cast<char>(length >> 8);
+	output += static_cast<char>(length);
+	output += static_cast<char>(type);
+	output += static_cast<char>(flags);
+	append_uint32(output, stream_id);
+}
+
+void http2_session::append_settings()
+{
+	// only what differs from the defaults: the limit of streams and of the decoded header list
+	append_frame_header(12, settings_frame, 0, 0);
+
+	output += '\0';
+	output += '\x3';
+	append_uint32(output, static_cast<uint32_t>(stream_limit));
+
+	output += '\0';
+	output += '\x6';
+	append_uint32(output, hpack_decoder::max_list_size);
+}
+
+void http2_session::append_window_update(uint32_t stream_id, uint32_t increment)
+{
+	append_frame_header(4, window_update_frame, 0, stream_id);
+	append_uint32(output, increment);
+}
+
+void http2_session::reset(uint32_t stream_id, http2_error error)
+{
+	append_frame_header(4, rst_stream_frame, 0, stream_id);
+	append_uint32(output, static_cast<uint32_t>(error));
+}
+
+void http2_session::fail(http2_error error)
+{
+	if (failed)
+	{
+		return;
+	}
+
+	append_frame_header(8, goaway_frame, 0, 0);
+	append_uint32(output, last_stream);
+	append_uint32(output, static_cast<uint32_t>(error));
+
+	failed = true;
+	goaway_sent = true;
+}
+
+void http2_session::close(std::map<uint32_t, stream>::iterator position, bool complete)
+{
+	finished.push_back({ position->first, position->second.sent, complete });
+	streams.erase(position);
+}
+
+void http2_session::finish_local(std::map<uint32_t, stream>::iterator position)
+{
+	// the response is whole, a request body still coming isn't needed anymore
+	position->second.local_closed = true;
+	if (!position->second.remote_closed)
+	{
+		reset(position->first, http2_error::no_error);
+	}
+	close(position, true);
+}
+
+bool http2_session::upgrade(std::string_view settings, http2_request request)
+{
+	std::string decoded;
+	if (!decode_base64url(settings, decoded) || decoded.size() % 6)
+	{
+		return false;
+	}
+
+	// acknowledged by the 101 response itself
+	const uint8_t *payload = reinterpret_cast<const uint8_t *>(decoded.data());
+	for (size_t i = 0; i != decoded.size(); i += 6)
+	{
+		if (!apply_setting(static_cast<uint16_t>(payload[i] << 8 | payload[i + 1]), read_uint32(payload + i + 2)))
+		{
+			return false;
+		}
+	}
+
+	last_stream = 1;
+	streams[1].remote_closed = true;
+	streams[1].send_window = peer_initial_window;
+
+	request.stream = 1;
+	requests.push_back(std::move(request));
+
+	return true;
+}
+
+void http2_session::receive(const char *data, size_t size)
+{
+	if (failed)
+	{
+		return;
+	}
+
+	// the client's preface first, compared as it arrives
+	if (preface_left)
+	{
+		size_t compared = std::min(size, preface_left);
+		if (memcmp(data, http2_preface.data() + http2_preface.size() - preface_left, compared) != 0)
+		{
+			fail(http2_error::protocol_error);
+			return;
+		}
+		preface_left -= compared;
+		data += compared;
+		size -= compared;
+	}
+
+	input.append(data, size);
+
+	while (!failed && input.size() - input_offset >= frame_header_size)
+	{
+		const uint8_t *header = reinterpret_cast<const uint8_t *>(input.data() + input_offset);
+		size_t length = size_t{ header[0] } << 16 | size_t{ header[1] } << 8 | header[2];
+		if (length > max_frame_size)
+		{
+			fail(http2_error::frame_size_error);
+			break;
+		}
+		if (input.size() - input_offset < frame_header_size + length)
+		{
+			break;
+		}
+
+		input_offset += frame_header_size + length;
+		handle_frame(header[3], header[4], read_uint32(header + 5) & 0x7fffffff, header + frame_header_size, length);
+	}
+
+	// a partial frame is kept at the beginning, so the buffer never grows beyond a frame and a read
+	input.erase(0, input_offset);
+	input_offset = 0;
+}
+
+bool http2_session::handle_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t *payload, size_t length)
+{
+	// a header block is interrupted by nothing, not even by frames of its own stream
+	if (header_stream && (type != continuation_frame || stream_id != header_stream))
+	{
+		fail(http2_error::protocol_error);
+		return false;
+	}
+
+	switch (type)
+	{
+	case data_frame:
+		return handle_data(flags, stream_id, payload, length);
+
+	case headers_frame:
+		return handle_headers(flags, stream_id, payload, length);
+
+	case priority_frame:
+		// priorities are left to the order of scheduling
+		if (!stream_id)
+		{
+			fail(http2_error::protocol_error);
+			return false;
+		}
+		if (length != 5)
+		{
+			reset(stream_id, http2_error::frame_size_error);
+		}
+		return true;
+
+	case rst_stream_frame:
+		if (!stream_id || stream_id > last_stream)
+		{
+			fail(http2_error::protocol_error);
+			return false;
+		}
+		if (length != 4)
+		{
+			fail(http2_error::frame_size_error);
+			return false;
+		}
+		if (auto found = streams.find(stream_id); found != streams.end())
+		{
+			close(found, false);
+		}
+		return true;
+
+	case settings_frame:
+		return handle_settings(flags, stream_id, payload, length);
+
+	case push_promise_frame:
+		fail(http2_error::protocol_error);
+		return false;
+
+	case ping_frame:
+		if (stream_id)
+		{
+			fail(http2_error::protocol_error);
+			return false;
+		}
+		if (length != 8)
+		{
+			fail(http2_error::frame_size_error);
+			return false;
+		}
+		if (!(flags & ack_flag))
+		{
+			append_frame_header(8, ping_frame, ack_flag, 0);
+			output.append(reinterpret_cast<const char *>(payload), 8);
+		}
+		return true;
+
+	case goaway_frame:
+		if (stream_id)
+		{
+			fail(http2_error::protocol_error);
+			return false;
+		}
+		if (length < 8)
+		{
+			fail(http2_error::frame_size_error);
+			return false;
+		}
+		goaway_received = true;
+		return true;
+
+	case window_update_frame:
+		return handle_window_update(stream_id, payload, length);
+
+	case continuation_frame:
+		if (!header_stream)
+		{
+			fail(http2_error::protocol_error);
+			return false;
+		}
+		if (header_block.size() + length > max_header_block)
+		{
+			fail(http2_error::enhance_your_calm);
+			return false;
+		}
+		header_block.append(reinterpret_cast<const char *>(payload), length);
+		return (flags & end_headers_flag) ? end_header_block() : true;
+
+	default:
+		// frames of unknown types are ignored
+		return true;
+	}
+}
+
+bool http2_session::handle_data(uint8_t flags, uint32_t stream_id, const uint8_t *payload, size_t length)
+{
+	if (!stream_id || stream_id > last_stream)
+	{
+		fail(http2_error::protocol_error);
+		return false;
+	}
+	if ((flags & padded_flag) && (!length || payload[0] >= length))
+	{
+		fail(http2_error::protocol_error);
+		return false;
+	}
+
+	// flow control counts the whole payload, padding included; bodies are discarded, so it's credited back at once
+	connection_receive_window -= length;
+	if (connection_receive_window < 0)
+	{
+		fail(http2_error::flow_control_error);
+		return false;
+	}
+	connection_unacknowledged += length;
+	if (connection_unacknowledged >= default_window / 2)
+	{
+		append_window_update(0, connection_unacknowledged);
+		connection_receive_window += connection_unacknowledged;
+		connection_unacknowledged = 0;
+	}
+
+	// frames still in flight to a stream that was reset are ignored
+	auto found = streams.find(stream_id);
+	if (found == streams.end())
+	{
+		return true;
+	}
+
+	stream &current = found->second;
+	if (current.remote_closed)
+	{
+		reset(stream_id, http2_error::stream_closed);
+		close(found, false);
+		return true;
+	}
+
+	current.receive_window -= length;
+	if (current.receive_window < 0)
+	{
+		reset(stream_id, http2_error::flow_control_error);
+		close(found, false);
+		return true;
+	}
+
+	if (flags & end_stream_flag)
+	{
+		current.remote_closed = true;
+		return true;
+	}
+
+	current.unacknowledged += length;
+	if (current.unacknowledged >= default_window / 2)
+	{
+		append_window_update(stream_id, current.unacknowledged);
+		current.receive_window += current.unacknowledged;
+		current.unacknowledged = 0;
+	}
+
+	return true;
+}
+
+bool http2_session::handle_headers(uint8_t flags, uint32_t stream_id, const uint8_t *payload, size_t length)
+{
+	if (!stream_id)
+	{
+		fail(http2_error::protocol_error);
+		return false;
+	}
+
+	size_t skipped = 0;
+	size_t padding = 0;
+	if (flags & padded_flag)
+	{
+		if (!length)
+		{
+			fail(http2_error::protocol_error);
+			return false;
+		}
+		padding = payload[0];
+		skipped = 1;
+	}
+	if (flags & priority_flag)
+	{
+		skipped += 5;
+	}
+	if (skipped + padding > length)
+	{
+		fail(http2_error::protocol_error);
+		return false;
+	}
+
+	header_block.assign(reinterpret_cast<const char *>(payload) + skipped, length - skipped - padding);
+	header_stream = stream_id;
+	header_end_stream = flags & end_stream_flag;
+
+	return (flags & end_headers_flag) ? end_header_block() : true;
+}
+
+bool http2_session::end_header_block()
+{
+	uint32_t stream_id = header_stream;
+	header_stream = 0;
+
+	// every block is decoded, even of a stream that is refused, or the tables would fall out of step
+	std::vector<http2_header> fields;
+	if (!decoder.decode(reinterpret_cast<const uint8_t *>(header_block.data()), header_block.size(), fields))
+	{
+		fail(http2_error::compression_error);
+		return false;
+	}
+
+	auto found = streams.find(stream_id);
+	if (found != streams.end())
+	{
+		// trailers end the request body, any other block on an open stream is out of place
+		if (found->second.remote_closed || !header_end_stream)
+		{
+			reset(stream_id, found->second.remote_closed ? http2_error::stream_closed : http2_error::protocol_error);
+			close(found, false);
+			return true;
+		}
+		found->second.remote_closed = true;
+		return true;
+	}
+
+	// streams of the client are odd and opened in increasing order, a lower one is closed already
+	if (!(stream_id & 1) || stream_id <= last_stream)
+	{
+		fail((stream_id & 1) ? http2_error::stream_closed : http2_error::protocol_error);
+		return false;
+	}
+	last_stream = stream_id;
+
+	// after GOAWAY new streams are ignored, the client retries them elsewhere
+	if (goaway_sent || goaway_received)
+	{
+		return true;
+	}
+
+	if (streams.size() >= stream_limit)
+	{
+		reset(stream_id, http2_error::refused_stream);
+		return true;
+	}
+
+	http2_request request;
+	request.stream = stream_id;
+	request.body = !header_end_stream;
+
+	bool valid = true;
+	bool regular = false;
+	bool scheme = false;
+
+	for (http2_header &i: fields)
+	{
+		if (i.name.empty())
+		{
+			valid = false;
+		}
+		else if (i.name[0] == ':')
+		{
+			// pseudo-header fields come first, once each
+			if (regular)
+			{
+				valid = false;
+			}
+			else if (i.name == ":method" && request.method.empty())
+			{
+				request.method = std::move(i.value);
+			}
+			else if (i.name == ":path" && request.path.empty())
+			{
+				request.path = std::move(i.value);
+			}
+			else if (i.name == ":scheme" && !scheme)
+			{
+				scheme = true;
+			}
+			else if (i.name != ":authority")
+			{
+				valid = false;
+			}
+		}
+		else
+		{
+			regular = true;
+
+			if (std::any_of(i.name.begin(), i.name.end(), [](char c) { return c >= 'A' && c <= 'Z'; }) ||
+					is_connection_specific(i.name) || (i.name == "te" && i.value != "trailers"))
+			{
+				valid = false;
+			}
+			else if (i.name == "accept-encoding")
+			{
+				if (!request.accept_encoding.empty())
+				{
+					request.accept_encoding += ", ";
+				}
+				request.accept_encoding += i.value;
+			}
+		}
+	}
+
+	if (!valid || request.method.empty() || request.path.empty() || !scheme)
+	{
+		reset(stream_id, http2_error::protocol_error);
+		return true;
+	}
+
+	stream &opened = streams[stream_id];
+	opened.send_window = peer_initial_window;
+	opened.remote_closed = header_end_stream;
+
+	requests.push_back(std::move(request));
+
+	return true;
+}
+
+bool http2_session::handle_settings(uint8_t flags, uint32_t stream_id, const uint8_t *payload, size_t length)
+{
+	if (stream_id)
+	{
+		fail(http2_error::protocol_error);
+		return false;
+	}
+
+	if (flags & ack_flag)
+	{
+		if (length)
+		{
+			fail(http2_error::frame_size_error);
+			return false;
+		}
+		return true;
+	}
+
+	if (length % 6)
+	{
+		fail(http2_error::frame_size_error);
+		return false;
+	}
+
+	for (size_t i = 0; i != length; i += 6)
+	{
+		if (!apply_setting(static_cast<uint16_t>(payload[i] << 8 | payload[i + 1]), read_uint32(payload + i + 2)))
+		{
+			return false;
+		}
+	}
+
+	append_frame_header(0, settings_frame, ack_flag, 0);
+
+	return true;
+}
+
+bool http2_session::apply_setting(uint16_t identifier, uint32_t value)
+{
+	switch (identifier)
+	{
+	case 0x1:
+		encoder.set_table_size(value);
+		return true;
+
+	case 0x2:
+		if (value > 1)
+		{
+			fail(http2_error::protocol_error);
+			return false;
+		}
+		return true;
+
+	case 0x4:
+		if (value > max_window)
+		{
+			fail(http2_error::flow_control_error);
+			return false;
+		}
+
+		// the change applies to the windows of the open streams as well
+		for (auto &i: streams)
+		{
+			i.second.send_window += static_cast<int64_t>(value) - peer_initial_window;
+			if (i.second.send_window > max_window)
+			{
+				fail(http2_error::flow_control_error);
+				return false;
+			}
+		}
+		peer_initial_window = value;
+		return true;
+
+	case 0x5:
+		if (value < max_frame_size || value > 0xffffff)
+		{
+			fail(http2_error::protocol_error);
+			return false;
+		}
+		peer_frame_size = std::min<size_t>(value, max_sent_frame);
+		return true;
+
+	default:
+		return true;
+	}
+}
+
+bool http2_session::handle_window_update(uint32_t stream_id, const uint8_t *payload, size_t length)
+{
+	if (length != 4)
+	{
+		fail(http2_error::frame_size_error);
+		return false;
+	}
+
+	uint32_t increment = read_uint32(payload) & 0x7fffffff;
+
+	if (!stream_id)
+	{
+		connection_send_window += increment;
+		if (!increment || connection_send_window > max_window)
+		{
+			fail(increment ? http2_error::flow_control_error : http2_error::protocol_error);
+			return false;
+		}
+		return true;
+	}
+
+	if (stream_id > last_stream)
+	{
+		fail(http2_error::protocol_error);
+		return false;
+	}
+
+	auto found = streams.find(stream_id);
+	if (found == streams.end())
+	{
+		return true;
+	}
+
+	found->second.send_window += increment;
+	if (!increment || found->second.send_window > max_window)
+	{
+		reset(stream_id, increment ? http2_error::flow_control_error : http2_error::protocol_error);
+		close(found, false);
+	}
+
+	return true;
+}
+
+void http2_session::encode_head(uint32_t stream_id, std::string_view http1_head, bool end_stream)
+{
+	std::string block;
+	encoder.begin_block(block);
+
+	// the code of the status line, then the fields with their names lowercased and those of HTTP/1 connections left out
+	size_t line_end = http1_head.find("\r\n");
+	std::string_view status_line = http1_head.substr(0, line_end);
+	encoder.encode(":status", status_line.size() >= 12 ? status_line.substr(9, 3) : std::string_view("500"), block);
+
+	std::string name;
+	while (line_end != std::string_view::npos)
+	{
+		size_t line_start = line_end + 2;
+		line_end = http1_head.find("\r\n", line_start);
+		std::string_view line = http1_head.substr(line_start, line_end == std::string_view::npos ? std::string_view::npos :
+				line_end - line_start);
+
+		size_t colon = line.find(':');
+		if (colon == std::string_view::npos || colon == 0)
+		{
+			continue;
+		}
+
+		name.assign(line.substr(0, colon));
+		std::transform(name.begin(), name.end(), name.begin(), [](char c)
+				{
+					return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+				});
+		if (is_connection_specific(name))
+		{
+			continue;
+		}
+
+		size_t value_start = line.find_first_not_of(" \t", colon + 1);
+		encoder.encode(name, value_start == std::string_view::npos ? std::string_view{} : line.substr(value_start), block);
+	}
+
+	// HEADERS, then CONTINUATION frames for what doesn't fit
+	size_t sent = std::min(block.size(), peer_frame_size);
+	append_frame_header(sent, headers_frame, (end_stream ? end_stream_flag : 0) | (sent == block.size() ? end_headers_flag : 0),
+			stream_id);
+	output.append(block, 0, sent);
+
+	while (sent != block.size())
+	{
+		size_t length = std::min(block.size() - sent, peer_frame_size);
+		append_frame_header(length, continuation_frame, sent + length == block.size() ? end_headers_flag : 0, stream_id);
+		output.append(block, sent, length);
+		sent += length;
+	}
+}
+
+bool http2_session::respond(uint32_t stream_id, std::string_view http1_head, int file, off_t offset, size_t length,
+		std::shared_ptr<const void> keeper)
+{
+	auto found = streams.find(stream_id);
+	if (found == streams.end() || found->second.responded || failed)
+	{
+		return false;
+	}
+
+	encode_head(stream_id, http1_head, !length);
+
+	stream &current = found->second;
+	current.responded = true;
+	current.file = file;
+	current.offset = offset;
+	current.left = length;
+	current.keeper = std::move(keeper);
+
+	if (!length)
+	{
+		finish_local(found);
+	}
+
+	return true;
+}
+
+bool http2_session::respond(uint32_t stream_id, std::string_view http1_head, std::string body)
+{
+	auto found = streams.find(stream_id);
+	if (found == streams.end() || found->second.responded || failed)
+	{
+		return false;
+	}
+
+	encode_head(stream_id, http1_head, body.empty());
+
+	stream &current = found->second;
+	current.responded = true;
+	current.left = body.size();
+	current.body = std::move(body);
+
+	if (!current.left)
+	{
+		finish_local(found);
+	}
+
+	return true;
+}
+
+void http2_session::schedule(size_t budget)
+{
+	// bodies wait for the preface of the client, an upgraded one may not read past the 101 response until it has sent it
+	while (!preface_left && !failed && output.size() + scheduled_file_bytes < budget && connection_send_window > 0 && !streams.empty())
+	{
+		// the next stream after the one given a frame last that has a body to send and room in its window
+		auto position = streams.upper_bound(last_scheduled);
+		bool found = false;
+		for (size_t i = 0; i != streams.size(); ++i, ++position)
+		{
+			if (position == streams.end())
+			{
+				position = streams.begin();
+			}
+
+			const stream &candidate = position->second;
+			if (candidate.responded && candidate.left && candidate.send_window > 0)
+			{
+				found = true;
+				break;
+			}
+		}
+
+		if (!found)
+		{
+			break;
+		}
+
+		stream &current = position->second;
+		size_t length = static_cast<size_t>(std::min<int64_t>({ static_cast<int64_t>(std::min<uint64_t>(current.left, peer_frame_size)),
+				current.send_window, connection_send_window }));
+		bool last = (length == current.left);
+
+		append_frame_header(length, data_frame, last ? end_stream_flag : 0, position->first);
+		if (current.file != -1)
+		{
+			file_parts.push_back({ output.size(), current.file, current.offset, length, current.keeper });
+			current.offset += length;
+			scheduled_file_bytes += length;
+		}
+		else
+		{
+			output.append(current.body, current.body_offset, length);
+			current.body_offset += length;
+		}
+
+		current.left -= length;
+		current.sent += length;
+		current.send_window -= length;
+		connection_send_window -= length;
+		last_scheduled = position->first;
+
+		if (last)
+		{
+			finish_local(position);
+		}
+	}
+}
+
+void http2_session::shut_down()
+{
+	if (goaway_sent)
+	{
+		return;
+	}
+
+	append_frame_header(8, goaway_frame, 0, 0);
+	append_uint32(output, last_stream);
+	append_uint32(output, static_cast<uint32_t>(http2_error::no_error));
+
+	goaway_sent = true;
+}
@@ -0,0 +1,389 @@
+#include "logging.h"
+
+#include <cstring>
+#include <ctime>
+#include <string>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+constexpr char async_logger::log_file_err_name[];
+constexpr char async_logger::log_file_log_name[];
+constexpr size_t async_logger::batch_size;
+
+thread_local thread_slot_handle<async_logger::ring, async_logger::max_threads>
+	async_logger::local_ring{ async_logger::instance().rings };
+
+namespace
+{
+	constexpr auto idle_period = std::chrono::milliseconds(5);
+
+	int64_t realtime_ns() noexcept
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		return static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+	}
+
+	void write_all(int fd, const char *data, size_t size) noexcept
+	{
+		while (size)
+		{
+			ssize_t written = write(fd, data, size);
+			if (written == -1)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				return;
+			}
+			data += written;
+			size -= written;
+		}
+	}
+
+	const char *describe_errno(int error_number, char *buffer, size_t buffer_size) noexcept
+	{
+#if (!defined(_GNU_SOURCE) && defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200112L)
+		if (strerror_r(error_number, buffer, buffer_size) != 0)
+		{
+			return "(failed to decipher)";
+		}
+		return buffer;
+#elif defined(_GNU_SOURCE)
+		const char *result = strerror_r(error_number, buffer, buffer_size);
+		return result ? result : "(failed to decipher)";
+#else
+		(void)error_number;
+		(void)buffer;
+		(void)buffer_size;
+		return "(alas impossible to report errno-provided errors)";
+#endif
+	}
+
+	log_record make_record(log_level level, const char *function, const char *file, size_t line,
+			const char *message) noexcept
+	{
+		log_record record;
+		record.timestamp_ns = realtime_ns();
+		record.function = function;
+		record.file = file;
+		record.message = message;
+		record.value = 0;
+		record.line = static_cast<uint32_t>(line);
+		record.error_number = 0;
+		record.level = level;
+		record.has_errno = false;
+		record.has_value = false;
+		record.detail_length = 0;
+		return record;
+	}
+
+	void copy_detail(log_record &record, const char *detail) noexcept
+	{
+		if (!detail)
+		{
+			return;
+		}
+
+		size_t length = strnlen(detail, log_record::detail_capacity);
+		memcpy(record.detail, detail, length);
+		record.detail_length = static_cast<unsigned char>(length);
+	}
+}
+
+void async_logger::batch::add(const log_record &record) noexcept
+{
+	constexpr size_t record_max_length = 1024;
+	if (batch_size - used < record_max_length)
+	{
+		flush();
+	}
+	used += format_log_record(record, buffer + used, batch_size - used);
+}
+
+void async_logger::batch::flush() noexcept
+{
+	if (used && fd != -1)
+	{
+		write_all(fd, buffer, used);
+	}
+	used = 0;
+}
+
+async_logger &async_logger::instance()
+{
+	static async_logger object;
+	return object;
+}
+
+async_logger::~async_logger()
+{
+	stop();
+}
+
+bool async_logger::start(bool truncate) noexcept
+{
+	if (running())
+	{
+		return true;
+	}
+
+	const int flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (truncate ? O_TRUNC : 0);
+	int err_fd = open(log_file_err_name, flags, 0644);
+	int log_fd = open(log_file_log_name, flags, 0644);
+	if (err_fd == -1 || log_fd == -1)
+	{
+		LOG_CERROR("failed to open log files, logging stays synchronous");
+
+		// the one that did open isn't kept
+		if (err_fd != -1)
+		{
+			close(err_fd);
+		}
+		if (log_fd != -1)
+		{
+			close(log_fd);
+		}
+		return false;
+	}
+
+	// the consumer isn't running, the batches are free to take them
+	err_batch.fd = err_fd;
+	log_batch.fd = log_fd;
+
+	stop_requested = false;
+	running_flag.store(true, std::memory_order_release);
+
+	try
+	{
+		consumer = std::thread(&async_logger::consuming_loop, this);
+	}
+	catch (std::exception &e)
+	{
+		running_flag.store(false, std::memory_order_release);
+		close_files();
+		LOG_CERROR_TEXT("failed to launch the logging thread, logging stays synchronous:", e.what());
+		return false;
+	}
+
+	return true;
+}
+
+void async_logger::stop() noexcept
+{
+	if (!consumer.joinable() || consumer.get_id() == std::this_thread::get_id())
+	{
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(consumer_mutex);
+		stop_requested = true;
+	}
+	consumer_condv.notify_one();
+	consumer.join();
+
+	running_flag.store(false, std::memory_order_release);
+	drain();
+	close_files();
+}
+
+void async_logger::close_files() noexcept
+{
+	for (batch *i: { &err_batch, &log_batch })
+	{
+		if (i->fd != -1)
+		{
+			close(i->fd);
+			i->fd = -1;
+		}
+	}
+}
+
+void async_logger::append(const log_record &record) noexcept
+{
+	if (!running())
+	{
+		write_synchronously(record);
+		return;
+	}
+
+	ring *own = local_ring.get();
+	if (!own)
+	{
+		dropped_without_ring.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	own->push(record);
+}
+
+uint64_t async_logger::dropped() const noexcept
+{
+	uint64_t result = dropped_without_ring.load(std::memory_order_relaxed);
+	rings.for_each([&result](const ring &r)
+	{
+		result += r.dropped();
+	});
+	return result;
+}
+
+void async_logger::consuming_loop() noexcept
+{
+	std::unique_lock<std::mutex> lock(consumer_mutex);
+
+	while (!stop_requested)
+	{
+		lock.unlock();
+		size_t drained = drain();
+		lock.lock();
+
+		if (!drained && !stop_requested)
+		{
+			consumer_condv.wait_for(lock, idle_period);
+		}
+	}
+}
+
+size_t async_logger::drain() noexcept
+{
+	size_t drained = 0;
+	uint64_t lost = 0;
+
+	rings.for_each([&](ring &r)
+	{
+		drained += r.consume([&](const log_record &record)
+		{
+			(record.level == log_level::error ? err_batch : log_batch).add(record);
+		});
+		lost += r.take_new_drops();
+	});
+
+	uint64_t dropped = dropped_without_ring.load(std::memory_order_relaxed);
+	lost += dropped - reported_dropped_without_ring;
+	reported_dropped_without_ring = dropped;
+
+	if (lost)
+	{
+		log_record record = make_record(log_level::error, __func__, __FILE__, __LINE__,
+				"log records were dropped because the logging rings were full:");
+		record.value = static_cast<long long>(lost);
+		record.has_value = true;
+		err_batch.add(record);
+	}
+
+	err_batch.flush();
+	log_batch.flush();
+
+	return drained;
+}
+
+void async_logger::write_synchronously(const log_record &record) noexcept
+{
+	constexpr size_t buffer_size = 1024;
+	char buffer[buffer_size];
+
+	size_t length = format_log_record(record, buffer, buffer_size);
+	write_all(STDERR_FILENO, buffer, length);
+}
+
+size_t format_log_record(const log_record &record, char *buffer, size_t buffer_size) noexcept
+{
+	time_t seconds = static_cast<time_t>(record.timestamp_ns / 1000000000);
+	long microseconds = static_cast<long>(record.timestamp_ns % 1000000000 / 1000);
+
+	struct tm broken_down;
+	char timestamp[32] = "";
+	if (localtime_r(&seconds, &broken_down))
+	{
+		strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %T", &broken_down);
+	}
+
+	int length = 0;
+
+	if (record.level == log_level::error)
+	{
+		constexpr size_t errno_buffer_size = 256;
+		char errno_buffer[errno_buffer_size];
+		const char *meaning = record.has_errno
+			? describe_errno(record.error_number, errno_buffer, errno_buffer_size) : nullptr;
+
+		length = snprintf(buffer, buffer_size, "[%s.%06ld] Error in %s (%s, line %u)\n", timestamp, microseconds,
+				record.function, record.file, static_cast<unsigned>(record.line));
+		if (meaning && length >= 0 && static_cast<size_t>(length) < buffer_size)
+		{
+			length += snprintf(buffer + length, buffer_size - length, "errno %d means %s\n",
+					record.error_number, meaning);
+		}
+		if (length >= 0 && static_cast<size_t>(length) < buffer_size)
+		{
+			length += snprintf(buffer + length, buffer_size - length, "Therefore %s", record.message);
+		}
+	}
+	else
+	{
+		length = snprintf(buffer, buffer_size, "[%s.%06ld] %s", timestamp, microseconds, record.message);
+	}
+
+	if (length >= 0 && static_cast<size_t>(length) < buffer_size && record.has_value)
+	{
+		length += snprintf(buffer + length, buffer_size - length, " %lld", record.value);
+	}
+	if (length >= 0 && static_cast<size_t>(length) < buffer_size && record.detail_length)
+	{
+		length += snprintf(buffer + length, buffer_size - length, " %.*s",
+				static_cast<int>(record.detail_length), record.detail);
+	}
+	if (length >= 0 && static_cast<size_t>(length) < buffer_size)
+	{
+		length += snprintf(buffer + length, buffer_size - length, record.level == log_level::error ? "\n\n" : "\n");
+	}
+
+	if (length < 0)
+	{
+		return 0;
+	}
+
+	return (static_cast<size_t>(length) < buffer_size) ? length : buffer_size - 1;
+}
+
+void log_errno(const char *function, const char *file, size_t line, const char *message, int actual_errno) noexcept
+{
+	log_record record = make_record(log_level::error, function, file, line, message);
+	record.error_number = actual_errno;
+	record.has_errno = true;
+
+	async_logger::instance().append(record);
+}
+
+void log_errno(const char *function, const char *file, size_t line, const char *message,
+		int actual_errno, long long value) noexcept
+{
+	log_record record = make_record(log_level::error, function, file, line, message);
+	record.error_number = actual_errno;
+	record.has_errno = true;
+	record.value = value;
+	record.has_value = true;
+
+	async_logger::instance().append(record);
+}
+
+void log_message(log_level level, const char *function, const char *file, size_t line, const char *message,
+		const char *detail) noexcept
+{
+	log_record record = make_record(level, function, file, line, message);
+	copy_detail(record, detail);
+
+	async_logger::instance().append(record);
+}
+
+void log_value(const char *function, const char *file, size_t line, const char *message, long long value) noexcept
+{
+	log_record record = make_record(log_level::info, function, file, line, message);
+	record.value = value;
+	record.has_value = true;
+
+	async_logger::instance().append(record);
+}
@@ -0,0 +1,359 @@
+#include "metrics.h"
+
+#include <cstdio>
+
+constexpr unsigned latency_histogram::sub_bucket_bits;
+constexpr unsigned latency_histogram::max_value_bits;
+constexpr size_t latency_histogram::bucket_count;
+constexpr short thread_metrics::min_status;
+constexpr short thread_metrics::max_status;
+
+thread_local thread_slot_handle<thread_metrics, server_metrics::max_threads>
+	server_metrics::local_slot{ server_metrics::instance().slots };
+
+namespace
+{
+	// Prometheus buckets are every power of two from about a microsecond up to about a minute
+	constexpr unsigned exported_min_bits = 10;
+	constexpr unsigned exported_max_bits = 36;
+
+	const double exported_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+	const char *deadline_names[connection_deadline_count] = { "read_header", "read_body", "write_stall", "keep_alive" };
+
+	void append_format(std::string &destination, const char *format, double value)
+	{
+		char buffer[64];
+		int length = snprintf(buffer, sizeof(buffer), format, value);
+		if (length > 0)
+		{
+			destination.append(buffer, static_cast<size_t>(length) < sizeof(buffer) ? length : sizeof(buffer) - 1);
+		}
+	}
+
+	void append_header(std::string &destination, const char *name, const char *help, const char *type)
+	{
+		destination += "# HELP ";
+		destination += name;
+		destination += ' ';
+		destination += help;
+		destination += "\n# TYPE ";
+		destination += name;
+		destination += ' ';
+		destination += type;
+		destination += '\n';
+	}
+
+	void append_counter(std::string &destination, const char *name, const char *help, uint64_t value)
+	{
+		append_header(destination, name, help, "counter");
+		destination += name;
+		destination += ' ';
+		destination += std::to_string(value);
+		destination += '\n';
+	}
+
+	void append_histogram(std::string &destination, const char *name, const char *help,
+			const latency_histogram::snapshot &histogram)
+	{
+		append_header(destination, name, help, "histogram");
+
+		for (unsigned bits = exported_min_bits; bits <= exported_max_bits; ++bits)
+		{
+			destination += name;
+			destination += "_bucket{le=\"";
+			append_format(destination, "%.9g", static_cast<double>(uint64_t{ 1 } << bits) / 1e9);
+			destination += "\"} ";
+			destination += std::to_string(histogram.count_below(uint64_t{ 1 } << bits));
+			destination += '\n';
+		}
+
+		destination += name;
+		destination += "_bucket{le=\"+Inf\"} ";
+		destination += std::to_string(histogram.count);
+		destination += '\n';
+
+		destination += name;
+		destination += "_sum ";
+		append_format(destination, "%.9g", static_cast<double>(histogram.sum) / 1e9);
+		destination += '\n';
+
+		destination += name;
+		destination += "_count ";
+		destination += std::to_string(histogram.count);
+		destination += '\n';
+
+		// precomputed quantiles of the fine-grained buckets, cheaper for us than histogram_quantile() for Prometheus
+		std::string quantile_name = name;
+		quantile_name += "_quantile";
+		append_header(destination, quantile_name.data(), "Upper bound of the quantile since start", "gauge");
+		for (double i: exported_quantiles)
+		{
+			destination += quantile_name;
+			destination += "{quantile=\"";
+			append_format(destination, "%g", i);
+			destination += "\"} ";
+			append_format(destination, "%.9g", static_cast<double>(histogram.value_at_quantile(i)) / 1e9);
+			destination += '\n';
+		}
+	}
+}
+
+uint64_t latency_histogram::snapshot::value_at_quantile(double quantile) const noexcept
+{
+	if (!count)
+	{
+		return 0;
+	}
+
+	uint64_t rank = static_cast<uint64_t>(quantile * count);
+	if (rank >= count)
+	{
+		rank = count - 1;
+	}
+
+	uint64_t seen = 0;
+	for (size_t i = 0; i != bucket_count; ++i)
+	{
+		seen += buckets[i];
+		if (seen > rank)
+		{
+			return bucket_upper_bound(i);
+		}
+	}
+
+	return bucket_upper_bound(bucket_count - 1);
+}
+
+uint64_t latency_histogram::snapshot::count_below(uint64_t bound) const noexcept
+{
+	uint64_t result = 0;
+
+	for (size_t i = 0; i != bucket_count && bucket_upper_bound(i) <= bound; ++i)
+	{
+		result += buckets[i];
+	}
+
+	return result;
+}
+
+server_metrics &server_metrics::instance()
+{
+	static server_metrics object;
+	return object;
+}
+
+void server_metrics::register_gauge(std::string name, std::string help, gauge_reader reader)
+{
+	std::lock_guard<std::mutex> lock(gauges_mutex);
+	gauges.push_back(gauge{ std::move(name), std::move(help), std::move(reader), "gauge" });
+}
+
+void server_metrics::register_counter(std::string name, std::string help, gauge_reader reader)
+{
+	std::lock_guard<std::mutex> lock(gauges_mutex);
+	gauges.push_back(gauge{ std::move(name), std::move(help), std::move(reader), "counter" });
+}
+
+std::string server_metrics::render_prometheus() const
+{
+	constexpr size_t status_count = thread_metrics::max_status - thread_metrics::min_status + 1;
+
+	std::vector<uint64_t> requests_by_status(status_count);
+	uint64_t bytes_sent = 0;
+	uint64_t connections_accepted = 0;
+	uint64_t accept_errors = 0;
+	uint64_t accept_batches = 0;
+	uint64_t accept_pauses = 0;
+	uint64_t shed_fd_exhausted = 0;
+	uint64_t shed_per_client = 0;
+	uint64_t sendfile_short_writes = 0;
+	uint64_t arena_overflows = 0;
+	uint64_t listing_renders = 0;
+	uint64_t listing_cache_hits = 0;
+	uint64_t path_cache_hits = 0;
+	uint64_t path_cache_misses = 0;
+	uint64_t negative_cache_hits = 0;
+	uint64_t negative_cache_flushes = 0;
+	uint64_t bundle_hits = 0;
+	uint64_t proxied_requests = 0;
+	uint64_t upstream_connects = 0;
+	uint64_t upstream_reuses = 0;
+	uint64_t upstream_failures = 0;
+	uint64_t rate_limited = 0;
+	uint64_t http2_connections = 0;
+	uint64_t http2_streams = 0;
+	uint64_t tls_handshakes = 0;
+	uint64_t tls_resumptions = 0;
+	uint64_t tls_kernel_offloads = 0;
+	uint64_t tls_failures = 0;
+	uint64_t connection_timeouts[connection_deadline_count] = {};
+	int64_t open_connections = 0;
+
+	std::unique_ptr<latency_histogram::snapshot> request_duration{ new latency_histogram::snapshot };
+	std::unique_ptr<latency_histogram::snapshot> open_duration{ new latency_histogram::snapshot };
+	std::unique_ptr<latency_histogram::snapshot> handoff_duration{ new latency_histogram::snapshot };
+	std::unique_ptr<latency_histogram::snapshot> blocking_wait_duration{ new latency_histogram::snapshot };
+
+	auto add = [&](const thread_metrics &m)
+	{
+		for (size_t i = 0; i != status_count; ++i)
+		{
+			requests_by_status[i] += m.requests_by_status[i].load(std::memory_order_relaxed);
+		}
+		bytes_sent += m.bytes_sent.load(std::memory_order_relaxed);
+		connections_accepted += m.connections_accepted.load(std::memory_order_relaxed);
+		accept_errors += m.accept_errors.load(std::memory_order_relaxed);
+		accept_batches += m.accept_batches.load(std::memory_order_relaxed);
+		accept_pauses += m.accept_pauses.load(std::memory_order_relaxed);
+		shed_fd_exhausted += m.shed_fd_exhausted.load(std::memory_order_relaxed);
+		shed_per_client += m.shed_per_client.load(std::memory_order_relaxed);
+		sendfile_short_writes += m.sendfile_short_writes.load(std::memory_order_relaxed);
+		arena_overflows += m.arena_overflows.load(std::memory_order_relaxed);
+		listing_renders += m.listing_renders.load(std::memory_order_relaxed);
+		listing_cache_hits += m.listing_cache_hits.load(std::memory_order_relaxed);
+		path_cache_hits += m.path_cache_hits.load(std::memory_order_relaxed);
+		path_cache_misses += m.path_cache_misses.load(std::memory_order_relaxed);
+		negative_cache_hits += m.negative_cache_hits.load(std::memory_order_relaxed);
+		negative_cache_flushes += m.negative_cache_flushes.load(std::memory_order_relaxed);
+		bundle_hits += m.bundle_hits.load(std::memory_order_relaxed);
+		proxied_requests += m.proxied_requests.load(std::memory_order_relaxed);
+		upstream_connects += m.upstream_connects.load(std::memory_order_relaxed);
+		upstream_reuses += m.upstream_reuses.load(std::memory_order_relaxed);
+		upstream_failures += m.upstream_failures.load(std::memory_order_relaxed);
+		rate_limited += m.rate_limited.load(std::memory_order_relaxed);
+		http2_connections += m.http2_connections.load(std::memory_order_relaxed);
+		http2_streams += m.http2_streams.load(std::memory_order_relaxed);
+		tls_handshakes += m.tls_handshakes.load(std::memory_order_relaxed);
+		tls_resumptions += m.tls_resumptions.load(std::memory_order_relaxed);
+		tls_kernel_offloads += m.tls_kernel_offloads.load(std::memory_order_relaxed);
+		tls_failures += m.tls_failures.load(std::memory_order_relaxed);
+		for (size_t i = 0; i != connection_deadline_count; ++i)
+		{
+			connection_timeouts[i] += m.connection_timeouts[i].load(std::memory_order_relaxed);
+		}
+		open_connections += m.open_connections.load(std::memory_order_relaxed);
+		m.request_duration.add_to(*request_duration);
+		m.open_duration.add_to(*open_duration);
+		m.handoff_duration.add_to(*handoff_duration);
+		m.blocking_wait_duration.add_to(*blocking_wait_duration);
+	};
+
+	slots.for_each(add);
+	add(shared_overflow);
+
+	std::string result;
+	result.reserve(16 * 1024);
+
+	append_header(result, "cpp_server_requests_total", "Requests answered, by status", "counter");
+	for (size_t i = 0; i != status_count; ++i)
+	{
+		if (requests_by_status[i])
+		{
+			result += "cpp_server_requests_total{status=\"";
+			result += std::to_string(i + thread_metrics::min_status);
+			result += "\"} ";
+			result += std::to_string(requests_by_status[i]);
+			result += '\n';
+		}
+	}
+
+	append_counter(result, "cpp_server_sent_bytes_total", "Bytes sent to clients, headers included", bytes_sent);
+	append_counter(result, "cpp_server_connections_accepted_total", "Connections accepted", connections_accepted);
+	append_counter(result, "cpp_server_accept_errors_total", "Failed calls to accept", accept_errors);
+	append_counter(result, "cpp_server_accept_batches_total", "Readiness notifications of the listener drained",
+			accept_batches);
+	append_counter(result, "cpp_server_accept_pauses_total", "Times accepting paused with the connection budget used up",
+			accept_pauses);
+
+	append_header(result, "cpp_server_connections_shed_total", "Connections closed right after accept", "counter");
+	result += "cpp_server_connections_shed_total{reason=\"fd_exhausted\"} ";
+	result += std::to_string(shed_fd_exhausted);
+	result += "\ncpp_server_connections_shed_total{reason=\"per_client_cap\"} ";
+	result += std::to_string(shed_per_client);
+	result += '\n';
+	append_counter(result, "cpp_server_sendfile_short_writes_total", "Calls to sendfile that sent less than asked",
+			sendfile_short_writes);
+	append_counter(result, "cpp_server_arena_overflows_total", "Request allocations beyond the arena of the connection",
+			arena_overflows);
+	append_counter(result, "cpp_server_directory_listing_renders_total", "Directory listings rendered anew", listing_renders);
+	append_counter(result, "cpp_server_directory_listing_cache_hits_total", "Directory listings served from the cache",
+			listing_cache_hits);
+	append_counter(result, "cpp_server_path_cache_hits_total", "Request paths resolved from the cache", path_cache_hits);
+	append_counter(result, "cpp_server_path_cache_misses_total", "Request paths looked up beneath the root", path_cache_misses);
+	append_counter(result, "cpp_server_negative_cache_hits_total", "Requests answered with 404 from the negative cache",
+			negative_cache_hits);
+	append_counter(result, "cpp_server_negative_cache_flushes_total", "Negative cache flushes on changes of the served tree",
+			negative_cache_flushes);
+	append_counter(result, "cpp_server_bundle_hits_total", "Requests served from the static bundle", bundle_hits);
+	append_counter(result, "cpp_server_proxied_requests_total", "Requests forwarded to an upstream", proxied_requests);
+	append_counter(result, "cpp_server_upstream_connects_total", "Connections opened to upstreams", upstream_connects);
+	append_counter(result, "cpp_server_upstream_reuses_total", "Requests sent over a pooled keep-alive upstream connection",
+			upstream_reuses);
+	append_counter(result, "cpp_server_upstream_failures_total", "Upstream connections that failed, closed early or timed out",
+			upstream_failures);
+	append_counter(result, "cpp_server_rate_limited_total", "Requests turned away with 429 over a rate limit", rate_limited);
+	append_counter(result, "cpp_server_http2_connections_total", "Connections switched to HTTP/2", http2_connections);
+	append_counter(result, "cpp_server_http2_streams_total", "Requests served on streams of HTTP/2 connections", http2_streams);
+	append_counter(result, "cpp_server_tls_handshakes_total", "Completed TLS handshakes", tls_handshakes);
+	append_counter(result, "cpp_server_tls_resumed_handshakes_total", "TLS handshakes that resumed a session", tls_resumptions);
+	append_counter(result, "cpp_server_tls_kernel_offloads_total", "TLS connections encrypted by the kernel when sending",
+			tls_kernel_offloads);
+	append_counter(result, "cpp_server_tls_handshake_failures_total", "TLS handshakes that failed or timed out", tls_failures);
+
+	append_header(result, "cpp_server_connection_timeouts_total", "Connections closed on an expired deadline", "counter");
+	for (size_t i = 0; i != connection_deadline_count; ++i)
+	{
+		result += "cpp_server_connection_timeouts_total{deadline=\"";
+		result += deadline_names[i];
+		result += "\"} ";
+		result += std::to_string(connection_timeouts[i]);
+		result += '\n';
+	}
+
+	append_header(result, "cpp_server_open_connections", "Client connections currently open", "gauge");
+	result += "cpp_server_open_connections ";
+	result += std::to_string(open_connections);
+	result += '\n';
+
+	append_histogram(result, "cpp_server_request_duration_seconds", "From accept to the last byte sent",
+			*request_duration);
+	append_histogram(result, "cpp_server_open_duration_seconds", "Opening the file and getting its properties",
+			*open_duration);
+	append_histogram(result, "cpp_server_connection_handoff_seconds", "From accept to a worker taking the connection",
+			*handoff_duration);
+	append_histogram(result, "cpp_server_blocking_queue_wait_seconds", "Jobs waiting for a thread of the blocking pool",
+			*blocking_wait_duration);
+
+	std::lock_guard<std::mutex> lock(gauges_mutex);
+	for (const auto &i: gauges)
+	{
+		append_header(result, i.name.data(), i.help.data(), i.type);
+
+		gauge_values values;
+		try
+		{
+			values = i.reader();
+		}
+		catch (...)
+		{
+			continue;
+		}
+
+		for (const auto &j: values)
+		{
+			result += i.name;
+			if (!j.first.empty())
+			{
+				result += '{';
+				result += j.first;
+				result += '}';
+			}
+			result += ' ';
+			append_format(result, "%.17g", j.second);
+			result += '\n';
+		}
+	}
+
+	return result;
+}
@@ -2,13 +2,15 @@
 
 thread_local stealing_queue<thread_pool::moveable_task> *thread_pool::local_tasks_queue;
 
+thread_local event_loop *thread_pool::local_loop;
+
 thread_local size_t thread_pool::thread_index;
 
 std::unique_ptr<thread_pool> worker_threads;
 
-void initialize_thread_pool()
+void initialize_thread_pool(size_t count, std::vector<unsigned> cpus)
 {
-	worker_threads.reset(new thread_pool);
+	worker_threads.reset(new thread_pool(count, std::move(cpus)));
 }
 
 void terminate_thread_pool()
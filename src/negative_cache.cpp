@@ -0,0 +1,439 @@
+#include "negative_cache.h"
+
+#include <cerrno>
+#include <vector>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "access_log.h"
+#include "logging.h"
+#include "metrics.h"
+
+constexpr size_t negative_cache::shard_count;
+constexpr size_t negative_cache::bloom_bits_per_path;
+
+namespace
+{
+	// changes that may bring something to serve at a path that had nothing
+	constexpr uint32_t watched_events = IN_CREATE | IN_MOVED_TO | IN_ATTRIB;
+
+	constexpr size_t bloom_hashes = 3;
+}
+
+negative_cache &negative_cache::instance()
+{
+	static negative_cache object;
+	return object;
+}
+
+negative_cache::~negative_cache()
+{
+	stop();
+}
+
+bool negative_cache::start(const std::string &directory, size_t capacity, bool use_bloom, double validity_seconds) noexcept
+{
+	if (!capacity)
+	{
+		return true;
+	}
+
+	try
+	{
+		root_path = directory;
+		while (root_path.size() > 1 && root_path.back() == '/')
+		{
+			root_path.pop_back();
+		}
+
+		if (use_bloom)
+		{
+			bloom_words = (capacity * bloom_bits_per_path + 63) / 64;
+			bloom = std::make_unique<std::atomic<uint64_t>[]>(bloom_words);
+		}
+	}
+	catch (std::exception &e)
+	{
+		LOG_CERROR_TEXT("Failed to set up the negative cache, it is disabled:", e.what());
+		return false;
+	}
+
+	validity_ns = static_cast<int64_t>(validity_seconds * 1000000000);
+	shard_capacity = (capacity + shard_count - 1) / shard_count;
+
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (inotify_fd == -1 || stop_fd == -1)
+	{
+		LOG_CERROR("failed to set up inotify, paths not found are known only for the validity of the path cache");
+		return true;
+	}
+
+	try
+	{
+		std::unordered_map<int, std::string> directories;
+		bool complete = watch_tree(directories, std::string());
+		LOG_CLOG_VALUE("Directories watched for the negative cache:", directories.size());
+
+		watcher = std::thread(&negative_cache::watching_loop, this, std::move(directories));
+		watched.store(complete, std::memory_order_release);
+	}
+	catch (std::exception &e)
+	{
+		LOG_CERROR_TEXT("Failed to launch the watching thread, paths not found are known only for the validity of the path cache:",
+				e.what());
+	}
+
+	return true;
+}
+
+void negative_cache::stop() noexcept
+{
+	if (watcher.joinable())
+	{
+		uint64_t one = 1;
+		if (write(stop_fd, &one, sizeof(one)) == sizeof(one))
+		{
+			watcher.join();
+		}
+		else
+		{
+			watcher.detach();
+		}
+	}
+
+	watched.store(false, std::memory_order_release);
+}
+
+bool negative_cache::bloom_may_contain(size_t hash) const noexcept
+{
+	size_t bits = bloom_words * 64;
+	size_t step = (hash >> 32) | 1;
+
+	for (size_t i = 0; i != bloom_hashes; ++i)
+	{
+		size_t bit = (hash + i * step) % bits;
+		if (!(bloom[bit / 64].load(std::memory_order_relaxed) & (uint64_t{ 1 } << (bit % 64))))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void negative_cache::bloom_insert(size_t hash) noexcept
+{
+	size_t bits = bloom_words * 64;
+	size_t step = (hash >> 32) | 1;
+
+	for (size_t i = 0; i != bloom_hashes; ++i)
+	{
+		size_t bit = (hash + i * step) % bits;
+		bloom[bit / 64].fetch_or(uint64_t{ 1 } << (bit % 64), std::memory_order_relaxed);
+	}
+
+	// evicted paths keep their bits, a filter saturated by them would let everything through to the shards;
+	// paths still cached are missed by a cleared filter once and put back as they are looked up again
+	if (bloom_insertions.fetch_add(1, std::memory_order_relaxed) + 1 >= bloom_words * 64 / bloom_bits_per_path * 2)
+	{
+		bloom_clear();
+	}
+}
+
+void negative_cache::bloom_clear() noexcept
+{
+	bloom_insertions.store(0, std::memory_order_relaxed);
+	for (size_t i = 0; i != bloom_words; ++i)
+	{
+		bloom[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+bool negative_cache::fresh(const entry &known, int64_t now) const noexcept
+{
+	return known.generation == generation() &&
+			(watched.load(std::memory_order_acquire) || now - known.recorded_ns < validity_ns);
+}
+
+bool negative_cache::contains(std::string_view relative) noexcept
+{
+	if (!shard_capacity)
+	{
+		return false;
+	}
+
+	size_t hash = path_hash{}(relative);
+	if (bloom && !bloom_may_contain(hash))
+	{
+		return false;
+	}
+
+	shard &own = shard_of(hash);
+	int64_t now = monotonic_now_ns();
+
+	std::lock_guard<std::mutex> lock(own.mutex);
+	auto found = own.entries.find(relative);
+	if (found == own.entries.end())
+	{
+		return false;
+	}
+
+	if (!fresh(found->second, now))
+	{
+		own.recency.unlink(found->second);
+		own.entries.erase(found);
+		return false;
+	}
+
+	own.recency.touch(found->second);
+	server_metrics::instance().local().negative_cache_hits.fetch_add(1, std::memory_order_relaxed);
+
+	return true;
+}
+
+void negative_cache::record(std::string_view relative, uint64_t looked_up_in) noexcept
+{
+	// a lookup that raced with a change of the tree tells nothing about the tree as it is now
+	if (!shard_capacity || looked_up_in != generation())
+	{
+		return;
+	}
+
+	size_t hash = path_hash{}(relative);
+	shard &own = shard_of(hash);
+	int64_t now = monotonic_now_ns();
+
+	try
+	{
+		std::lock_guard<std::mutex> lock(own.mutex);
+
+		auto found = own.entries.find(relative);
+		if (found != own.entries.end())
+		{
+			found->second.generation = looked_up_in;
+			found->second.recorded_ns = now;
+			own.recency.touch(found->second);
+		}
+		else
+		{
+			// the least recently used path goes, unlinked from the list in constant time
+			if (own.entries.size() >= shard_capacity)
+			{
+				entry *oldest = own.recency.least_recent();
+				own.recency.unlink(*oldest);
+				own.entries.erase(own.entries.find(*oldest->path));
+			}
+
+			auto added = own.entries.emplace(std::string(relative), entry{}).first;
+			added->second.generation = looked_up_in;
+			added->second.recorded_ns = now;
+			added->second.path = &added->first;
+			own.recency.push(added->second);
+		}
+	}
+	catch (...)
+	{
+		return;
+	}
+
+	if (bloom)
+	{
+		bloom_insert(hash);
+	}
+}
+
+void negative_cache::forget_all() noexcept
+{
+	// entries of the former generation are stale from here on even before they are erased
+	tree_generation.fetch_add(1, std::memory_order_acq_rel);
+	server_metrics::instance().local().negative_cache_flushes.fetch_add(1, std::memory_order_relaxed);
+
+	if (bloom)
+	{
+		bloom_clear();
+	}
+
+	for (shard &own: shards)
+	{
+		std::lock_guard<std::mutex> lock(own.mutex);
+		own.recency.clear();
+		own.entries.clear();
+	}
+}
+
+bool negative_cache::watch_tree(std::unordered_map<int, std::string> &directories, const std::string &relative) noexcept
+{
+	bool complete = true;
+
+	try
+	{
+		std::vector<std::string> pending{ relative };
+
+		while (!pending.empty())
+		{
+			std::string current = std::move(pending.back());
+			pending.pop_back();
+
+			std::string path = root_path;
+			if (!current.empty())
+			{
+				path += '/';
+				path += current;
+			}
+
+			// the watch comes before the listing, so a subdirectory created in between is either listed or reported
+			int wd = inotify_add_watch(inotify_fd, path.data(), watched_events | IN_ONLYDIR |
+					(current.empty() ? 0 : IN_DONT_FOLLOW));
+			if (wd == -1)
+			{
+				if (errno != ENOENT && errno != ENOTDIR)
+				{
+					LOG_CERROR_TEXT("failed to watch a directory for the negative cache", path.data());
+					complete = false;
+				}
+				continue;
+			}
+			directories[wd] = current;
+
+			DIR *directory = opendir(path.data());
+			if (!directory)
+			{
+				continue;
+			}
+
+			while (struct dirent *entry = readdir(directory))
+			{
+				std::string_view name{ entry->d_name };
+				if (name == "." || name == "..")
+				{
+					continue;
+				}
+
+				bool subdirectory = (entry->d_type == DT_DIR);
+				if (entry->d_type == DT_UNKNOWN)
+				{
+					struct stat status;
+					subdirectory = (fstatat(dirfd(directory), entry->d_name, &status, AT_SYMLINK_NOFOLLOW) == 0 &&
+							S_ISDIR(status.st_mode));
+				}
+
+				if (subdirectory)
+				{
+					pending.push_back(current.empty() ? std::string(name) : current + '/' + entry->d_name);
+				}
+			}
+
+			closedir(directory);
+		}
+	}
+	catch (std::exception &e)
+	{
+		LOG_CERROR_TEXT("Failed to watch the served tree for the negative cache:", e.what());
+		return false;
+	}
+
+	return complete;
+}
+
+void negative_cache::watching_loop(std::unordered_map<int, std::string> directories) noexcept
+{
+	struct pollfd watched_fds[2] = { { inotify_fd, POLLIN, 0 }, { stop_fd, POLLIN, 0 } };
+	alignas(struct inotify_event) char buffer[16 * 1024];
+
+	while (true)
+	{
+		if (poll(watched_fds, 2, -1) == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			LOG_CERROR("poll of inotify failed, paths not found are known only for the validity of the path cache");
+			break;
+		}
+
+		if (watched_fds[1].revents)
+		{
+			break;
+		}
+
+		bool changed = false;
+		bool overflown = false;
+		std::vector<std::string> created;
+
+		ssize_t length;
+		while ((length = read(inotify_fd, buffer, sizeof(buffer))) > 0)
+		{
+			for (char *position = buffer; position < buffer + length; )
+			{
+				const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(position);
+				position += sizeof(struct inotify_event) + event->len;
+
+				if (event->mask & IN_Q_OVERFLOW)
+				{
+					changed = overflown = true;
+					continue;
+				}
+				if (event->mask & IN_IGNORED)
+				{
+					directories.erase(event->wd);
+					continue;
+				}
+				if (!(event->mask & watched_events))
+				{
+					continue;
+				}
+				changed = true;
+
+				// a directory created or moved in is watched together with everything it already has
+				auto parent = directories.find(event->wd);
+				if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)) && event->len &&
+						parent != directories.end())
+				{
+					try
+					{
+						created.push_back(parent->second.empty() ? std::string(event->name) :
+								parent->second + '/' + event->name);
+					}
+					catch (...)
+					{
+						overflown = true;
+					}
+				}
+			}
+		}
+
+		bool complete = true;
+		if (overflown)
+		{
+			// events are lost, directories created meanwhile are found by walking the tree anew
+			complete = watch_tree(directories, std::string());
+		}
+		else
+		{
+			for (const std::string &path: created)
+			{
+				complete = watch_tree(directories, path) && complete;
+			}
+		}
+
+		if (!complete && watched.exchange(false, std::memory_order_acq_rel))
+		{
+			LOG_CERROR("the served tree can't be watched completely, paths not found are known only for the validity of the path cache");
+		}
+
+		if (changed)
+		{
+			forget_all();
+		}
+	}
+
+	watched.store(false, std::memory_order_release);
+}
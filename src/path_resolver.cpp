@@ -0,0 +1,423 @@
+#include "path_resolver.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+#include "logging.h"
+#include "metrics.h"
+#include "negative_cache.h"
+#include "utils.h"
+
+constexpr size_t path_resolver::shard_count;
+
+namespace
+{
+	int hex_value(char c) noexcept
+	{
+		if (c >= '0' && c <= '9')
+		{
+			return c - '0';
+		}
+		if (c >= 'a' && c <= 'f')
+		{
+			return c - 'a' + 10;
+		}
+		if (c >= 'A' && c <= 'F')
+		{
+			return c - 'A' + 10;
+		}
+		return -1;
+	}
+
+	// characters a path segment may carry as they are, everything else is percent-encoded
+	bool is_path_character(char c) noexcept
+	{
+		return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+				strchr("-._~!$&'()*+,;=:@/", c) != nullptr;
+	}
+
+	// errors meaning there is nothing to serve, not worth a line in the log
+	bool expected_miss(int error) noexcept
+	{
+		return error == ENOENT || error == ENOTDIR || error == EACCES || error == EXDEV || error == ELOOP ||
+				error == ENAMETOOLONG || error == EPERM || error == ENXIO;
+	}
+}
+
+resolved_file::resolved_file(int descriptor, const struct stat &properties, std::string location) :
+	fd{ descriptor },
+	status(properties),
+	location_text{ std::move(location) }
+{
+	try
+	{
+		last_modified_text = time_t_to_string(status.st_mtim.tv_sec);
+
+		char tag[48];
+		snprintf(tag, sizeof(tag), "\"%llx.%lx-%llx\"", static_cast<unsigned long long>(status.st_mtim.tv_sec),
+				static_cast<long>(status.st_mtim.tv_nsec), static_cast<unsigned long long>(status.st_size));
+		etag_text = tag;
+
+		if (!directory())
+		{
+			// the descriptor of this process is named rather than the path, so nothing of the request reaches the shell
+			char command[96];
+			snprintf(command, sizeof(command), "file -L --brief --mime /proc/%d/fd/%d", static_cast<int>(getpid()), fd);
+
+			mime = popen_reader(command);
+			if (!mime.empty() && mime.back() == '\n')
+			{
+				mime.pop_back();
+			}
+		}
+	}
+	catch (...)
+	{
+		close(fd);
+		throw;
+	}
+}
+
+resolved_file::~resolved_file()
+{
+	if (close(fd) == -1)
+	{
+		LOG_CERROR_VALUE("failed to close a resolved file with descriptor", fd);
+	}
+}
+
+bool resolved_file::same_as(const struct stat &other) const noexcept
+{
+	return other.st_ino == status.st_ino && other.st_dev == status.st_dev && other.st_size == status.st_size &&
+			other.st_mtim.tv_sec == status.st_mtim.tv_sec && other.st_mtim.tv_nsec == status.st_mtim.tv_nsec &&
+			other.st_ctim.tv_sec == status.st_ctim.tv_sec && other.st_ctim.tv_nsec == status.st_ctim.tv_nsec;
+}
+
+path_resolver &path_resolver::instance()
+{
+	static path_resolver object;
+	return object;
+}
+
+bool path_resolver::open_root(const std::string &directory, size_t capacity, double validity_seconds) noexcept
+{
+	root_fd = open(directory.data(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (root_fd == -1)
+	{
+		LOG_CERROR_TEXT("Failed to open the served directory", directory.data());
+		return false;
+	}
+
+	try
+	{
+		root_path = directory;
+		while (root_path.size() > 1 && root_path.back() == '/')
+		{
+			root_path.pop_back();
+		}
+	}
+	catch (...)
+	{
+		return false;
+	}
+
+	shard_capacity = (capacity + shard_count - 1) / shard_count;
+	validity_ns = static_cast<int64_t>(validity_seconds * 1000000000);
+
+	return true;
+}
+
+bool path_resolver::normalize(std::string_view url_path, std::pmr::string &relative)
+{
+	relative.clear();
+
+	size_t i = 0;
+	while (i != url_path.size())
+	{
+		if (url_path[i] == '/')
+		{
+			++i;
+			continue;
+		}
+
+		size_t mark = relative.size();
+		if (!relative.empty())
+		{
+			relative += '/';
+		}
+		size_t segment = relative.size();
+
+		while (i != url_path.size() && url_path[i] != '/')
+		{
+			char c = url_path[i++];
+			if (c == '%')
+			{
+				int high = (i < url_path.size()) ? hex_value(url_path[i]) : -1;
+				int low = (i + 1 < url_path.size()) ? hex_value(url_path[i + 1]) : -1;
+				if (high == -1 || low == -1)
+				{
+					return false;
+				}
+				c = static_cast<char>(high << 4 | low);
+				if (c == '/' || c == '\0')
+				{
+					return false;
+				}
+				i += 2;
+			}
+			relative += c;
+		}
+
+		std::string_view name = std::string_view(relative).substr(segment);
+		if (name == ".")
+		{
+			relative.resize(mark);
+		}
+		else if (name == "..")
+		{
+			if (mark == 0)
+			{
+				return false;
+			}
+			relative.resize(mark);
+
+			size_t parent = relative.rfind('/');
+			relative.resize(parent == std::pmr::string::npos ? 0 : parent);
+		}
+	}
+
+	return true;
+}
+
+void path_resolver::append_encoded(std::string &destination, std::string_view relative)
+{
+	static constexpr char digits[] = "0123456789ABCDEF";
+
+	for (char c: relative)
+	{
+		if (is_path_character(c))
+		{
+			destination += c;
+		}
+		else
+		{
+			destination += '%';
+			destination += digits[static_cast<unsigned char>(c) >> 4];
+			destination += digits[static_cast<unsigned char>(c) & 0x0f];
+		}
+	}
+}
+
+int path_resolver::open_beneath(const char *relative, int flags) noexcept
+{
+	const char *path = *relative ? relative : ".";
+
+	if (beneath_supported.load(std::memory_order_relaxed))
+	{
+		struct open_how how{};
+		how.flags = static_cast<uint64_t>(flags);
+		how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+
+		long result = syscall(SYS_openat2, root_fd, path, &how, sizeof(how));
+		if (result != -1 || errno != ENOSYS)
+		{
+			return static_cast<int>(result);
+		}
+
+		beneath_supported.store(false, std::memory_order_relaxed);
+		LOG_CERROR_TEXT("openat2 isn't supported by the kernel, symlinks under the root may lead outside of it", nullptr);
+	}
+
+	// the normalized path has no dot-dot segments, only symlinks aren't confined here
+	return openat(root_fd, path, flags);
+}
+
+std::shared_ptr<const resolved_file> path_resolver::load(const std::pmr::string &relative, uint64_t generation)
+{
+	// non-blocking, so a FIFO under the root can't hang the open
+	int fd = open_beneath(relative.data(), O_RDONLY | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+	if (fd == -1)
+	{
+		// running out of descriptors or memory says nothing about the path
+		if (expected_miss(errno))
+		{
+			negative_cache::instance().record(relative, generation);
+		}
+		else
+		{
+			LOG_CERROR_TEXT("Failed to open a requested path", relative.data());
+		}
+		return nullptr;
+	}
+
+	struct stat status;
+	if (fstat(fd, &status) == -1)
+	{
+		close(fd);
+		return nullptr;
+	}
+	if (!S_ISREG(status.st_mode) && !S_ISDIR(status.st_mode))
+	{
+		close(fd);
+		negative_cache::instance().record(relative, generation);
+		return nullptr;
+	}
+
+	std::string location;
+	location.reserve(root_path.size() + 1 + relative.size());
+	location += root_path;
+	if (!relative.empty())
+	{
+		location += '/';
+		location += relative;
+	}
+
+	return std::make_shared<const resolved_file>(fd, status, std::move(location));
+}
+
+bool path_resolver::still_valid(const resolved_file &file, const std::pmr::string &relative) noexcept
+{
+	int fd = open_beneath(relative.data(), O_PATH | O_CLOEXEC);
+	if (fd == -1)
+	{
+		return false;
+	}
+
+	struct stat status;
+	bool same = (fstat(fd, &status) == 0 && file.same_as(status));
+	close(fd);
+
+	return same;
+}
+
+void path_resolver::store(shard &own, const std::pmr::string &relative, std::shared_ptr<const resolved_file> file,
+		int64_t now)
+{
+	std::lock_guard<std::mutex> lock(own.mutex);
+
+	auto found = own.entries.find(std::string_view(relative));
+	if (found != own.entries.end())
+	{
+		found->second.file = std::move(file);
+		found->second.validated_ns = now;
+		++found->second.requests;
+		own.recency.touch(found->second);
+		return;
+	}
+
+	// the least recently used file goes, unlinked from the list in constant time
+	if (own.entries.size() >= shard_capacity)
+	{
+		entry *oldest = own.recency.least_recent();
+		own.recency.unlink(*oldest);
+		own.entries.erase(own.entries.find(*oldest->path));
+	}
+
+	auto added = own.entries.emplace(std::string(relative), entry{}).first;
+	added->second.file = std::move(file);
+	added->second.validated_ns = now;
+	added->second.requests = 1;
+	added->second.path = &added->first;
+	own.recency.push(added->second);
+}
+
+std::shared_ptr<const resolved_file> path_resolver::resolve(const std::pmr::string &relative)
+{
+	// taken before the filesystem is looked at, a change of the tree meanwhile keeps the path out of the negative cache
+	uint64_t generation = negative_cache::instance().generation();
+
+	if (!shard_capacity)
+	{
+		server_metrics::instance().local().path_cache_misses.fetch_add(1, std::memory_order_relaxed);
+		return load(relative, generation);
+	}
+
+	shard &own = shard_of(relative);
+	int64_t now = monotonic_now_ns();
+
+	std::shared_ptr<const resolved_file> cached;
+	bool fresh = false;
+	{
+		std::lock_guard<std::mutex> lock(own.mutex);
+		auto found = own.entries.find(std::string_view(relative));
+		if (found != own.entries.end())
+		{
+			own.recency.touch(found->second);
+			++found->second.requests;
+			cached = found->second.file;
+			fresh = (now - found->second.validated_ns < validity_ns);
+		}
+	}
+
+	if (cached && (fresh || still_valid(*cached, relative)))
+	{
+		if (!fresh)
+		{
+			std::lock_guard<std::mutex> lock(own.mutex);
+			auto found = own.entries.find(std::string_view(relative));
+			if (found != own.entries.end() && found->second.file == cached)
+			{
+				found->second.validated_ns = now;
+			}
+		}
+
+		server_metrics::instance().local().path_cache_hits.fetch_add(1, std::memory_order_relaxed);
+		return cached;
+	}
+
+	server_metrics::instance().local().path_cache_misses.fetch_add(1, std::memory_order_relaxed);
+
+	std::shared_ptr<const resolved_file> loaded = load(relative, generation);
+	if (loaded)
+	{
+		store(own, relative, loaded, now);
+	}
+	else if (cached)
+	{
+		std::lock_guard<std::mutex> lock(own.mutex);
+		auto found = own.entries.find(std::string_view(relative));
+		if (found != own.entries.end() && found->second.file == cached)
+		{
+			own.recency.unlink(found->second);
+			own.entries.erase(found);
+		}
+	}
+
+	return loaded;
+}
+
+std::vector<std::string> path_resolver::hottest(size_t count) const
+{
+	std::vector<std::pair<uint64_t, std::string>> counted;
+
+	for (const shard &own: shards)
+	{
+		std::lock_guard<std::mutex> lock(own.mutex);
+		for (const auto &[path, known]: own.entries)
+		{
+			counted.emplace_back(known.requests, path);
+		}
+	}
+
+	count = std::min(count, counted.size());
+	std::partial_sort(counted.begin(), counted.begin() + count, counted.end(), [](const auto &left, const auto &right)
+			{
+				return left.first > right.first;
+			});
+
+	std::vector<std::string> result;
+	result.reserve(count);
+	for (size_t i = 0; i != count; ++i)
+	{
+		result.push_back(std::move(counted[i].second));
+	}
+
+	return result;
+}
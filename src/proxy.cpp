@@ -0,0 +1,862 @@
+#include "proxy.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "access_log.h"
+#include "logging.h"
+#include "path_resolver.h"
+
+constexpr size_t upstream_connection::buffer_size;
+constexpr size_t reverse_proxy::pipe_capacity;
+constexpr int64_t reverse_proxy::down_for_ns;
+constexpr int64_t reverse_proxy::max_idle_ns;
+constexpr size_t reverse_proxy::max_cached_pipes;
+
+namespace
+{
+	bool same_name(std::string_view a, std::string_view b) noexcept
+	{
+		return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y)
+				{
+					return (x | 0x20) == (y | 0x20);
+				});
+	}
+
+	std::string_view trimmed(std::string_view value) noexcept
+	{
+		while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+		{
+			value.remove_prefix(1);
+		}
+		while (!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+		{
+			value.remove_suffix(1);
+		}
+		return value;
+	}
+
+	// the next line of the head without its line break, empty at the blank line
+	std::string_view next_line(std::string_view head, size_t &position) noexcept
+	{
+		size_t end = head.find('\n', position);
+		if (end == std::string_view::npos)
+		{
+			end = head.size();
+		}
+
+		std::string_view line = head.substr(position, end - position);
+		position = (end == head.size()) ? end : end + 1;
+
+		if (!line.empty() && line.back() == '\r')
+		{
+			line.remove_suffix(1);
+		}
+		return line;
+	}
+
+	// headers of one connection that the other side of the proxy mustn't see
+	bool is_hop_by_hop(std::string_view name) noexcept
+	{
+		static constexpr std::string_view names[] =
+		{
+			"Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer", "Transfer-Encoding", "Upgrade", "Expect"
+		};
+
+		return std::any_of(std::begin(names), std::end(names), [name](std::string_view i)
+				{
+					return same_name(name, i);
+				});
+	}
+
+	// true if the comma-separated list has the token
+	bool has_token(std::string_view list, std::string_view token) noexcept
+	{
+		while (!list.empty())
+		{
+			size_t comma = list.find(',');
+			if (same_name(trimmed(list.substr(0, comma)), token))
+			{
+				return true;
+			}
+			list = (comma == std::string_view::npos) ? std::string_view{} : list.substr(comma + 1);
+		}
+		return false;
+	}
+
+	// the next line of a body being received, without its line break; false if a line doesn't fit the buffer
+	subtask receive_line(async_socket &from, int64_t timeout_ms, char *buffer, size_t size, size_t &start, size_t &end,
+			std::string_view &line)
+	{
+		const char *found;
+		while (!(found = static_cast<const char *>(memchr(buffer + start, '\n', end - start))))
+		{
+			memmove(buffer, buffer + start, end - start);
+			end -= start;
+			start = 0;
+			if (end == size)
+			{
+				co_return false;
+			}
+
+			from.expect(timeout_ms);
+			ssize_t received = co_await from.recv(buffer + end, size - end);
+			if (received <= 0)
+			{
+				co_return false;
+			}
+			end += received;
+		}
+
+		line = std::string_view(buffer + start, found - buffer - start);
+		start = found - buffer + 1;
+		if (!line.empty() && line.back() == '\r')
+		{
+			line.remove_suffix(1);
+		}
+		co_return true;
+	}
+
+	// the hexadecimal size at the beginning of a chunk line, extensions after it ignored
+	bool parse_chunk_size(std::string_view line, uint64_t &size) noexcept
+	{
+		size_t digits = 0;
+		size = 0;
+		for (; digits != line.size() && digits != 16; ++digits)
+		{
+			char c = line[digits] | 0x20;
+			int value = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+			if (value == -1)
+			{
+				break;
+			}
+			size = size * 16 + value;
+		}
+
+		return digits != 0 && digits != 16 && (digits == line.size() || line[digits] == ';' || line[digits] == ' ' ||
+				line[digits] == '\t');
+	}
+}
+
+reverse_proxy &reverse_proxy::instance()
+{
+	static reverse_proxy object;
+	return object;
+}
+
+reverse_proxy::worker_state &reverse_proxy::local()
+{
+	static thread_local worker_state state;
+	return state;
+}
+
+void upstream_retirement::operator()(upstream_connection *connection) const noexcept
+{
+	connection->loop.retire([](void *retired)
+			{
+				delete static_cast<upstream_connection *>(retired);
+			}, connection);
+}
+
+reverse_proxy::worker_state::~worker_state()
+{
+	for (pipe_pair &i: pipes)
+	{
+		close(i.read_end);
+		close(i.write_end);
+	}
+}
+
+size_t reverse_proxy::add_upstream(const std::string &name)
+{
+	for (size_t i = 0; i != upstreams.size(); ++i)
+	{
+		if (upstreams[i]->name == name)
+		{
+			return i;
+		}
+	}
+
+	size_t colon = name.rfind(':');
+	if (colon == std::string::npos || colon == 0 || colon + 1 == name.size())
+	{
+		throw std::runtime_error("an upstream is host:port");
+	}
+
+	std::string host = name.substr(0, colon);
+	std::string port = name.substr(colon + 1);
+	if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+	{
+		host = host.substr(1, host.size() - 2);
+	}
+
+	struct addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	hints.ai_flags = AI_NUMERICSERV;
+
+	struct addrinfo *found = nullptr;
+	if (getaddrinfo(host.data(), port.data(), &hints, &found) != 0 || !found)
+	{
+		throw std::runtime_error("an upstream can't be resolved");
+	}
+
+	std::unique_ptr<upstream> added{ new upstream };
+	added->name = name;
+	memcpy(&added->address, found->ai_addr, found->ai_addrlen);
+	added->length = found->ai_addrlen;
+	freeaddrinfo(found);
+
+	upstreams.push_back(std::move(added));
+	return upstreams.size() - 1;
+}
+
+bool reverse_proxy::configure(const std::vector<std::string> &specifications, size_t idle_per_upstream) noexcept
+{
+	idle_limit = idle_per_upstream;
+
+	for (const std::string &i: specifications)
+	{
+		try
+		{
+			size_t equals = i.find('=');
+			if (equals == std::string::npos || equals == 0 || i[0] != '/')
+			{
+				throw std::runtime_error("a proxied prefix is /path=host:port[,host:port...]");
+			}
+
+			// kept as the request paths are matched, normalized with a leading slash
+			std::pmr::string relative;
+			if (!path_resolver::normalize(std::string_view(i).substr(0, equals), relative))
+			{
+				throw std::runtime_error("a proxied prefix is a path beneath the root");
+			}
+
+			proxy_route route;
+			route.prefix = "/";
+			route.prefix.append(relative);
+
+			std::string_view list = std::string_view(i).substr(equals + 1);
+			while (!list.empty())
+			{
+				size_t comma = list.find(',');
+				std::string_view name = trimmed(list.substr(0, comma));
+				if (!name.empty())
+				{
+					route.upstreams.push_back(add_upstream(std::string(name)));
+				}
+				list = (comma == std::string_view::npos) ? std::string_view{} : list.substr(comma + 1);
+			}
+
+			if (route.upstreams.empty())
+			{
+				throw std::runtime_error("a proxied prefix has no upstream");
+			}
+
+			routes.push_back(std::move(route));
+		}
+		catch (std::exception &e)
+		{
+			LOG_CERROR_TEXT("Failed to configure a proxied prefix:", e.what());
+			LOG_CERROR_TEXT("The proxied prefix is", i.data());
+			return false;
+		}
+	}
+
+	std::stable_sort(routes.begin(), routes.end(), [](const proxy_route &a, const proxy_route &b)
+			{
+				return a.prefix.size() > b.prefix.size();
+			});
+	for (size_t i = 0; i != routes.size(); ++i)
+	{
+		routes[i].index = i;
+	}
+
+	if (!routes.empty())
+	{
+		LOG_CLOG_VALUE("Prefixes forwarded to upstreams:", routes.size());
+		LOG_CLOG_VALUE("Upstreams the prefixes are balanced across:", upstreams.size());
+	}
+
+	return true;
+}
+
+const proxy_route *reverse_proxy::match(std::string_view path, std::pmr::string &normalized) const noexcept
+{
+	if (routes.empty())
+	{
+		return nullptr;
+	}
+
+	try
+	{
+		std::pmr::string relative(normalized.get_allocator());
+		if (!path_resolver::normalize(path, relative))
+		{
+			return nullptr;
+		}
+
+		normalized.assign("/");
+		normalized.append(relative);
+		if (!relative.empty() && path.back() == '/')
+		{
+			normalized += '/';
+		}
+	}
+	catch (std::bad_alloc &)
+	{
+		return nullptr;
+	}
+
+	path = std::string_view(normalized);
+	for (const proxy_route &i: routes)
+	{
+		if (i.prefix == "/")
+		{
+			return &i;
+		}
+		if (path.compare(0, i.prefix.size(), i.prefix) == 0 && (path.size() == i.prefix.size() || path[i.prefix.size()] == '/'))
+		{
+			return &i;
+		}
+	}
+
+	return nullptr;
+}
+
+upstream_pointer reverse_proxy::acquire(const proxy_route &route, event_loop &loop) noexcept
+{
+	try
+	{
+		worker_state &state = local();
+		if (state.idle.size() < upstreams.size())
+		{
+			state.idle.resize(upstreams.size());
+		}
+		if (state.cursors.size() < routes.size())
+		{
+			state.cursors.resize(routes.size());
+		}
+
+		// round robin over the upstreams that are up, over all of them if none is
+		int64_t now = monotonic_now_ns();
+		size_t &cursor = state.cursors[route.index];
+		size_t count = route.upstreams.size();
+		size_t chosen = route.upstreams[cursor % count];
+
+		for (size_t i = 0; i != count; ++i)
+		{
+			size_t candidate = route.upstreams[(cursor + i) % count];
+			if (upstreams[candidate]->down_until_ns.load(std::memory_order_relaxed) <= now)
+			{
+				chosen = candidate;
+				cursor += i;
+				break;
+			}
+		}
+		++cursor;
+
+		// the most recently used first, a connection the upstream has closed meanwhile is readable
+		std::vector<upstream_pointer> &idle = state.idle[chosen];
+		while (!idle.empty())
+		{
+			upstream_pointer connection = std::move(idle.back());
+			idle.pop_back();
+
+			char byte;
+			if (now - connection->idle_since_ns < max_idle_ns && recv(connection->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == -1 &&
+					(errno == EAGAIN || errno == EWOULDBLOCK))
+			{
+				connection->reused = true;
+				return connection;
+			}
+		}
+
+		int fd = socket(upstreams[chosen]->address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+		if (fd == -1)
+		{
+			LOG_CERROR_TEXT("Failed to open a socket to an upstream", upstreams[chosen]->name.data());
+			return nullptr;
+		}
+
+		// heads are small writes answered by the upstream, Nagle would hold them back
+		int yes = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+		upstream_pointer connection{ new upstream_connection(loop, fd, chosen) };
+		if (!connection->socket.attach(fd))
+		{
+			return nullptr;
+		}
+
+		return connection;
+	}
+	catch (std::exception &e)
+	{
+		LOG_CERROR_TEXT("Failed to get a connection to an upstream:", e.what());
+	}
+
+	return nullptr;
+}
+
+void reverse_proxy::mark_down(size_t upstream) noexcept
+{
+	upstreams[upstream]->down_until_ns.store(monotonic_now_ns() + down_for_ns, std::memory_order_relaxed);
+}
+
+void reverse_proxy::release(upstream_pointer connection) noexcept
+{
+	worker_state &state = local();
+	if (state.draining || !connection->connected || connection->upstream >= state.idle.size())
+	{
+		return;
+	}
+
+	int64_t now = monotonic_now_ns();
+	std::vector<upstream_pointer> &idle = state.idle[connection->upstream];
+
+	// the oldest are at the front
+	auto fresh = std::find_if(idle.begin(), idle.end(), [now](const upstream_pointer &i)
+			{
+				return now - i->idle_since_ns < max_idle_ns;
+			});
+	idle.erase(idle.begin(), fresh);
+
+	if (idle.size() >= idle_limit)
+	{
+		return;
+	}
+
+	try
+	{
+		connection->socket.relax();
+		connection->idle_since_ns = now;
+		idle.push_back(std::move(connection));
+	}
+	catch (std::bad_alloc &)
+	{}
+}
+
+pipe_pair reverse_proxy::take_pipe() noexcept
+{
+	worker_state &state = local();
+	pipe_pair pipe;
+
+	if (!state.pipes.empty())
+	{
+		pipe = state.pipes.back();
+		state.pipes.pop_back();
+		return pipe;
+	}
+
+	int ends[2];
+	if (pipe2(ends, O_NONBLOCK | O_CLOEXEC) == 0)
+	{
+		pipe.read_end = ends[0];
+		pipe.write_end = ends[1];
+	}
+
+	return pipe;
+}
+
+void reverse_proxy::give_back(pipe_pair pipe, bool empty) noexcept
+{
+	if (!pipe)
+	{
+		return;
+	}
+
+	worker_state &state = local();
+	if (empty && !state.draining && state.pipes.size() < max_cached_pipes)
+	{
+		try
+		{
+			state.pipes.push_back(pipe);
+			return;
+		}
+		catch (std::bad_alloc &)
+		{}
+	}
+
+	close(pipe.read_end);
+	close(pipe.write_end);
+}
+
+void reverse_proxy::drain_local() noexcept
+{
+	worker_state &state = local();
+	state.draining = true;
+	state.idle.clear();
+
+	for (pipe_pair &i: state.pipes)
+	{
+		close(i.read_end);
+		close(i.write_end);
+	}
+	state.pipes.clear();
+}
+
+void reverse_proxy::forward_request_head(std::string_view head, std::string_view normalized, const struct sockaddr_storage &client,
+		std::string &destination)
+{
+	char address[INET6_ADDRSTRLEN] = "unknown";
+	if (client.ss_family == AF_INET)
+	{
+		inet_ntop(AF_INET, &reinterpret_cast<const struct sockaddr_in &>(client).sin_addr, address, sizeof(address));
+	}
+	else if (client.ss_family == AF_INET6)
+	{
+		inet_ntop(AF_INET6, &reinterpret_cast<const struct sockaddr_in6 &>(client).sin6_addr, address, sizeof(address));
+	}
+
+	size_t position = 0;
+	std::string_view request_line = next_line(head, position);
+
+	// the method, the path as it was matched and whatever query came after the original one
+	size_t space = request_line.find(' ');
+	destination += request_line.substr(0, space + 1);
+	path_resolver::append_encoded(destination, normalized);
+
+	std::string_view target = request_line.substr(space + 1);
+	target = target.substr(0, target.find(' '));
+	size_t query = target.find('?');
+	if (query != std::string_view::npos)
+	{
+		destination += target.substr(query);
+	}
+	destination += " HTTP/1.0\r\n";
+
+	bool forwarded_for = false;
+	bool dropping = false;
+
+	for (std::string_view line = next_line(head, position); !line.empty(); line = next_line(head, position))
+	{
+		// a folded line continues the header above it
+		if (line.front() == ' ' || line.front() == '\t')
+		{
+			if (!dropping)
+			{
+				destination += line;
+				destination += "\r\n";
+			}
+			continue;
+		}
+
+		std::string_view name = line.substr(0, line.find(':'));
+		dropping = is_hop_by_hop(name);
+		if (dropping)
+		{
+			continue;
+		}
+
+		destination += line;
+		if (same_name(name, "X-Forwarded-For"))
+		{
+			destination += ", ";
+			destination += address;
+			forwarded_for = true;
+		}
+		destination += "\r\n";
+	}
+
+	if (!forwarded_for)
+	{
+		destination += "X-Forwarded-For: ";
+		destination += address;
+		destination += "\r\n";
+	}
+	destination += "Connection: keep-alive\r\n\r\n";
+}
+
+bool reverse_proxy::parse_content_length(std::string_view value, uint64_t &length) noexcept
+{
+	if (value.empty() || value.size() > 18)
+	{
+		return false;
+	}
+
+	length = 0;
+	for (char c: value)
+	{
+		if (c < '0' || c > '9')
+		{
+			return false;
+		}
+		length = length * 10 + (c - '0');
+	}
+	return true;
+}
+
+size_t reverse_proxy::response_head_length(const char *data, size_t size) noexcept
+{
+	std::string_view received(data, size);
+
+	size_t blank = received.find("\n\r\n");
+	size_t bare = received.find("\n\n");
+	if (blank != std::string_view::npos && (bare == std::string_view::npos || blank < bare))
+	{
+		return blank + 3;
+	}
+	if (bare != std::string_view::npos)
+	{
+		return bare + 2;
+	}
+	return 0;
+}
+
+bool reverse_proxy::parse_response_head(std::string_view head, bool head_request, upstream_response &response) noexcept
+{
+	size_t position = 0;
+	std::string_view status_line = next_line(head, position);
+
+	// HTTP/x.y SSS, the reason phrase may be empty
+	if (status_line.size() < 12 || status_line.compare(0, 5, "HTTP/") != 0 || status_line[8] != ' ' ||
+			!std::all_of(status_line.begin() + 9, status_line.begin() + 12, [](char c) { return c >= '0' && c <= '9'; }))
+	{
+		return false;
+	}
+
+	bool http11 = status_line.compare(5, 3, "1.0") != 0;
+	response.status = static_cast<short>((status_line[9] - '0') * 100 + (status_line[10] - '0') * 10 + (status_line[11] - '0'));
+
+	bool close_requested = false;
+	bool keep_alive_offered = false;
+	bool length_declared = false;
+
+	for (std::string_view line = next_line(head, position); !line.empty(); line = next_line(head, position))
+	{
+		size_t colon = line.find(':');
+		if (colon == std::string_view::npos)
+		{
+			continue;
+		}
+
+		std::string_view name = line.substr(0, colon);
+		std::string_view value = trimmed(line.substr(colon + 1));
+
+		if (same_name(name, "Content-Length"))
+		{
+			uint64_t length = 0;
+
+			// differing lengths leave the end of the body unknown
+			if (!parse_content_length(value, length) || (length_declared && length != response.content_length))
+			{
+				return false;
+			}
+			response.content_length = length;
+			length_declared = true;
+		}
+		else if (same_name(name, "Transfer-Encoding"))
+		{
+			response.chunked = response.chunked || !same_name(value, "identity");
+		}
+		else if (same_name(name, "Connection"))
+		{
+			close_requested = close_requested || has_token(value, "close");
+			keep_alive_offered = keep_alive_offered || has_token(value, "keep-alive");
+		}
+	}
+
+	// a length beside the chunks is either ignored or trusted further on, depending on who reads it
+	if (response.chunked && length_declared)
+	{
+		return false;
+	}
+
+	bool bodiless = head_request || response.status == 204 || response.status == 304;
+	response.length_known = bodiless || length_declared;
+	if (bodiless)
+	{
+		response.content_length = 0;
+		response.chunked = false;
+	}
+
+	response.reusable = !close_requested && (http11 || keep_alive_offered) && (response.length_known || response.chunked);
+
+	return response.status >= 200;
+}
+
+void reverse_proxy::forward_response_head(std::string_view head, bool keep_alive, std::string &destination)
+{
+	size_t position = 0;
+	std::string_view status_line = next_line(head, position);
+
+	destination += "HTTP/1.0";
+	destination += status_line.substr(8);
+	destination += "\r\n";
+
+	bool dropping = false;
+
+	for (std::string_view line = next_line(head, position); !line.empty(); line = next_line(head, position))
+	{
+		if (line.front() == ' ' || line.front() == '\t')
+		{
+			if (!dropping)
+			{
+				destination += line;
+				destination += "\r\n";
+			}
+			continue;
+		}
+
+		dropping = is_hop_by_hop(line.substr(0, line.find(':')));
+		if (!dropping)
+		{
+			destination += line;
+			destination += "\r\n";
+		}
+	}
+
+	if (keep_alive)
+	{
+		destination += "Connection: keep-alive\r\n";
+	}
+	destination += "\r\n";
+}
+
+subtask send_all(async_socket &to, const char *data, size_t size, int64_t timeout_ms)
+{
+	for (size_t sent = 0; sent != size; )
+	{
+		to.expect(timeout_ms);
+		ssize_t written = co_await to.send(data + sent, size - sent);
+		if (written <= 0)
+		{
+			co_return false;
+		}
+		sent += written;
+	}
+
+	co_return true;
+}
+
+subtask relay(async_socket &from, int64_t read_timeout_ms, async_socket &to, int64_t write_timeout_ms, pipe_pair pipe,
+		char *buffer, size_t buffer_size, uint64_t length, bool to_end, uint64_t &moved)
+{
+	size_t chunk = pipe ? reverse_proxy::pipe_capacity : buffer_size;
+	uint64_t done = 0;
+
+	while (to_end || done != length)
+	{
+		size_t wanted = to_end ? chunk : static_cast<size_t>(std::min<uint64_t>(length - done, chunk));
+
+		from.expect(read_timeout_ms);
+		ssize_t received;
+		if (pipe)
+		{
+			received = co_await from.splice_in(pipe.write_end, wanted);
+		}
+		else
+		{
+			received = co_await from.recv(buffer, wanted);
+		}
+
+		if (received <= 0)
+		{
+			co_return received == 0 && to_end;
+		}
+
+		to.expect(write_timeout_ms);
+		for (size_t sent = 0; sent != static_cast<size_t>(received); )
+		{
+			ssize_t written;
+			if (pipe)
+			{
+				written = co_await to.splice_out(pipe.read_end, received - sent);
+			}
+			else
+			{
+				written = co_await to.send(buffer + sent, received - sent);
+			}
+
+			if (written <= 0)
+			{
+				co_return false;
+			}
+
+			sent += written;
+			done += written;
+			moved += written;
+			to.expect(write_timeout_ms);
+		}
+	}
+
+	co_return true;
+}
+
+subtask relay_chunked(async_socket &from, int64_t read_timeout_ms, async_socket &to, int64_t write_timeout_ms, pipe_pair pipe,
+		char *buffer, size_t buffer_size, size_t start, size_t end, uint64_t &moved, bool &clean)
+{
+	clean = false;
+
+	std::string_view line;
+	uint64_t size = 0;
+
+	while (true)
+	{
+		if (!co_await receive_line(from, read_timeout_ms, buffer, buffer_size, start, end, line))
+		{
+			co_return false;
+		}
+		if (!parse_chunk_size(line, size))
+		{
+			co_return false;
+		}
+		if (!size)
+		{
+			break;
+		}
+
+		// the data that came with the size line, then the rest of the chunk straight from the socket
+		size_t early = static_cast<size_t>(std::min<uint64_t>(size, end - start));
+		if (!co_await send_all(to, buffer + start, early, write_timeout_ms))
+		{
+			co_return false;
+		}
+		moved += early;
+		start += early;
+
+		if (size != early)
+		{
+			if (!co_await relay(from, read_timeout_ms, to, write_timeout_ms, pipe, buffer, buffer_size, size - early, false,
+					moved))
+			{
+				co_return false;
+			}
+			start = end = 0;
+		}
+
+		// the line break that ends the data
+		if (!co_await receive_line(from, read_timeout_ms, buffer, buffer_size, start, end, line))
+		{
+			co_return false;
+		}
+		if (!line.empty())
+		{
+			co_return false;
+		}
+	}
+
+	// trailers aren't passed on, the body ends with the blank line after them
+	do
+	{
+		if (!co_await receive_line(from, read_timeout_ms, buffer, buffer_size, start, end, line))
+		{
+			co_return false;
+		}
+	}
+	while (!line.empty());
+
+	clean = (start == end);
+	co_return true;
+}
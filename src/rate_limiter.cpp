@@ -0,0 +1,276 @@
+#include "rate_limiter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <memory_resource>
+#include <new>
+#include <stdexcept>
+
+#include <netinet/in.h>
+
+#include "logging.h"
+#include "path_resolver.h"
+
+constexpr size_t rate_limiter::set_size;
+
+rate_limiter &rate_limiter::instance()
+{
+	static rate_limiter object;
+	return object;
+}
+
+rate_limiter::limit rate_limiter::make_limit(double rate, double burst)
+{
+	if (!(rate > 0) || !(rate <= 1e9))
+	{
+		throw std::runtime_error("a rate is a positive number of requests per second");
+	}
+
+	// one second of requests unless given otherwise
+	if (burst == 0)
+	{
+		burst = std::max(rate, 1.0);
+	}
+	if (!(burst >= 1) || burst > 1e6)
+	{
+		throw std::runtime_error("a burst is at least one request");
+	}
+
+	limit result;
+	result.interval_ns = std::max<int64_t>(static_cast<int64_t>(1e9 / rate), 1);
+	result.tolerance_ns = static_cast<int64_t>((burst - 1) * result.interval_ns);
+	return result;
+}
+
+uint64_t rate_limiter::key_of(const struct sockaddr_storage &peer, uint64_t salt) noexcept
+{
+	uint64_t high = 0;
+	uint64_t low = 0;
+
+	if (peer.ss_family == AF_INET)
+	{
+		const struct sockaddr_in &ipv4 = reinterpret_cast<const struct sockaddr_in &>(peer);
+		low = uint64_t{ 0xffff } << 32 | ntohl(ipv4.sin_addr.s_addr);
+	}
+	else if (peer.ss_family == AF_INET6)
+	{
+		const struct sockaddr_in6 &ipv6 = reinterpret_cast<const struct sockaddr_in6 &>(peer);
+		memcpy(&high, ipv6.sin6_addr.s6_addr, sizeof(high));
+		memcpy(&low, ipv6.sin6_addr.s6_addr + sizeof(high), sizeof(low));
+	}
+
+	// the finalizer of MurmurHash3 over the address and the salt, 0 is left for unused buckets
+	uint64_t key = high * 0x9e3779b97f4a7c15ULL ^ low ^ salt * 0xc2b2ae3d27d4eb4fULL;
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
+
+	return key ? key : 1;
+}
+
+bool rate_limiter::configure(double rate, double burst, const std::vector<std::string> &prefix_limits, size_t entries) noexcept
+{
+	try
+	{
+		if (rate > 0)
+		{
+			per_client = make_limit(rate, burst);
+		}
+
+		for (const std::string &i: prefix_limits)
+		{
+			size_t equals = i.find('=');
+			if (equals == std::string::npos || equals == 0 || i[0] != '/')
+			{
+				throw std::runtime_error("a limited prefix is /path=rate[:burst]");
+			}
+
+			// kept as the request paths are matched, normalized with a leading slash
+			std::pmr::string relative;
+			if (!path_resolver::normalize(std::string_view(i).substr(0, equals), relative))
+			{
+				throw std::runtime_error("a limited prefix is a path beneath the root");
+			}
+
+			prefix_limit added;
+			added.prefix = "/";
+			added.prefix.append(relative);
+
+			size_t consumed = 0;
+			std::string numbers = i.substr(equals + 1);
+			double prefix_rate = std::stod(numbers, &consumed);
+			double prefix_burst = 0;
+			if (consumed != numbers.size())
+			{
+				if (numbers[consumed] != ':')
+				{
+					throw std::runtime_error("a limited prefix is /path=rate[:burst]");
+				}
+				std::string rest = numbers.substr(consumed + 1);
+				prefix_burst = std::stod(rest, &consumed);
+				if (consumed != rest.size())
+				{
+					throw std::runtime_error("a limited prefix is /path=rate[:burst]");
+				}
+			}
+
+			added.rate = make_limit(prefix_rate, prefix_burst);
+			prefixes.push_back(std::move(added));
+		}
+	}
+	catch (std::exception &e)
+	{
+		LOG_CERROR_TEXT("Failed to configure the rate limits:", e.what());
+		return false;
+	}
+
+	if (!per_client.interval_ns && prefixes.empty())
+	{
+		return true;
+	}
+
+	std::stable_sort(prefixes.begin(), prefixes.end(), [](const prefix_limit &a, const prefix_limit &b)
+			{
+				return a.prefix.size() > b.prefix.size();
+			});
+
+	size_t set_count = 1;
+	while (set_count * set_size < entries && set_count < (size_t{ 1 } << 30))
+	{
+		set_count <<= 1;
+	}
+
+	sets.reset(new (std::nothrow) bucket_set[set_count]);
+	if (!sets)
+	{
+		LOG_CERROR_TEXT("No memory for the table of rate limits", nullptr);
+		return false;
+	}
+	set_mask = set_count - 1;
+
+	LOG_CLOG_VALUE("Clients tracked by the rate limits at a time:", set_count * set_size);
+
+	return true;
+}
+
+int64_t rate_limiter::take(uint64_t key, const limit &rate, int64_t now_ns) noexcept
+{
+	bucket_set &set = sets[key & set_mask];
+	bucket *found = nullptr;
+
+	for (bucket &i: set.buckets)
+	{
+		if (i.key.load(std::memory_order_relaxed) == key)
+		{
+			found = &i;
+			break;
+		}
+	}
+
+	if (!found)
+	{
+		// a bucket that is full again holds nothing worth keeping, it's taken over as it is
+		bucket *closest_to_full = &set.buckets[0];
+
+		for (bucket &i: set.buckets)
+		{
+			uint64_t previous = i.key.load(std::memory_order_relaxed);
+			int64_t full_at = i.full_at_ns.load(std::memory_order_relaxed);
+
+			if ((!previous || full_at <= now_ns) && i.key.compare_exchange_strong(previous, key, std::memory_order_relaxed))
+			{
+				found = &i;
+				break;
+			}
+			if (full_at < closest_to_full->full_at_ns.load(std::memory_order_relaxed))
+			{
+				closest_to_full = &i;
+			}
+		}
+
+		if (!found)
+		{
+			uint64_t previous = closest_to_full->key.load(std::memory_order_relaxed);
+			if (!closest_to_full->key.compare_exchange_strong(previous, key, std::memory_order_relaxed))
+			{
+				// lost to another thread taking the same bucket, the request goes uncounted
+				return 0;
+			}
+			closest_to_full->full_at_ns.store(now_ns, std::memory_order_relaxed);
+			found = closest_to_full;
+		}
+	}
+
+	int64_t full_at = found->full_at_ns.load(std::memory_order_relaxed);
+	while (true)
+	{
+		int64_t from = std::max(full_at, now_ns);
+		if (from - now_ns > rate.tolerance_ns)
+		{
+			return from - now_ns - rate.tolerance_ns;
+		}
+		if (found->full_at_ns.compare_exchange_weak(full_at, from + rate.interval_ns, std::memory_order_relaxed))
+		{
+			return 0;
+		}
+	}
+}
+
+uint32_t rate_limiter::admit(const struct sockaddr_storage &peer, std::string_view path, int64_t now_ns) noexcept
+{
+	if (!sets)
+	{
+		return 0;
+	}
+
+	int64_t wait_ns = 0;
+
+	// prefixes are matched by segments of the normalized path, so that //dl, /./dl or /%64l are /dl as well;
+	// a path that doesn't normalize is matched as it is, whatever else turns it away
+	char storage[512];
+	std::pmr::monotonic_buffer_resource resource(storage, sizeof(storage));
+	std::pmr::string normalized(&resource);
+
+	if (!prefixes.empty())
+	{
+		try
+		{
+			if (path_resolver::normalize(path, normalized))
+			{
+				normalized.insert(normalized.begin(), '/');
+				path = normalized;
+			}
+		}
+		catch (std::bad_alloc &)
+		{
+		}
+	}
+
+	// the limit of the prefix first, a request it turns away doesn't count against the client as a whole
+	for (size_t i = 0; i != prefixes.size(); ++i)
+	{
+		const std::string &prefix = prefixes[i].prefix;
+		if (prefix == "/" || (path.compare(0, prefix.size(), prefix) == 0 &&
+				(path.size() == prefix.size() || path[prefix.size()] == '/')))
+		{
+			wait_ns = take(key_of(peer, i + 1), prefixes[i].rate, now_ns);
+			break;
+		}
+	}
+
+	if (!wait_ns && per_client.interval_ns)
+	{
+		wait_ns = take(key_of(peer, 0), per_client, now_ns);
+	}
+
+	if (!wait_ns)
+	{
+		return 0;
+	}
+
+	int64_t seconds = (wait_ns + 999999999) / 1000000000;
+	return static_cast<uint32_t>(std::min<int64_t>(std::max<int64_t>(seconds, 1), UINT32_MAX));
+}
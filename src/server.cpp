@@ -23,7 +23,7 @@ int get_binded_socket(struct addrinfo *address_info) noexcept
 
 	for (auto it = address_info; it; it = it->ai_next)
 	{
-		socket_fd = socket(it->ai_family, it->ai_socktype, it->ai_protocol);
+		socket_fd = socket(it->ai_family, it->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, it->ai_protocol);
 		if (socket_fd == -1)
 		{
 			continue;
@@ -32,11 +32,13 @@ int get_binded_socket(struct addrinfo *address_info) noexcept
 		int yes = 1;
 		if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1)
 		{
-			std::lock_guard<std::mutex> lock(cerr_mutex);
 			LOG_CERROR("Program terminates due to setsockopt fail");
 			exit(EXIT_FAILURE);
 		}
 
+		// the receive buffer has to be known before the handshake for the window scale to match
+		set_listener_options(socket_fd);
+
 		if (bind(socket_fd, it->ai_addr, it->ai_addrlen) == -1)
 		{
 			close(socket_fd);
@@ -59,14 +61,27 @@ int get_binded_socket(struct addrinfo *address_info) noexcept
 
 int get_listening_socket() noexcept
 {
+	int inherited = inherited_listening_socket();
+	if (inherited != -1)
+	{
+		// the options and the backlog of this process apply, listen again only resizes the queue
+		set_listener_options(inherited);
+		if (listen(inherited, listen_backlog) == -1)
+		{
+			LOG_CERROR("failed to apply the backlog to the inherited listening socket");
+		}
+
+		LOG_CLOG_VALUE("Listening master socket fd is inherited from the previous process as", inherited);
+		return inherited;
+	}
+
 	struct addrinfo hints = get_addrinfo_hints();
 	struct addrinfo *address_info;
 
 	int gai_res = getaddrinfo(server_ip.data(), server_port.data(), &hints, &address_info);
 	if (gai_res != 0)
 	{
-		std::lock_guard<std::mutex> lock(cerr_mutex);
-		std::cerr << "Error of getaddrinfo: " << gai_strerror(gai_res) << "\n";
+		LOG_CERROR_TEXT("Error of getaddrinfo:", gai_strerror(gai_res));
 		exit(EXIT_FAILURE);
 	}
 
@@ -76,210 +91,2053 @@ int get_listening_socket() noexcept
 
 	if (socket_fd == -1)
 	{
-		std::lock_guard<std::mutex> lock(cerr_mutex);
-		std::cerr << "Failed to bind\n";
+		LOG_CERROR_TEXT("Failed to bind", nullptr);
 		exit(EXIT_FAILURE);
 	}
 
-	if (listen(socket_fd, SOMAXCONN) == -1)
+	if (listen(socket_fd, listen_backlog) == -1)
 	{
-		std::lock_guard<std::mutex> lock(cerr_mutex);
 		LOG_CERROR("Program terminates due to listen error");
 		exit(EXIT_FAILURE);
 	}
 
-	std::clog << "Listening master socket fd is " << socket_fd << std::endl;
+	LOG_CLOG_VALUE("Listening master socket fd is", socket_fd);
 
 	return socket_fd;
 }
 
-void run_server_loop(int master_socket)
+namespace
 {
-	size_t limit_of_file_descriptors = set_maximal_avaliable_limit_of_fd();
-	std::clog << "Processing at most " << limit_of_file_descriptors << " fd at a time." << std::endl;
+	// failures aren't fatal, the server works with the defaults of the system
+	void set_option(int fd, int level, int name, int value, const char *failure_message) noexcept
+	{
+		if (setsockopt(fd, level, name, &value, sizeof(value)) == -1)
+		{
+			LOG_CERROR(failure_message);
+		}
+	}
+}
 
-//	initialize_thread_pool();		// why aren't we using the thread pool?!
+void set_listener_options(int fd) noexcept
+{
+	// accepted sockets inherit these from the listener on Linux, so the very first bytes are covered too
+	set_connection_options(fd);
 
-	while (true)
+	if (tcp_defer_accept)
+	{
+		set_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, tcp_defer_accept, "failed to set TCP_DEFER_ACCEPT");
+	}
+	if (tcp_fastopen)
+	{
+		set_option(fd, IPPROTO_TCP, TCP_FASTOPEN, tcp_fastopen, "failed to set TCP_FASTOPEN");
+	}
+}
+
+void set_connection_options(int fd) noexcept
+{
+	if (tcp_nodelay)
+	{
+		set_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "failed to set TCP_NODELAY");
+	}
+	if (send_buffer)
+	{
+		set_option(fd, SOL_SOCKET, SO_SNDBUF, send_buffer, "failed to set SO_SNDBUF");
+	}
+	if (receive_buffer)
+	{
+		set_option(fd, SOL_SOCKET, SO_RCVBUF, receive_buffer, "failed to set SO_RCVBUF");
+	}
+	if (tcp_notsent_lowat)
+	{
+		set_option(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, tcp_notsent_lowat, "failed to set TCP_NOTSENT_LOWAT");
+	}
+	if (busy_poll)
+	{
+		set_option(fd, SOL_SOCKET, SO_BUSY_POLL, busy_poll, "failed to set SO_BUSY_POLL");
+	}
+}
+
+namespace
+{
+	enum watched_descriptor
+	{
+		listener,
+		signals,
+		resume,
+		watched_count
+	};
+
+	// with descriptors exhausted the listener is left alone this long unless a connection goes away earlier
+	constexpr int64_t exhausted_backoff_ms = 100;
+
+	// signals and resumes are looked at between batches even while the backlog keeps filling
+	constexpr size_t max_accept_batch = 1024;
+
+	enum class signal_action
+	{
+		none,
+		shutdown,
+		upgrade
+	};
+
+	// reads every pending signal, the strongest of the actions asked for wins
+	signal_action pending_signal_action(int signal_fd) noexcept
 	{
-		active_connection client(master_socket);
+		signal_action result = signal_action::none;
+		struct signalfd_siginfo info;
 
-		if (!client)
+		while (read(signal_fd, &info, sizeof(info)) == sizeof(info))
 		{
-			continue;
+			int signal_number = static_cast<int>(info.ssi_signo);
+
+			if (signal_number == SIGINT || signal_number == SIGTERM || signal_number == SIGQUIT)
+			{
+				LOG_CLOG_VALUE("Interrupted by signal, finishing the work and shutting the server. Signal", signal_number);
+				result = signal_action::shutdown;
+			}
+			else if (signal_number == SIGUSR2)
+			{
+				if (result == signal_action::none)
+				{
+					result = signal_action::upgrade;
+				}
+			}
+			else
+			{
+				LOG_CLOG_VALUE("Ignoring signal", signal_number);
+			}
 		}
 
-	//	worker_threads->enqueue_task(process_the_accepted_connection, std::move(client));
+		return result;
+	}
+
+	[[ noreturn ]] void drain_and_exit(int master_socket, int signal_fd) noexcept
+	{
+		if (close(master_socket) == -1)
+		{
+			LOG_CERROR("failed to close the listening socket");
+		}
 
-		std::thread detached{ process_the_accepted_connection, std::move(client) };
-		if (detached.joinable())
+		for (size_t i = 0; i != worker_threads->size(); ++i)
 		{
-			detached.detach();
+			worker_threads->run_on(i, http_connection::drain_local);
+		}
+
+		admission_control &admission = admission_control::instance();
+		LOG_CLOG_VALUE("Stopped accepting, connections left to drain:", admission.connections());
+
+		const int64_t deadline = event_loop::now_ms() + static_cast<int64_t>(drain_timeout * 1000);
+		constexpr int64_t check_period_ms = 100;
+		struct pollfd watched = { signal_fd, POLLIN, 0 };
+
+		while (admission.connections())
+		{
+			int64_t left = deadline - event_loop::now_ms();
+			if (left <= 0)
+			{
+				LOG_CLOG_VALUE("Drain timeout is over, connections cut short:", admission.connections());
+				break;
+			}
+
+			watched.revents = 0;
+			if (poll(&watched, signal_fd == -1 ? 0 : 1, static_cast<int>(std::min(left, check_period_ms))) > 0 &&
+					pending_signal_action(signal_fd) == signal_action::shutdown)
+			{
+				LOG_CLOG_VALUE("Interrupted again, connections cut short:", admission.connections());
+				break;
+			}
+		}
+
+		// the next start reads ahead what was requested most in this run
+		if (!hot_list.empty() && hot_list_size)
+		{
+			warm_up::save_hot_list(hot_list, hot_list_size);
 		}
-	}
 
-	// how is this reachable? either introduce try-catch or revise while condition
-//	terminate_thread_pool();
+		exit(EXIT_SUCCESS);
+	}
 }
 
-void process_the_accepted_connection(active_connection client)
+void run_server_loop(int master_socket)
 {
-	constexpr size_t buffer_size = 8192;
-	char buffer[buffer_size] = { 0 };
+	size_t limit_of_file_descriptors = set_maximal_avaliable_limit_of_fd();
+	LOG_CLOG_VALUE("Processing at most this many fd at a time:", limit_of_file_descriptors);
+
+	path_resolver &resolver = path_resolver::instance();
+	if (!resolver.open_root(server_directory, path_cache_entries, path_cache_validity))
+	{
+		LOG_CERROR_TEXT("Program terminates as the served directory can't be opened", nullptr);
+		exit(EXIT_FAILURE);
+	}
 
-	ssize_t recieved = recv(client, buffer, buffer_size, MSG_NOSIGNAL);
+	if (!bundle_path.empty() && !static_bundle::instance().open(bundle_path))
+	{
+		LOG_CERROR_TEXT("Program terminates as the static bundle can't be served", nullptr);
+		exit(EXIT_FAILURE);
+	}
 
-	if (recieved > 0)
+	// streams aren't forwarded, so over HTTP/2 a proxied prefix could only be refused; clients stay on HTTP/1 instead
+	if (!proxy_routes.empty() && http2_max_streams)
 	{
-		http_request request(buffer);
-		process_client_request(client, request);
+		LOG_CLOG_TEXT("HTTP/2 isn't spoken while prefixes are proxied", nullptr);
+		http2_max_streams = 0;
 	}
-	else if (recieved == -1)
+
+	if (!tls_certificate.empty() && !tls_context::instance().configure(tls_certificate, tls_key, tls_session_cache,
+			http2_max_streams != 0))
 	{
-		std::lock_guard<std::mutex> lock(cerr_mutex);
-		LOG_CERROR("Failed to recieve the request and process the client");
-		std::cerr << "Client " << client << " remains unprocessed\n";
+		LOG_CERROR_TEXT("Program terminates as connections can't be served over TLS", nullptr);
+		exit(EXIT_FAILURE);
 	}
-}
 
-void process_client_request(active_connection &client, http_request request)
-{
-	request.parse_request();
+	if (!rate_limiter::instance().configure(rate_limit, rate_burst, rate_limit_prefixes, rate_limit_entries))
+	{
+		LOG_CERROR_TEXT("Program terminates as the rate limits can't be applied", nullptr);
+		exit(EXIT_FAILURE);
+	}
+
+	reverse_proxy &proxy = reverse_proxy::instance();
+	if (!proxy.configure(proxy_routes, proxy_keepalive))
+	{
+		LOG_CERROR_TEXT("Program terminates as the proxied prefixes can't be forwarded", nullptr);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!negative_cache::instance().start(server_directory, negative_cache_entries, negative_cache_bloom, path_cache_validity))
+	{
+		LOG_CERROR_TEXT("Requests for missing paths are looked up every time", nullptr);
+	}
+
+	// cached files, listings and idle upstream connections keep their descriptors open
+	size_t reserved = reserved_descriptors + resolver.capacity() +
+		(directory_listings == listing_format::none ? 0 : listing_cache::capacity) +
+		proxy.idle_capacity(worker_count ? worker_count : std::max(std::thread::hardware_concurrency(), 1u));
+
+	// a connection may hold an open file besides its socket, or an upstream socket and a pipe if it's proxied;
+	// the reserve is left for logs, pipes and the like
+	size_t per_connection = proxy.enabled() ? 4 : 2;
+	size_t budget = limit_of_file_descriptors > reserved ? (limit_of_file_descriptors - reserved) / per_connection : 1;
+	if (max_connections && max_connections < budget)
+	{
+		budget = max_connections;
+	}
+
+	admission_control &admission = admission_control::instance();
+	admission.configure(budget, max_connections_per_client);
+
+	register_server_gauges();
+
+	initialize_thread_pool(worker_count, worker_cpu_list);
+	if (!worker_threads || !worker_threads->size())
+	{
+		LOG_CERROR_TEXT("Program terminates as there are no worker threads to serve connections", nullptr);
+		exit(EXIT_FAILURE);
+	}
+	LOG_CLOG_VALUE("Worker threads serving connections:", worker_threads->size());
+
+	// each worker allocates the room for its connections itself, on its own node if it is pinned
+	for (size_t i = 0; i != worker_threads->size(); ++i)
+	{
+		worker_threads->run_on(i, []()
+				{
+					http_connection::reserve_local(connection_slots);
+				});
+	}
+
+	initialize_blocking_pool(blocking_thread_count);
+	if (blocking_threads)
+	{
+		LOG_CLOG_VALUE("Threads making blocking calls:", blocking_threads->size());
+	}
 
-	std::string address = (server_directory + request.get_address()).data();
+	// accepting starts right away, the caches are warmed behind it
+	warm_up::instance().start(hot_list, warm_up_tree);
 
-	if (request)
+	// only after the pool is started, as threads inherit the affinity of the one that creates them
+	if (!acceptor_cpu_list.empty())
 	{
-		open_file file(address.data());
+		pin_current_thread(acceptor_cpu_list);
+	}
+
+	int signal_fd = open_signal_fd();
 
-		if (file)
+	struct pollfd watched[watched_count];
+	watched[listener] = { master_socket, POLLIN, 0 };
+	watched[signals] = { signal_fd, POLLIN, 0 };
+	watched[resume] = { admission.resume_fd(), POLLIN, 0 };
+
+	// connections are handed to the workers in turn, each one stays with the event loop of its worker
+	std::vector<std::vector<active_connection>> batches(worker_threads->size());
+	size_t next_worker = 0;
+	int64_t backoff_until = 0;
+
+	report_upgrade_ready();
+
+	while (true)
+	{
+		// while the budget is used up the listener is left alone and new clients wait in its backlog
+		int timeout = -1;
+		bool accepting = admission.has_room();
+		if (accepting && backoff_until)
 		{
-			if (request.status_required())
+			int64_t left = backoff_until - event_loop::now_ms();
+			if (left > 0)
 			{
-				if (send_status_line(client, request.get_status()) == -1)
-				{
-					return;
-				}
-				if (send_headers(client, file) == -1)
-				{
-					return;
-				}
+				accepting = false;
+				timeout = static_cast<int>(left);
+			}
+			else
+			{
+				backoff_until = 0;
 			}
+		}
+		watched[listener].fd = accepting ? master_socket : -1;
 
-			send_client_a_file(client, file);
+		if (poll(watched, watched_count, timeout) == -1)
+		{
+			if (errno != EINTR)
+			{
+				LOG_CERROR("poll of the listening socket failed");
+			}
+			continue;
 		}
-		else
+
+		if (watched[signals].revents & POLLIN)
 		{
-			if (request.status_required())
+			signal_action action = pending_signal_action(signal_fd);
+
+			if (action == signal_action::shutdown || (action == signal_action::upgrade && start_upgrade(master_socket)))
 			{
-				send_status_line(client, 404);
+				break;
 			}
 		}
-	}
-	else
-	{
-		if (request.status_required())
+
+		if (watched[resume].revents & POLLIN)
+		{
+			admission.acknowledge_resume();
+			backoff_until = 0;
+		}
+
+		if (!(watched[listener].revents & POLLIN))
+		{
+			continue;
+		}
+
+		// the backlog is drained at once and every worker gets its share of it in one handoff
+		size_t accepted = 0;
+		while (accepted != max_accept_batch && admission.has_room())
+		{
+			active_connection client(master_socket);
+
+			if (!client)
+			{
+				if (client.accept_error() == EMFILE || client.accept_error() == ENFILE)
+				{
+					admission.shed_pending(master_socket);
+					backoff_until = event_loop::now_ms() + exhausted_backoff_ms;
+				}
+				break;
+			}
+
+			if (!client.admit())
+			{
+				continue;
+			}
+
+			batches[next_worker++ % batches.size()].push_back(std::move(client));
+			++accepted;
+		}
+
+		if (!accepted)
 		{
-			send_status_line(client, request.get_status());
+			continue;
+		}
+		server_metrics::instance().local().accept_batches.fetch_add(1, std::memory_order_relaxed);
+
+		for (size_t i = 0; i != batches.size(); ++i)
+		{
+			if (!batches[i].empty())
+			{
+				worker_threads->enqueue_task_to(i, http_connection::serve_batch, std::move(batches[i]));
+				batches[i].clear();
+			}
 		}
 	}
+
+	drain_and_exit(master_socket, signal_fd);
 }
 
-const char *http_response_phrase(short status) noexcept
+namespace
 {
-	static const std::map<short, const char *> responses
+	uint32_t elapsed_us(int64_t from_ns, int64_t to_ns) noexcept
 	{
-		{ 200, "OK" },
-		{ 400, "Bad Request" },
-		{ 404, "Not Found" },
-		{ 405, "Method Not Allowed" },
-		{ 414, "URI Too Long" },
-		{ 500, "Internal Server Error" },
-		{ 505, "HTTP Version Not Supported" }
-	};
+		return static_cast<uint32_t>((to_ns - from_ns) / 1000);
+	}
 
-	const char *result;
+	int64_t milliseconds(double seconds) noexcept
+	{
+		return static_cast<int64_t>(seconds * 1000);
+	}
 
-	try
+	bool equal_ignoring_case(std::string_view left, std::string_view right) noexcept
 	{
-		result = responses.at(status);
+		return left.size() == right.size() && strncasecmp(left.data(), right.data(), left.size()) == 0;
 	}
-	catch (std::out_of_range &ex)
+
+	bool contains_ignoring_case(std::string_view text, std::string_view pattern) noexcept
 	{
-		return "Unknown error of response status";
+		for (size_t i = 0; i + pattern.size() <= text.size(); ++i)
+		{
+			if (strncasecmp(text.data() + i, pattern.data(), pattern.size()) == 0)
+			{
+				return true;
+			}
+		}
+		return false;
 	}
 
-	return result;
+	/*
+	*	An HTTP/1.1 request without a body that asks to switch to HTTP/2 over cleartext, with the settings
+	*	of the client in HTTP2-Settings; the request becomes that of the first stream.
+	*/
+	bool is_http2_upgrade(std::string_view head, http2_request &request, std::string_view &settings)
+	{
+		size_t line_end = head.find('\n');
+		std::string_view line = head.substr(0, line_end);
+		if (!line.empty() && line.back() == '\r')
+		{
+			line.remove_suffix(1);
+		}
+
+		size_t target = line.find(' ');
+		size_t version = line.rfind(' ');
+		if (target == std::string_view::npos || version <= target + 1 || line.substr(version + 1) != "HTTP/1.1")
+		{
+			return false;
+		}
+
+		bool upgrade = false;
+		bool connection = false;
+		bool has_settings = false;
+
+		while (line_end != std::string_view::npos)
+		{
+			size_t line_start = line_end + 1;
+			line_end = head.find('\n', line_start);
+			line = head.substr(line_start, line_end == std::string_view::npos ? std::string_view::npos : line_end - line_start);
+			if (!line.empty() && line.back() == '\r')
+			{
+				line.remove_suffix(1);
+			}
+
+			size_t colon = line.find(':');
+			if (colon == std::string_view::npos)
+			{
+				continue;
+			}
+
+			std::string_view name = line.substr(0, colon);
+			size_t value_start = line.find_first_not_of(" \t", colon + 1);
+			std::string_view value = (value_start == std::string_view::npos) ? std::string_view{} : line.substr(value_start);
+
+			if (equal_ignoring_case(name, "Upgrade"))
+			{
+				upgrade = contains_ignoring_case(value, "h2c");
+			}
+			else if (equal_ignoring_case(name, "Connection"))
+			{
+				connection = contains_ignoring_case(value, "upgrade");
+			}
+			else if (equal_ignoring_case(name, "HTTP2-Settings"))
+			{
+				settings = value;
+				has_settings = true;
+			}
+			else if (equal_ignoring_case(name, "Accept-Encoding"))
+			{
+				request.accept_encoding.assign(value);
+			}
+			else if ((equal_ignoring_case(name, "Content-Length") && value != "0") || equal_ignoring_case(name, "Transfer-Encoding"))
+			{
+				return false;
+			}
+		}
+
+		if (!upgrade || !connection || !has_settings)
+		{
+			return false;
+		}
+
+		request.method.assign(head.substr(0, target));
+		request.path.assign(head.substr(target + 1, version - target - 1));
+		return true;
+	}
 }
 
-ssize_t send_status_line(active_connection &client, short status)
+constexpr size_t http_connection::buffer_size;
+constexpr size_t http_connection::max_skipped_body;
+
+thread_local slab<http_connection> http_connection::local_connections;
+thread_local bool http_connection::local_draining = false;
+
+http_connection::http_connection(event_loop &owner, active_connection accepted) noexcept :
+	client{ std::move(accepted) },
+	socket(owner),
+	request_start_ns{ client.accepted_ns() },
+	request_start_realtime_ns{ client.accepted_realtime_ns() }
 {
-	constexpr char http_version[] = "HTTP/1.0";
-	std::string status_line = http_version;
-	status_line += ' ';
-	status_line += std::to_string(status);
-	status_line += ' ';
-	status_line += http_response_phrase(status);
-	status_line += "\r\n";
+	server_metrics::instance().local().open_connections.fetch_add(1, std::memory_order_relaxed);
+}
 
-	return send(client, status_line.data(), status_line.size(), MSG_NOSIGNAL);
+http_connection::~http_connection()
+{
+	server_metrics::instance().local().open_connections.fetch_sub(1, std::memory_order_relaxed);
 }
 
-ssize_t send_headers(active_connection &client, open_file &file)
+void http_connection::drain_local() noexcept
 {
-	// too many += CRLF, let's revise that
-	std::string general_header;
+	local_draining = true;
 
-	general_header += "Date: ";
-	general_header += time_t_to_string(time_t_now());
-	general_header += "\r\n";
+	local_connections.for_each([](http_connection &i)
+			{
+				// connections waiting for a request are closed, the ones with a request in progress get to complete it
+				if (i.current == stage::idle || (i.current == stage::reading_head && !i.input_used))
+				{
+					i.socket.cancel();
+				}
+				else
+				{
+					i.keep_alive = false;
+				}
+			});
 
-	std::string response_header;
+	reverse_proxy::drain_local();
+}
 
-	response_header += "Location: ";
-	response_header += file.location();
-	response_header += "\r\n";
-	response_header += "Server: Bolbot-CPPserver/10.0\r\n";
+void http_connection::reserve_local(size_t count) noexcept
+{
+	// the frames are freed into this pool as the slab destroys its connections, so it has to be there first
+	frame_pool::prepare();
+	local_connections.reserve(count);
+}
 
-	std::string entity_header;
+void http_connection::serve(active_connection client) noexcept
+{
+	server_metrics::instance().local().handoff_duration.record(monotonic_now_ns() - client.accepted_ns());
 
-	const char allowed_methods[] = "GET";
-	entity_header += "Allow: ";
-	entity_header += allowed_methods;
-	entity_header += "\r\n";
+	event_loop *loop = thread_pool::current_loop();
+	if (!loop)
+	{
+		LOG_CERROR_TEXT("Connection reached a thread without an event loop, closing it", nullptr);
+		return;
+	}
 
-	entity_header += "Content-Length: ";
-	entity_header += std::to_string(file.size());
-	entity_header += "\r\n";
-	entity_header += "Content-Type: ";
-	entity_header += file.mime_type();
-	entity_header += "\r\n";
+	frame_pool::prepare();
 
-	entity_header += "Expires: ";
-	entity_header += time_t_to_string(time_t_now());
-	entity_header += "\r\n";
-	entity_header += "Last-Modified: ";
-	entity_header += file.last_modified();
-	entity_header += "\r\n";
+	slab_handle handle;
+	http_connection *connection = local_connections.acquire(handle, *loop, std::move(client));
+	if (!connection)
+	{
+		LOG_CERROR_TEXT("No memory for one more connection, closing it", nullptr);
+		return;
+	}
+	connection->self = handle;
 
-	std::string total = general_header + response_header + entity_header + "\r\n";
+	if (!connection->start())
+	{
+		local_connections.release(handle);
+	}
+}
 
-	return send(client, total.data(), total.size(), MSG_NOSIGNAL);
+void http_connection::serve_batch(std::vector<active_connection> &clients) noexcept
+{
+	for (auto &i: clients)
+	{
+		serve(std::move(i));
+	}
 }
 
-void send_client_a_file(active_connection &client, open_file &file) noexcept
+bool http_connection::start() noexcept
 {
-	constexpr size_t max_attempts = 3;
+	// set again rather than trusted to be inherited, only the ones configured cost a syscall
+	set_connection_options(client);
 
-	for (size_t i = 0; i < max_attempts; ++i)
+	if (!socket.attach(client))
 	{
-		ssize_t file_sent = sendfile(client, file, nullptr, file.size());
+		return false;
+	}
 
-		if (file_sent ==  -1 || file.size() == static_cast<size_t>(file_sent))
-		{
-			break;
-		}
+	socket.expect(milliseconds(read_header_timeout));
+
+	try
+	{
+		routine = run();
+	}
+	catch (std::bad_alloc &)
+	{
+		LOG_CERROR_TEXT("No memory for the coroutine of one more connection, closing it", nullptr);
+		return false;
 	}
+
+	routine.start(finished, this);
+
+	return true;
+}
+
+void http_connection::finished(void *connection) noexcept
+{
+	// destroys the coroutine as well, which is suspended for the last time;
+	// its socket may have more events in the batch being dispatched, so the slot is released after it
+	auto release = [](void *finishing)
+			{
+				local_connections.release(static_cast<http_connection *>(finishing)->self);
+			};
+
+	event_loop *loop = thread_pool::current_loop();
+	if (loop)
+	{
+		loop->retire(release, connection);
+	}
+	else
+	{
+		release(connection);
+	}
+}
+
+void http_connection::consume(size_t length) noexcept
+{
+	memmove(input, input + length, input_used - length);
+	input_used -= length;
+}
+
+void http_connection::count_timeout() noexcept
+{
+	static const connection_deadline deadline_of_stage[] =
+	{
+		connection_deadline::read_header,		// reading_head
+		connection_deadline::read_body,			// skipping_body
+		connection_deadline::write_stall,		// writing
+		connection_deadline::keep_alive,		// idle
+		connection_deadline::write_stall,		// opening, never armed
+		connection_deadline::write_stall		// proxying, the upstream has deadlines of its own
+	};
+
+	server_metrics::instance().local().count_timeout(deadline_of_stage[static_cast<size_t>(current)]);
+}
+
+bool http_connection::received(ssize_t result) noexcept
+{
+	if (result > 0)
+	{
+		input_used += result;
+		return true;
+	}
+
+	if (result == 0)
+	{
+		// whatever has arrived before the end of input still gets answered
+		input_closed = true;
+		return true;
+	}
+
+	if (result == -ETIMEDOUT)
+	{
+		count_timeout();
+	}
+	else if (result != -ECANCELED && result != -ECONNRESET)
+	{
+		LOG_CERROR_VALUE("Failed to recieve the request and process the client, remains unprocessed",
+				static_cast<int>(client));
+	}
+
+	return false;
+}
+
+subtask http_connection::secure()
+{
+	thread_metrics &metrics = server_metrics::instance().local();
+
+	if (!tls.start(client))
+	{
+		co_return false;
+	}
+	socket.secure(tls);
+
+	ssize_t result = co_await socket.handshake();
+	if (result < 0)
+	{
+		if (result == -ETIMEDOUT)
+		{
+			count_timeout();
+		}
+		if (result != -ECANCELED)
+		{
+			metrics.tls_failures.fetch_add(1, std::memory_order_relaxed);
+		}
+		co_return false;
+	}
+
+	metrics.tls_handshakes.fetch_add(1, std::memory_order_relaxed);
+	if (tls.resumed())
+	{
+		metrics.tls_resumptions.fetch_add(1, std::memory_order_relaxed);
+	}
+	if (tls.kernel_sends())
+	{
+		metrics.tls_kernel_offloads.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	co_return true;
+}
+
+task http_connection::run()
+{
+	// the handshake counts against the deadline of the first request head
+	if (tls_context::instance().enabled() && !co_await secure())
+	{
+		co_return;
+	}
+
+	while (true)
+	{
+		// the head is read until its blank line, or as much of it as fits the buffer or arrives before the end of input
+		size_t head;
+		while (!(head = http_request::head_length(input, input_used)) && input_used != buffer_size && !input_closed)
+		{
+			if (!received(co_await socket.recv(input + input_used, buffer_size - input_used)))
+			{
+				co_return;
+			}
+		}
+
+		if (!head && !(head = input_used))
+		{
+			co_return;
+		}
+
+		// HTTP/2 by prior knowledge or by an upgrade takes the connection over for good
+		if (http2_max_streams)
+		{
+			std::string_view request_head(input, head);
+			http2_request upgrade;
+			std::string_view settings;
+
+			if (request_head.starts_with(http2_preface.substr(0, http2_preface.find('\n') + 1)))
+			{
+				co_await serve_http2(0);
+				co_return;
+			}
+			// h2c is cleartext only, over TLS HTTP/2 is agreed with ALPN
+			if (!tls.active() && is_http2_upgrade(request_head, upgrade, settings))
+			{
+				co_await serve_http2(head);
+				co_return;
+			}
+		}
+
+		if (!start_request(head))
+		{
+			co_return;
+		}
+
+		if (current == stage::proxying)
+		{
+			if (!co_await exchange_with_upstream())
+			{
+				co_return;
+			}
+		}
+		else
+		{
+			if (current == stage::opening)
+			{
+				socket.relax();
+				open_start_ns = monotonic_now_ns();
+
+				co_await offload([this]()
+						{
+							open_target();
+						});
+
+				if (!finish_open())
+				{
+					co_return;
+				}
+			}
+
+			if (body_left)
+			{
+				current = stage::skipping_body;
+				socket.expect(milliseconds(read_body_timeout));
+
+				while (true)
+				{
+					size_t skipped = std::min(body_left, input_used);
+					consume(skipped);
+					body_left -= skipped;
+
+					if (!body_left)
+					{
+						break;
+					}
+
+					if (input_closed || !received(co_await socket.recv(input + input_used, buffer_size - input_used)))
+					{
+						co_return;
+					}
+				}
+			}
+
+			current = stage::writing;
+			send_start_ns = monotonic_now_ns();
+			socket.expect(milliseconds(write_stall_timeout));
+
+			// the request was answered at least in part once writing starts, so from here on it gets logged
+			bool sending = true;
+
+			while (sending && output_sent != output.size())
+			{
+				ssize_t sent = co_await socket.send(output.data() + output_sent, output.size() - output_sent);
+
+				if (sent > 0)
+				{
+					output_sent += sent;
+					record.bytes_sent += sent;
+					socket.expect(milliseconds(write_stall_timeout));
+				}
+				else
+				{
+					if (sent == -ETIMEDOUT)
+					{
+						count_timeout();
+					}
+					sending = false;
+				}
+			}
+
+			while (sending && file_left)
+			{
+				ssize_t sent = co_await socket.sendfile(body_fd, file_offset, file_left);
+
+				if (sent > 0)
+				{
+					if (static_cast<size_t>(sent) < file_left)
+					{
+						server_metrics::instance().local().sendfile_short_writes.fetch_add(1, std::memory_order_relaxed);
+					}
+					file_left -= sent;
+					record.bytes_sent += sent;
+					socket.expect(milliseconds(write_stall_timeout));
+				}
+				else
+				{
+					// 0 if the file got shorter since its size was taken, the promised length can't be kept anymore
+					if (sent == -ETIMEDOUT)
+					{
+						count_timeout();
+					}
+					sending = false;
+				}
+			}
+
+			if (!sending)
+			{
+				keep_alive = false;
+			}
+		}
+
+		finish_request();
+
+		if (!keep_alive)
+		{
+			co_return;
+		}
+
+		current = stage::idle;
+		socket.expect(milliseconds(keep_alive_timeout));
+
+		while (!input_used)
+		{
+			if (input_closed || !received(co_await socket.recv(input, buffer_size)))
+			{
+				co_return;
+			}
+		}
+
+		current = stage::reading_head;
+		request_start_ns = monotonic_now_ns();
+		request_start_realtime_ns = realtime_now_ns();
+		socket.expect(milliseconds(read_header_timeout));
+	}
+}
+
+subtask http_connection::exchange_with_upstream()
+{
+	reverse_proxy &proxy = reverse_proxy::instance();
+	thread_metrics &metrics = server_metrics::instance().local();
+	int64_t upstream_timeout = milliseconds(proxy_timeout);
+	int64_t stall_timeout = milliseconds(write_stall_timeout);
+
+	metrics.proxied_requests.fetch_add(1, std::memory_order_relaxed);
+
+	// the client has no deadline while the upstream is busy, the upstream socket has its own
+	socket.relax();
+
+	// a pooled connection the upstream has closed meanwhile is replaced, once per upstream
+	bool resendable = !body_left;
+	size_t attempts = upstream_route->upstreams.size() + 1;
+	size_t refused = 0;
+
+	upstream_pointer upstream;
+	upstream_response response;
+	size_t received = 0;
+	size_t head = 0;
+	short failure = 502;
+
+	while (!head && attempts--)
+	{
+		received = 0;
+		response = upstream_response{};
+		upstream = proxy.acquire(*upstream_route, *thread_pool::current_loop());
+		if (!upstream)
+		{
+			break;
+		}
+
+		bool reused = upstream->reused;
+		if (reused)
+		{
+			metrics.upstream_reuses.fetch_add(1, std::memory_order_relaxed);
+		}
+		else
+		{
+			metrics.upstream_connects.fetch_add(1, std::memory_order_relaxed);
+
+			socklen_t length;
+			const struct sockaddr *address = proxy.address(upstream->upstream, length);
+			upstream->socket.expect(upstream_timeout);
+
+			if (co_await upstream->socket.connect(address, length) < 0)
+			{
+				LOG_CERROR_TEXT("Failed to connect to an upstream, it's skipped for a while", proxy.name(upstream->upstream).data());
+				metrics.upstream_failures.fetch_add(1, std::memory_order_relaxed);
+				proxy.mark_down(upstream->upstream);
+				if (++refused == upstream_route->upstreams.size())
+				{
+					break;
+				}
+				continue;
+			}
+			upstream->connected = true;
+		}
+
+		// nothing of a head that didn't get through has reached the application
+		if (!co_await send_all(upstream->socket, output.data(), output.size(), upstream_timeout))
+		{
+			metrics.upstream_failures.fetch_add(1, std::memory_order_relaxed);
+			if (reused)
+			{
+				continue;
+			}
+			break;
+		}
+
+		// the part of the body that came with the head, then the rest spliced from the client socket
+		size_t early = std::min(body_left, input_used);
+		if (early && !co_await send_all(upstream->socket, input, early, upstream_timeout))
+		{
+			metrics.upstream_failures.fetch_add(1, std::memory_order_relaxed);
+			break;
+		}
+		consume(early);
+		body_left -= early;
+
+		if (body_left)
+		{
+			current = stage::skipping_body;
+
+			// records of a TLS client are decrypted by OpenSSL, so they're read into the buffer
+			pipe_pair pipe = tls.active() ? pipe_pair{} : proxy.take_pipe();
+			uint64_t moved = 0;
+			bool relayed = co_await relay(socket, milliseconds(read_body_timeout), upstream->socket, upstream_timeout, pipe,
+					upstream->buffer, upstream_connection::buffer_size, body_left, false, moved);
+			proxy.give_back(pipe, relayed);
+
+			body_left = 0;
+			if (!relayed)
+			{
+				break;
+			}
+		}
+
+		current = stage::proxying;
+		upstream->socket.expect(upstream_timeout);
+
+		ssize_t result = 1;
+		while (!(head = reverse_proxy::response_head_length(upstream->buffer, received)) &&
+				received != upstream_connection::buffer_size)
+		{
+			result = co_await upstream->socket.recv(upstream->buffer + received, upstream_connection::buffer_size - received);
+			if (result <= 0)
+			{
+				break;
+			}
+			received += result;
+		}
+
+		if (!head)
+		{
+			metrics.upstream_failures.fetch_add(1, std::memory_order_relaxed);
+			if (!result && !received && reused && resendable)
+			{
+				continue;
+			}
+			failure = (result == -ETIMEDOUT) ? 504 : 502;
+			break;
+		}
+
+		if (!reverse_proxy::parse_response_head(std::string_view(upstream->buffer, head), record.method == access_method::head,
+				response))
+		{
+			LOG_CERROR_TEXT("An upstream response can't be forwarded", proxy.name(upstream->upstream).data());
+			head = 0;
+			break;
+		}
+	}
+
+	current = stage::writing;
+	send_start_ns = monotonic_now_ns();
+	output.clear();
+	output_sent = 0;
+
+	// whatever is left of the request isn't read through, the connection is closed after the error
+	if (!head)
+	{
+		keep_alive = false;
+		record.status = failure;
+
+		std::string_view answer = upstream_error_response(failure);
+		if (co_await send_all(socket, answer.data(), answer.size(), stall_timeout))
+		{
+			record.bytes_sent += answer.size();
+		}
+		co_return true;
+	}
+
+	record.status = response.status;
+	keep_alive = keep_alive && response.length_known;
+	reverse_proxy::forward_response_head(std::string_view(upstream->buffer, head), keep_alive, output);
+
+	// the body that came with the head, more than the declared length means the connection is out of step;
+	// chunks are unwrapped on the way, so they are left in the buffer for that
+	size_t early = response.chunked ? 0 : received - head;
+	bool overrun = response.length_known && early > response.content_length;
+	if (response.length_known)
+	{
+		early = std::min<uint64_t>(early, response.content_length);
+	}
+
+	bool sent = co_await send_all(socket, output.data(), output.size(), stall_timeout);
+	if (sent)
+	{
+		record.bytes_sent += output.size();
+		sent = co_await send_all(socket, upstream->buffer + head, early, stall_timeout);
+	}
+	if (sent)
+	{
+		record.bytes_sent += early;
+	}
+	output.clear();
+
+	if (sent && response.chunked)
+	{
+		// an HTTP/1.0 client reads the plain body up to the end of the connection
+		pipe_pair pipe = (!tls.active() || tls.kernel_sends()) ? proxy.take_pipe() : pipe_pair{};
+		uint64_t moved = 0;
+		bool clean = false;
+		sent = co_await relay_chunked(upstream->socket, upstream_timeout, socket, stall_timeout, pipe, upstream->buffer,
+				upstream_connection::buffer_size, head, received, moved, clean);
+		proxy.give_back(pipe, sent);
+		record.bytes_sent += moved;
+		overrun = !clean;
+	}
+	else if (sent && (!response.length_known || response.content_length > early))
+	{
+		pipe_pair pipe = (!tls.active() || tls.kernel_sends()) ? proxy.take_pipe() : pipe_pair{};
+		uint64_t moved = 0;
+		sent = co_await relay(upstream->socket, upstream_timeout, socket, stall_timeout, pipe, upstream->buffer,
+				upstream_connection::buffer_size, response.content_length - early, !response.length_known, moved);
+		proxy.give_back(pipe, sent);
+		record.bytes_sent += moved;
+	}
+
+	if (!sent)
+	{
+		keep_alive = false;
+	}
+	else if (response.reusable && !overrun)
+	{
+		proxy.release(std::move(upstream));
+	}
+
+	co_return true;
+}
+
+subtask http_connection::serve_http2(size_t upgrade_head)
+{
+	thread_metrics &metrics = server_metrics::instance().local();
+	int64_t stall_timeout = milliseconds(write_stall_timeout);
+
+	metrics.http2_connections.fetch_add(1, std::memory_order_relaxed);
+
+	std::unique_ptr<http2_session> session = std::make_unique<http2_session>(std::min<size_t>(http2_max_streams, UINT32_MAX));
+	std::map<uint32_t, http2_exchange> exchanges;
+	std::vector<http2_exchange *> opened;
+
+	// the request that asked for the upgrade is answered on stream 1, once 101 and the preface of the server are out
+	if (upgrade_head)
+	{
+		static constexpr std::string_view switching =
+			"HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+
+		http2_request request;
+		std::string_view settings;
+		if (!is_http2_upgrade(std::string_view(input, upgrade_head), request, settings) ||
+				!session->upgrade(settings, std::move(request)))
+		{
+			co_return false;
+		}
+		consume(upgrade_head);
+
+		current = stage::writing;
+		socket.expect(stall_timeout);
+		if (!co_await send_all(socket, switching.data(), switching.size(), stall_timeout))
+		{
+			co_return false;
+		}
+	}
+
+	while (true)
+	{
+		// whatever has arrived meanwhile is taken without waiting for more
+		if (!input_closed && input_used != buffer_size)
+		{
+			ssize_t result = socket.recv_now(input + input_used, buffer_size - input_used);
+			if (result != -EAGAIN && !received(result))
+			{
+				break;
+			}
+		}
+
+		// settings, pings and flow control are answered by the session, complete requests collected
+		if (input_used)
+		{
+			session->receive(input, input_used);
+			input_used = 0;
+		}
+
+		if (local_draining)
+		{
+			session->shut_down();
+		}
+
+		std::vector<http2_request> &requests = session->new_requests();
+		if (!requests.empty())
+		{
+			metrics.http2_streams.fetch_add(requests.size(), std::memory_order_relaxed);
+
+			// the files of all the new streams are opened by one job of the blocking pool
+			opened.clear();
+			for (const http2_request &i: requests)
+			{
+				http2_exchange &exchange = exchanges[i.stream];
+				if (begin_stream(exchange, i))
+				{
+					opened.push_back(&exchange);
+				}
+			}
+
+			if (!opened.empty())
+			{
+				current = stage::opening;
+				socket.relax();
+
+				// cold files of a batch are opened side by side rather than one after another
+				co_await offload_each(opened.size(), [&opened](size_t i)
+						{
+							open_stream(*opened[i]);
+						});
+			}
+
+			for (const http2_request &i: requests)
+			{
+				respond_stream(*session, i.stream, exchanges[i.stream]);
+			}
+			requests.clear();
+		}
+
+		// DATA frames of all the streams with a response, in turn
+		session->schedule(http2_write_budget);
+
+		// with nothing to write the client has to send something first
+		bool writing = session->has_output();
+		bool flushed = true;
+		if (writing)
+		{
+			current = stage::writing;
+			socket.expect(stall_timeout);
+			flushed = co_await flush_http2(*session);
+			session->written();
+		}
+
+		for (const http2_finished &i: session->finished_streams())
+		{
+			auto found = exchanges.find(i.stream);
+			if (found != exchanges.end())
+			{
+				if (found->second.responded)
+				{
+					finish_stream(found->second, i.bytes_sent);
+				}
+				exchanges.erase(found);
+			}
+		}
+		session->finished_streams().clear();
+
+		if (!flushed || session->done())
+		{
+			break;
+		}
+
+		if (writing)
+		{
+			continue;
+		}
+		if (input_closed)
+		{
+			break;
+		}
+
+		// an idle connection closes like an idle one of HTTP/1, streams waiting for window updates like a stalled write
+		current = session->idle() ? stage::idle : stage::writing;
+		socket.expect(session->idle() ? milliseconds(keep_alive_timeout) : stall_timeout);
+
+		if (!received(co_await socket.recv(input, buffer_size)))
+		{
+			break;
+		}
+	}
+
+	// the responses cut short are logged with what they got through
+	for (auto &i: exchanges)
+	{
+		if (i.second.responded)
+		{
+			finish_stream(i.second, 0);
+		}
+	}
+
+	co_return true;
+}
+
+subtask http_connection::flush_http2(http2_session &session)
+{
+	int64_t stall_timeout = milliseconds(write_stall_timeout);
+	const std::string &output = session.pending_output();
+	std::deque<http2_file_part> &parts = session.pending_file_parts();
+	size_t sent = 0;
+
+	while (true)
+	{
+		// the frames up to the next body from a file, the header of its DATA frame held back to go out with it
+		size_t until = parts.empty() ? output.size() : parts.front().after;
+		while (sent != until)
+		{
+			ssize_t result = co_await socket.send(output.data() + sent, until - sent, !parts.empty());
+			if (result <= 0)
+			{
+				if (result == -ETIMEDOUT)
+				{
+					count_timeout();
+				}
+				co_return false;
+			}
+			sent += result;
+			socket.expect(stall_timeout);
+		}
+
+		if (parts.empty())
+		{
+			co_return true;
+		}
+
+		// 0 if the file got shorter since its size was taken, the frame can't be completed anymore
+		http2_file_part &part = parts.front();
+		while (part.length)
+		{
+			ssize_t result = co_await socket.sendfile(part.file, part.offset, part.length);
+			if (result <= 0)
+			{
+				if (result == -ETIMEDOUT)
+				{
+					count_timeout();
+				}
+				co_return false;
+			}
+			if (static_cast<size_t>(result) < part.length)
+			{
+				server_metrics::instance().local().sendfile_short_writes.fetch_add(1, std::memory_order_relaxed);
+			}
+			part.length -= result;
+			socket.expect(stall_timeout);
+		}
+		parts.pop_front();
+	}
+}
+
+bool http_connection::begin_stream(http2_exchange &exchange, const http2_request &request) noexcept
+{
+	int64_t now = monotonic_now_ns();
+
+	memset(&exchange.record, 0, sizeof(exchange.record));
+	exchange.record.timestamp_ns = realtime_now_ns();
+	exchange.record.set_address(client.peer());
+	exchange.start_ns = now;
+
+	try
+	{
+		std::string_view path = request.path;
+		std::string_view query = path.substr(std::min(path.find('?'), path.size()));
+		path.remove_suffix(query.size());
+
+		exchange.record.set_path(path.data(), path.size());
+		exchange.record.method = (request.method == "GET") ? access_method::get : (request.method == "HEAD") ?
+				access_method::head : (request.method == "POST") ? access_method::post : access_method::unknown;
+		exchange.record.status = 200;
+
+		// the same order as for HTTP/1: the rate limits, the method, then the path
+		uint32_t retry_after = rate_limiter::instance().admit(client.peer(), path, now);
+
+		if (retry_after)
+		{
+			exchange.record.status = 429;
+			exchange.head = too_many_requests_response(retry_after, false);
+			server_metrics::instance().local().rate_limited.fetch_add(1, std::memory_order_relaxed);
+		}
+		else if (exchange.record.method != access_method::get || path.empty() || path[0] != '/')
+		{
+			exchange.record.status = (exchange.record.method != access_method::get) ? 405 : 400;
+			append_status_line(exchange.head, exchange.record.status);
+		}
+		else if (!metrics_path.empty() && path == metrics_path)
+		{
+			std::string response = build_metrics_response(true, false);
+			size_t head_end = response.find("\r\n\r\n") + 4;
+			exchange.body.assign(response, head_end);
+			response.resize(head_end);
+			exchange.head = std::move(response);
+		}
+		else
+		{
+			exchange.target.assign(path);
+			exchange.query.assign(query);
+
+			bool normalized = path_resolver::normalize(exchange.target, exchange.relative);
+			const static_bundle &bundle = static_bundle::instance();
+			bool directory = false;
+			const bundle_variant *bundled = normalized ? bundle.find(exchange.relative, http_request::accepts_coding(
+					request.accept_encoding, "gzip"), &directory) : nullptr;
+
+			if (bundled && directory && needs_trailing_slash(exchange.target, exchange.relative))
+			{
+				exchange.record.status = 301;
+				append_redirect(exchange.head, exchange.relative, exchange.query, false);
+			}
+			else if (bundled)
+			{
+				append_status_line(exchange.head, exchange.record.status);
+				append_dated_headers(exchange.head, bundle.headers(*bundled));
+				exchange.body_fd = bundle.descriptor();
+				exchange.body_offset = static_cast<off_t>(bundled->body_offset);
+				exchange.body_length = bundled->body_length;
+				server_metrics::instance().local().bundle_hits.fetch_add(1, std::memory_order_relaxed);
+			}
+			else if (!normalized || negative_cache::instance().contains(exchange.relative))
+			{
+				exchange.record.status = 404;
+				exchange.head = not_found_response(false);
+			}
+			else
+			{
+				exchange.opening = true;
+			}
+		}
+	}
+	catch (std::exception &e)
+	{
+		LOG_CERROR_TEXT("Failed to process the request of a stream:", e.what());
+		exchange.opening = false;
+		exchange.open_failed = true;
+	}
+
+	exchange.record.parse_us = elapsed_us(now, monotonic_now_ns());
+
+	return exchange.opening;
+}
+
+void http_connection::open_stream(http2_exchange &exchange) noexcept
+{
+	int64_t start = monotonic_now_ns();
+
+	try
+	{
+		resolve(exchange.target, exchange.relative, exchange.file, exchange.listing);
+	}
+	catch (std::exception &e)
+	{
+		LOG_CERROR_TEXT("Failed to open the file requested on a stream:", e.what());
+		exchange.file.reset();
+		exchange.listing.reset();
+		exchange.open_failed = true;
+	}
+
+	int64_t end = monotonic_now_ns();
+	exchange.record.open_us = elapsed_us(start, end);
+	server_metrics::instance().local().open_duration.record(end - start);
+}
+
+void http_connection::respond_stream(http2_session &session, uint32_t stream, http2_exchange &exchange) noexcept
+{
+	try
+	{
+		if (exchange.open_failed)
+		{
+			exchange.record.status = 500;
+			exchange.head.clear();
+			append_status_line(exchange.head, exchange.record.status);
+		}
+		else if (exchange.opening && exchange.listing)
+		{
+			append_status_line(exchange.head, exchange.record.status);
+			append_headers(exchange.head, exchange.target, exchange.listing->size(), exchange.listing->mime_type(),
+					exchange.listing->last_modified());
+			exchange.body_fd = exchange.listing->descriptor();
+			exchange.body_length = exchange.listing->size();
+		}
+		else if (exchange.opening && exchange.file && exchange.file->directory())
+		{
+			exchange.file.reset();
+			exchange.record.status = 301;
+			exchange.head.clear();
+			append_redirect(exchange.head, exchange.relative, exchange.query, false);
+		}
+		else if (exchange.opening && exchange.file)
+		{
+			append_status_line(exchange.head, exchange.record.status);
+			append_headers(exchange.head, *exchange.file);
+			exchange.body_fd = exchange.file->descriptor();
+			exchange.body_length = exchange.file->size();
+		}
+		else if (exchange.opening)
+		{
+			exchange.record.status = 404;
+			exchange.head = not_found_response(false);
+		}
+
+		// the file or the listing stays open while a frame of its body is still to be sent
+		std::shared_ptr<const void> keeper = exchange.listing ? std::shared_ptr<const void>(exchange.listing) :
+				std::shared_ptr<const void>(exchange.file);
+
+		exchange.send_start_ns = monotonic_now_ns();
+		if (exchange.body_fd != -1)
+		{
+			exchange.responded = session.respond(stream, exchange.head, exchange.body_fd, exchange.body_offset,
+					exchange.body_length, std::move(keeper));
+		}
+		else
+		{
+			exchange.responded = session.respond(stream, exchange.head, std::move(exchange.body));
+		}
+	}
+	catch (std::exception &e)
+	{
+		LOG_CERROR_TEXT("Failed to build the response of a stream:", e.what());
+	}
+}
+
+void http_connection::finish_stream(http2_exchange &exchange, uint64_t bytes_sent) noexcept
+{
+	int64_t now = monotonic_now_ns();
+	exchange.record.bytes_sent = bytes_sent;
+	exchange.record.send_us = elapsed_us(exchange.send_start_ns, now);
+
+	access_log::instance().append(exchange.record);
+	server_metrics::instance().local().count_request(exchange.record.status, bytes_sent, now - exchange.start_ns);
+}
+
+bool http_connection::start_request(size_t head_length) noexcept
+{
+	// paths of the previous request drop their memory before the arena hands it out again
+	std::pmr::string(arena.get()).swap(target);
+	std::pmr::string(arena.get()).swap(relative);
+	arena.reset();
+
+	memset(&record, 0, sizeof(record));
+	record.timestamp_ns = request_start_realtime_ns;
+	record.set_address(client.peer());
+	record.receive_us = elapsed_us(request_start_ns, monotonic_now_ns());
+
+	int64_t phase_start = monotonic_now_ns();
+
+	try
+	{
+		http_request request(input, head_length, arena.get());
+		request.parse_request();
+
+		// a client over its rate is turned away before anything is looked up or forwarded
+		uint32_t retry_after = rate_limiter::instance().admit(client.peer(), request.get_address(), phase_start);
+
+		// a request for a proxied prefix goes on with its own head, rewritten for the upstream
+		upstream_route = nullptr;
+		std::pmr::string forwarded_path(arena.get());
+		if (!retry_after && request.status_required() && (request || request.get_status() == 405))
+		{
+			upstream_route = reverse_proxy::instance().match(request.get_address(), forwarded_path);
+		}
+
+		// the upstream would frame the request by a header this parser skipped
+		if (upstream_route && request.has_improper_header())
+		{
+			upstream_route = nullptr;
+			request.refuse(400);
+		}
+
+		output.clear();
+		if (upstream_route)
+		{
+			reverse_proxy::forward_request_head(std::string_view(input, head_length), forwarded_path, client.peer(), output);
+		}
+
+		consume(head_length);
+
+		int64_t phase_end = monotonic_now_ns();
+		record.parse_us = elapsed_us(phase_start, phase_end);
+		record.method = request.get_method();
+		record.http09 = !request.status_required();
+		record.set_path(request.get_address().data(), request.get_address().size());
+		record.status = request.get_status();
+
+		keep_alive = (request || upstream_route) && request.status_required() && request.keep_alive() && !input_closed &&
+				!local_draining;
+
+		// a proxied body is streamed to the upstream whatever its length
+		body_left = request.content_length();
+		if (body_left > max_skipped_body && !upstream_route)
+		{
+			keep_alive = false;
+			body_left = 0;
+		}
+
+		output_sent = 0;
+		file_offset = 0;
+		file_left = 0;
+
+		if (retry_after)
+		{
+			record.status = 429;
+			if (request.status_required())
+			{
+				output += too_many_requests_response(retry_after, keep_alive);
+			}
+			server_metrics::instance().local().rate_limited.fetch_add(1, std::memory_order_relaxed);
+		}
+		else if (upstream_route)
+		{
+			current = stage::proxying;
+		}
+		else if (request && !metrics_path.empty() && std::string_view(request.get_address()) == metrics_path)
+		{
+			output = build_metrics_response(request.status_required(), keep_alive);
+		}
+		else if (request)
+		{
+			target.assign(request.get_address());
+			query.assign(request.get_query());
+
+			bool normalized = path_resolver::normalize(target, relative);
+			const static_bundle &bundle = static_bundle::instance();
+			bool directory = false;
+			const bundle_variant *bundled = normalized ? bundle.find(relative, request.gzip_accepted(), &directory) : nullptr;
+
+			// a path of the bundle, above the root or known to be missing is answered right here, without the blocking pool
+			if (bundled && directory && needs_trailing_slash(target, relative))
+			{
+				record.status = 301;
+				if (request.status_required())
+				{
+					append_redirect(output, relative, query, keep_alive);
+				}
+			}
+			else if (bundled)
+			{
+				if (request.status_required())
+				{
+					append_status_line(output, record.status);
+					append_dated_headers(output, bundle.headers(*bundled), keep_alive);
+				}
+				body_fd = bundle.descriptor();
+				file_offset = static_cast<off_t>(bundled->body_offset);
+				file_left = bundled->body_length;
+				server_metrics::instance().local().bundle_hits.fetch_add(1, std::memory_order_relaxed);
+			}
+			else if (!normalized || negative_cache::instance().contains(relative))
+			{
+				record.status = 404;
+				if (request.status_required())
+				{
+					output += not_found_response(keep_alive);
+				}
+			}
+			else
+			{
+				current = stage::opening;
+			}
+		}
+		else
+		{
+			keep_alive = false;
+			if (request.status_required())
+			{
+				append_status_line(output, request.get_status());
+			}
+		}
+	}
+	catch (std::exception &e)
+	{
+		LOG_CERROR_TEXT("Failed to process the request, closing the connection:", e.what());
+		return false;
+	}
+
+	return true;
+}
+
+void http_connection::open_target() noexcept
+{
+	int64_t start = monotonic_now_ns();
+
+	try
+	{
+		resolve(target, relative, file, listing);
+	}
+	catch (std::exception &e)
+	{
+		LOG_CERROR_TEXT("Failed to open the requested file, closing the connection:", e.what());
+		file.reset();
+		listing.reset();
+		open_failed = true;
+	}
+
+	server_metrics::instance().local().open_duration.record(monotonic_now_ns() - start);
+}
+
+void http_connection::resolve(std::string_view target, std::pmr::string &relative, std::shared_ptr<const resolved_file> &file,
+		std::shared_ptr<const directory_listing> &listing)
+{
+	file = path_resolver::instance().resolve(relative);
+	if (!file || !file->directory() || needs_trailing_slash(target, relative))
+	{
+		return;
+	}
+
+	std::shared_ptr<const resolved_file> directory = std::move(file);
+
+	if (!index_file.empty())
+	{
+		size_t length = relative.size();
+		if (length)
+		{
+			relative += '/';
+		}
+		relative += index_file;
+
+		file = path_resolver::instance().resolve(relative);
+		if (file && !file->directory())
+		{
+			return;
+		}
+
+		file.reset();
+		relative.resize(length);
+	}
+
+	// a directory is never sent as it is, without an index or a listing it isn't found
+	if (directory_listings != listing_format::none)
+	{
+		std::pmr::string url_path{ relative.get_allocator() };
+		url_path.reserve(relative.size() + 1);
+		url_path += '/';
+		url_path += relative;
+
+		listing = listing_cache::instance().get(directory->descriptor(), relative, url_path, directory_listings);
+	}
+}
+
+bool http_connection::finish_open() noexcept
+{
+	record.open_us = elapsed_us(open_start_ns, monotonic_now_ns());
+
+	if (open_failed)
+	{
+		return false;
+	}
+
+	bool status_required = !record.http09;
+
+	try
+	{
+		if (listing)
+		{
+			if (status_required)
+			{
+				append_status_line(output, record.status);
+				append_headers(output, target, listing->size(), listing->mime_type(), listing->last_modified(), keep_alive);
+			}
+			file_left = listing->size();
+			body_fd = listing->descriptor();
+		}
+		else if (file && file->directory())
+		{
+			file.reset();
+			record.status = 301;
+			if (status_required)
+			{
+				append_redirect(output, relative, query, keep_alive);
+			}
+		}
+		else if (file)
+		{
+			if (status_required)
+			{
+				append_status_line(output, record.status);
+				append_headers(output, *file, keep_alive);
+			}
+			file_left = file->size();
+			body_fd = file->descriptor();
+		}
+		else
+		{
+			file.reset();
+			record.status = 404;
+			if (status_required)
+			{
+				output += not_found_response(keep_alive);
+			}
+		}
+	}
+	catch (std::exception &e)
+	{
+		LOG_CERROR_TEXT("Failed to build the response, closing the connection:", e.what());
+		return false;
+	}
+
+	return true;
+}
+
+void http_connection::finish_request() noexcept
+{
+	int64_t now = monotonic_now_ns();
+	record.send_us = elapsed_us(send_start_ns, now);
+
+	access_log::instance().append(record);
+	server_metrics::instance().local().count_request(record.status, record.bytes_sent, now - request_start_ns);
+
+	file.reset();
+	listing.reset();
+	body_fd = -1;
+	output.clear();
+	output_sent = 0;
+}
+
+const char *http_response_phrase(short status) noexcept
+{
+	static const std::map<short, const char *> responses
+	{
+		{ 200, "OK" },
+		{ 301, "Moved Permanently" },
+		{ 400, "Bad Request" },
+		{ 404, "Not Found" },
+		{ 405, "Method Not Allowed" },
+		{ 411, "Length Required" },
+		{ 414, "URI Too Long" },
+		{ 429, "Too Many Requests" },
+		{ 500, "Internal Server Error" },
+		{ 501, "Not Implemented" },
+		{ 502, "Bad Gateway" },
+		{ 504, "Gateway Timeout" },
+		{ 505, "HTTP Version Not Supported" }
+	};
+
+	const char *result;
+
+	try
+	{
+		result = responses.at(status);
+	}
+	catch (std::out_of_range &ex)
+	{
+		return "Unknown error of response status";
+	}
+
+	return result;
+}
+
+std::string_view not_found_response(bool keep_alive) noexcept
+{
+	static constexpr std::string_view closing = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+	static constexpr std::string_view kept_alive =
+		"HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: keep-alive\r\n\r\n";
+
+	return keep_alive ? kept_alive : closing;
+}
+
+bool needs_trailing_slash(std::string_view target, std::string_view relative) noexcept
+{
+	// the root is always requested with its slash
+	return !relative.empty() && !target.empty() && target.back() != '/';
+}
+
+void append_redirect(std::string &destination, std::string_view relative, std::string_view query, bool keep_alive)
+{
+	static constexpr char digits[] = "0123456789ABCDEF";
+
+	append_status_line(destination, 301);
+
+	// the path is decoded and may hold anything, the query of an HTTP/2 request as well
+	destination += "Location: /";
+	path_resolver::append_encoded(destination, relative);
+	destination += '/';
+	for (char c: query)
+	{
+		unsigned char u = static_cast<unsigned char>(c);
+		if (u <= ' ' || u >= 0x7f)
+		{
+			destination += '%';
+			destination += digits[u >> 4];
+			destination += digits[u & 0x0f];
+		}
+		else
+		{
+			destination += c;
+		}
+	}
+	destination += "\r\nContent-Length: 0\r\n";
+	if (keep_alive)
+	{
+		destination += "Connection: keep-alive\r\n";
+	}
+	destination += "\r\n";
+}
+
+std::string_view too_many_requests_response(uint32_t retry_after, bool keep_alive) noexcept
+{
+	struct responses
+	{
+		std::string closing[max_retry_after + 1];
+		std::string kept_alive[max_retry_after + 1];
+
+		responses()
+		{
+			for (uint32_t i = 1; i <= max_retry_after; ++i)
+			{
+				std::string common = "HTTP/1.0 429 Too Many Requests\r\nRetry-After: " + std::to_string(i) + "\r\nContent-Length: 0\r\n";
+				closing[i] = common + "\r\n";
+				kept_alive[i] = common + "Connection: keep-alive\r\n\r\n";
+			}
+		}
+	};
+
+	// built on the first use, the longer waits are rounded down to a retry that gets turned away again
+	static const responses serialized;
+
+	uint32_t index = std::min(std::max(retry_after, 1u), max_retry_after);
+	return keep_alive ? serialized.kept_alive[index] : serialized.closing[index];
+}
+
+std::string_view upstream_error_response(short status) noexcept
+{
+	static constexpr std::string_view bad_gateway = "HTTP/1.0 502 Bad Gateway\r\nContent-Length: 0\r\n\r\n";
+	static constexpr std::string_view gateway_timeout = "HTTP/1.0 504 Gateway Timeout\r\nContent-Length: 0\r\n\r\n";
+
+	return status == 504 ? gateway_timeout : bad_gateway;
+}
+
+void append_status_line(std::string &destination, short status)
+{
+	char code[8];
+	snprintf(code, sizeof(code), " %hd ", status);
+
+	destination += "HTTP/1.0";
+	destination += code;
+	destination += http_response_phrase(status);
+	destination += "\r\n";
+}
+
+void append_headers(std::string &destination, open_file &file, bool keep_alive)
+{
+	append_headers(destination, file.location(), file.size(), file.mime_type(), file.last_modified(), keep_alive);
+}
+
+void append_dated_headers(std::string &destination, std::string_view precomputed, bool keep_alive)
+{
+	time_t now = time_t_now();
+
+	destination += "Date: ";
+	append_time_t(destination, now);
+	destination += "\r\nExpires: ";
+	append_time_t(destination, now);
+	destination += "\r\n";
+	if (keep_alive)
+	{
+		destination += "Connection: keep-alive\r\n";
+	}
+	destination += precomputed;
+}
+
+void append_headers(std::string &destination, const resolved_file &file, bool keep_alive)
+{
+	append_headers(destination, file.location(), file.size(), file.mime_type(), file.last_modified(), keep_alive, file.etag());
+}
+
+void append_headers(std::string &destination, std::string_view location, size_t size, std::string_view mime_type,
+		std::string_view last_modified, bool keep_alive, std::string_view etag)
+{
+	time_t now = time_t_now();
+
+	destination += "Date: ";
+	append_time_t(destination, now);
+	destination += "\r\n";
+	if (keep_alive)
+	{
+		destination += "Connection: keep-alive\r\n";
+	}
+
+	destination += "Location: ";
+	destination += location;
+	destination += "\r\nServer: Bolbot-CPPserver/10.0\r\n";
+
+	char length[24];
+	snprintf(length, sizeof(length), "%zu", size);
+
+	destination += "Allow: GET\r\nContent-Length: ";
+	destination += length;
+	destination += "\r\nContent-Type: ";
+	destination += mime_type;
+	if (!etag.empty())
+	{
+		destination += "\r\nETag: ";
+		destination += etag;
+	}
+	destination += "\r\nExpires: ";
+	append_time_t(destination, now);
+	destination += "\r\nLast-Modified: ";
+	destination += last_modified;
+	destination += "\r\n\r\n";
+}
+
+std::string build_metrics_response(bool status_required, bool keep_alive)
+{
+	std::string body = server_metrics::instance().render_prometheus();
+
+	if (!status_required)
+	{
+		return body;
+	}
+
+	std::string response = "HTTP/1.0 200 OK\r\nDate: ";
+	response += time_t_to_string(time_t_now());
+	response += "\r\nServer: Bolbot-CPPserver/10.0\r\n";
+	if (keep_alive)
+	{
+		response += "Connection: keep-alive\r\n";
+	}
+	response += "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n";
+	response += "Content-Length: ";
+	response += std::to_string(body.size());
+	response += "\r\n\r\n";
+	response += body;
+
+	return response;
+}
+
+void register_server_gauges()
+{
+	server_metrics &metrics = server_metrics::instance();
+
+	metrics.register_gauge("cpp_server_thread_pool_queue_depth", "Tasks waiting in the queues of the thread pool", []()
+	{
+		server_metrics::gauge_values result;
+		if (!worker_threads)
+		{
+			return result;
+		}
+
+		std::vector<size_t> sizes = worker_threads->queue_sizes();
+		for (size_t i = 0; i != sizes.size(); ++i)
+		{
+			std::string labels = (i == 0) ? "queue=\"common\"" : "queue=\"worker_" + std::to_string(i - 1) + "\"";
+			result.emplace_back(std::move(labels), static_cast<double>(sizes[i]));
+		}
+		return result;
+	});
+
+	metrics.register_gauge("cpp_server_blocking_pool_queue_depth", "Jobs waiting for a thread of the blocking pool", []()
+	{
+		server_metrics::gauge_values result;
+		if (blocking_threads)
+		{
+			result.emplace_back("", static_cast<double>(blocking_threads->queue_depth()));
+		}
+		return result;
+	});
+
+	metrics.register_counter("cpp_server_heap_allocations_total", "Calls of operator new since start", []()
+	{
+		return server_metrics::gauge_values{ { "", static_cast<double>(heap_allocations()) } };
+	});
+
+	metrics.register_gauge("cpp_server_connection_budget", "Connections admitted at a time and currently open", []()
+	{
+		return server_metrics::gauge_values
+		{
+			{ "state=\"limit\"", static_cast<double>(admission_control::instance().limit()) },
+			{ "state=\"in_use\"", static_cast<double>(admission_control::instance().connections()) }
+		};
+	});
+
+	metrics.register_gauge("cpp_server_warm_up", "Paths resolved and hot files read ahead by the warm-up, seconds it took", []()
+	{
+		warm_up &warming = warm_up::instance();
+		return server_metrics::gauge_values
+		{
+			{ "value=\"indexed\"", static_cast<double>(warming.indexed_paths()) },
+			{ "value=\"prefetched\"", static_cast<double>(warming.prefetched_files()) },
+			{ "value=\"seconds\"", warming.seconds() }
+		};
+	});
+
+	metrics.register_gauge("cpp_server_log_records_dropped", "Log records lost because the logging rings were full", []()
+	{
+		return server_metrics::gauge_values{ { "", static_cast<double>(async_logger::instance().dropped()) } };
+	});
+
+	metrics.register_gauge("cpp_server_access_log_records", "Access log records by fate", []()
+	{
+		return server_metrics::gauge_values
+		{
+			{ "state=\"written\"", static_cast<double>(access_log::instance().records_written()) },
+			{ "state=\"dropped\"", static_cast<double>(access_log::instance().dropped()) }
+		};
+	});
 }
 
 time_t time_t_now() noexcept
@@ -0,0 +1,139 @@
+#include "static_bundle.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "logging.h"
+
+constexpr char bundle_file_header::magic_value[8];
+
+static_bundle &static_bundle::instance()
+{
+	static static_bundle object;
+	return object;
+}
+
+static_bundle::~static_bundle()
+{
+	if (mapping)
+	{
+		munmap(const_cast<char *>(mapping), mapped);
+	}
+	if (fd != -1)
+	{
+		close(fd);
+	}
+}
+
+bool static_bundle::open(const std::string &path) noexcept
+{
+	fd = ::open(path.data(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		LOG_CERROR_TEXT("Failed to open the static bundle", path.data());
+		return false;
+	}
+
+	struct stat status;
+	bundle_file_header candidate;
+	if (fstat(fd, &status) == -1 || pread(fd, &candidate, sizeof(candidate), 0) != sizeof(candidate) ||
+			!candidate.valid() || candidate.file_size != static_cast<uint64_t>(status.st_size))
+	{
+		LOG_CERROR_TEXT("Not a static bundle of this version or a truncated one", path.data());
+		close(fd);
+		fd = -1;
+		return false;
+	}
+
+	// the index and the strings precede the bodies and are all that is mapped
+	uint64_t entries_end = candidate.entries_offset + candidate.entry_count * sizeof(bundle_entry);
+	uint64_t slots_end = candidate.slots_offset + uint64_t{ candidate.slot_count } * sizeof(uint32_t);
+	uint64_t strings_end = candidate.strings_offset + candidate.strings_size;
+	if (candidate.entries_offset < sizeof(candidate) || entries_end > candidate.slots_offset ||
+			candidate.entries_offset % alignof(bundle_entry) || candidate.slots_offset % alignof(uint32_t) ||
+			slots_end > candidate.strings_offset || strings_end > candidate.file_size || strings_end < candidate.strings_offset)
+	{
+		LOG_CERROR_TEXT("The index of the static bundle is out of its bounds", path.data());
+		close(fd);
+		fd = -1;
+		return false;
+	}
+
+	void *result = mmap(nullptr, strings_end, PROT_READ, MAP_SHARED, fd, 0);
+	if (result == MAP_FAILED)
+	{
+		LOG_CERROR_TEXT("Failed to map the static bundle", path.data());
+		close(fd);
+		fd = -1;
+		return false;
+	}
+	madvise(result, strings_end, MADV_WILLNEED);
+
+	mapping = static_cast<const char *>(result);
+	mapped = strings_end;
+	header = reinterpret_cast<const bundle_file_header *>(mapping);
+	entries = reinterpret_cast<const bundle_entry *>(mapping + header->entries_offset);
+	slots = reinterpret_cast<const uint32_t *>(mapping + header->slots_offset);
+	strings = mapping + header->strings_offset;
+
+	LOG_CLOG_VALUE("Files served from the static bundle:", header->entry_count);
+
+	return true;
+}
+
+const bundle_variant *static_bundle::find(std::string_view relative, bool gzip_accepted, bool *directory) const noexcept
+{
+	if (!header)
+	{
+		return nullptr;
+	}
+
+	uint64_t hash = bundle_path_hash(relative);
+	uint32_t mask = header->slot_count - 1;
+
+	// linear probing, the table is at most half full
+	for (uint32_t i = hash & mask, probes = 0; probes != header->slot_count; i = (i + 1) & mask, ++probes)
+	{
+		uint32_t slot = slots[i];
+		if (!slot)
+		{
+			return nullptr;
+		}
+		if (slot > header->entry_count)
+		{
+			continue;
+		}
+
+		const bundle_entry &entry = entries[slot - 1];
+		if (entry.hash != hash || entry.path_length != relative.size() || !in_strings(entry.path_offset, entry.path_length) ||
+				std::string_view(strings + entry.path_offset, entry.path_length) != relative)
+		{
+			continue;
+		}
+
+		const bundle_variant *chosen = &entry.variants[bundle_identity];
+		if (gzip_accepted && entry.variants[bundle_gzip].headers_length)
+		{
+			chosen = &entry.variants[bundle_gzip];
+		}
+
+		// a damaged entry is as good as a missing one, nothing outside of the bundle is ever sent
+		if (!chosen->headers_length || !in_strings(chosen->headers_offset, chosen->headers_length) ||
+				chosen->body_offset < mapped || chosen->body_offset > header->file_size ||
+				chosen->body_length > header->file_size - chosen->body_offset)
+		{
+			return nullptr;
+		}
+
+		if (directory)
+		{
+			*directory = entry.flags & bundle_directory;
+		}
+
+		return chosen;
+	}
+
+	return nullptr;
+}
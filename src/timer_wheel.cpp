@@ -0,0 +1,174 @@
+#include "timer_wheel.h"
+
+constexpr unsigned timer_wheel::slot_bits;
+constexpr size_t timer_wheel::slots_per_level;
+constexpr unsigned timer_wheel::levels;
+
+namespace
+{
+	constexpr uint64_t slot_mask = timer_wheel::slots_per_level - 1;
+}
+
+timer_wheel::timer_wheel(int64_t now_ms, int64_t tick_length_ms) noexcept :
+	origin_ms{ now_ms },
+	tick_ms{ tick_length_ms > 0 ? tick_length_ms : 1 }
+{}
+
+void timer_wheel::place(timer &t) noexcept
+{
+	uint64_t expiry = t.expiry_tick;
+	if (expiry < current_tick)
+	{
+		expiry = current_tick;
+	}
+
+	uint64_t delta = expiry - current_tick;
+	unsigned level = 0;
+	while (level + 1 != levels && delta >= (uint64_t{ 1 } << (slot_bits * (level + 1))))
+	{
+		++level;
+	}
+
+	if (delta >= (uint64_t{ 1 } << (slot_bits * levels)))
+	{
+		// beyond the range of the wheel, fires at its far end and gets re-armed by the owner if it cares
+		expiry = current_tick + (uint64_t{ 1 } << (slot_bits * levels)) - 1;
+		t.expiry_tick = expiry;
+	}
+
+	slots[level][(expiry >> (slot_bits * level)) & slot_mask].push_back(t);
+}
+
+void timer_wheel::arm(timer &t, int64_t now_ms, int64_t delay_ms) noexcept
+{
+	t.unlink();
+
+	if (delay_ms < 0)
+	{
+		delay_ms = 0;
+	}
+
+	// rounded up, so a timer never fires early
+	t.expiry_tick = tick_of(now_ms + delay_ms + tick_ms - 1);
+	place(t);
+}
+
+void timer_wheel::cancel(timer &t) noexcept
+{
+	t.unlink();
+}
+
+void timer_wheel::cascade(unsigned level, size_t index) noexcept
+{
+	slot &source = slots[level][index];
+
+	while (!source.empty())
+	{
+		timer &t = *source.head.next;
+		t.unlink();
+		place(t);
+	}
+}
+
+size_t timer_wheel::process_tick() noexcept
+{
+	size_t index = current_tick & slot_mask;
+
+	for (unsigned level = 1; level != levels && index == 0; ++level)
+	{
+		index = (current_tick >> (slot_bits * level)) & slot_mask;
+		cascade(level, index);
+	}
+
+	// handlers may arm, cancel or destroy any timer, the due ones included, so they are moved out first
+	slot due;
+	slot &current = slots[0][current_tick & slot_mask];
+	while (!current.empty())
+	{
+		timer &t = *current.head.next;
+		t.unlink();
+		due.push_back(t);
+	}
+
+	++current_tick;
+
+	size_t fired = 0;
+	while (!due.empty())
+	{
+		timer &t = *due.head.next;
+		t.unlink();
+		++fired;
+
+		if (t.handler)
+		{
+			t.handler->on_timer();
+		}
+	}
+
+	return fired;
+}
+
+size_t timer_wheel::advance(int64_t now_ms) noexcept
+{
+	uint64_t target = tick_of(now_ms);
+	size_t fired = 0;
+
+	if (empty())
+	{
+		current_tick = target + 1;
+		return 0;
+	}
+
+	while (current_tick <= target)
+	{
+		fired += process_tick();
+	}
+
+	return fired;
+}
+
+int timer_wheel::next_timeout_ms(int64_t now_ms) const noexcept
+{
+	bool upper_levels_empty = true;
+	for (unsigned level = 1; level != levels && upper_levels_empty; ++level)
+	{
+		for (size_t i = 0; i != slots_per_level; ++i)
+		{
+			if (!slots[level][i].empty())
+			{
+				upper_levels_empty = false;
+				break;
+			}
+		}
+	}
+
+	for (uint64_t distance = 0; distance != slots_per_level; ++distance)
+	{
+		uint64_t tick = current_tick + distance;
+
+		// either a due slot of level 0 or the cascade of the upper levels needs a wake-up
+		if (!slots[0][tick & slot_mask].empty() || (!upper_levels_empty && (tick & slot_mask) == 0))
+		{
+			int64_t wait = origin_ms + static_cast<int64_t>(tick) * tick_ms - now_ms;
+			return wait > 0 ? static_cast<int>(wait) : 0;
+		}
+	}
+
+	return -1;
+}
+
+bool timer_wheel::empty() const noexcept
+{
+	for (unsigned level = 0; level != levels; ++level)
+	{
+		for (size_t i = 0; i != slots_per_level; ++i)
+		{
+			if (!slots[level][i].empty())
+			{
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
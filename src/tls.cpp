@@ -0,0 +1,279 @@
+#include "tls.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <new>
+
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "logging.h"
+
+constexpr size_t tls_stream::record_size;
+
+namespace
+{
+	// the preference of the server, as the wire format of ALPN
+	constexpr unsigned char with_http2[] = "\x02h2\x08http/1.1\x08http/1.0";
+	constexpr unsigned char without_http2[] = "\x08http/1.1\x08http/1.0";
+
+	// the ciphers of TLS 1.2 the kernel can encrypt with, all those of TLS 1.3 are
+	constexpr const char *kernel_ciphers = "ECDHE+AESGCM:ECDHE+CHACHA20";
+
+	constexpr unsigned char session_context[] = "cpp_server";
+
+	void log_tls_error(const char *what) noexcept
+	{
+		char reason[256] = "unknown";
+		if (unsigned long error = ERR_get_error())
+		{
+			ERR_error_string_n(error, reason, sizeof(reason));
+		}
+		ERR_clear_error();
+
+		LOG_CERROR_TEXT(what, reason);
+	}
+
+	// the argument is the list of the server
+	int select_protocol(SSL *, const unsigned char **selected, unsigned char *selected_length, const unsigned char *offered,
+			unsigned int offered_length, void *argument)
+	{
+		const unsigned char *supported = static_cast<const unsigned char *>(argument);
+		unsigned char *chosen = nullptr;
+
+		if (SSL_select_next_proto(&chosen, selected_length, supported, strlen(reinterpret_cast<const char *>(supported)),
+				offered, offered_length) != OPENSSL_NPN_NEGOTIATED)
+		{
+			return SSL_TLSEXT_ERR_NOACK;
+		}
+
+		*selected = chosen;
+		return SSL_TLSEXT_ERR_OK;
+	}
+}
+
+tls_context &tls_context::instance()
+{
+	static tls_context object;
+	return object;
+}
+
+bool tls_context::configure(const std::string &certificate, const std::string &key, size_t session_cache, bool http2) noexcept
+{
+	SSL_CTX *created = SSL_CTX_new(TLS_server_method());
+	if (!created)
+	{
+		log_tls_error("Failed to create the TLS context:");
+		return false;
+	}
+
+	// renegotiation would interleave a handshake with the records the kernel encrypts, it isn't spoken at all
+	SSL_CTX_set_min_proto_version(created, TLS1_2_VERSION);
+	SSL_CTX_set_options(created, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_NO_COMPRESSION |
+			SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_IGNORE_UNEXPECTED_EOF);
+	SSL_CTX_set_mode(created, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+
+	const std::string &key_file = key.empty() ? certificate : key;
+
+	if (SSL_CTX_set_cipher_list(created, kernel_ciphers) != 1 ||
+			SSL_CTX_use_certificate_chain_file(created, certificate.data()) != 1 ||
+			SSL_CTX_use_PrivateKey_file(created, key_file.data(), SSL_FILETYPE_PEM) != 1 ||
+			SSL_CTX_check_private_key(created) != 1 ||
+			SSL_CTX_set_session_id_context(created, session_context, sizeof(session_context) - 1) != 1)
+	{
+		log_tls_error("Failed to load the certificate and the key for TLS:");
+		SSL_CTX_free(created);
+		return false;
+	}
+
+	// tickets are encrypted with keys of this process, the cache also resumes clients that don't take tickets
+	if (session_cache)
+	{
+		SSL_CTX_set_session_cache_mode(created, SSL_SESS_CACHE_SERVER);
+		SSL_CTX_sess_set_cache_size(created, static_cast<long>(std::min<size_t>(session_cache, LONG_MAX)));
+	}
+	else
+	{
+		SSL_CTX_set_session_cache_mode(created, SSL_SESS_CACHE_OFF);
+	}
+
+	SSL_CTX_set_alpn_select_cb(created, select_protocol, const_cast<unsigned char *>(http2 ? with_http2 : without_http2));
+
+	context = created;
+
+	LOG_CLOG_TEXT("Connections are served over TLS with the certificate", certificate.data());
+
+	return true;
+}
+
+tls_stream::~tls_stream()
+{
+	if (!ssl)
+	{
+		return;
+	}
+
+	// close_notify if it goes out at once, the connection isn't kept open to wait for the answer
+	if (!broken && SSL_is_init_finished(ssl))
+	{
+		ERR_clear_error();
+		SSL_shutdown(ssl);
+	}
+
+	SSL_free(ssl);
+	ERR_clear_error();
+}
+
+bool tls_stream::start(int fd) noexcept
+{
+	ssl = SSL_new(tls_context::instance().get());
+	if (!ssl)
+	{
+		log_tls_error("Failed to start TLS of a connection:");
+		return false;
+	}
+
+	if (SSL_set_fd(ssl, fd) != 1)
+	{
+		log_tls_error("Failed to start TLS of a connection:");
+		SSL_free(ssl);
+		ssl = nullptr;
+		return false;
+	}
+
+	SSL_set_accept_state(ssl);
+
+	return true;
+}
+
+ssize_t tls_stream::fail(int result) noexcept
+{
+	int call_error = errno;
+
+	switch (SSL_get_error(ssl, result))
+	{
+	case SSL_ERROR_WANT_READ:
+		want = EPOLLIN;
+		errno = EAGAIN;
+		return -1;
+
+	case SSL_ERROR_WANT_WRITE:
+		want = EPOLLOUT;
+		errno = EAGAIN;
+		return -1;
+
+	case SSL_ERROR_ZERO_RETURN:
+		// close_notify, or the end of input without it
+		return 0;
+
+	case SSL_ERROR_SYSCALL:
+		broken = true;
+		ERR_clear_error();
+		errno = call_error ? call_error : ECONNRESET;
+		return -1;
+
+	default:
+		broken = true;
+		ERR_clear_error();
+		errno = EPROTO;
+		return -1;
+	}
+}
+
+ssize_t tls_stream::handshake() noexcept
+{
+	ERR_clear_error();
+
+	int result = SSL_do_handshake(ssl);
+	if (result != 1)
+	{
+		ssize_t failed = fail(result);
+		if (!failed)
+		{
+			// closed in the middle of the handshake
+			broken = true;
+			errno = ECONNRESET;
+			return -1;
+		}
+		return failed;
+	}
+
+	kernel_send = BIO_get_ktls_send(SSL_get_wbio(ssl));
+
+	return 0;
+}
+
+ssize_t tls_stream::read(char *buffer, size_t length) noexcept
+{
+	ERR_clear_error();
+
+	int done = SSL_read(ssl, buffer, static_cast<int>(std::min<size_t>(length, INT_MAX)));
+	return done > 0 ? done : fail(done);
+}
+
+ssize_t tls_stream::write(const char *data, size_t length) noexcept
+{
+	if (!length)
+	{
+		return 0;
+	}
+
+	ERR_clear_error();
+
+	int done = SSL_write(ssl, data, static_cast<int>(std::min<size_t>(length, INT_MAX)));
+	return done > 0 ? done : fail(done);
+}
+
+ssize_t tls_stream::write_file(int file, off_t &offset, size_t length) noexcept
+{
+	if (!chunk_length)
+	{
+		if (!chunk)
+		{
+			chunk.reset(new (std::nothrow) char[record_size]);
+			if (!chunk)
+			{
+				errno = ENOMEM;
+				return -1;
+			}
+		}
+
+		ssize_t loaded = pread(file, chunk.get(), std::min(length, record_size), offset);
+		if (loaded <= 0)
+		{
+			return loaded;
+		}
+		chunk_length = static_cast<size_t>(loaded);
+	}
+
+	ssize_t written = write(chunk.get(), chunk_length);
+	if (written <= 0)
+	{
+		return written;
+	}
+
+	chunk_length -= static_cast<size_t>(written);
+	memmove(chunk.get(), chunk.get() + written, chunk_length);
+	offset += written;
+
+	return written;
+}
+
+bool tls_stream::resumed() const noexcept
+{
+	return SSL_session_reused(ssl) == 1;
+}
+
+bool tls_stream::http2() const noexcept
+{
+	const unsigned char *protocol = nullptr;
+	unsigned int length = 0;
+	SSL_get0_alpn_selected(ssl, &protocol, &length);
+
+	return length == 2 && memcmp(protocol, "h2", 2) == 0;
+}
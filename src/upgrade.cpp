@@ -0,0 +1,249 @@
+#include "upgrade.h"
+
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "logging.h"
+
+extern char **environ;
+
+namespace
+{
+	constexpr char listener_variable[] = "CPP_SERVER_LISTENER_FD";
+	constexpr char ready_variable[] = "CPP_SERVER_READY_FD";
+
+	// descriptor numbers in the new process, right above the standard ones
+	constexpr int handed_listener_fd = 3;
+	constexpr int handed_ready_fd = 4;
+
+	constexpr int ready_timeout_ms = 10000;
+
+	std::string executable;
+	std::string working_directory;
+	std::vector<std::string> arguments;
+
+	int inherited_listener = -1;
+	int inherited_ready = -1;
+
+	int descriptor_from_environment(const char *name) noexcept
+	{
+		const char *value = getenv(name);
+		if (!value)
+		{
+			return -1;
+		}
+
+		char *end = nullptr;
+		long result = strtol(value, &end, 10);
+		unsetenv(name);		// children of this process, popen ones included, must not see it
+
+		if (*end != '\0' || result < 0 || result > INT_MAX || fcntl(static_cast<int>(result), F_GETFD) == -1)
+		{
+			return -1;
+		}
+
+		return static_cast<int>(result);
+	}
+}
+
+void remember_invocation(char **argv) noexcept
+{
+	try
+	{
+		char buffer[PATH_MAX];
+
+		ssize_t length = readlink("/proc/self/exe", buffer, sizeof(buffer) - 1);
+		if (length > 0)
+		{
+			executable.assign(buffer, length);
+		}
+
+		if (getcwd(buffer, sizeof(buffer)))
+		{
+			working_directory = buffer;
+		}
+
+		for (char **i = argv; *i; ++i)
+		{
+			arguments.emplace_back(*i);
+		}
+	}
+	catch (...)
+	{
+		executable.clear();
+	}
+
+	inherited_listener = descriptor_from_environment(listener_variable);
+	inherited_ready = descriptor_from_environment(ready_variable);
+
+	if (inherited_listener != -1)
+	{
+		fcntl(inherited_listener, F_SETFD, FD_CLOEXEC);
+	}
+	if (inherited_ready != -1)
+	{
+		fcntl(inherited_ready, F_SETFD, FD_CLOEXEC);
+	}
+}
+
+bool started_by_upgrade() noexcept
+{
+	return inherited_listener != -1;
+}
+
+int inherited_listening_socket() noexcept
+{
+	return inherited_listener;
+}
+
+void report_upgrade_ready() noexcept
+{
+	if (inherited_ready == -1)
+	{
+		return;
+	}
+
+	char ready = '1';
+	if (write(inherited_ready, &ready, sizeof(ready)) == -1)
+	{
+		LOG_CERROR("failed to report readiness to the previous process");
+	}
+	close(inherited_ready);
+	inherited_ready = -1;
+
+	LOG_CLOG_TEXT("Took over the listening socket from the previous process", nullptr);
+}
+
+bool start_upgrade(int master_socket) noexcept
+{
+	if (executable.empty() || arguments.empty())
+	{
+		LOG_CERROR_TEXT("Can't upgrade, the executable of this process is unknown", nullptr);
+		return false;
+	}
+
+	LOG_CLOG_TEXT("Upgrading to the binary", executable.data());
+
+	// everything the child needs is prepared before fork, after it only async-signal-safe calls are allowed
+	std::vector<std::string> environment_strings;
+	std::vector<char *> environment;
+	std::vector<char *> argument_pointers;
+	try
+	{
+		for (char **i = environ; *i; ++i)
+		{
+			environment_strings.emplace_back(*i);
+		}
+		environment_strings.push_back(std::string(listener_variable) + "=" + std::to_string(handed_listener_fd));
+		environment_strings.push_back(std::string(ready_variable) + "=" + std::to_string(handed_ready_fd));
+
+		for (auto &i: environment_strings)
+		{
+			environment.push_back(&i[0]);
+		}
+		environment.push_back(nullptr);
+
+		for (auto &i: arguments)
+		{
+			argument_pointers.push_back(&i[0]);
+		}
+		argument_pointers.push_back(nullptr);
+	}
+	catch (std::exception &e)
+	{
+		LOG_CERROR_TEXT("Can't upgrade:", e.what());
+		return false;
+	}
+
+	int ready_pipe[2];
+	if (pipe2(ready_pipe, O_CLOEXEC) == -1)
+	{
+		LOG_CERROR("Can't upgrade, pipe2 failed");
+		return false;
+	}
+
+	pid_t child = fork();
+	if (child == -1)
+	{
+		LOG_CERROR("Can't upgrade, fork failed");
+		close(ready_pipe[0]);
+		close(ready_pipe[1]);
+		return false;
+	}
+
+	if (child == 0)
+	{
+		// descriptors are moved out of the way first, so neither of the final numbers is overwritten early
+		int listener = fcntl(master_socket, F_DUPFD, handed_ready_fd + 1);
+		int ready = fcntl(ready_pipe[1], F_DUPFD, handed_ready_fd + 1);
+		if (listener == -1 || ready == -1 || dup2(listener, handed_listener_fd) == -1 || dup2(ready, handed_ready_fd) == -1)
+		{
+			_exit(127);
+		}
+
+		// sockets of clients and open files stay with the old process
+		close_range(handed_ready_fd + 1, ~0U, 0);
+
+		int null_fd = open("/dev/null", O_RDWR);
+		for (int i = STDIN_FILENO; i <= STDERR_FILENO; ++i)
+		{
+			if (null_fd != -1 && null_fd != i)
+			{
+				dup2(null_fd, i);
+			}
+		}
+		if (null_fd > STDERR_FILENO)
+		{
+			close(null_fd);
+		}
+
+		// the handled signals stay blocked across exec, the new process reads them from its own signalfd
+		if (!working_directory.empty() && chdir(working_directory.data()) == -1)
+		{
+			_exit(127);
+		}
+
+		execve(executable.data(), argument_pointers.data(), environment.data());
+		_exit(127);
+	}
+
+	close(ready_pipe[1]);
+
+	struct pollfd watched = { ready_pipe[0], POLLIN, 0 };
+	char ready = 0;
+	bool success = false;
+
+	int polled;
+	while ((polled = poll(&watched, 1, ready_timeout_ms)) == -1 && errno == EINTR)
+	{}
+
+	if (polled == 1 && read(ready_pipe[0], &ready, sizeof(ready)) == 1)
+	{
+		success = true;
+	}
+	close(ready_pipe[0]);
+
+	if (!success)
+	{
+		LOG_CERROR_TEXT("The new process failed to start or to report readiness in time, serving on", nullptr);
+		kill(child, SIGKILL);
+		waitpid(child, nullptr, 0);
+		return false;
+	}
+
+	LOG_CLOG_VALUE("The new process took over, draining. Its pid is", child);
+
+	return true;
+}
@@ -1,20 +1,172 @@
 #include "utils.h"
 
-std::mutex cerr_mutex;
-
 std::string server_ip;
 std::string server_port;
 std::string server_directory;
+std::string access_log_prefix;
+size_t access_log_segment_mebibytes;
+size_t access_log_kept_segments;
+std::string metrics_path;
+double read_header_timeout;
+double read_body_timeout;
+double write_stall_timeout;
+double keep_alive_timeout;
+size_t max_connections;
+size_t max_connections_per_client;
+size_t reserved_descriptors;
+double drain_timeout;
+bool tcp_nodelay;
+int tcp_defer_accept;
+int tcp_fastopen;
+int send_buffer;
+int receive_buffer;
+int listen_backlog;
+int tcp_notsent_lowat;
+int busy_poll;
+size_t worker_count;
+size_t blocking_thread_count;
+size_t connection_slots;
+std::string index_file;
+listing_format directory_listings;
+size_t path_cache_entries;
+double path_cache_validity;
+size_t negative_cache_entries;
+bool negative_cache_bloom;
+bool warm_up_tree;
+std::string hot_list;
+size_t hot_list_size;
+std::string bundle_path;
+std::vector<std::string> proxy_routes;
+size_t proxy_keepalive;
+double proxy_timeout;
+double rate_limit;
+double rate_burst;
+std::vector<std::string> rate_limit_prefixes;
+size_t rate_limit_entries;
+size_t http2_max_streams;
+std::string tls_certificate;
+std::string tls_key;
+size_t tls_session_cache;
+std::vector<unsigned> worker_cpu_list;
+std::vector<unsigned> acceptor_cpu_list;
+
+namespace
+{
+	// the daemon works from the root directory, a relative path is taken from where the server is started
+	void make_absolute(std::string &path)
+	{
+		char working_directory[4096];
+		if (!path.empty() && path.front() != '/' && getcwd(working_directory, sizeof(working_directory)))
+		{
+			path = std::string(working_directory) + '/' + path;
+		}
+	}
+}
 
 void parse_program_options(int argc, char **argv) noexcept
 {
 	try
 	{
+		std::string worker_cpus;
+		std::string acceptor_cpus;
+		std::string listing;
+
 		boost::program_options::options_description options("Call with following obligatory arguments");
 		options.add_options()
 			("host,h", boost::program_options::value<std::string>(&server_ip), "IP of server (i. e. 127.0.0.1)")
 			("port,p", boost::program_options::value<std::string>(&server_port), "Port (use in range 1024..65535)")
-			("directory,d", boost::program_options::value<std::string>(&server_directory), "Directory");
+			("directory,d", boost::program_options::value<std::string>(&server_directory), "Directory")
+			("access-log", boost::program_options::value<std::string>(&access_log_prefix)->default_value("the_server_access"),
+				"Prefix of binary access log files, empty to disable")
+			("access-log-segment", boost::program_options::value<size_t>(&access_log_segment_mebibytes)->default_value(64),
+				"Size of every access log file in MiB before rotation")
+			("access-log-keep", boost::program_options::value<size_t>(&access_log_kept_segments)->default_value(0),
+				"Access log files kept, the oldest are removed on rotation; 0 keeps them all")
+			("metrics-path", boost::program_options::value<std::string>(&metrics_path)->default_value("/__metrics"),
+				"Reserved path answered with metrics in Prometheus text format, empty to disable")
+			("read-header-timeout", boost::program_options::value<double>(&read_header_timeout)->default_value(10),
+				"Seconds for the whole request head to arrive")
+			("read-body-timeout", boost::program_options::value<double>(&read_body_timeout)->default_value(30),
+				"Seconds for a request body to arrive")
+			("write-stall-timeout", boost::program_options::value<double>(&write_stall_timeout)->default_value(30),
+				"Seconds a response may make no progress")
+			("keep-alive-timeout", boost::program_options::value<double>(&keep_alive_timeout)->default_value(5),
+				"Seconds an idle keep-alive connection waits for the next request")
+			("max-connections", boost::program_options::value<size_t>(&max_connections)->default_value(0),
+				"Connections served at a time, 0 to derive it from the limit of descriptors")
+			("max-connections-per-client", boost::program_options::value<size_t>(&max_connections_per_client)->default_value(0),
+				"Connections served at a time per client address, 0 for no limit")
+			("reserved-fds", boost::program_options::value<size_t>(&reserved_descriptors)->default_value(64),
+				"Descriptors kept out of the connection budget for logs, files and pipes")
+			("drain-timeout", boost::program_options::value<double>(&drain_timeout)->default_value(30),
+				"Seconds given to responses in flight to complete on shutdown")
+			("tcp-nodelay", boost::program_options::bool_switch(&tcp_nodelay), "Disable Nagle's algorithm")
+			("tcp-defer-accept", boost::program_options::value<int>(&tcp_defer_accept)->default_value(0),
+				"Seconds the kernel holds a connection until the request arrives, 0 to disable")
+			("tcp-fastopen", boost::program_options::value<int>(&tcp_fastopen)->default_value(0),
+				"Queue length of TCP Fast Open, 0 to disable")
+			("send-buffer", boost::program_options::value<int>(&send_buffer)->default_value(0),
+				"SO_SNDBUF of sockets in bytes, 0 for the system default")
+			("receive-buffer", boost::program_options::value<int>(&receive_buffer)->default_value(0),
+				"SO_RCVBUF of sockets in bytes, 0 for the system default")
+			("backlog", boost::program_options::value<int>(&listen_backlog)->default_value(SOMAXCONN),
+				"Length of the queue of pending connections")
+			("tcp-notsent-lowat", boost::program_options::value<int>(&tcp_notsent_lowat)->default_value(0),
+				"Unsent bytes above which a socket isn't writable, 0 for the system default")
+			("busy-poll", boost::program_options::value<int>(&busy_poll)->default_value(0),
+				"Microseconds to busy poll the device queue on blocking receive, 0 to disable")
+			("workers", boost::program_options::value<size_t>(&worker_count)->default_value(0),
+				"Worker threads, 0 for one per CPU of worker-cpus or of the machine")
+			("worker-cpus", boost::program_options::value<std::string>(&worker_cpus)->default_value(""),
+				"CPUs to pin the workers to, one each in turn (i. e. 0-7,16-23), empty not to pin")
+			("blocking-threads", boost::program_options::value<size_t>(&blocking_thread_count)->default_value(16),
+				"Threads for open, stat and popen, 0 to make these calls on the workers")
+			("connection-slots", boost::program_options::value<size_t>(&connection_slots)->default_value(64),
+				"Connections every worker allocates room for at startup, more are allocated as needed and kept")
+			("acceptor-cpus", boost::program_options::value<std::string>(&acceptor_cpus)->default_value(""),
+				"CPUs to pin the accepting thread to, empty not to pin")
+			("index", boost::program_options::value<std::string>(&index_file)->default_value("index.html"),
+				"File served for a requested directory that has it, empty to disable")
+			("listing", boost::program_options::value<std::string>(&listing)->default_value("none"),
+				"Listing of a requested directory without the index file: none, html or json")
+			("path-cache", boost::program_options::value<size_t>(&path_cache_entries)->default_value(1024),
+				"Resolved files kept open for the paths requested most recently, 0 to disable")
+			("path-cache-validity", boost::program_options::value<double>(&path_cache_validity)->default_value(1),
+				"Seconds a cached file is served before it's checked against the filesystem again")
+			("negative-cache", boost::program_options::value<size_t>(&negative_cache_entries)->default_value(4096),
+				"Paths with nothing to serve answered with 404 without a lookup until the tree changes, 0 to disable")
+			("negative-bloom", boost::program_options::bool_switch(&negative_cache_bloom),
+				"Put a Bloom filter in front of the negative cache")
+			("warm-up", boost::program_options::bool_switch(&warm_up_tree),
+				"Walk the served directory in the background at startup and resolve what is found into the path cache")
+			("hot-list", boost::program_options::value<std::string>(&hot_list)->default_value(""),
+				"File of paths read ahead at startup and rewritten on shutdown with those requested most, empty for none")
+			("hot-list-size", boost::program_options::value<size_t>(&hot_list_size)->default_value(256),
+				"Paths written to the hot list on shutdown, 0 to leave the list as it is")
+			("bundle", boost::program_options::value<std::string>(&bundle_path)->default_value(""),
+				"Static bundle made by the bundle tool to serve files from ahead of the directory, empty for none")
+			("proxy", boost::program_options::value<std::vector<std::string>>(&proxy_routes)->composing(),
+				"Prefix forwarded to upstreams in turn, repeatable (i. e. /api=127.0.0.1:8080,127.0.0.1:8081)")
+			("proxy-keepalive", boost::program_options::value<size_t>(&proxy_keepalive)->default_value(16),
+				"Idle keep-alive connections every worker keeps to every upstream")
+			("proxy-timeout", boost::program_options::value<double>(&proxy_timeout)->default_value(30),
+				"Seconds to connect to an upstream, and for the upstream to make progress with a request")
+			("rate-limit", boost::program_options::value<double>(&rate_limit)->default_value(0),
+				"Requests per second let through from a client address, 0 for no limit")
+			("rate-burst", boost::program_options::value<double>(&rate_burst)->default_value(0),
+				"Requests a client address may make at once above its rate, 0 for one second of them")
+			("rate-limit-prefix", boost::program_options::value<std::vector<std::string>>(&rate_limit_prefixes)->composing(),
+				"Rate per client address for a prefix, repeatable (i. e. /downloads=2:5 for 2 per second, 5 at once)")
+			("rate-limit-entries", boost::program_options::value<size_t>(&rate_limit_entries)->default_value(65536),
+				"Clients and prefixes tracked by the rate limits at a time")
+			("http2-max-streams", boost::program_options::value<size_t>(&http2_max_streams)->default_value(100),
+				"Streams of an HTTP/2 connection served at a time, 0 not to speak HTTP/2; not spoken while a prefix is proxied")
+			("tls-certificate", boost::program_options::value<std::string>(&tls_certificate)->default_value(""),
+				"PEM certificate chain to serve every connection over TLS with, empty for plain connections")
+			("tls-key", boost::program_options::value<std::string>(&tls_key)->default_value(""),
+				"PEM private key of the certificate, empty if it's in the certificate file")
+			("tls-session-cache", boost::program_options::value<size_t>(&tls_session_cache)->default_value(20480),
+				"TLS sessions kept to resume, 0 to resume by session tickets only");
 
 		boost::program_options::variables_map map;
 		boost::program_options::store(boost::program_options::parse_command_line(argc, argv, options), map);
@@ -22,7 +174,6 @@ void parse_program_options(int argc, char **argv) noexcept
 
 		if (!map.count("host") || !map.count("port") || !map.count("directory"))
 		{
-			std::lock_guard<std::mutex> lock(cerr_mutex);
 			std::cerr << options << "\n";
 			exit(EXIT_SUCCESS);
 		}
@@ -31,16 +182,53 @@ void parse_program_options(int argc, char **argv) noexcept
 		{
 			throw std::runtime_error("Failed to parce given comand line arguemnts");
 		}
+
+		if (read_header_timeout <= 0 || read_body_timeout <= 0 || write_stall_timeout <= 0 || keep_alive_timeout <= 0 ||
+				drain_timeout < 0 || tcp_defer_accept < 0 || tcp_fastopen < 0 || send_buffer < 0 || receive_buffer < 0 ||
+				listen_backlog <= 0 || tcp_notsent_lowat < 0 || busy_poll < 0 || path_cache_validity < 0 ||
+				proxy_timeout <= 0 || rate_limit < 0 || rate_burst < 0)
+		{
+			throw std::runtime_error("timeouts, sizes and counts can't be negative");
+		}
+
+		if (listing == "none")
+		{
+			directory_listings = listing_format::none;
+		}
+		else if (listing == "html")
+		{
+			directory_listings = listing_format::html;
+		}
+		else if (listing == "json")
+		{
+			directory_listings = listing_format::json;
+		}
+		else
+		{
+			throw std::runtime_error("listing is one of none, html and json");
+		}
+
+		if (index_file.find('/') != std::string::npos)
+		{
+			throw std::runtime_error("index is a file name, not a path");
+		}
+
+		make_absolute(access_log_prefix);
+		make_absolute(hot_list);
+		make_absolute(bundle_path);
+		make_absolute(tls_certificate);
+		make_absolute(tls_key);
+
+		worker_cpu_list = parse_cpu_list(worker_cpus);
+		acceptor_cpu_list = parse_cpu_list(acceptor_cpus);
 	}
 	catch (std::exception &e)
 	{
-		std::lock_guard<std::mutex> lock(cerr_mutex);
 		std::cerr << "Command-line arguments error: " << e.what() << ". Terminating.\n";
 		exit(EXIT_FAILURE);	
 	}
 	catch (...)
 	{
-		std::lock_guard<std::mutex> lock(cerr_mutex);
 		std::cerr << "Unknown error in command-line parser. Terminating.\n";
 		exit(EXIT_FAILURE);
 	}
@@ -48,11 +236,11 @@ void parse_program_options(int argc, char **argv) noexcept
 
 void daemonize() noexcept
 {
-	pid_t pid = fork();
+	// a process started by a binary upgrade is already the child of a daemon, the old one waits for its readiness
+	pid_t pid = started_by_upgrade() ? 0 : fork();
 
 	if (pid == -1)
 	{
-		std::lock_guard<std::mutex> lock(cerr_mutex);
 		std::cerr << "Error creating child process in damonize.\n";
 		exit(EXIT_FAILURE);
 	}
@@ -71,20 +259,21 @@ void daemonize() noexcept
 	}
 	catch (std::exception &e)
 	{
-		std::lock_guard<std::mutex> lock(cerr_mutex);
-		std::cerr << "Failed to redirect output to log files: " << e.what() << "\n";
+		LOG_CERROR_TEXT("Failed to redirect output to log files:", e.what());
 	}
 	catch (...)
 	{
-		std::lock_guard<std::mutex> lock(cerr_mutex);
-		std::cerr << "Unknown error while redirecting output to log files.\n";
+		LOG_CERROR_TEXT("Unknown error while redirecting output to log files.", nullptr);
 	}
 
+	// the logs of an old process still draining are appended to, not overwritten
+	async_logger::instance().start(!started_by_upgrade());
+	access_log::instance().start(access_log_prefix, access_log_segment_mebibytes, access_log_kept_segments);
+
 	pid_t sid = setsid();
 
 	if (sid == -1)
 	{
-		std::lock_guard<std::mutex> lock(cerr_mutex);
 		LOG_CERROR("program terminates due to the setsid failure");
 		exit(EXIT_FAILURE);
 	}
@@ -92,123 +281,93 @@ void daemonize() noexcept
 	int chdir_res = chdir("/");
 	if (chdir_res == -1)
 	{
-		std::lock_guard<std::mutex> lock(cerr_mutex);
 		LOG_CERROR("program terminates due to the chdir failure");
 		exit(EXIT_FAILURE);
 	}
 
-	close(STDIN_FILENO);
-	close(STDOUT_FILENO);
-	close(STDERR_FILENO);
+	// pointed at /dev/null rather than closed, so that a file opened later can't take the number of stderr
+	// and get the text written there when no log file is open
+	int null_fd = open("/dev/null", O_RDWR);
+	for (int i = STDIN_FILENO; i <= STDERR_FILENO; ++i)
+	{
+		if (null_fd == -1)
+		{
+			close(i);
+		}
+		else if (null_fd != i)
+		{
+			dup2(null_fd, i);
+		}
+	}
+	if (null_fd > STDERR_FILENO)
+	{
+		close(null_fd);
+	}
 
 	if (std::atexit(atexit_terminator))
 	{
-		std::lock_guard<std::mutex> lock(cerr_mutex);
-		std::cerr << "Failed to set function for terminating threads at exit: atexit_terminator()\n";
+		LOG_CERROR_TEXT("Failed to set function for terminating threads at exit:", "atexit_terminator()");
 	}
 	std::set_terminate(terminate_handler);
 
-	std::clog << "Daemoized successfully. " << time_t_to_string(current_time_t())
-		<< "\nMaster process id " << getpid()
-		<< "\nServer IP " << server_ip << "\nServer port " << server_port
-		<< "\nServer directory " << server_directory << std::endl;
+	LOG_CLOG_TEXT("Daemoized successfully.", time_t_to_string(current_time_t()).data());
+	LOG_CLOG_VALUE("Master process id", getpid());
+	LOG_CLOG_TEXT("Server IP", server_ip.data());
+	LOG_CLOG_TEXT("Server port", server_port.data());
+	LOG_CLOG_TEXT("Server directory", server_directory.data());
 }
 
-void log_errno(const char *function, const char *file, size_t line, const char *message, int actual_errno) noexcept
+sigset_t handled_signals() noexcept
 {
-	// cerr_mutex is locked before call to this function
-	std::cerr << "Error in " << function << " (" << file << ", line " << line << ")\n";
-
-	constexpr size_t buffer_size = 1024;
-	static thread_local char buffer[buffer_size] = { 0 };
+	sigset_t result;
+	sigemptyset(&result);
+	sigaddset(&result, SIGINT);
+	sigaddset(&result, SIGHUP);
+	sigaddset(&result, SIGTERM);
+	sigaddset(&result, SIGQUIT);
+	sigaddset(&result, SIGUSR1);
+	sigaddset(&result, SIGUSR2);
 
-	std::cerr << "errno " << actual_errno << " means ";
-
-#if (!defined(_GNU_SOURCE) && defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200112L)
+	return result;
+}
 
-	int strerror_res = strerror_r(actual_errno, buffer, buffer_size);
-	if (strerror_res != 0)
-	{
-		std::cerr << "(failed to decipher because of error with errno " << (strerror_res == -1 ? errno : strerror_res)  << ")\n";
-	}
-	else
+void set_signals() noexcept
+{
+	// nothing is done in signal context: the signals are blocked in every thread and read by the acceptor from a signalfd
+	sigset_t handled = handled_signals();
+	int mask_result = pthread_sigmask(SIG_BLOCK, &handled, nullptr);
+	if (mask_result != 0)
 	{
-		std::cerr << buffer << "\n";
+		LOG_CERROR_TEXT("pthread_sigmask failed to block the handled signals:", strerror(mask_result));
 	}
 
-	std::cout << "using XSI strerror_r, return type is " << typeid(decltype(strerror_r(actual_errno, buffer, buffer_size))).name() << std::endl;
-
-#elif defined(_GNU_SOURCE)
-
-	const char *strerror_res = strerror_r(actual_errno, buffer, buffer_size);
-	if (strerror_res)
-	{
-		std::cerr << strerror_res << "\n";
-	}
-	else
+	// a client gone in the middle of sendfile must not kill the server, EPIPE is enough
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
 	{
-		std::cerr << "(failed to decipher)\n";
+		LOG_CERROR("failed to ignore SIGPIPE");
 	}
-
-	std::cout << "using GNU strerror_r, return type is " << typeid(decltype(strerror_r(actual_errno, buffer, buffer_size))).name() << std::endl;
-
-#else
-
-	std::cerr << "(alas impossible to report errno-provided errors)\n";
-
-#endif	
-
-	std::cerr << "Therefore " << message << "\n\n";
 }
 
-void signal_handler(int signal_number) noexcept
+int open_signal_fd() noexcept
 {
-	if (signal_number == SIGINT || signal_number == SIGTERM || signal_number == SIGQUIT || signal_number == SIGABRT)
-	{
-		std::clog << "Interrupted by signal " << signal_number << ": " << strsignal(signal_number)
-			<< "\nFinishing the work and shutting the server.\n";
-
-		terminate_thread_pool();
-
-		exit(EXIT_SUCCESS);
-	}
-}
+	sigset_t handled = handled_signals();
 
-void set_signal(int signal_number, struct sigaction &sa) noexcept
-{
-	if (sigaction(signal_number, &sa, nullptr) == -1)
+	int result = signalfd(-1, &handled, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (result == -1)
 	{
-		std::lock_guard<std::mutex> lock(cerr_mutex);
-		LOG_CERROR("sigaction failed");
-		std::cerr << "Failed to set handler for " << strsignal(signal_number) << "\n";
+		LOG_CERROR("failed to create signalfd, the server can only be killed");
 	}
-}
 
-void set_signals() noexcept
-{
-	struct sigaction sa;
-	sa.sa_handler = signal_handler;
-	sa.sa_flags = SA_RESTART | SA_NOCLDWAIT;
-	sigemptyset(&sa.sa_mask);
-	set_signal(SIGINT, sa);
-	set_signal(SIGHUP, sa);
-	set_signal(SIGTERM, sa);
-	//set_signal(SIGCHLD, sa);
-	set_signal(SIGQUIT, sa);
-	set_signal(SIGUSR1, sa);
-	set_signal(SIGUSR2, sa);
+	return result;
 }
 
 constexpr char log_redirector::log_file_out_name[];
-constexpr char log_redirector::log_file_err_name[];
-constexpr char log_redirector::log_file_log_name[];
 
 size_t set_maximal_avaliable_limit_of_fd() noexcept
 {
 	struct rlimit descriptors_limit;
 	if (getrlimit(RLIMIT_NOFILE, &descriptors_limit) == -1)
 	{
-		std::lock_guard<std::mutex> lock(cerr_mutex);
 		LOG_CERROR("getrlimit failed");
 		return 0;
 	}
@@ -219,7 +378,6 @@ size_t set_maximal_avaliable_limit_of_fd() noexcept
 
 	if (setrlimit(RLIMIT_NOFILE, &descriptors_limit) == -1)
 	{
-		std::lock_guard<std::mutex> lock(cerr_mutex);
 		LOG_CERROR("setrlimit failed");
 		return previous;
 	}
@@ -229,19 +387,11 @@ size_t set_maximal_avaliable_limit_of_fd() noexcept
 
 void checked_pclose(FILE *closable) noexcept
 {
+	int descriptor = fileno(closable);
+
 	if (pclose(closable) == -1)
 	{
-		{
-			std::lock_guard<std::mutex> lock(cerr_mutex);
-			LOG_CERROR("failed to pclose the popened file");
-		}
-
-		int descriptor = fileno(closable);
-		if (descriptor != -1)
-		{
-			std::lock_guard<std::mutex> lock(cerr_mutex);
-			std::cerr << "File with descriptor " << descriptor << " wasn't pclosed in proper way.\n";
-		}
+		LOG_CERROR_VALUE("failed to pclose the popened file with descriptor", descriptor);
 	}
 }
 
@@ -253,7 +403,6 @@ std::string popen_reader(const char *command)
 
 	if (!source)
 	{
-		std::lock_guard<std::mutex> lock(cerr_mutex);
 		LOG_CERROR("failed to popen the file");
 		return std::string{};
 	}
@@ -264,7 +413,6 @@ std::string popen_reader(const char *command)
 	rewind(source.get());
 	if (!fgets(buffer, buffer_size, source.get()))
 	{
-		std::lock_guard<std::mutex> lock(cerr_mutex);
 		LOG_CERROR("fgets failed so popen_reader returns \"\" (empty result)");
 		return std::string{};
 	}
@@ -291,15 +439,22 @@ time_t current_time_t()
 }
 
 std::string time_t_to_string(time_t seconds_since_epoch)
+{
+	std::string result;
+	append_time_t(result, seconds_since_epoch);
+
+	return result;
+}
+
+void append_time_t(std::string &destination, time_t seconds_since_epoch)
 {
 	struct tm time_now;
 	tzset();
 	struct tm *ret_val = localtime_r(&seconds_since_epoch, &time_now);
 	if (ret_val != &time_now)
 	{
-		std::lock_guard<std::mutex> lock(cerr_mutex);
 		LOG_CERROR("requested data-string will be empty due to fail of localtime_r");
-		return "";
+		return;
 	}
 
 	const char *day_of_week[7] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
@@ -311,65 +466,66 @@ std::string time_t_to_string(time_t seconds_since_epoch)
 		"Sep", "Oct", "Nov", "Dec"
 	};
 
-	constexpr size_t date_max_length = 512;
+	constexpr size_t date_max_length = 64;
 	char date_string[date_max_length];
 
-	const char format_string[] = ", %d  %Y %T GMT";
-	size_t strftime_res = strftime(date_string, date_max_length, format_string, &time_now);
-	if (strftime_res == 0)
+	int length = snprintf(date_string, date_max_length, "%s, %02d %s %d %02d:%02d:%02d GMT", day_of_week[time_now.tm_wday],
+			time_now.tm_mday, month[time_now.tm_mon], time_now.tm_year + 1900, time_now.tm_hour, time_now.tm_min,
+			time_now.tm_sec);
+	if (length <= 0 || static_cast<size_t>(length) >= date_max_length)
 	{
-		std::lock_guard<std::mutex> lock(cerr_mutex);
-		LOG_CERROR("requested data-string will be empty due to fail of strftime_res");
-		return "";
+		LOG_CERROR("requested data-string will be empty due to fail of snprintf");
+		return;
 	}
 
-	std::string result;
-	result += day_of_week[time_now.tm_wday];
-	result += date_string;
-	constexpr size_t month_position = 8;
-	result.insert(month_position, month[time_now.tm_mon]);
-
-	return result;
+	destination.append(date_string, length);
 }
 
 void atexit_terminator() noexcept
 {
+	// its jobs post their continuations to the workers
+	terminate_blocking_pool();
 	terminate_thread_pool();
 
-	std::clog << "Exiting. " << time_t_to_string(current_time_t()) << std::endl;
+	access_log::instance().stop();
+
+	LOG_CLOG_TEXT("Exiting.", time_t_to_string(current_time_t()).data());
+
+	async_logger::instance().stop();
 }
 
 [[noreturn]] void terminate_handler() noexcept
 {
-	terminate_thread_pool();
-	std::clog << "Terminating at " << time_t_to_string(current_time_t()) << std::endl;
+	// the cause is logged before anything is torn down, which may well fail on its own
+	LOG_CLOG_TEXT("Terminating at", time_t_to_string(current_time_t()).data());
 
 	std::exception_ptr current = std::current_exception();
 	if (current)
 	{
-		std::clog << "Current exception: ";
 		try
 		{
 			std::rethrow_exception(current);
 		}
 		catch (std::exception &e)
 		{
-			std::clog << e.what() << std::endl;
-			std::lock_guard<std::mutex> lock(cerr_mutex);
-			std::cerr << "Terminating because of unhandled exception: " << e.what() << "\n";
+			LOG_CERROR_TEXT("Terminating because of unhandled exception:", e.what());
 		}
 		catch (...)
 		{
-			std::clog << " yet unknown to the modern science." << std::endl;
-			std::lock_guard<std::mutex> lock(cerr_mutex);
-			std::cerr << "Terminating because of unknown exception (not an std::exception)\n";
+			LOG_CERROR_TEXT("Terminating because of unknown exception (not an std::exception)", nullptr);
 		}
 	}
 	else
 	{
-		std::lock_guard<std::mutex> lock(cerr_mutex);
-		std::cerr << "Terminating because of unhnandled bare throw; or unprovoked call to std::terminate()\n";
+		LOG_CERROR_TEXT("Terminating because of unhnandled bare throw; or unprovoked call to std::terminate()", nullptr);
 	}
 
+	// the pools detach the thread this runs on, if it's one of theirs, instead of joining it
+	terminate_blocking_pool();
+	terminate_thread_pool();
+	access_log::instance().stop();
+
+	async_logger::instance().stop();
+
 	std::abort();
 }
@@ -0,0 +1,302 @@
+#include "warm_up.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <memory_resource>
+#include <vector>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "access_log.h"
+#include "blocking_pool.h"
+#include "logging.h"
+#include "path_resolver.h"
+
+constexpr size_t warm_up::paths_per_job;
+
+warm_up &warm_up::instance()
+{
+	static warm_up object;
+	return object;
+}
+
+bool warm_up::start(const std::string &hot_list, bool walk) noexcept
+{
+	if (hot_list.empty() && !walk)
+	{
+		return false;
+	}
+
+	if (!blocking_threads)
+	{
+		LOG_CERROR_TEXT("There is no blocking pool to warm up the caches with, the server starts cold", nullptr);
+		return false;
+	}
+
+	started_ns = monotonic_now_ns();
+	limit = path_resolver::instance().capacity();
+	max_runners = std::max<size_t>(blocking_threads->size() / 2, 1);
+
+	try
+	{
+		// a missing list is no error, the first run has none yet
+		std::ifstream list(hot_list);
+		std::string line;
+		std::pmr::string relative;
+
+		while (!hot_list.empty() && std::getline(list, line))
+		{
+			if (!line.empty() && path_resolver::normalize(line, relative) && !relative.empty())
+			{
+				pending.push_back(item{ std::string(relative), false, true });
+			}
+		}
+
+		if (walk && limit)
+		{
+			pending.push_back(item{ std::string(), true, false });
+		}
+	}
+	catch (std::exception &e)
+	{
+		LOG_CERROR_TEXT("Failed to read the hot list, the caches are warmed without it:", e.what());
+	}
+
+	LOG_CLOG_VALUE("Warming up the caches in the background, hot paths:", pending.size() - (walk && limit ? 1 : 0));
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (pending.empty())
+		{
+			return false;
+		}
+		runners = 1;
+	}
+	launch();
+
+	return true;
+}
+
+void warm_up::launch() noexcept
+{
+	if (blocking_threads->submit([this]()
+			{
+				run_job();
+			}))
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if (--runners == 0)
+	{
+		pending.clear();
+		finish();
+	}
+}
+
+void warm_up::run_job() noexcept
+{
+	item next;
+	for (size_t i = 0; i != paths_per_job; ++i)
+	{
+		if (!take(next))
+		{
+			return;
+		}
+		process(next);
+	}
+
+	// queued anew behind the requests that came meanwhile
+	launch();
+}
+
+bool warm_up::take(item &next) noexcept
+{
+	bool more_runners = false;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		// hot paths are at the front and taken even with the path cache full, the walk stops there
+		if (!pending.empty() && !pending.front().hot && indexed.load(std::memory_order_relaxed) >= limit)
+		{
+			pending.clear();
+		}
+
+		if (pending.empty())
+		{
+			if (--runners == 0)
+			{
+				finish();
+			}
+			return false;
+		}
+
+		next = std::move(pending.front());
+		pending.pop_front();
+
+		if (runners < max_runners && pending.size() > runners * paths_per_job)
+		{
+			++runners;
+			more_runners = true;
+		}
+	}
+
+	if (more_runners)
+	{
+		launch();
+	}
+
+	return true;
+}
+
+void warm_up::process(const item &next) noexcept
+{
+	try
+	{
+		std::pmr::string relative{ next.relative.data(), next.relative.size() };
+		std::shared_ptr<const resolved_file> file = path_resolver::instance().resolve(relative);
+		if (!file)
+		{
+			return;
+		}
+		indexed.fetch_add(1, std::memory_order_relaxed);
+
+		if (file->directory())
+		{
+			if (next.directory)
+			{
+				list_directory(file->descriptor(), next.relative);
+			}
+		}
+		else if (next.hot)
+		{
+			// pages are read in the background, the descriptor may be closed meanwhile
+			if (posix_fadvise(file->descriptor(), 0, 0, POSIX_FADV_WILLNEED) == 0)
+			{
+				prefetched.fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+	}
+	catch (std::exception &e)
+	{
+		LOG_CERROR_TEXT("Failed to warm up a path:", e.what());
+	}
+}
+
+void warm_up::list_directory(int directory_fd, const std::string &relative)
+{
+	// a descriptor of its own, the cached one is shared with requests
+	int own = openat(directory_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (own == -1)
+	{
+		return;
+	}
+
+	DIR *directory = fdopendir(own);
+	if (!directory)
+	{
+		close(own);
+		return;
+	}
+
+	std::unique_ptr<DIR, int (*)(DIR *)> closer{ directory, closedir };
+
+	while (struct dirent *entry = readdir(directory))
+	{
+		std::string_view name{ entry->d_name };
+		if (name == "." || name == "..")
+		{
+			continue;
+		}
+
+		bool subdirectory = (entry->d_type == DT_DIR);
+		if (entry->d_type == DT_UNKNOWN)
+		{
+			struct stat status;
+			subdirectory = (fstatat(own, entry->d_name, &status, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(status.st_mode));
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+
+		// no use listing more than the path cache holds
+		if (indexed.load(std::memory_order_relaxed) + pending.size() >= limit)
+		{
+			break;
+		}
+		pending.push_back(item{ relative.empty() ? std::string(name) : relative + '/' + entry->d_name, subdirectory, false });
+	}
+}
+
+void warm_up::finish() noexcept
+{
+	int64_t duration = monotonic_now_ns() - started_ns;
+	duration_ns.store(duration > 0 ? duration : 1, std::memory_order_release);
+
+	LOG_CLOG_VALUE("Warm-up finished, milliseconds:", duration / 1000000);
+	LOG_CLOG_VALUE("Paths indexed by the warm-up:", indexed.load(std::memory_order_relaxed));
+	LOG_CLOG_VALUE("Hot files read ahead by the warm-up:", prefetched.load(std::memory_order_relaxed));
+}
+
+bool warm_up::save_hot_list(const std::string &hot_list, size_t count) noexcept
+{
+	static const char hex[] = "0123456789ABCDEF";
+
+	try
+	{
+		std::vector<std::string> paths = path_resolver::instance().hottest(count);
+
+		// written aside and renamed over, a list cut short by a crash is never read
+		std::string temporary = hot_list + ".tmp";
+		{
+			std::ofstream list(temporary, std::ios::trunc);
+			for (const std::string &path: paths)
+			{
+				std::string line{ "/" };
+				for (char c: path)
+				{
+					unsigned char u = static_cast<unsigned char>(c);
+					if (u <= ' ' || u >= 0x7f || c == '%')
+					{
+						line += '%';
+						line += hex[u >> 4];
+						line += hex[u & 0xf];
+					}
+					else
+					{
+						line += c;
+					}
+				}
+				list << line << '\n';
+			}
+
+			list.flush();
+			if (!list)
+			{
+				LOG_CERROR_TEXT("Failed to write the hot list", temporary.data());
+				return false;
+			}
+		}
+
+		if (rename(temporary.data(), hot_list.data()) == -1)
+		{
+			LOG_CERROR_TEXT("Failed to replace the hot list", hot_list.data());
+			return false;
+		}
+
+		LOG_CLOG_VALUE("Paths saved to the hot list:", paths.size());
+	}
+	catch (std::exception &e)
+	{
+		LOG_CERROR_TEXT("Failed to save the hot list:", e.what());
+		return false;
+	}
+
+	return true;
+}
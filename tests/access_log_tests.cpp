@@ -0,0 +1,146 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "access_log.h"
+#include "check.h"
+
+namespace
+{
+	const size_t per_segment = (1024 * 1024 - sizeof(access_log_file_header)) / sizeof(access_log_record);
+
+	std::string segment_name(const std::string &prefix, unsigned sequence)
+	{
+		char name[4096];
+		snprintf(name, sizeof(name), "%s.%06u.bin", prefix.c_str(), sequence);
+		return name;
+	}
+
+	bool exists(const std::string &name)
+	{
+		struct stat status;
+		return stat(name.c_str(), &status) == 0;
+	}
+
+	// appended no faster than the writer takes them, so that none is dropped for a full ring
+	void write_records(access_log &log, size_t count, unsigned short status)
+	{
+		access_log_record record;
+		memset(&record, 0, sizeof(record));
+		record.timestamp_ns = realtime_now_ns();
+		record.status = status;
+		record.set_path("/index.html", 11);
+
+		uint64_t target = log.records_written() + count;
+		while (count)
+		{
+			size_t batch = std::min(count, access_log::ring_capacity / 2);
+			for (size_t i = 0; i != batch; ++i)
+			{
+				log.append(record);
+			}
+			count -= batch;
+
+			uint64_t expected = target - count;
+			for (int wait = 0; wait != 1000 && log.records_written() < expected; ++wait)
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(2));
+			}
+		}
+	}
+
+	void test_rotation(const std::string &prefix)
+	{
+		access_log &log = access_log::instance();
+
+		check(log.start(prefix, 1), "the access log starts");
+		check(log.enabled(), "the access log is enabled once started");
+		write_records(log, per_segment + 10, 404);
+		log.stop();
+
+		check(log.records_written() == per_segment + 10, "every record is written");
+		check(log.dropped() == 0, "no record is dropped");
+
+		FILE *first = fopen(segment_name(prefix, 1).c_str(), "rb");
+		access_log_file_header header;
+		check(first && fread(&header, sizeof(header), 1, first) == 1, "the first segment has a header");
+		check(first && header.valid() && header.sequence == 1, "the header is of this format and numbers the segment");
+
+		access_log_record record;
+		check(first && fread(&record, sizeof(record), 1, first) == 1, "the first segment has records");
+		check(first && record.status == 404 && record.path_length == 11 && memcmp(record.path, "/index.html", 11) == 0,
+				"a record reads back as it was written");
+		if (first)
+		{
+			fclose(first);
+		}
+
+		struct stat status;
+		check(stat(segment_name(prefix, 1).c_str(), &status) == 0 &&
+				static_cast<size_t>(status.st_size) == sizeof(access_log_file_header) + per_segment * sizeof(access_log_record),
+				"a full segment holds as many records as fit");
+		check(stat(segment_name(prefix, 2).c_str(), &status) == 0 &&
+				static_cast<size_t>(status.st_size) == sizeof(access_log_file_header) + 10 * sizeof(access_log_record),
+				"the last segment is truncated to its records");
+		check(!exists(segment_name(prefix, 3)), "no segment is opened ahead of records");
+
+		unlink(segment_name(prefix, 1).c_str());
+		unlink(segment_name(prefix, 2).c_str());
+	}
+	// restarted, the log goes on after the highest segment there and keeps only the newest when told to
+	void test_numbering_and_retention(const std::string &prefix)
+	{
+		// a segment of an earlier run with a gap below it
+		FILE *earlier = fopen(segment_name(prefix, 3).data(), "w");
+		check(earlier && fputs("earlier", earlier) >= 0 && fclose(earlier) == 0, "an earlier segment is made");
+
+		access_log &log = access_log::instance();
+
+		check(log.start(prefix, 1), "the access log starts after the earlier segment");
+		write_records(log, per_segment * 2 + 1, 200);
+		log.stop();
+
+		struct stat status;
+		check(stat(segment_name(prefix, 3).data(), &status) == 0 && status.st_size == 7, "the earlier segment is left as it was");
+		check(exists(segment_name(prefix, 4)) && exists(segment_name(prefix, 5)) && exists(segment_name(prefix, 6)),
+				"segments go on after the highest one");
+		check(!exists(segment_name(prefix, 1)), "no segment is made below the highest one");
+		check(log.dropped() == 0, "no record is dropped");
+
+		check(log.start(prefix, 1, 2), "the access log starts again, keeping two segments");
+		write_records(log, 1, 200);
+		log.stop();
+
+		check(exists(segment_name(prefix, 6)) && exists(segment_name(prefix, 7)), "the two newest segments are kept");
+		check(!exists(segment_name(prefix, 3)) && !exists(segment_name(prefix, 4)) && !exists(segment_name(prefix, 5)),
+				"older segments are removed");
+
+		for (unsigned i = 3; i <= 7; ++i)
+		{
+			unlink(segment_name(prefix, i).data());
+		}
+	}
+}
+
+int main()
+{
+	char directory[] = "/tmp/access_log_tests.XXXXXX";
+	if (!mkdtemp(directory))
+	{
+		fprintf(stderr, "FAILED: a temporary directory is made\n");
+		return EXIT_FAILURE;
+	}
+
+	test_rotation(std::string(directory) + "/access");
+	test_numbering_and_retention(std::string(directory) + "/access");
+
+	rmdir(directory);
+
+	return check_result();
+}
@@ -0,0 +1,37 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <cstdio>
+#include <cstdlib>
+
+/*
+*	Harness of the regression tests, one executable per module run by ctest: every failed check is reported
+*	and counted, and main returns check_result() once they have all run.
+*/
+inline int &check_failures()
+{
+	static int failures = 0;
+	return failures;
+}
+
+inline void check(bool condition, const char *what)
+{
+	if (!condition)
+	{
+		fprintf(stderr, "FAILED: %s\n", what);
+		++check_failures();
+	}
+}
+
+inline int check_result()
+{
+	if (check_failures())
+	{
+		fprintf(stderr, "%d check(s) failed\n", check_failures());
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+#endif		// CHECK_H
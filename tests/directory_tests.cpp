@@ -0,0 +1,165 @@
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "directory_listing.h"
+#include "server.h"
+#include "check.h"
+
+namespace
+{
+	const char odd_name[] = "<b>&\"c\".txt";
+
+	bool make_file(const std::string &name, const char *text)
+	{
+		int fd = open(name.data(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd == -1)
+		{
+			return false;
+		}
+		ssize_t length = static_cast<ssize_t>(strlen(text));
+		bool written = (write(fd, text, length) == length);
+		close(fd);
+		return written;
+	}
+
+	std::string contents(const directory_listing &listing)
+	{
+		std::string text(listing.size(), '\0');
+		ssize_t read = pread(listing.descriptor(), text.data(), text.size(), 0);
+		text.resize(read > 0 ? static_cast<size_t>(read) : 0);
+		return text;
+	}
+
+	bool has(const std::string &text, const char *part)
+	{
+		return text.find(part) != std::string::npos;
+	}
+
+	void test_html(int directory_fd, const struct stat &status)
+	{
+		std::shared_ptr<const directory_listing> listing = directory_listing::render(directory_fd, status, "/files",
+				listing_format::html);
+		std::string text = contents(*listing);
+
+		check(listing->size() == text.size(), "the whole listing reads back");
+		check(has(text, "<title>Index of /files/</title>"), "the listing names its directory with a slash");
+		check(has(text, "<a href=\"../\">../</a>"), "a directory below the root links its parent");
+		check(has(text, "<a href=\"/files/a.txt\">a.txt</a></td><td>5</td>"), "a file is linked with its size");
+		check(has(text, "<a href=\"/files/sub/\">sub/</a>"), "a subdirectory is linked with its slash");
+		check(has(text, "href=\"/files/%3Cb%3E%26%22c%22.txt\">&lt;b&gt;&amp;&quot;c&quot;.txt</a>"),
+				"names are encoded in links and escaped in text");
+		check(strcmp(listing->mime_type(), "text/html; charset=utf-8") == 0, "an HTML listing is sent as HTML");
+	}
+
+	void test_json(int directory_fd, const struct stat &status)
+	{
+		std::shared_ptr<const directory_listing> listing = directory_listing::render(directory_fd, status, "/files/",
+				listing_format::json);
+		std::string text = contents(*listing);
+
+		check(has(text, "{\"path\":\"/files/\",\"entries\":["), "the listing names its directory");
+		check(has(text, "{\"name\":\"a.txt\",\"type\":\"file\",\"size\":5,"), "a file comes with its size");
+		check(has(text, "{\"name\":\"sub\",\"type\":\"directory\",\"size\":0,"), "a subdirectory is told apart");
+		check(has(text, "\"name\":\"<b>&\\\"c\\\".txt\""), "names are escaped as JSON strings");
+		check(strcmp(listing->mime_type(), "application/json") == 0, "a JSON listing is sent as JSON");
+	}
+
+	void test_cache(const std::string &directory)
+	{
+		int directory_fd = open(directory.data(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		listing_cache &cache = listing_cache::instance();
+
+		std::shared_ptr<const directory_listing> first = cache.get(directory_fd, "files", "/files", listing_format::html);
+		std::shared_ptr<const directory_listing> again = cache.get(directory_fd, "files", "/files", listing_format::html);
+		check(first && first == again, "an unchanged directory is listed once");
+
+		// the modification time moves on, even on a coarse clock
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		check(make_file(directory + "/added.txt", "added"), "a file is added");
+
+		std::shared_ptr<const directory_listing> changed = cache.get(directory_fd, "files", "/files", listing_format::html);
+		check(changed && changed != first && has(contents(*changed), "added.txt"), "a changed directory is listed again");
+
+		close(directory_fd);
+		unlink((directory + "/added.txt").data());
+	}
+
+	// a directory requested without its slash is redirected, relative links of its listing would resolve against the parent
+	void test_needs_trailing_slash()
+	{
+		check(needs_trailing_slash("/sub", "sub"), "a directory without its slash is redirected");
+		check(needs_trailing_slash("/a/b", "a/b"), "a nested directory without its slash is redirected");
+		check(needs_trailing_slash("/sub/.", "sub"), "a dot segment doesn't stand for the slash");
+		check(needs_trailing_slash("/%73ub", "sub"), "an encoded path is redirected as well");
+		check(!needs_trailing_slash("/sub/", "sub"), "a directory with its slash is served");
+		check(!needs_trailing_slash("/sub//", "sub"), "a directory with repeated slashes is served");
+		check(!needs_trailing_slash("/", ""), "the root is served");
+		check(!needs_trailing_slash("/.", ""), "the root by a dot segment is served");
+	}
+
+	void test_redirect_response()
+	{
+		std::string closing;
+		append_redirect(closing, "sub", "", false);
+		check(closing == "HTTP/1.0 301 Moved Permanently\r\nLocation: /sub/\r\nContent-Length: 0\r\n\r\n",
+				"the redirect points to the path with a slash");
+
+		std::string kept_alive;
+		append_redirect(kept_alive, "a/b", "?x=1&y", true);
+		check(kept_alive == "HTTP/1.0 301 Moved Permanently\r\nLocation: /a/b/?x=1&y\r\nContent-Length: 0\r\n"
+				"Connection: keep-alive\r\n\r\n", "the query follows the slash, with the connection");
+
+		// //evil.com/sub normalizes to evil.com/sub, a path of this site
+		std::string rooted;
+		append_redirect(rooted, "evil.com/sub", "", false);
+		check(rooted.find("Location: /evil.com/sub/\r\n") != std::string::npos, "the redirect never leaves the site");
+
+		std::string encoded;
+		append_redirect(encoded, "a b\r\nSet-Cookie: x", "?q\r\nX: y", false);
+		check(encoded.find("Location: /a%20b%0D%0ASet-Cookie:%20x/?q%0D%0AX:%20y\r\n") != std::string::npos,
+				"a decoded path and the query are encoded again, no header can be injected");
+	}
+}
+
+int main()
+{
+	char directory[] = "/tmp/directory_tests.XXXXXX";
+	if (!mkdtemp(directory))
+	{
+		fprintf(stderr, "FAILED: a temporary directory is made\n");
+		return EXIT_FAILURE;
+	}
+	std::string root = directory;
+
+	check(make_file(root + "/a.txt", "hello") && make_file(root + '/' + odd_name, "odd") && mkdir((root + "/sub").data(), 0755) == 0,
+			"the directory is filled");
+
+	int directory_fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	struct stat status;
+	if (directory_fd == -1 || fstat(directory_fd, &status) == -1)
+	{
+		fprintf(stderr, "FAILED: the directory is opened\n");
+		return EXIT_FAILURE;
+	}
+
+	test_html(directory_fd, status);
+	test_json(directory_fd, status);
+	close(directory_fd);
+
+	test_cache(root);
+	test_needs_trailing_slash();
+	test_redirect_response();
+
+	unlink((root + "/a.txt").data());
+	unlink((root + '/' + odd_name).data());
+	rmdir((root + "/sub").data());
+	rmdir(directory);
+
+	return check_result();
+}
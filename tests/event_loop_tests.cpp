@@ -0,0 +1,199 @@
+#include <atomic>
+#include <thread>
+
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "event_loop.h"
+#include "check.h"
+
+namespace
+{
+	class counting_handler final : public event_handler
+	{
+	public:
+		int handled = 0;
+		uint32_t last = 0;
+
+		void on_event(uint32_t events) noexcept override
+		{
+			++handled;
+			last = events;
+		}
+	};
+
+	class counting_timer final : public timer_handler
+	{
+	public:
+		int fired = 0;
+
+		void on_timer() noexcept override
+		{
+			++fired;
+		}
+	};
+
+	void test_dispatch()
+	{
+		event_loop loop;
+
+		int pair[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1)
+		{
+			check(false, "socketpair");
+			return;
+		}
+
+		counting_handler handler;
+		check(loop.add(pair[0], EPOLLIN, &handler), "the handler is registered");
+
+		loop.poll();
+		check(handler.handled == 0, "nothing is dispatched before the descriptor is ready");
+
+		check(write(pair[1], "x", 1) == 1, "the socket is written to");
+		loop.poll();
+		check(handler.handled == 1 && (handler.last & EPOLLIN), "a ready descriptor is dispatched to its handler");
+
+		loop.remove(pair[0]);
+		check(write(pair[1], "x", 1) == 1, "the socket is written to again");
+		loop.poll();
+		check(handler.handled == 1, "a removed descriptor isn't dispatched");
+
+		close(pair[0]);
+		close(pair[1]);
+	}
+
+	void test_timer()
+	{
+		event_loop loop;
+		counting_timer owner;
+		timer deadline(&owner);
+
+		loop.arm(deadline, event_loop::tick_ms);
+		check(deadline.armed(), "the timer is armed");
+
+		for (int i = 0; i != 10 && !owner.fired; ++i)
+		{
+			loop.sleep_unless([]() { return false; });
+		}
+		check(owner.fired == 1 && !deadline.armed(), "a due timer fires once");
+	}
+
+	void test_wake()
+	{
+		event_loop loop;
+		std::atomic<bool> woken{ false };
+
+		// woken up repeatedly until the loop was caught asleep
+		std::thread waker([&]()
+		{
+			while (!loop.wake())
+			{
+				std::this_thread::yield();
+			}
+			woken.store(true);
+		});
+
+		loop.sleep_unless([]() { return false; });
+		waker.join();
+
+		check(woken.load(), "a sleeping loop returns once woken by another thread");
+	}
+
+	class closing_handler final : public event_handler
+	{
+	public:
+		event_loop &loop;
+		int fd;
+		closing_handler *peer = nullptr;
+		bool retired = false;
+		bool destroyed = false;
+		bool handled_destroyed = false;
+		int handled = 0;
+
+		closing_handler(event_loop &owner, int descriptor) :
+			loop(owner),
+			fd{ descriptor }
+		{}
+
+		static void destroy(void *object)
+		{
+			closing_handler *handler = static_cast<closing_handler *>(object);
+			handler->loop.remove(handler->fd);
+			handler->destroyed = true;
+		}
+
+		void on_event(uint32_t) noexcept override
+		{
+			++handled;
+			handled_destroyed = handled_destroyed || destroyed;
+
+			// a handler already closed by its peer leaves the peer alone
+			if (!retired && !peer->retired)
+			{
+				peer->retired = true;
+				loop.retire(destroy, peer);
+			}
+		}
+	};
+
+	// handlers of one batch closing each other: whichever is dispatched first retires the other one,
+	// which must not be destroyed before its own events of the batch are handled
+	void test_handler_closed_within_batch()
+	{
+		event_loop loop;
+
+		int first[2];
+		int second[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, first) == -1 || socketpair(AF_UNIX, SOCK_STREAM, 0, second) == -1)
+		{
+			check(false, "socketpair");
+			return;
+		}
+
+		closing_handler a(loop, first[0]);
+		closing_handler b(loop, second[0]);
+		a.peer = &b;
+		b.peer = &a;
+
+		check(loop.add(a.fd, EPOLLIN, &a) && loop.add(b.fd, EPOLLIN, &b), "both handlers are registered");
+
+		// both readable before the loop looks, so they come in one batch
+		check(write(first[1], "x", 1) == 1 && write(second[1], "x", 1) == 1, "both sockets are written to");
+
+		loop.poll();
+
+		check(a.handled == 1 && b.handled == 1, "both handlers get their event of the batch");
+		check(!a.handled_destroyed && !b.handled_destroyed, "no handler is dispatched to after it's destroyed");
+		check(a.destroyed != b.destroyed, "the handler retired during the batch is destroyed once it's over");
+
+		for (int i: { first[0], first[1], second[0], second[1] })
+		{
+			close(i);
+		}
+	}
+
+	void test_retired_outside_dispatch()
+	{
+		event_loop loop;
+
+		bool destroyed = false;
+		loop.retire([](void *flag)
+				{
+					*static_cast<bool *>(flag) = true;
+				}, &destroyed);
+
+		check(destroyed, "an object retired outside a dispatch is destroyed at once");
+	}
+}
+
+int main()
+{
+	test_dispatch();
+	test_timer();
+	test_wake();
+	test_handler_closed_within_batch();
+	test_retired_outside_dispatch();
+
+	return check_result();
+}
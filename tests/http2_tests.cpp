@@ -0,0 +1,329 @@
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "http2.h"
+#include "check.h"
+
+namespace
+{
+	using field_list = std::vector<std::pair<std::string, std::string>>;
+
+	// the hexadecimal digits of the text, spaces between them skipped
+	std::vector<uint8_t> bytes(std::string_view hex)
+	{
+		std::vector<uint8_t> result;
+		int high = -1;
+		for (char c: hex)
+		{
+			int value = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+			if (value == -1)
+			{
+				continue;
+			}
+			if (high == -1)
+			{
+				high = value;
+			}
+			else
+			{
+				result.push_back(static_cast<uint8_t>(high << 4 | value));
+				high = -1;
+			}
+		}
+		return result;
+	}
+
+	bool decodes_to(hpack_decoder &decoder, std::string_view hex, const field_list &expected)
+	{
+		std::vector<uint8_t> block = bytes(hex);
+		std::vector<http2_header> fields;
+		if (!decoder.decode(block.data(), block.size(), fields) || fields.size() != expected.size())
+		{
+			return false;
+		}
+
+		for (size_t i = 0; i != fields.size(); ++i)
+		{
+			if (fields[i].name != expected[i].first || fields[i].value != expected[i].second)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool rejects(std::string_view hex)
+	{
+		hpack_decoder decoder;
+		std::vector<uint8_t> block = bytes(hex);
+		std::vector<http2_header> fields;
+		return !decoder.decode(block.data(), block.size(), fields);
+	}
+
+	// RFC 7541, C.2
+	void test_literal_fields()
+	{
+		hpack_decoder decoder;
+		check(decodes_to(decoder, "400a 6375 7374 6f6d 2d6b 6579 0d63 7573 746f 6d2d 6865 6164 6572",
+				{ { "custom-key", "custom-header" } }), "C.2.1 a literal with indexing decodes");
+		check(decodes_to(decoder, "be", { { "custom-key", "custom-header" } }), "C.2.1 the literal is indexed");
+
+		check(decodes_to(decoder, "040c 2f73 616d 706c 652f 7061 7468", { { ":path", "/sample/path" } }),
+				"C.2.2 a literal without indexing decodes");
+		check(decodes_to(decoder, "1008 7061 7373 776f 7264 0673 6563 7265 74", { { "password", "secret" } }),
+				"C.2.3 a never indexed literal decodes");
+		check(decodes_to(decoder, "be", { { "custom-key", "custom-header" } }), "C.2.2 and C.2.3 don't touch the table");
+		check(decodes_to(decoder, "82", { { ":method", "GET" } }), "C.2.4 an indexed field decodes");
+	}
+
+	// RFC 7541, C.3 and C.4: the same requests plain and Huffman-coded
+	void test_requests(const char *const blocks[3], const char *what)
+	{
+		hpack_decoder decoder;
+		bool decoded = decodes_to(decoder, blocks[0], { { ":method", "GET" }, { ":scheme", "http" }, { ":path", "/" },
+				{ ":authority", "www.example.com" } });
+		decoded = decodes_to(decoder, blocks[1], { { ":method", "GET" }, { ":scheme", "http" }, { ":path", "/" },
+				{ ":authority", "www.example.com" }, { "cache-control", "no-cache" } }) && decoded;
+		decoded = decodes_to(decoder, blocks[2], { { ":method", "GET" }, { ":scheme", "https" }, { ":path", "/index.html" },
+				{ ":authority", "www.example.com" }, { "custom-key", "custom-value" } }) && decoded;
+
+		// the newest entry first, then the older ones in turn
+		decoded = decodes_to(decoder, "be bf c0", { { "custom-key", "custom-value" }, { "cache-control", "no-cache" },
+				{ ":authority", "www.example.com" } }) && decoded;
+		check(decoded, what);
+
+		std::vector<uint8_t> past = bytes("c1");
+		std::vector<http2_header> fields;
+		check(!decoder.decode(past.data(), past.size(), fields), "an index past the dynamic table is refused");
+	}
+
+	// RFC 7541, C.5 and C.6: responses with the table limited to 256 bytes, the first block opening with the update
+	void test_responses(const char *const blocks[3], const char *what)
+	{
+		hpack_decoder decoder;
+		std::string first = std::string("3fe101") + blocks[0];
+
+		bool decoded = decodes_to(decoder, first, { { ":status", "302" }, { "cache-control", "private" },
+				{ "date", "Mon, 21 Oct 2013 20:13:21 GMT" }, { "location", "https://www.example.com" } });
+		decoded = decodes_to(decoder, blocks[1], { { ":status", "307" }, { "cache-control", "private" },
+				{ "date", "Mon, 21 Oct 2013 20:13:21 GMT" }, { "location", "https://www.example.com" } }) && decoded;
+		decoded = decodes_to(decoder, blocks[2], { { ":status", "200" }, { "cache-control", "private" },
+				{ "date", "Mon, 21 Oct 2013 20:13:22 GMT" }, { "location", "https://www.example.com" },
+				{ "content-encoding", "gzip" }, { "set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1" } }) &&
+				decoded;
+		check(decoded, what);
+
+		// 215 bytes in three entries are left of the last block, the fourth one is evicted
+		check(decodes_to(decoder, "be bf c0", { { "set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1" },
+				{ "content-encoding", "gzip" }, { "date", "Mon, 21 Oct 2013 20:13:22 GMT" } }), "the table keeps the newest entries");
+		std::vector<uint8_t> evicted = bytes("c1");
+		std::vector<http2_header> fields;
+		check(!decoder.decode(evicted.data(), evicted.size(), fields), "entries over the size of the table are evicted");
+	}
+
+	void test_malformed_blocks()
+	{
+		// a literal name of four bytes of ones holds the whole of EOS
+		check(rejects("0084 ffff ffff 0161"), "EOS in a Huffman string is refused");
+
+		// 'a' is 00011, the three bits after it are ones, then a whole byte more
+		check(!rejects("0081 1f01 61"), "a Huffman string padded with up to seven ones decodes");
+		check(rejects("0082 1fff 0161"), "padding longer than seven bits is refused");
+		check(rejects("0081 1801 61"), "padding that isn't the start of EOS is refused");
+
+		check(!rejects("3f80 8080 00"), "an integer with four continuation bytes is read whole");
+		check(rejects("3f80 8080 8000"), "an integer past four continuation bytes is refused");
+		check(rejects("3fe2 1f"), "a table size above the allowed one is refused");
+		check(rejects("82 3fe1 01"), "an update of the table size after a field is refused");
+	}
+
+	std::string frame(uint8_t type, uint8_t flags, uint32_t stream, std::string_view payload)
+	{
+		std::string result;
+		result += static_cast<char>(payload.size() >> 16);
+		result += static_cast<char>(payload.size() >> 8);
+		result += static_cast<char>(payload.size());
+		result += static_cast<char>(type);
+		result += static_cast<char>(flags);
+		result += static_cast<char>(stream >> 24);
+		result += static_cast<char>(stream >> 16);
+		result += static_cast<char>(stream >> 8);
+		result += static_cast<char>(stream);
+		result += payload;
+		return result;
+	}
+
+	// the error code of the GOAWAY in the output, -1 if there is none
+	long long goaway_error(const std::string &output)
+	{
+		for (size_t i = 0; i + http2_session::frame_header_size <= output.size(); )
+		{
+			const uint8_t *header = reinterpret_cast<const uint8_t *>(output.data() + i);
+			size_t length = size_t{ header[0] } << 16 | size_t{ header[1] } << 8 | header[2];
+			if (header[3] == 0x7 && length >= 8 && i + http2_session::frame_header_size + length <= output.size())
+			{
+				const uint8_t *code = header + http2_session::frame_header_size + 4;
+				return uint32_t{ code[0] } << 24 | uint32_t{ code[1] } << 16 | uint32_t{ code[2] } << 8 | code[3];
+			}
+			i += http2_session::frame_header_size + length;
+		}
+		return -1;
+	}
+
+	// GET / over http, the path given as a literal without indexing
+	std::string request_block(std::string_view path)
+	{
+		std::string block = "\x82\x86\x04";
+		block += static_cast<char>(path.size());
+		block += path;
+		return block;
+	}
+
+	// the preface and empty settings of a client
+	std::string opening()
+	{
+		return std::string(http2_preface) + frame(0x4, 0, 0, "");
+	}
+
+	void test_continuation()
+	{
+		std::string block = request_block("/split");
+
+		http2_session whole(100);
+		std::string input = opening() + frame(0x1, 0x1, 1, block.substr(0, 2)) + frame(0x9, 0x4, 1, block.substr(2));
+		whole.receive(input.data(), input.size());
+		check(whole.new_requests().size() == 1 && whole.new_requests()[0].path == "/split",
+				"a header block continued in a CONTINUATION is decoded whole");
+
+		http2_session interleaved(100);
+		input = opening() + frame(0x1, 0x1, 1, block.substr(0, 2)) + frame(0x1, 0x5, 3, request_block("/other"));
+		interleaved.receive(input.data(), input.size());
+		check(goaway_error(interleaved.pending_output()) == static_cast<long long>(http2_error::protocol_error) &&
+				interleaved.done(), "a frame of another stream within a header block is a protocol error");
+
+		http2_session other_stream(100);
+		input = opening() + frame(0x1, 0x1, 1, block.substr(0, 2)) + frame(0x9, 0x4, 3, block.substr(2));
+		other_stream.receive(input.data(), input.size());
+		check(goaway_error(other_stream.pending_output()) == static_cast<long long>(http2_error::protocol_error),
+				"a CONTINUATION of another stream is a protocol error");
+
+		http2_session stray(100);
+		input = opening() + frame(0x9, 0x4, 1, block);
+		stray.receive(input.data(), input.size());
+		check(goaway_error(stray.pending_output()) == static_cast<long long>(http2_error::protocol_error),
+				"a CONTINUATION without a block to continue is a protocol error");
+	}
+
+	void test_data_limits()
+	{
+		// a request with a body, its stream open for DATA
+		std::string input = opening() + frame(0x1, 0x4, 1, request_block("/upload"));
+
+		// bodies are credited back every half window, so a client within its windows never runs out of them
+		http2_session credited(100);
+		credited.receive(input.data(), input.size());
+		std::string chunk(http2_session::max_frame_size, 'x');
+		for (int i = 0; i != 16; ++i)
+		{
+			std::string data = frame(0x0, 0, 1, chunk);
+			credited.receive(data.data(), data.size());
+		}
+		check(goaway_error(credited.pending_output()) == -1 && !credited.done(),
+				"four windows of DATA credited back as they arrive are taken");
+
+		// no frame is larger than a window can take at once; one above the frame size is refused before it's read
+		http2_session oversized(100);
+		input += frame(0x0, 0, 1, std::string(http2_session::max_frame_size + 1, 'x'));
+		oversized.receive(input.data(), input.size());
+		check(goaway_error(oversized.pending_output()) == static_cast<long long>(http2_error::frame_size_error) &&
+				oversized.done(), "DATA over the frame size is a connection error");
+
+		http2_session padded(100);
+		input = opening() + frame(0x1, 0x4, 1, request_block("/upload")) + frame(0x0, 0x8, 1, std::string("\x05xxxx", 5));
+		padded.receive(input.data(), input.size());
+		check(goaway_error(padded.pending_output()) == static_cast<long long>(http2_error::protocol_error),
+				"padding longer than DATA is a protocol error");
+
+		http2_session idle_stream(100);
+		input = opening() + frame(0x0, 0, 1, "xxxx");
+		idle_stream.receive(input.data(), input.size());
+		check(goaway_error(idle_stream.pending_output()) == static_cast<long long>(http2_error::protocol_error),
+				"DATA on a stream never opened is a protocol error");
+	}
+
+	void test_upgrade()
+	{
+		http2_request request;
+		request.method = "GET";
+		request.path = "/";
+
+		http2_session valid(100);
+		check(valid.upgrade("AAMAAABkAAQAAP__", request) && valid.new_requests().size() == 1 &&
+				valid.new_requests()[0].stream == 1, "an upgrade with valid settings becomes stream 1");
+
+		http2_session not_base64(100);
+		check(!not_base64.upgrade("AAMA*ABk", request), "settings outside the URL-safe alphabet are refused");
+
+		http2_session truncated(100);
+		check(!truncated.upgrade("AAMAAAB", request), "settings that aren't a whole number of entries are refused");
+
+		http2_session push(100);
+		check(!push.upgrade("AAIAAAAC", request), "an upgrade enabling push with 2 is refused");
+
+		http2_session window(100);
+		check(!window.upgrade("AASAAAAA", request), "an initial window above the maximum is refused");
+	}
+}
+
+int main()
+{
+	test_literal_fields();
+
+	const char *const plain_requests[3] =
+	{
+		"8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+		"8286 84be 5808 6e6f 2d63 6163 6865",
+		"8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65"
+	};
+	test_requests(plain_requests, "C.3 requests decode and fill the dynamic table");
+
+	const char *const huffman_requests[3] =
+	{
+		"8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff",
+		"8286 84be 5886 a8eb 1064 9cbf",
+		"8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf"
+	};
+	test_requests(huffman_requests, "C.4 Huffman-coded requests decode and fill the dynamic table");
+
+	const char *const plain_responses[3] =
+	{
+		"4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3120 474d"
+		"546e 1768 7474 7073 3a2f 2f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+		"4803 3330 37c1 c0bf",
+		"88c1 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3220 474d 54c0 5a04 677a 6970 7738 666f"
+		"6f3d 4153 444a 4b48 514b 425a 584f 5157 454f 5049 5541 5851 5745 4f49 553b 206d 6178 2d61 6765 3d33 3630 303b"
+		"2076 6572 7369 6f6e 3d31"
+	};
+	test_responses(plain_responses, "C.5 responses decode and evict from the dynamic table");
+
+	const char *const huffman_responses[3] =
+	{
+		"4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005 9504 0b81 66e0 82a6 2d1b ff6e 919d 29ad 1718 63c7"
+		"8f0b 97c8 e9ae 82ae 43d3",
+		"4883 640e ffc1 c0bf",
+		"88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d 1bff c05a 839b d9ab 77ad 94e7 821d d7f2 e6c7 b335"
+		"dfdf cd5b 3960 d5af 2708 7f36 72c1 ab27 0fb5 291f 9587 3160 65c0 03ed 4ee5 b106 3d50 07"
+	};
+	test_responses(huffman_responses, "C.6 Huffman-coded responses decode and evict from the dynamic table");
+
+	test_malformed_blocks();
+	test_continuation();
+	test_data_limits();
+	test_upgrade();
+
+	return check_result();
+}
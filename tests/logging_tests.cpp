@@ -0,0 +1,158 @@
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "logging.h"
+#include "check.h"
+
+namespace
+{
+	std::string contents(const std::string &name)
+	{
+		std::ifstream file(name.c_str());
+		std::stringstream text;
+		text << file.rdbuf();
+		return text.str();
+	}
+
+	void test_format()
+	{
+		log_record record;
+		memset(&record, 0, sizeof(record));
+		record.function = "serve";
+		record.file = "server.cpp";
+		record.message = "connections open:";
+		record.line = 42;
+		record.level = log_level::error;
+		record.has_errno = true;
+		record.error_number = ENOENT;
+		record.has_value = true;
+		record.value = 7;
+		record.detail_length = 4;
+		memcpy(record.detail, "/tmp", 4);
+
+		char buffer[1024];
+		size_t length = format_log_record(record, buffer, sizeof(buffer));
+		std::string text(buffer, length);
+
+		check(text.find("Error in serve (server.cpp, line 42)\n") != std::string::npos, "an error names where it happened");
+		check(text.find("errno 2 means") != std::string::npos, "an error tells its errno");
+		check(text.find("Therefore connections open: 7 /tmp\n\n") != std::string::npos, "the message comes with its value and detail");
+
+		char small[16];
+		check(format_log_record(record, small, sizeof(small)) < sizeof(small), "a record is cut to the buffer");
+	}
+
+	void test_records_reach_files(const std::string &directory)
+	{
+		async_logger &logger = async_logger::instance();
+
+		check(chdir(directory.c_str()) == 0 && logger.start(), "the logger starts");
+		check(logger.running(), "the logger runs once started");
+
+		LOG_CLOG_VALUE("answered requests:", 12);
+		LOG_CERROR_TEXT("a failure of the test", "with detail");
+		logger.stop();
+
+		check(!logger.running(), "the logger is stopped");
+
+		std::string log = contents(directory + '/' + async_logger::log_file_log_name);
+		std::string errors = contents(directory + '/' + async_logger::log_file_err_name);
+
+		check(log.find("answered requests: 12\n") != std::string::npos, "information goes to the log file");
+		check(errors.find("Therefore a failure of the test with detail") != std::string::npos, "errors go to the error file");
+		check(log.find("a failure of the test") == std::string::npos, "errors stay out of the log file");
+		check(logger.dropped() == 0, "no record is dropped");
+	}
+	size_t open_descriptors()
+	{
+		size_t count = 0;
+		if (DIR *listing = opendir("/proc/self/fd"))
+		{
+			while (readdir(listing))
+			{
+				++count;
+			}
+			closedir(listing);
+		}
+		return count;
+	}
+
+	// started again elsewhere, the logger writes to the files it opened this time
+	void test_restart_elsewhere(const std::string &first, const std::string &second)
+	{
+		async_logger &logger = async_logger::instance();
+		size_t descriptors = open_descriptors();
+
+		check(chdir(first.data()) == 0 && logger.start(), "the logger starts in the first directory");
+		LOG_CLOG("written to the first directory");
+		logger.stop();
+
+		check(open_descriptors() == descriptors, "the files are closed as the logger stops");
+
+		check(chdir(second.data()) == 0 && logger.start(), "the logger starts in the second directory");
+		LOG_CLOG("written to the second directory");
+		LOG_CERROR_TEXT("an error in the second directory", nullptr);
+		logger.stop();
+
+		std::string first_log = contents(first + '/' + async_logger::log_file_log_name);
+		std::string second_log = contents(second + '/' + async_logger::log_file_log_name);
+		std::string second_errors = contents(second + '/' + async_logger::log_file_err_name);
+
+		check(first_log.find("written to the first directory") != std::string::npos, "the first run is logged where it ran");
+		check(first_log.find("second") == std::string::npos, "the second run doesn't write to the files of the first");
+		check(second_log.find("written to the second directory") != std::string::npos, "the second run is logged where it ran");
+		check(second_errors.find("an error in the second directory") != std::string::npos, "errors follow as well");
+		check(open_descriptors() == descriptors, "no descriptor is left open");
+	}
+
+	// the log file can't be made where a directory is in its way, the error log that did open isn't kept
+	void test_failed_start(const std::string &directory)
+	{
+		async_logger &logger = async_logger::instance();
+		std::string blocked = directory + "/blocked";
+
+		check(mkdir(blocked.data(), 0755) == 0 && mkdir((blocked + '/' + async_logger::log_file_log_name).data(), 0755) == 0,
+				"a directory is put in the way of the log file");
+
+		size_t descriptors = open_descriptors();
+		check(chdir(blocked.data()) == 0 && !logger.start(), "the logger doesn't start without its files");
+		check(open_descriptors() == descriptors, "the file that did open is closed");
+
+		unlink((blocked + '/' + async_logger::log_file_err_name).data());
+		rmdir((blocked + '/' + async_logger::log_file_log_name).data());
+		rmdir(blocked.data());
+	}
+}
+
+int main()
+{
+	char directory[] = "/tmp/logging_tests.XXXXXX";
+	char other[] = "/tmp/logging_tests.XXXXXX";
+	if (!mkdtemp(directory) || !mkdtemp(other))
+	{
+		fprintf(stderr, "FAILED: temporary directories are made\n");
+		return EXIT_FAILURE;
+	}
+
+	test_format();
+	test_records_reach_files(directory);
+	test_restart_elsewhere(directory, other);
+	test_failed_start(directory);
+
+	check(chdir("/") == 0, "back to the root");
+	for (const char *i: { directory, other })
+	{
+		unlink((std::string(i) + '/' + async_logger::log_file_log_name).c_str());
+		unlink((std::string(i) + '/' + async_logger::log_file_err_name).c_str());
+		rmdir(i);
+	}
+
+	return check_result();
+}
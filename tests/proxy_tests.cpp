@@ -0,0 +1,392 @@
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "server.h"
+#include "check.h"
+
+namespace
+{
+	std::atomic<int> upstream_connections{ 0 };
+	std::atomic<int> upstream_requests{ 0 };
+
+	int listen_on_loopback(uint16_t &port)
+	{
+		int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		struct sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		socklen_t length = sizeof(address);
+		if (fd == -1 || bind(fd, reinterpret_cast<struct sockaddr *>(&address), length) == -1 || listen(fd, 16) == -1 ||
+				getsockname(fd, reinterpret_cast<struct sockaddr *>(&address), &length) == -1)
+		{
+			close(fd);
+			return -1;
+		}
+
+		port = ntohs(address.sin_port);
+		return fd;
+	}
+
+	int connect_to(uint16_t port)
+	{
+		int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		struct sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		address.sin_port = htons(port);
+
+		if (fd == -1 || connect(fd, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) == -1)
+		{
+			close(fd);
+			return -1;
+		}
+
+		// a test that goes wrong fails instead of hanging
+		struct timeval timeout = { 5, 0 };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		return fd;
+	}
+
+	bool send_text(int fd, const std::string &text)
+	{
+		for (size_t sent = 0; sent != text.size(); )
+		{
+			ssize_t written = send(fd, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+			if (written <= 0)
+			{
+				return false;
+			}
+			sent += written;
+		}
+		return true;
+	}
+
+	// reads into the buffer until it holds the blank line, the length of the head or 0 if the stream ends first
+	size_t receive_head(int fd, std::string &buffer)
+	{
+		size_t blank;
+		while ((blank = buffer.find("\r\n\r\n")) == std::string::npos)
+		{
+			char part[4096];
+			ssize_t received = recv(fd, part, sizeof(part), 0);
+			if (received <= 0)
+			{
+				return 0;
+			}
+			buffer.append(part, received);
+		}
+		return blank + 4;
+	}
+
+	// the value of Content-Length in the head, -1 if there is none
+	long long declared_length(const std::string &head)
+	{
+		size_t header = head.find("Content-Length: ");
+		return (header == std::string::npos) ? -1 : atoll(head.data() + header + 16);
+	}
+
+	// a response with its body, the whole of it if it has a length and up to the end of the connection otherwise
+	std::string receive_response(int fd)
+	{
+		std::string response;
+		size_t head = receive_head(fd, response);
+		if (!head)
+		{
+			return response;
+		}
+
+		long long length = declared_length(response.substr(0, head));
+		while (length == -1 || response.size() < head + static_cast<size_t>(length))
+		{
+			char part[65536];
+			ssize_t received = recv(fd, part, sizeof(part), 0);
+			if (received <= 0)
+			{
+				break;
+			}
+			response.append(part, received);
+		}
+		return response;
+	}
+
+	std::string body_of(const std::string &response)
+	{
+		size_t blank = response.find("\r\n\r\n");
+		return (blank == std::string::npos) ? std::string() : response.substr(blank + 4);
+	}
+
+	// answers every request with what it saw: the connection, the path and the length and sum of the body
+	void serve_upstream(int fd, int connection)
+	{
+		std::string buffer;
+		while (size_t head = receive_head(fd, buffer))
+		{
+			std::string request = buffer.substr(0, head);
+			buffer.erase(0, head);
+			++upstream_requests;
+
+			long long length = declared_length(request);
+			while (length > 0 && buffer.size() < static_cast<size_t>(length))
+			{
+				char part[65536];
+				ssize_t received = recv(fd, part, sizeof(part), 0);
+				if (received <= 0)
+				{
+					close(fd);
+					return;
+				}
+				buffer.append(part, received);
+			}
+
+			unsigned long sum = 0;
+			for (size_t i = 0; length > 0 && i != static_cast<size_t>(length); ++i)
+			{
+				sum += static_cast<unsigned char>(buffer[i]);
+			}
+			buffer.erase(0, length > 0 ? length : 0);
+
+			std::string path = request.substr(request.find(' ') + 1);
+			path.resize(path.find(' '));
+
+			if (path == "/api/cut")
+			{
+				send_text(fd, "HTTP/1.1 200 OK\r\nContent-Length: 1000\r\n\r\n0123456789");
+				break;
+			}
+			if (path == "/api/chunked")
+			{
+				send_text(fd, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5;x=y\r\nhello\r\n6\r\n world\r\n0\r\n"
+						"Trailer-Field: 1\r\n\r\n");
+				continue;
+			}
+
+			std::string body = "connection " + std::to_string(connection) + " path " + path + " length " +
+					std::to_string(length > 0 ? length : 0) + " sum " + std::to_string(sum);
+			send_text(fd, "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body);
+		}
+
+		close(fd);
+	}
+
+	void run_upstream(int listener)
+	{
+		while (true)
+		{
+			int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+			if (fd == -1)
+			{
+				return;
+			}
+			std::thread(serve_upstream, fd, ++upstream_connections).detach();
+		}
+	}
+
+	std::string word_after(const std::string &text, const char *name)
+	{
+		size_t found = text.find(name);
+		if (found == std::string::npos)
+		{
+			return {};
+		}
+		std::string word = text.substr(found + strlen(name) + 1);
+		return word.substr(0, word.find(' '));
+	}
+
+	void test_keep_alive_reuse(uint16_t port)
+	{
+		int fd = connect_to(port);
+		check(send_text(fd, "GET /api/echo HTTP/1.0\r\nConnection: keep-alive\r\n\r\n"), "the first request is sent");
+		std::string first = receive_response(fd);
+		check(send_text(fd, "GET /api/echo HTTP/1.0\r\nConnection: keep-alive\r\n\r\n"), "the second request is sent");
+		std::string second = receive_response(fd);
+		close(fd);
+
+		check(first.compare(0, 15, "HTTP/1.0 200 OK") == 0 && second.compare(0, 15, "HTTP/1.0 200 OK") == 0,
+				"both requests are answered by the upstream");
+		check(!word_after(first, "connection").empty() && word_after(first, "connection") == word_after(second, "connection"),
+				"the second request reuses the upstream connection of the first");
+	}
+
+	void test_body_spliced(uint16_t port)
+	{
+		std::string body(300000, '\0');
+		unsigned long sum = 0;
+		for (size_t i = 0; i != body.size(); ++i)
+		{
+			body[i] = static_cast<char>(i * 7 + i / 251);
+			sum += static_cast<unsigned char>(body[i]);
+		}
+
+		int fd = connect_to(port);
+		check(send_text(fd, "POST /api/echo HTTP/1.0\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body),
+				"a long body is sent");
+		std::string response = body_of(receive_response(fd));
+		close(fd);
+
+		check(word_after(response, "length") == std::to_string(body.size()), "the whole body reaches the upstream");
+		check(word_after(response, "sum") == std::to_string(sum), "the body reaches the upstream unchanged");
+	}
+
+	void test_upstream_closing_mid_body(uint16_t port)
+	{
+		int fd = connect_to(port);
+		check(send_text(fd, "GET /api/cut HTTP/1.0\r\nConnection: keep-alive\r\n\r\n"), "the cut request is sent");
+		std::string response = receive_response(fd);
+		char byte;
+		bool closed = (recv(fd, &byte, 1, 0) == 0);
+		close(fd);
+
+		check(response.compare(0, 15, "HTTP/1.0 200 OK") == 0, "the head of a cut response is passed on");
+		check(body_of(response) == "0123456789", "what came of the body is passed on");
+		check(closed, "the client connection is closed where the body ends short");
+
+		int connections = upstream_connections.load();
+		fd = connect_to(port);
+		send_text(fd, "GET /api/echo HTTP/1.0\r\n\r\n");
+		response = receive_response(fd);
+		close(fd);
+
+		check(response.compare(0, 15, "HTTP/1.0 200 OK") == 0, "the next request is served after a cut response");
+		check(upstream_connections.load() == connections + 1, "the cut upstream connection isn't pooled");
+	}
+
+	void test_framing_rejected(uint16_t port)
+	{
+		struct
+		{
+			const char *request;
+			const char *status;
+			const char *what;
+		} cases[] =
+		{
+			{ "POST /api/echo HTTP/1.0\r\nTransfer-Encoding: chunked\r\n\r\n3\r\nabc\r\n0\r\n\r\n", "HTTP/1.0 411",
+				"a chunked request is asked for its length" },
+			{ "POST /api/echo HTTP/1.0\r\nTransfer-Encoding: gzip\r\n\r\n", "HTTP/1.0 501", "another transfer coding isn't implemented" },
+			{ "POST /api/echo HTTP/1.0\r\nContent-Length: 3\r\nContent-Length: 3\r\n\r\nabc", "HTTP/1.0 400",
+				"a duplicate length is refused" },
+			{ "POST /api/echo HTTP/1.0\r\nContent-Length: 3x\r\n\r\nabc", "HTTP/1.0 400", "a length with junk after it is refused" },
+			{ "POST /api/echo HTTP/1.0\r\nContent-Length: +3\r\n\r\nabc", "HTTP/1.0 400", "a signed length is refused" },
+			{ "POST /api/echo HTTP/1.0\r\nContent-Length: 1234567890123456789\r\n\r\nabc", "HTTP/1.0 400",
+				"an overlong length is refused" },
+			{ "POST /api/echo HTTP/1.0\r\nContent-Length : 3\r\n\r\nabc", "HTTP/1.0 400", "an improper header isn't forwarded" }
+		};
+
+		int requests = upstream_requests.load();
+		for (auto &i: cases)
+		{
+			int fd = connect_to(port);
+			send_text(fd, i.request);
+			std::string response;
+			char part[4096];
+			ssize_t received;
+			while ((received = recv(fd, part, sizeof(part), 0)) > 0)
+			{
+				response.append(part, received);
+			}
+			close(fd);
+
+			check(response.compare(0, strlen(i.status), i.status) == 0, i.what);
+		}
+		check(upstream_requests.load() == requests, "no request with doubtful framing reaches the upstream");
+	}
+
+	void test_normalized_path(uint16_t port)
+	{
+		int fd = connect_to(port);
+		send_text(fd, "GET //%61pi/./x/../echo?q=1 HTTP/1.0\r\n\r\n");
+		std::string response = body_of(receive_response(fd));
+		close(fd);
+
+		check(word_after(response, "path") == "/api/echo?q=1", "the route is matched and forwarded by the normalized path");
+	}
+
+	void test_chunked_response(uint16_t port)
+	{
+		int fd = connect_to(port);
+		send_text(fd, "GET /api/chunked HTTP/1.0\r\n\r\n");
+		std::string response = receive_response(fd);
+		close(fd);
+
+		check(response.compare(0, 15, "HTTP/1.0 200 OK") == 0, "a chunked response is passed on");
+		check(body_of(response) == "hello world", "the chunks are unwrapped for the client");
+		check(response.find("Transfer-Encoding") == std::string::npos, "the transfer coding isn't passed on");
+	}
+}
+
+int main()
+{
+	uint16_t upstream_port = 0;
+	uint16_t server_port_number = 0;
+	int upstream_listener = listen_on_loopback(upstream_port);
+	int probe = listen_on_loopback(server_port_number);
+	close(probe);
+	if (upstream_listener == -1 || !server_port_number)
+	{
+		fprintf(stderr, "FAILED: loopback sockets can't be opened\n");
+		return EXIT_FAILURE;
+	}
+
+	char directory[] = "/tmp/proxy_tests_XXXXXX";
+	if (!mkdtemp(directory))
+	{
+		fprintf(stderr, "FAILED: the served directory can't be made\n");
+		return EXIT_FAILURE;
+	}
+
+	// the server runs in a child of its own, the upstream and the clients in this process
+	pid_t child = fork();
+	if (child == 0)
+	{
+		close(upstream_listener);
+
+		std::string port = std::to_string(server_port_number);
+		std::string route = "/api=127.0.0.1:" + std::to_string(upstream_port);
+		const char *arguments[] = { "proxy_tests", "-h", "127.0.0.1", "-p", port.data(), "-d", directory, "--proxy", route.data(),
+			"--workers", "1", "--access-log", "", "--blocking-threads", "0" };
+		parse_program_options(sizeof(arguments) / sizeof(arguments[0]), const_cast<char **>(arguments));
+		set_signals();
+		run_server_loop(get_listening_socket());
+		_exit(EXIT_FAILURE);
+	}
+
+	std::thread(run_upstream, upstream_listener).detach();
+
+	int ready = -1;
+	for (int i = 0; i != 100 && ready == -1; ++i)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		ready = connect_to(server_port_number);
+	}
+	close(ready);
+	check(ready != -1, "the server starts listening");
+
+	if (ready != -1)
+	{
+		test_keep_alive_reuse(server_port_number);
+		test_body_spliced(server_port_number);
+		test_upstream_closing_mid_body(server_port_number);
+		test_framing_rejected(server_port_number);
+		test_normalized_path(server_port_number);
+		test_chunked_response(server_port_number);
+	}
+
+	kill(child, SIGKILL);
+	waitpid(child, nullptr, 0);
+	rmdir(directory);
+
+	return check_result();
+}
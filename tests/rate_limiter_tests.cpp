@@ -0,0 +1,105 @@
+#include <cstdio>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "rate_limiter.h"
+#include "check.h"
+
+namespace
+{
+	constexpr int64_t now = 1000000000;
+	constexpr int64_t second = 1000000000;
+
+	struct sockaddr_storage client(const char *address)
+	{
+		struct sockaddr_storage peer;
+		memset(&peer, 0, sizeof(peer));
+
+		struct sockaddr_in &ipv4 = reinterpret_cast<struct sockaddr_in &>(peer);
+		ipv4.sin_family = AF_INET;
+		inet_pton(AF_INET, address, &ipv4.sin_addr);
+
+		return peer;
+	}
+
+	void test_invalid_limits(rate_limiter &limiter)
+	{
+		check(!limiter.configure(0, 0, { "dl=1" }, 1024), "a prefix starts with a slash");
+		check(!limiter.configure(0, 0, { "/dl=fast" }, 1024), "a rate is a number");
+		check(!limiter.configure(0, 0, { "/dl=1:many" }, 1024), "a burst is a number");
+		check(!limiter.configure(0, 0, { "/dl=-1" }, 1024), "a rate is positive");
+		check(!limiter.enabled(), "no limit is applied");
+	}
+
+	// two requests at once, then one per second
+	void test_per_client(rate_limiter &limiter)
+	{
+		struct sockaddr_storage peer = client("10.0.0.1");
+
+		check(limiter.admit(peer, "/a", now) == 0 && limiter.admit(peer, "/b", now) == 0, "the burst is let through");
+		check(limiter.admit(peer, "/c", now) == 1, "a request over the burst waits a second");
+		check(limiter.admit(client("10.0.0.2"), "/a", now) == 0, "another client has a bucket of its own");
+		check(limiter.admit(peer, "/c", now + second) == 0, "a second later a request is let through again");
+	}
+
+	// a request the prefix turns away doesn't count against the client as a whole
+	void test_prefix(rate_limiter &limiter)
+	{
+		struct sockaddr_storage peer = client("10.0.1.1");
+
+		check(limiter.admit(peer, "/dl/x.txt", now) == 0, "the first request under the prefix is let through");
+		check(limiter.admit(peer, "/dl/y.txt", now) >= 100, "the next waits for the rate of the prefix");
+		check(limiter.admit(peer, "/index.html", now) == 0, "paths outside the prefix still have the burst of the client");
+
+		struct sockaddr_storage other = client("10.0.1.2");
+		check(limiter.admit(other, "/dl", now) == 0 && limiter.admit(other, "/dlx/x.txt", now) == 0,
+				"the prefix is matched by whole segments");
+	}
+
+	// every spelling of a path beneath the prefix is normalized before the prefix is matched
+	void test_prefix_variants(rate_limiter &limiter)
+	{
+		const char *variants[] = { "//dl/x.txt", "/./dl/x.txt", "/%64l/x.txt", "/dl//x.txt", "/other/../dl/x.txt", "/dl" };
+
+		// a client of its own for every variant, the burst of one is spent by the plain path first
+		unsigned number = 1;
+		for (const char *i: variants)
+		{
+			char address[32];
+			snprintf(address, sizeof(address), "10.0.2.%u", number++);
+			struct sockaddr_storage peer = client(address);
+
+			check(limiter.admit(peer, "/dl/x.txt", now) == 0, "the first request of a client is let through");
+			if (limiter.admit(peer, i, now) == 0)
+			{
+				fprintf(stderr, "FAILED: %s bypasses the limit of /dl\n", i);
+				++check_failures();
+			}
+		}
+
+		struct sockaddr_storage leaving = client("10.0.3.1");
+		check(limiter.admit(leaving, "/dl/x.txt", now) == 0 && limiter.admit(leaving, "/dl/../x.txt", now) == 0,
+				"a path leaving the prefix isn't limited by it");
+	}
+}
+
+int main()
+{
+	rate_limiter &limiter = rate_limiter::instance();
+
+	test_invalid_limits(limiter);
+
+	if (!limiter.configure(1, 2, { "/dl=0.01:1" }, 1024))
+	{
+		fprintf(stderr, "FAILED: the limits are configured\n");
+		return EXIT_FAILURE;
+	}
+
+	test_per_client(limiter);
+	test_prefix(limiter);
+	test_prefix_variants(limiter);
+
+	return check_result();
+}